@@ -0,0 +1,422 @@
+/*
+* Microbenchmarks for the helpers the worker and the UI call on every pass, whose cost
+* grows with the session: is_uploaded(), count_imported_images(), count_uploaded_images()
+* and delete_images_in_import_folder() at 1k, 10k and 100k files and track entries, the
+* Exif parse each import and upload scan does per image, and the ui.h text and frame
+* rendering at 480x320 and the full screen size.
+*
+* Prints one JSON object per line, each with ns_per_op and the heap allocations per op
+* (malloc, calloc and realloc calls anywhere in the process, libc and SDL included):
+*   make bench && ./bench_helpers --label v1.4 > v1.4.jsonl
+* Options: --max N (largest size, default 100000), --fullscreen WxH (default 800x480, the
+* official Pi touchscreen), --dir PATH (scratch directory parent, default /tmp),
+* --label TEXT. Frames are drawn with SDL's software renderer into an off-screen surface,
+* which is what the 480x320 window uses.
+*/
+
+#define UPLOADER_NO_MAIN
+#include "../uploader_gui.c"
+#include "bench_util.h"
+
+#define BENCH_MIN_TIME_NS 200000000LL // each case repeats for at least this long
+#define BENCH_MAX_OPS 10000000L
+#define BENCH_DESTRUCTIVE_OPS 3 // cases whose set up is slower than the operation itself
+
+// every heap allocation in the process goes through these
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+atomic_ullong bench_allocs;
+atomic_ullong bench_alloc_bytes;
+
+void *malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bench_alloc_bytes, size, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bench_alloc_bytes, count * size, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bench_alloc_bytes, size, memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer)
+{
+    __libc_free(pointer);
+}
+
+typedef void (*Bench_op)(void *ctx, long i);
+
+const char *bench_label = "";
+
+static long long bench_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void bench_report(const char *name, const char *variant, long n, long ops, long long elapsed_ns, unsigned long long allocs, unsigned long long alloc_bytes)
+{
+    struct json_object *result = json_object_new_object();
+    json_object_object_add(result, "benchmark", json_object_new_string("helpers"));
+    json_object_object_add(result, "label", json_object_new_string(bench_label));
+    json_object_object_add(result, "name", json_object_new_string(name));
+    json_object_object_add(result, "case", json_object_new_string(variant));
+    json_object_object_add(result, "n", json_object_new_int64(n));
+    json_object_object_add(result, "ops", json_object_new_int64(ops));
+    json_object_object_add(result, "ns_per_op", json_object_new_double((double)elapsed_ns / ops));
+    json_object_object_add(result, "allocs_per_op", json_object_new_double((double)allocs / ops));
+    json_object_object_add(result, "alloc_bytes_per_op", json_object_new_double((double)alloc_bytes / ops));
+    printf("%s\n", json_object_to_json_string_ext(result, JSON_C_TO_STRING_PLAIN));
+    fflush(stdout);
+    json_object_put(result);
+}
+
+// repeats op until BENCH_MIN_TIME_NS has passed, timing the whole run
+static void bench_run(const char *name, const char *variant, long n, Bench_op op, void *ctx)
+{
+    op(ctx, 0); // warm caches and one-time set up outside the measurement
+
+    unsigned long long allocs = atomic_load(&bench_allocs);
+    unsigned long long alloc_bytes = atomic_load(&bench_alloc_bytes);
+    long long start_ns = bench_now_ns();
+    long long elapsed_ns = 0;
+    long ops = 0;
+    for (long batch = 1; elapsed_ns < BENCH_MIN_TIME_NS && ops < BENCH_MAX_OPS; batch *= 2)
+    {
+        for (long i = 0; i < batch; i++)
+        {
+            op(ctx, ops + i + 1);
+        }
+        ops += batch;
+        elapsed_ns = bench_now_ns() - start_ns;
+    }
+    bench_report(name, variant, n, ops, elapsed_ns, atomic_load(&bench_allocs) - allocs, atomic_load(&bench_alloc_bytes) - alloc_bytes);
+}
+
+// for operations that consume their input: setup runs before each op, outside the timing
+static void bench_run_with_setup(const char *name, const char *variant, long n, Bench_op setup, Bench_op op, void *ctx)
+{
+    long long elapsed_ns = 0;
+    unsigned long long allocs = 0;
+    unsigned long long alloc_bytes = 0;
+    for (long i = 0; i < BENCH_DESTRUCTIVE_OPS; i++)
+    {
+        setup(ctx, i);
+        unsigned long long allocs_before = atomic_load(&bench_allocs);
+        unsigned long long bytes_before = atomic_load(&bench_alloc_bytes);
+        long long start_ns = bench_now_ns();
+        op(ctx, i);
+        elapsed_ns += bench_now_ns() - start_ns;
+        allocs += atomic_load(&bench_allocs) - allocs_before;
+        alloc_bytes += atomic_load(&bench_alloc_bytes) - bytes_before;
+    }
+    bench_report(name, variant, n, BENCH_DESTRUCTIVE_OPS, elapsed_ns, allocs, alloc_bytes);
+}
+
+static void bench_name(char *out, size_t size, long i)
+{
+    snprintf(out, size, "IMG_%06ld.JPG", i);
+}
+
+static void bench_write_track_file(long n)
+{
+    FILE *f = fopen(TRACK_FILE, "w");
+    char name[32];
+    for (long i = 0; i < n; i++)
+    {
+        bench_name(name, sizeof(name), i);
+        fprintf(f, "%s\n", name);
+    }
+    fclose(f);
+}
+
+static void bench_fill_import_folder(void *ctx, long i)
+{
+    (void)i;
+    long n = *(long *)ctx;
+    char path[1024];
+    char name[32];
+    for (long j = 0; j < n; j++)
+    {
+        bench_name(name, sizeof(name), j);
+        snprintf(path, sizeof(path), "%s/%s", LOCAL_DIR, name);
+        close(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    }
+}
+
+static void bench_is_uploaded_last(void *ctx, long i)
+{
+    (void)i;
+    is_uploaded((const char *)ctx);
+}
+
+static void bench_is_uploaded_missing(void *ctx, long i)
+{
+    (void)ctx;
+    (void)i;
+    is_uploaded("IMG_NOT_THERE.JPG");
+}
+
+static void bench_count_imported(void *ctx, long i)
+{
+    (void)ctx;
+    (void)i;
+    count_imported_images();
+}
+
+static void bench_count_uploaded(void *ctx, long i)
+{
+    (void)ctx;
+    (void)i;
+    count_uploaded_images();
+}
+
+static void bench_delete_imports(void *ctx, long i)
+{
+    (void)ctx;
+    (void)i;
+    delete_images_in_import_folder();
+}
+
+static void bench_exif_parse(void *ctx, long i)
+{
+    (void)i;
+    Exif_info info;
+    exif_parse(ctx, EXIF_READ_BYTES, &info);
+}
+
+static void bench_exif_read_file(void *ctx, long i)
+{
+    (void)i;
+    Exif_info info;
+    exif_read_file(ctx, &info);
+}
+
+#ifndef HEADLESS
+typedef struct
+{
+    SDL_Renderer *renderer;
+    TTF_Font *font;
+    Navigation_buttons buttons;
+    Program_status program;
+    long n;
+} Bench_ui;
+
+static void bench_render_text_cached(void *ctx, long i)
+{
+    (void)i;
+    Bench_ui *ui = ctx;
+    render_text(ui->renderer, ui->font, " images sent to server", 10, 10);
+}
+
+// a new string every call, as when names or messages scroll past
+static void bench_render_text_uncached(void *ctx, long i)
+{
+    Bench_ui *ui = ctx;
+    char text[64];
+    snprintf(text, sizeof(text), "Uploaded IMG_%06ld.JPG", i % ui->n);
+    render_text(ui->renderer, ui->font, text, 10, 10);
+}
+
+static void bench_render_number(void *ctx, long i)
+{
+    Bench_ui *ui = ctx;
+    render_number(ui->renderer, ui->font, ui->n + i, 10, 10, ui_colors.white);
+}
+
+static void bench_render_frame_steady(void *ctx, long i)
+{
+    (void)i;
+    Bench_ui *ui = ctx;
+    render_frame(ui->renderer, ui->font, ui->buttons);
+}
+
+// the counts move every frame, as they do during a busy session
+static void bench_render_frame_counting(void *ctx, long i)
+{
+    Bench_ui *ui = ctx;
+    ui->program.imported = ui->n + i;
+    ui->program.uploaded = ui->n + i / 2;
+    status_publish_program(&ui->program, 1);
+    render_frame(ui->renderer, ui->font, ui->buttons);
+}
+
+static void bench_ui(const char *font_path, int width, int height, const long *sizes, int size_count)
+{
+    SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+    SDL_Renderer *renderer = surface ? SDL_CreateSoftwareRenderer(surface) : NULL;
+    if (!renderer)
+    {
+        fprintf(stderr, "Could not create a %dx%d software renderer: %s\n", width, height, SDL_GetError());
+        return;
+    }
+
+    ui_size_parameters(width, height);
+    TTF_Font *font = TTF_OpenFont(font_path, ui_parameters.font_size);
+    if (!font)
+    {
+        fprintf(stderr, "Font load error: %s\n", TTF_GetError());
+        SDL_DestroyRenderer(renderer);
+        SDL_FreeSurface(surface);
+        return;
+    }
+
+    char variant[64];
+    Bench_ui ui = {renderer, font, initialize_navigation_buttons(width, height), {0, 0, CAMERA_STATUS_UPLOADING, "Bench camera", "BENCH0001"}, 0};
+    current_screen = SCREEN_MAIN;
+    for (int s = 0; s < size_count; s++)
+    {
+        ui.n = sizes[s];
+        ui.program.imported = ui.n;
+        ui.program.uploaded = ui.n / 2;
+        status_publish_program(&ui.program, 1);
+
+        snprintf(variant, sizeof(variant), "%dx%d cached", width, height);
+        bench_run("render_text", variant, ui.n, bench_render_text_cached, &ui);
+        snprintf(variant, sizeof(variant), "%dx%d uncached", width, height);
+        bench_run("render_text", variant, ui.n, bench_render_text_uncached, &ui);
+        snprintf(variant, sizeof(variant), "%dx%d", width, height);
+        bench_run("render_number", variant, ui.n, bench_render_number, &ui);
+        snprintf(variant, sizeof(variant), "%dx%d steady", width, height);
+        bench_run("render_frame", variant, ui.n, bench_render_frame_steady, &ui);
+        snprintf(variant, sizeof(variant), "%dx%d counting", width, height);
+        bench_run("render_frame", variant, ui.n, bench_render_frame_counting, &ui);
+    }
+
+    TTF_CloseFont(font);
+    text_cache_clear();
+    SDL_DestroyRenderer(renderer);
+    SDL_FreeSurface(surface);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    long max = 100000;
+    int full_width = 800;
+    int full_height = 480;
+    const char *dir = "/tmp";
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value)
+        {
+            fprintf(stderr, "Missing value for %s.\n", argv[i]);
+            return 10;
+        }
+        if (strcmp(argv[i], "--max") == 0)
+        {
+            max = atol(value);
+        }
+        else if (strcmp(argv[i], "--fullscreen") == 0)
+        {
+            if (sscanf(value, "%dx%d", &full_width, &full_height) != 2 || full_width < 1 || full_height < 1)
+            {
+                fprintf(stderr, "Expected --fullscreen WIDTHxHEIGHT.\n");
+                return 10;
+            }
+        }
+        else if (strcmp(argv[i], "--dir") == 0)
+        {
+            dir = value;
+        }
+        else if (strcmp(argv[i], "--label") == 0)
+        {
+            bench_label = value;
+        }
+        else
+        {
+            fprintf(stderr, "Invalid argument %s. Valid options are --max, --fullscreen, --dir and --label.\n", argv[i]);
+            return 10;
+        }
+        i++;
+    }
+
+    long sizes[3];
+    int size_count = 0;
+    for (long n = 1000; n <= max && size_count < 3; n *= 10)
+    {
+        sizes[size_count++] = n;
+    }
+    if (size_count == 0)
+    {
+        fprintf(stderr, "--max must be at least 1000.\n");
+        return 10;
+    }
+
+    // the font is found from where the uploader runs, before moving to the scratch directory
+    char font_path[2048];
+    char cwd[1024];
+    snprintf(font_path, sizeof(font_path), "%s/Rubik/Rubik-VariableFont_wght.ttf", getcwd(cwd, sizeof(cwd)) ? cwd : ".");
+
+    char scratch[1024];
+    if (bench_enter_scratch(scratch, sizeof(scratch), dir, "bench_helpers") != 0)
+    {
+        return 1;
+    }
+    LOCAL_DIR = get_import_directory();
+    logging_status = LOGGIN_ERROR_ONLY;
+
+    for (int s = 0; s < size_count; s++)
+    {
+        long n = sizes[s];
+        char last[32];
+        bench_name(last, sizeof(last), n - 1);
+
+        bench_write_track_file(n);
+        bench_run("is_uploaded", "last entry", n, bench_is_uploaded_last, last);
+        bench_run("is_uploaded", "not uploaded", n, bench_is_uploaded_missing, NULL);
+        bench_run("count_uploaded_images", "", n, bench_count_uploaded, NULL);
+
+        bench_fill_import_folder(&n, 0);
+        bench_run("count_imported_images", "", n, bench_count_imported, NULL);
+        bench_run_with_setup("delete_images_in_import_folder", "", n, bench_fill_import_folder, bench_delete_imports, &n);
+    }
+
+    // a camera JPEG's header, from memory as fetch_file() has it and from the card as the upload scan reads it
+    static unsigned char image[65536];
+    char image_path[1024];
+    bench_make_jpeg(image, sizeof(image), 1);
+    snprintf(image_path, sizeof(image_path), "%s/IMG_EXIF.JPG", LOCAL_DIR);
+    FILE *f = fopen(image_path, "wb");
+    if (f)
+    {
+        fwrite(image, 1, sizeof(image), f);
+        fclose(f);
+    }
+    bench_run("exif_parse", "memory", 1, bench_exif_parse, image);
+    bench_run("exif_read_file", "page cache", 1, bench_exif_read_file, image_path);
+
+#ifndef HEADLESS
+    if (TTF_Init() != 0)
+    {
+        fprintf(stderr, "TTF Init Error: %s\n", TTF_GetError());
+    }
+    else
+    {
+        bench_ui(font_path, 480, 320, sizes, size_count);
+        bench_ui(font_path, full_width, full_height, sizes, size_count);
+        TTF_Quit();
+    }
+#else
+    (void)font_path;
+#endif
+
+    bench_remove_scratch(scratch);
+    return 0;
+}
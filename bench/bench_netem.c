@@ -0,0 +1,484 @@
+/*
+* Upload benchmark over an impaired link. The FTP stand-in sits behind netem_proxy.h, which
+* plays a link profile: latency, jitter, a rate cap, stalls, connection resets and outages.
+* The images are imported up front, then the loop runs like the worker's upload step, with
+* the real connectivity probe deciding when the link is up, until everything is delivered
+* or --timeout runs out.
+*
+*   make bench && ./bench_netem --profile hotspot_3g --seed 7 --label v1.4 > 3g.json
+*
+* Besides goodput it reports how uploads recover: for every injected reset and every end of
+* an outage, the time until the next image is delivered. --profile-file takes a JSON file
+*   {"name": "tunnel", "phases": [{"seconds": 20, "latency_ms": 60, "rate_kbit": 2000},
+*                                 {"seconds": 5, "down": true}]}
+* with any of the Netem_phase fields, missing ones 0.
+*
+* --raw sends TIFF based RAW files instead of JPEGs, and --compression auto has them go out
+* compressed as in compress.h, so the two runs give the images per hour each way:
+*
+*   ./bench_netem --profile hotspot_3g --raw --compression off > raw.json
+*   ./bench_netem --profile hotspot_3g --raw --compression auto > raw_zstd.json
+*/
+
+#define UPLOADER_NO_MAIN
+#include "../uploader_gui.c"
+#include "bench_util.h"
+#include "ftp_standin.h"
+#include "netem_proxy.h"
+
+#define BENCH_VARIANTS 8
+
+typedef struct
+{
+    uint64_t received_us;
+    unsigned long size;
+} Bench_image;
+
+Bench_image *bench_images;
+int bench_image_count = 0;
+int bench_raw = 0;
+atomic_int bench_delivered;
+atomic_int bench_aborted_uploads;
+
+static void bench_stored(void *owner, const char *final_path, int err)
+{
+    (void)final_path;
+    (void)err;
+    free(owner);
+}
+
+static void bench_received(const char *path, unsigned long long bytes, int complete, void *ctx)
+{
+    (void)ctx;
+    const char *name = strrchr(path, '/');
+    int index;
+    char extension[16] = "";
+    // a compressed RAW arrives as NAME.zst, and counts once it is all there
+    int compressed = strlen(path) > 4 && strcmp(path + strlen(path) - 4, ".zst") == 0;
+    if (!complete)
+    {
+        atomic_fetch_add(&bench_aborted_uploads, 1);
+    }
+    else if (name && sscanf(name, "/IMG_%d.%15[A-Z]", &index, extension) == 2 && strcmp(extension, bench_raw ? "DNG" : "JPG") == 0 &&
+        index >= 0 && index < bench_image_count && (compressed || bytes == bench_images[index].size) && !bench_images[index].received_us)
+    {
+        bench_images[index].received_us = netem_now_us();
+        atomic_fetch_add(&bench_delivered, 1);
+    }
+}
+
+static int bench_load_profile(const char *path, Netem_profile *profile)
+{
+    static char name[64];
+    struct json_object *parsed = json_object_from_file(path);
+    struct json_object *phases;
+    if (!parsed || !json_object_object_get_ex(parsed, "phases", &phases) || !json_object_is_type(phases, json_type_array))
+    {
+        fprintf(stderr, "Could not read a profile with a \"phases\" array from %s.\n", path);
+        json_object_put(parsed);
+        return -1;
+    }
+
+    struct json_object *value;
+    snprintf(name, sizeof(name), "%s", json_object_object_get_ex(parsed, "name", &value) ? json_object_get_string(value) : path);
+    memset(profile, 0, sizeof(*profile));
+    profile->name = name;
+    profile->phase_count = json_object_array_length(phases);
+    if (profile->phase_count < 1 || profile->phase_count > NETEM_PHASES_MAX)
+    {
+        fprintf(stderr, "A profile needs 1 to %d phases.\n", NETEM_PHASES_MAX);
+        json_object_put(parsed);
+        return -1;
+    }
+
+    for (int i = 0; i < profile->phase_count; i++)
+    {
+        struct json_object *entry = json_object_array_get_idx(phases, i);
+        Netem_phase *phase = &profile->phases[i];
+        const char *ints[] = {"seconds", "latency_ms", "jitter_ms", "rate_kbit", "stall_ms"};
+        int *fields[] = {&phase->seconds, &phase->latency_ms, &phase->jitter_ms, &phase->rate_kbit, &phase->stall_ms};
+        for (int f = 0; f < 5; f++)
+        {
+            if (json_object_object_get_ex(entry, ints[f], &value))
+            {
+                *fields[f] = json_object_get_int(value);
+            }
+        }
+        if (json_object_object_get_ex(entry, "stall_percent", &value))
+        {
+            phase->stall_percent = json_object_get_double(value);
+        }
+        if (json_object_object_get_ex(entry, "resets_per_mb", &value))
+        {
+            phase->resets_per_mb = json_object_get_double(value);
+        }
+        if (json_object_object_get_ex(entry, "down", &value))
+        {
+            phase->down = json_object_get_boolean(value);
+        }
+        if (phase->seconds < 1)
+        {
+            fprintf(stderr, "Phase %d of %s needs \"seconds\" of at least 1.\n", i + 1, path);
+            json_object_put(parsed);
+            return -1;
+        }
+    }
+    json_object_put(parsed);
+    return 0;
+}
+
+// the first delivery after each event, in ms, for the events that were followed by one
+static int bench_recovery(const uint64_t *events_us, int event_count, double *recovery_ms)
+{
+    int count = 0;
+    for (int e = 0; e < event_count; e++)
+    {
+        uint64_t first_us = 0;
+        for (int i = 0; i < bench_image_count; i++)
+        {
+            uint64_t received_us = bench_images[i].received_us;
+            if (received_us > events_us[e] && (!first_us || received_us < first_us))
+            {
+                first_us = received_us;
+            }
+        }
+        if (first_us)
+        {
+            recovery_ms[count++] = (first_us - events_us[e]) / 1000.0;
+        }
+    }
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *profile_name = "venue_wifi";
+    const char *profile_file = NULL;
+    int images = 30;
+    long size_kb = 3000;
+    int concurrency = 1;
+    int timeout_s = 600;
+    unsigned seed = 1;
+    const char *dir = "/tmp";
+    const char *label = "";
+    int keep = 0;
+    const char *compression = "off";
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--keep") == 0)
+        {
+            keep = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--raw") == 0)
+        {
+            bench_raw = 1;
+            continue;
+        }
+        if (!value)
+        {
+            fprintf(stderr, "Missing value for %s.\n", argv[i]);
+            return 10;
+        }
+        if (strcmp(argv[i], "--profile") == 0)
+        {
+            profile_name = value;
+        }
+        else if (strcmp(argv[i], "--profile-file") == 0)
+        {
+            profile_file = value;
+        }
+        else if (strcmp(argv[i], "--images") == 0)
+        {
+            images = atoi(value);
+        }
+        else if (strcmp(argv[i], "--size-kb") == 0)
+        {
+            size_kb = atol(value);
+        }
+        else if (strcmp(argv[i], "--concurrency") == 0)
+        {
+            concurrency = atoi(value);
+        }
+        else if (strcmp(argv[i], "--timeout") == 0)
+        {
+            timeout_s = atoi(value);
+        }
+        else if (strcmp(argv[i], "--seed") == 0)
+        {
+            seed = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--dir") == 0)
+        {
+            dir = value;
+        }
+        else if (strcmp(argv[i], "--label") == 0)
+        {
+            label = value;
+        }
+        else if (strcmp(argv[i], "--compression") == 0)
+        {
+            compression = value;
+        }
+        else
+        {
+            fprintf(stderr, "Invalid argument %s. Valid options are --profile, --profile-file, --images, --size-kb, --concurrency, --timeout, --seed, --dir, --label, --raw, --compression and --keep.\n", argv[i]);
+            return 10;
+        }
+        i++;
+    }
+
+    Netem_profile profile;
+    if (profile_file)
+    {
+        if (bench_load_profile(profile_file, &profile) != 0)
+        {
+            return 10;
+        }
+    }
+    else
+    {
+        int found = 0;
+        for (size_t i = 0; i < sizeof(netem_profiles) / sizeof(netem_profiles[0]) && !found; i++)
+        {
+            found = strcmp(netem_profiles[i].name, profile_name) == 0;
+            profile = netem_profiles[i];
+        }
+        if (!found)
+        {
+            fprintf(stderr, "Unknown profile %s. Built in are loopback, venue_wifi, hotspot_3g and flaky.\n", profile_name);
+            return 10;
+        }
+    }
+    if (images < 1 || size_kb < 1 || concurrency < 1 || concurrency > UPLOAD_TRANSFERS_MAX || timeout_s < 1)
+    {
+        fprintf(stderr, "Need --images, --size-kb and --timeout of at least 1 and --concurrency of 1 to %d.\n", UPLOAD_TRANSFERS_MAX);
+        return 10;
+    }
+    if (strcmp(compression, "off") != 0 && strcmp(compression, "auto") != 0)
+    {
+        fprintf(stderr, "--compression is off or auto.\n");
+        return 10;
+    }
+
+    char scratch[1024];
+    if (bench_enter_scratch(scratch, sizeof(scratch), dir, "bench_netem") != 0)
+    {
+        return 1;
+    }
+    LOCAL_DIR = get_import_directory();
+    logging_status = LOGGIN_ERROR_ONLY;
+    UPLOAD_RAW = bench_raw;
+    UPLOAD_COMPRESSION = compression;
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    Ftp_standin server;
+    if (ftp_standin_start(&server, bench_received, NULL) != 0)
+    {
+        fprintf(stderr, "Could not start the FTP stand-in: %s\n", strerror(errno));
+        return 1;
+    }
+    Netem_proxy proxy;
+    if (netem_proxy_start(&proxy, &profile, server.port, seed) != 0)
+    {
+        fprintf(stderr, "Could not start the impairment proxy: %s\n", strerror(errno));
+        return 1;
+    }
+    // data connections take the same link as the control connection
+    server.passive = netem_proxy_passive;
+    server.passive_ctx = &proxy;
+
+    char url[64];
+    snprintf(url, sizeof(url), "ftp://127.0.0.1:%d/", proxy.port);
+    destination_add("bench", url, "bench:bench", "primary");
+    destination_init_ledgers(1);
+
+    file_io_init();
+    staging_init();
+    atomic_store(&upload_concurrency, concurrency);
+
+    unsigned long sizes[BENCH_VARIANTS];
+    for (int i = 0; i < BENCH_VARIANTS; i++)
+    {
+        sizes[i] = (unsigned long)(size_kb * 1024 * (0.5 + i / (double)(BENCH_VARIANTS - 1)));
+    }
+    bench_images = calloc(images, sizeof(Bench_image));
+    bench_image_count = images;
+    unsigned long long total_bytes = 0;
+    for (int i = 0; i < images; i++)
+    {
+        unsigned long size = sizes[(i * 5) % BENCH_VARIANTS];
+        char name[32];
+        snprintf(name, sizeof(name), bench_raw ? "IMG_%05d.DNG" : "IMG_%05d.JPG", i);
+        char *data = malloc(size);
+        if (!data)
+        {
+            fprintf(stderr, "Out of memory for synthetic images.\n");
+            return 1;
+        }
+        if (bench_raw)
+        {
+            bench_make_raw((unsigned char *)data, size, 2463534242u + i);
+        }
+        else
+        {
+            bench_make_jpeg((unsigned char *)data, size, 2463534242u + i);
+        }
+        bench_images[i].size = size;
+        total_bytes += size;
+        if (!import_store(name, data, size, bench_stored, data))
+        {
+            free(data);
+        }
+    }
+    staging_flush();
+
+    pthread_t probe_thread;
+    pthread_create(&probe_thread, NULL, internet_poll_thread, NULL);
+
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    uint64_t start_us = netem_now_us();
+    uint64_t deadline_us = start_us + timeout_s * 1000000ULL;
+    int passes = 0;
+
+    // the worker's upload step, without the camera
+    while (atomic_load(&bench_delivered) < images && netem_now_us() < deadline_us)
+    {
+        if (internet_up && upload_scan())
+        {
+            upload_pending_images();
+            passes++;
+        }
+        else
+        {
+            sleep(1);
+        }
+    }
+
+    uint64_t end_us = netem_now_us();
+    getrusage(RUSAGE_SELF, &usage_end);
+    stop_requested = 1;
+    pthread_join(probe_thread, NULL);
+    netem_proxy_stop(&proxy);
+    ftp_standin_stop(&server);
+
+    int delivered = atomic_load(&bench_delivered);
+    double *end_to_end_ms = malloc(images * sizeof(double));
+    int received = 0;
+    for (int i = 0; i < images; i++)
+    {
+        if (bench_images[i].received_us)
+        {
+            end_to_end_ms[received++] = (bench_images[i].received_us - start_us) / 1000.0;
+        }
+    }
+
+    // outages end where a down phase hands over to the next one
+    int loop_s = netem_profile_seconds(&profile);
+    int outage_capacity = 16 + (int)((end_us - start_us) / 1000000 / (loop_s > 0 ? loop_s : 1) + 1) * profile.phase_count;
+    uint64_t *outage_ends_us = malloc(outage_capacity * sizeof(uint64_t));
+    int outage_count = 0;
+    for (uint64_t phase_start_us = proxy.started_us; phase_start_us < end_us && outage_count < outage_capacity;)
+    {
+        for (int i = 0; i < profile.phase_count && phase_start_us < end_us && outage_count < outage_capacity; i++)
+        {
+            phase_start_us += profile.phases[i].seconds * 1000000ULL;
+            if (profile.phases[i].down && phase_start_us < end_us)
+            {
+                outage_ends_us[outage_count++] = phase_start_us;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&proxy.events_mutex);
+    int reset_count = proxy.reset_time_count;
+    double *reset_recovery_ms = malloc((reset_count + 1) * sizeof(double));
+    int reset_recovered = bench_recovery(proxy.reset_times_us, reset_count, reset_recovery_ms);
+    pthread_mutex_unlock(&proxy.events_mutex);
+    double *outage_recovery_ms = malloc((outage_count + 1) * sizeof(double));
+    int outage_recovered = bench_recovery(outage_ends_us, outage_count, outage_recovery_ms);
+
+    Destination snapshot[DESTINATIONS_MAX];
+    destination_snapshot(snapshot);
+    Net_probe_stats probe_stats;
+    net_probe_get(&probe_stats);
+
+    double wall_s = (end_us - start_us) / 1000000.0;
+    double cpu_s = bench_cpu_s(&usage_end) - bench_cpu_s(&usage_start);
+    unsigned long long delivered_bytes = 0;
+    for (int i = 0; i < images; i++)
+    {
+        delivered_bytes += bench_images[i].received_us ? bench_images[i].size : 0;
+    }
+
+    struct json_object *phases = json_object_new_array();
+    for (int i = 0; i < profile.phase_count; i++)
+    {
+        Netem_phase *p = &profile.phases[i];
+        struct json_object *phase = json_object_new_object();
+        json_object_object_add(phase, "seconds", json_object_new_int(p->seconds));
+        json_object_object_add(phase, "latency_ms", json_object_new_int(p->latency_ms));
+        json_object_object_add(phase, "jitter_ms", json_object_new_int(p->jitter_ms));
+        json_object_object_add(phase, "rate_kbit", json_object_new_int(p->rate_kbit));
+        json_object_object_add(phase, "stall_percent", json_object_new_double(p->stall_percent));
+        json_object_object_add(phase, "stall_ms", json_object_new_int(p->stall_ms));
+        json_object_object_add(phase, "resets_per_mb", json_object_new_double(p->resets_per_mb));
+        json_object_object_add(phase, "down", json_object_new_boolean(p->down));
+        json_object_array_add(phases, phase);
+    }
+
+    struct json_object *config = json_object_new_object();
+    json_object_object_add(config, "profile", json_object_new_string(profile.name));
+    json_object_object_add(config, "phases", phases);
+    json_object_object_add(config, "images", json_object_new_int(images));
+    json_object_object_add(config, "size_kb", json_object_new_int64(size_kb));
+    json_object_object_add(config, "concurrency", json_object_new_int(concurrency));
+    json_object_object_add(config, "timeout_s", json_object_new_int(timeout_s));
+    json_object_object_add(config, "seed", json_object_new_int64(seed));
+    json_object_object_add(config, "raw", json_object_new_boolean(bench_raw));
+    json_object_object_add(config, "compression", json_object_new_string(compression));
+
+    struct json_object *injected = json_object_new_object();
+    json_object_object_add(injected, "connections", json_object_new_int(atomic_load(&proxy.connections)));
+    json_object_object_add(injected, "resets", json_object_new_int(atomic_load(&proxy.resets)));
+    json_object_object_add(injected, "stalls", json_object_new_int(atomic_load(&proxy.stalls)));
+    json_object_object_add(injected, "outages", json_object_new_int(outage_count));
+    json_object_object_add(injected, "bytes_up", json_object_new_int64(atomic_load(&proxy.bytes_up)));
+    json_object_object_add(injected, "bytes_down", json_object_new_int64(atomic_load(&proxy.bytes_down)));
+
+    struct json_object *recovery = json_object_new_object();
+    json_object_object_add(recovery, "after_reset_ms", bench_percentiles(reset_recovery_ms, reset_recovered));
+    json_object_object_add(recovery, "after_outage_ms", bench_percentiles(outage_recovery_ms, outage_recovered));
+    json_object_object_add(recovery, "probe_reconnects", json_object_new_int(probe_stats.reconnects));
+
+    struct json_object *result = json_object_new_object();
+    json_object_object_add(result, "benchmark", json_object_new_string("netem"));
+    json_object_object_add(result, "label", json_object_new_string(label));
+    json_object_object_add(result, "config", config);
+    json_object_object_add(result, "images_delivered", json_object_new_int(delivered));
+    json_object_object_add(result, "upload_passes", json_object_new_int(passes));
+    json_object_object_add(result, "uploads_succeeded", json_object_new_int64(snapshot[0].uploads));
+    json_object_object_add(result, "upload_failures", json_object_new_int64(snapshot[0].failures));
+    json_object_object_add(result, "aborted_uploads", json_object_new_int(atomic_load(&bench_aborted_uploads)));
+    json_object_object_add(result, "bytes", json_object_new_int64(total_bytes));
+    json_object_object_add(result, "wall_s", json_object_new_double(wall_s));
+    json_object_object_add(result, "images_per_s", json_object_new_double(delivered / wall_s));
+    json_object_object_add(result, "images_per_hour", json_object_new_double(delivered / wall_s * 3600));
+    json_object_object_add(result, "goodput_mb_per_s", json_object_new_double(delivered_bytes / wall_s / (1024 * 1024)));
+    json_object_object_add(result, "delivered_at_ms", bench_percentiles(end_to_end_ms, received));
+    json_object_object_add(result, "injected", injected);
+    json_object_object_add(result, "recovery", recovery);
+    json_object_object_add(result, "cpu_s", json_object_new_double(cpu_s));
+    json_object_object_add(result, "max_rss_kb", json_object_new_int64(usage_end.ru_maxrss));
+    printf("%s\n", json_object_to_json_string_ext(result, JSON_C_TO_STRING_PRETTY));
+    json_object_put(result);
+
+    if (!keep)
+    {
+        bench_remove_scratch(scratch);
+    }
+    return delivered == images ? 0 : 2;
+}
@@ -0,0 +1,298 @@
+/*
+* End-to-end pipeline benchmark. Synthetic JPEGs go through the code the worker runs for a
+* camera pass: import_store() and staging, then upload_scan(), the upload lanes,
+* upload_file() and the track file. Only the USB fetch is replaced. Uploads go to the
+* in-process FTP stand-in (ftp_standin.h) over loopback. Images arrive in bursts of --burst,
+* each burst is imported and then uploaded, like one pass of the worker loop.
+*
+* Prints one JSON object on stdout so runs can be kept and compared across versions:
+*   make bench && ./bench_pipeline --images 200 --label v1.4 > v1.4.json
+* Latencies are per image: import_ms from handing the data over to staging until it is
+* written, end_to_end_ms from then until the stand-in has the last byte ("shutter to
+* server"). CPU and RSS are for the whole process, stand-in included. /tmp is often tmpfs;
+* use --dir on the SD card to measure the real write path.
+*/
+
+#define UPLOADER_NO_MAIN
+#include "../uploader_gui.c"
+#include "bench_util.h"
+#include "ftp_standin.h"
+
+#define BENCH_VARIANTS 8 // distinct synthetic images, so sizes spread over the range
+#define BENCH_UPLOAD_RETRIES 3
+
+typedef struct
+{
+    uint64_t shutter_us;
+    uint64_t stored_us;
+    uint64_t received_us;
+    unsigned long size;
+} Bench_image;
+
+typedef struct
+{
+    int index;
+    char *data;
+} Bench_save;
+
+Bench_image *bench_images;
+int bench_image_count = 0;
+atomic_int bench_failed_stores;
+atomic_int bench_aborted_uploads;
+
+static void bench_stored(void *owner, const char *final_path, int err)
+{
+    (void)final_path;
+    Bench_save *save = owner;
+    if (err)
+    {
+        atomic_fetch_add(&bench_failed_stores, 1);
+    }
+    else
+    {
+        bench_images[save->index].stored_us = usb_stats_now_us();
+    }
+    free(save->data);
+    free(save);
+}
+
+static void bench_received(const char *path, unsigned long long bytes, int complete, void *ctx)
+{
+    (void)ctx;
+    const char *name = strrchr(path, '/');
+    int index;
+    if (!complete)
+    {
+        atomic_fetch_add(&bench_aborted_uploads, 1);
+    }
+    else if (name && sscanf(name, "/IMG_%d.JPG", &index) == 1 && index >= 0 && index < bench_image_count && bytes == bench_images[index].size)
+    {
+        bench_images[index].received_us = usb_stats_now_us();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int images = 100;
+    long size_kb = 6000;
+    int burst = 20;
+    int concurrency = 1;
+    const char *durability = "batch";
+    const char *layout = "{name}";
+    const char *dir = "/tmp";
+    const char *label = "";
+    int keep = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--keep") == 0)
+        {
+            keep = 1;
+            continue;
+        }
+        if (!value)
+        {
+            fprintf(stderr, "Missing value for %s.\n", argv[i]);
+            return 10;
+        }
+        if (strcmp(argv[i], "--images") == 0)
+        {
+            images = atoi(value);
+        }
+        else if (strcmp(argv[i], "--size-kb") == 0)
+        {
+            size_kb = atol(value);
+        }
+        else if (strcmp(argv[i], "--burst") == 0)
+        {
+            burst = atoi(value);
+        }
+        else if (strcmp(argv[i], "--concurrency") == 0)
+        {
+            concurrency = atoi(value);
+        }
+        else if (strcmp(argv[i], "--durability") == 0)
+        {
+            durability = value;
+        }
+        else if (strcmp(argv[i], "--layout") == 0)
+        {
+            layout = value;
+        }
+        else if (strcmp(argv[i], "--dir") == 0)
+        {
+            dir = value;
+        }
+        else if (strcmp(argv[i], "--label") == 0)
+        {
+            label = value;
+        }
+        else
+        {
+            fprintf(stderr, "Invalid argument %s. Valid options are --images, --size-kb, --burst, --concurrency, --durability, --layout, --dir, --label and --keep.\n", argv[i]);
+            return 10;
+        }
+        i++;
+    }
+
+    if (images < 1 || size_kb < 1 || burst < 1 || concurrency < 1 || concurrency > UPLOAD_TRANSFERS_MAX || !layout_valid(layout))
+    {
+        fprintf(stderr, "Need --images, --size-kb and --burst of at least 1, --concurrency of 1 to %d and a layout containing {name}.\n", UPLOAD_TRANSFERS_MAX);
+        return 10;
+    }
+
+    char scratch[1024];
+    if (bench_enter_scratch(scratch, sizeof(scratch), dir, "bench_pipeline") != 0)
+    {
+        return 1;
+    }
+    LOCAL_DIR = get_import_directory();
+    LAYOUT = layout;
+    IMPORT_DURABILITY = durability;
+    logging_status = LOGGIN_ERROR_ONLY;
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    Ftp_standin server;
+    if (ftp_standin_start(&server, bench_received, NULL) != 0)
+    {
+        fprintf(stderr, "Could not start the FTP stand-in: %s\n", strerror(errno));
+        return 1;
+    }
+    char url[64];
+    snprintf(url, sizeof(url), "ftp://127.0.0.1:%d/", server.port);
+    destination_add("bench", url, "bench:bench", "primary");
+    destination_init_ledgers(1);
+    internet_up = 1;
+
+    file_io_init();
+    staging_init();
+    atomic_store(&upload_concurrency, concurrency);
+
+    unsigned long sizes[BENCH_VARIANTS];
+    unsigned char *variants[BENCH_VARIANTS];
+    for (int i = 0; i < BENCH_VARIANTS; i++)
+    {
+        // spread evenly over 50% to 150% of the mean
+        sizes[i] = (unsigned long)(size_kb * 1024 * (0.5 + i / (double)(BENCH_VARIANTS - 1)));
+        variants[i] = malloc(sizes[i]);
+        if (!variants[i])
+        {
+            fprintf(stderr, "Out of memory for synthetic images.\n");
+            return 1;
+        }
+        bench_make_jpeg(variants[i], sizes[i], 2463534242u + i);
+    }
+    bench_images = calloc(images, sizeof(Bench_image));
+    bench_image_count = images;
+
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    uint64_t start_us = usb_stats_now_us();
+    unsigned long long total_bytes = 0;
+
+    for (int next = 0; next < images;)
+    {
+        // one pass: the burst is fetched and stored, then everything waiting is uploaded
+        for (int end = next + burst; next < images && next < end; next++)
+        {
+            int variant = (next * 5) % BENCH_VARIANTS;
+            char name[32];
+            char relative[512];
+            snprintf(name, sizeof(name), "IMG_%05d.JPG", next);
+            layout_expand(relative, sizeof(relative), name, "BENCH0001", time(NULL));
+
+            // a fresh buffer per image, as gphoto2 hands over
+            Bench_save *save = malloc(sizeof(Bench_save));
+            save->index = next;
+            save->data = malloc(sizes[variant]);
+            memcpy(save->data, variants[variant], sizes[variant]);
+            bench_images[next].size = sizes[variant];
+            total_bytes += sizes[variant];
+
+            bench_images[next].shutter_us = usb_stats_now_us();
+            if (!import_store(relative, save->data, sizes[variant], bench_stored, save))
+            {
+                atomic_fetch_add(&bench_failed_stores, 1);
+                free(save->data);
+                free(save);
+            }
+        }
+        staging_flush();
+
+        if (upload_scan())
+        {
+            upload_pending_images();
+        }
+    }
+
+    // failed uploads are picked up by the next pass, as in the worker
+    for (int retry = 0; retry < BENCH_UPLOAD_RETRIES && upload_scan(); retry++)
+    {
+        upload_pending_images();
+    }
+
+    uint64_t elapsed_us = usb_stats_now_us() - start_us;
+    getrusage(RUSAGE_SELF, &usage_end);
+    ftp_standin_stop(&server);
+
+    double *import_ms = malloc(images * sizeof(double));
+    double *end_to_end_ms = malloc(images * sizeof(double));
+    int stored = 0;
+    int delivered = 0;
+    unsigned long long delivered_bytes = 0;
+    for (int i = 0; i < images; i++)
+    {
+        if (bench_images[i].stored_us)
+        {
+            import_ms[stored++] = (bench_images[i].stored_us - bench_images[i].shutter_us) / 1000.0;
+        }
+        if (bench_images[i].received_us)
+        {
+            end_to_end_ms[delivered++] = (bench_images[i].received_us - bench_images[i].shutter_us) / 1000.0;
+            delivered_bytes += bench_images[i].size;
+        }
+    }
+
+    double wall_s = elapsed_us / 1000000.0;
+    double cpu_s = bench_cpu_s(&usage_end) - bench_cpu_s(&usage_start);
+
+    struct json_object *config = json_object_new_object();
+    json_object_object_add(config, "images", json_object_new_int(images));
+    json_object_object_add(config, "size_kb", json_object_new_int64(size_kb));
+    json_object_object_add(config, "burst", json_object_new_int(burst));
+    json_object_object_add(config, "concurrency", json_object_new_int(concurrency));
+    json_object_object_add(config, "durability", json_object_new_string(durability));
+    json_object_object_add(config, "layout", json_object_new_string(layout));
+    json_object_object_add(config, "dir", json_object_new_string(dir));
+    json_object_object_add(config, "file_io", json_object_new_string(file_io_uring ? "io_uring" : "threads"));
+
+    struct json_object *result = json_object_new_object();
+    json_object_object_add(result, "benchmark", json_object_new_string("pipeline"));
+    json_object_object_add(result, "label", json_object_new_string(label));
+    json_object_object_add(result, "config", config);
+    json_object_object_add(result, "images_stored", json_object_new_int(stored));
+    json_object_object_add(result, "images_delivered", json_object_new_int(delivered));
+    json_object_object_add(result, "store_failures", json_object_new_int(atomic_load(&bench_failed_stores)));
+    json_object_object_add(result, "aborted_uploads", json_object_new_int(atomic_load(&bench_aborted_uploads)));
+    json_object_object_add(result, "bytes", json_object_new_int64(total_bytes));
+    json_object_object_add(result, "bytes_delivered", json_object_new_int64(delivered_bytes));
+    json_object_object_add(result, "wall_s", json_object_new_double(wall_s));
+    json_object_object_add(result, "images_per_s", json_object_new_double(delivered / wall_s));
+    json_object_object_add(result, "mb_per_s", json_object_new_double(delivered_bytes / wall_s / (1024 * 1024)));
+    json_object_object_add(result, "file_io_queue_depth_peak", json_object_new_int(atomic_load(&file_io_inflight_peak)));
+    json_object_object_add(result, "staging_inflight_peak_mb", json_object_new_double(staging_bytes_inflight_peak / (1024.0 * 1024)));
+    json_object_object_add(result, "import_ms", bench_percentiles(import_ms, stored));
+    json_object_object_add(result, "end_to_end_ms", bench_percentiles(end_to_end_ms, delivered));
+    json_object_object_add(result, "cpu_s", json_object_new_double(cpu_s));
+    json_object_object_add(result, "cpu_percent", json_object_new_double(cpu_s / wall_s * 100));
+    json_object_object_add(result, "max_rss_kb", json_object_new_int64(usage_end.ru_maxrss));
+    printf("%s\n", json_object_to_json_string_ext(result, JSON_C_TO_STRING_PRETTY));
+    json_object_put(result);
+
+    if (!keep)
+    {
+        bench_remove_scratch(scratch);
+    }
+    return delivered == images ? 0 : 2;
+}
@@ -0,0 +1,308 @@
+/*
+* Task pool benchmark and check (task_pool.h). With every worker held on a gate, it fills the
+* queues until the pool refuses, background tasks first and then high priority ones, opens
+* the gate and checks that the high priority tasks ran first and that their time queued was
+* recorded. A task then queues a batch on its own worker, which the idle workers must steal.
+* Last, small tasks go through as fast as the pool takes them, and the pool is stopped with
+* tasks still queued.
+*
+*   make bench && ./bench_task_pool --workers 4 --label v1.4 > pool.json
+*
+* Prints one JSON object; exits 2 if a check failed.
+*/
+
+#define UPLOADER_NO_MAIN
+#include "../uploader_gui.c"
+#include "bench_util.h"
+
+#define BENCH_HOLD_MS 50 // how long the filled queues wait behind the gate
+#define BENCH_STEAL_TASKS TASK_POOL_QUEUE_MAX // as many as one worker's queue holds
+#define BENCH_SPIN_US 2000 // run time of a stolen task, long enough for the others to wake
+
+typedef struct
+{
+    TASK_PRIORITY priority;
+    int started; // place in the order tasks started
+} Bench_task;
+
+pthread_mutex_t bench_gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t bench_gate_cond = PTHREAD_COND_INITIALIZER;
+int bench_gate_open = 1;
+int bench_gate_held = 0;
+atomic_int bench_started;
+atomic_int bench_done;
+
+static void bench_gate_task(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&bench_gate_mutex);
+    bench_gate_held++;
+    pthread_cond_broadcast(&bench_gate_cond);
+    while (!bench_gate_open)
+    {
+        pthread_cond_wait(&bench_gate_cond, &bench_gate_mutex);
+    }
+    bench_gate_held--;
+    pthread_mutex_unlock(&bench_gate_mutex);
+}
+
+// holds every worker on the gate; 0 if they did not all get there within a second
+static int bench_gate_close(int workers)
+{
+    pthread_mutex_lock(&bench_gate_mutex);
+    bench_gate_open = 0;
+    pthread_mutex_unlock(&bench_gate_mutex);
+    for (int i = 0; i < workers; i++)
+    {
+        task_pool_submit(TASK_KIND_REJECT_SCORE, TASK_PRIORITY_HIGH, bench_gate_task, NULL);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_mutex_lock(&bench_gate_mutex);
+    while (bench_gate_held < workers && pthread_cond_timedwait(&bench_gate_cond, &bench_gate_mutex, &deadline) == 0)
+    {
+    }
+    int held = bench_gate_held == workers;
+    pthread_mutex_unlock(&bench_gate_mutex);
+    return held;
+}
+
+static void bench_gate_release()
+{
+    pthread_mutex_lock(&bench_gate_mutex);
+    bench_gate_open = 1;
+    pthread_cond_broadcast(&bench_gate_cond);
+    pthread_mutex_unlock(&bench_gate_mutex);
+}
+
+static void bench_ordered_task(void *arg)
+{
+    Bench_task *task = arg;
+    task->started = atomic_fetch_add(&bench_started, 1);
+    atomic_fetch_add(&bench_done, 1);
+}
+
+static void bench_spin_task(void *arg)
+{
+    (void)arg;
+    uint64_t until_us = usb_stats_now_us() + BENCH_SPIN_US;
+    while (usb_stats_now_us() < until_us)
+    {
+    }
+    atomic_fetch_add(&bench_done, 1);
+}
+
+// queues the batch on the worker running it, so the other workers only get it by stealing
+static void bench_fork_task(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < BENCH_STEAL_TASKS; i++)
+    {
+        task_pool_submit(TASK_KIND_REJECT_SCORE, TASK_PRIORITY_HIGH, bench_spin_task, NULL);
+    }
+}
+
+static void bench_empty_task(void *arg)
+{
+    (void)arg;
+    atomic_fetch_add(&bench_done, 1);
+}
+
+// waits until bench_done reaches count; 0 after timeout_ms
+static int bench_wait_done(int count, int timeout_ms)
+{
+    uint64_t deadline_us = usb_stats_now_us() + timeout_ms * 1000ULL;
+    while (atomic_load(&bench_done) < count)
+    {
+        if (usb_stats_now_us() > deadline_us)
+        {
+            return 0;
+        }
+        usleep(100);
+    }
+    return 1;
+}
+
+// queues tasks of one priority until the pool refuses one, returning how many went in; tasks has room for capacity + 1
+static int bench_fill(Bench_task *tasks, int capacity, TASK_PRIORITY priority)
+{
+    int accepted = 0;
+    while (accepted <= capacity)
+    {
+        tasks[accepted].priority = priority;
+        TASK_KIND kind = priority == TASK_PRIORITY_HIGH ? TASK_KIND_REJECT_SCORE : TASK_KIND_THUMBNAIL;
+        if (!task_pool_submit(kind, priority, bench_ordered_task, &tasks[accepted]))
+        {
+            break;
+        }
+        accepted++;
+    }
+    return accepted;
+}
+
+int main(int argc, char *argv[])
+{
+    int workers = 4;
+    long tasks = 100000;
+    const char *label = "";
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value)
+        {
+            fprintf(stderr, "Missing value for %s.\n", argv[i]);
+            return 10;
+        }
+        if (strcmp(argv[i], "--workers") == 0)
+        {
+            workers = atoi(value);
+        }
+        else if (strcmp(argv[i], "--tasks") == 0)
+        {
+            tasks = atol(value);
+        }
+        else if (strcmp(argv[i], "--label") == 0)
+        {
+            label = value;
+        }
+        else
+        {
+            fprintf(stderr, "Invalid argument %s. Valid options are --workers, --tasks and --label.\n", argv[i]);
+            return 10;
+        }
+        i++;
+    }
+    if (workers < 1 || workers > TASK_POOL_WORKERS_MAX || tasks < 1)
+    {
+        fprintf(stderr, "Need --workers of 1 to %d and --tasks of at least 1.\n", TASK_POOL_WORKERS_MAX);
+        return 10;
+    }
+
+    logging_status = LOGGIN_ERROR_ONLY;
+    task_pool_start(workers);
+    int capacity = workers * TASK_POOL_QUEUE_MAX;
+    Bench_task *ordered = calloc(2 * capacity + 1, sizeof(Bench_task));
+    Task_kind_stats before[TASK_KIND_COUNT], after[TASK_KIND_COUNT];
+
+    // refusal and priority order: background queued first still runs after high priority
+    int gate_held = bench_gate_close(workers);
+    task_pool_snapshot(before);
+    int accepted_background = bench_fill(ordered, capacity, TASK_PRIORITY_BACKGROUND);
+    int accepted_high = bench_fill(ordered + accepted_background, capacity, TASK_PRIORITY_HIGH);
+    int accepted = accepted_background + accepted_high;
+    usleep(BENCH_HOLD_MS * 1000);
+    atomic_store(&bench_done, 0);
+    atomic_store(&bench_started, 0);
+    bench_gate_release();
+    int ordered_ran = bench_wait_done(accepted, 5000);
+    usleep(10000); // the stats are recorded just after each task returns
+    task_pool_snapshot(after);
+
+    int last_high = -1;
+    for (int i = 0; i < accepted; i++)
+    {
+        if (ordered[i].priority == TASK_PRIORITY_HIGH && ordered[i].started > last_high)
+        {
+            last_high = ordered[i].started;
+        }
+    }
+    // a worker can pick a background task while another has just taken the last high one
+    int background_early = 0;
+    for (int i = 0; i < accepted; i++)
+    {
+        background_early += ordered[i].priority == TASK_PRIORITY_BACKGROUND && ordered[i].started < last_high;
+    }
+    uint64_t refused = (after[TASK_KIND_REJECT_SCORE].refused - before[TASK_KIND_REJECT_SCORE].refused) +
+        (after[TASK_KIND_THUMBNAIL].refused - before[TASK_KIND_THUMBNAIL].refused);
+    uint64_t waited = 0;
+    uint64_t waited_us = 0;
+    for (int kind = 0; kind < TASK_KIND_COUNT; kind++)
+    {
+        waited += after[kind].wait.count - before[kind].wait.count;
+        waited_us += after[kind].wait.total_us - before[kind].wait.total_us;
+    }
+    double wait_avg_ms = waited ? (double)waited_us / waited / 1000.0 : 0.0;
+
+    // stealing: the batch sits on one worker's queue while the rest are idle
+    task_pool_snapshot(before);
+    atomic_store(&bench_done, 0);
+    uint64_t steal_start_us = usb_stats_now_us();
+    task_pool_submit(TASK_KIND_THUMBNAIL, TASK_PRIORITY_HIGH, bench_fork_task, NULL);
+    int stolen_ran = bench_wait_done(BENCH_STEAL_TASKS, 5000);
+    double steal_ms = (usb_stats_now_us() - steal_start_us) / 1000.0;
+    usleep(10000); // the stats are recorded just after each task returns
+    task_pool_snapshot(after);
+    uint64_t stolen = after[TASK_KIND_REJECT_SCORE].stolen - before[TASK_KIND_REJECT_SCORE].stolen;
+
+    // throughput of small tasks, resubmitting whatever the pool refuses
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    atomic_store(&bench_done, 0);
+    uint64_t start_us = usb_stats_now_us();
+    long retries = 0;
+    for (long i = 0; i < tasks; i++)
+    {
+        while (!task_pool_submit(TASK_KIND_REJECT_SCORE, TASK_PRIORITY_HIGH, bench_empty_task, NULL))
+        {
+            retries++;
+            sched_yield();
+        }
+    }
+    int throughput_ran = bench_wait_done(tasks, 60000);
+    double wall_s = (usb_stats_now_us() - start_us) / 1000000.0;
+    getrusage(RUSAGE_SELF, &usage_end);
+
+    // stopping with the workers busy and tasks queued: queued ones are dropped, workers joined
+    int stop_held = bench_gate_close(workers);
+    int queued_at_stop = bench_fill(ordered, capacity, TASK_PRIORITY_BACKGROUND);
+    stop_requested = 1;
+    bench_gate_release();
+    uint64_t stop_start_us = usb_stats_now_us();
+    task_pool_stop();
+    double stop_ms = (usb_stats_now_us() - stop_start_us) / 1000.0;
+
+    struct json_object *checks = json_object_new_object();
+    int refusal_ok = gate_held && accepted_background == capacity && accepted_high == capacity && refused == 2;
+    int order_ok = ordered_ran && background_early < workers;
+    // the gate tasks count too, having been taken before the snapshot and finished after it
+    int wait_ok = waited == (uint64_t)(accepted + workers) && waited_us >= (uint64_t)accepted * BENCH_HOLD_MS * 1000;
+    int steal_ok = stolen_ran && (workers == 1 || stolen > 0);
+    int stop_ok = stop_held && stop_ms < 1000;
+    json_object_object_add(checks, "refusal", json_object_new_boolean(refusal_ok));
+    json_object_object_add(checks, "priority_order", json_object_new_boolean(order_ok));
+    json_object_object_add(checks, "wait_recorded", json_object_new_boolean(wait_ok));
+    json_object_object_add(checks, "stealing", json_object_new_boolean(steal_ok));
+    json_object_object_add(checks, "throughput_ran", json_object_new_boolean(throughput_ran));
+    json_object_object_add(checks, "stop", json_object_new_boolean(stop_ok));
+
+    struct json_object *config = json_object_new_object();
+    json_object_object_add(config, "workers", json_object_new_int(workers));
+    json_object_object_add(config, "queue_max", json_object_new_int(TASK_POOL_QUEUE_MAX));
+    json_object_object_add(config, "tasks", json_object_new_int64(tasks));
+
+    struct json_object *result = json_object_new_object();
+    json_object_object_add(result, "benchmark", json_object_new_string("task_pool"));
+    json_object_object_add(result, "label", json_object_new_string(label));
+    json_object_object_add(result, "config", config);
+    json_object_object_add(result, "checks", checks);
+    json_object_object_add(result, "accepted_high", json_object_new_int(accepted_high));
+    json_object_object_add(result, "accepted_background", json_object_new_int(accepted_background));
+    json_object_object_add(result, "refused", json_object_new_int64(refused));
+    json_object_object_add(result, "background_before_last_high", json_object_new_int(background_early));
+    json_object_object_add(result, "wait_avg_ms", json_object_new_double(wait_avg_ms));
+    json_object_object_add(result, "stolen", json_object_new_int64(stolen));
+    json_object_object_add(result, "steal_batch_ms", json_object_new_double(steal_ms));
+    json_object_object_add(result, "tasks_per_s", json_object_new_double(tasks / wall_s));
+    json_object_object_add(result, "submit_retries", json_object_new_int64(retries));
+    json_object_object_add(result, "cpu_s", json_object_new_double(bench_cpu_s(&usage_end) - bench_cpu_s(&usage_start)));
+    json_object_object_add(result, "queued_at_stop", json_object_new_int(queued_at_stop));
+    json_object_object_add(result, "stop_ms", json_object_new_double(stop_ms));
+    printf("%s\n", json_object_to_json_string_ext(result, JSON_C_TO_STRING_PRETTY));
+    json_object_put(result);
+
+    free(ordered);
+    return refusal_ok && order_ok && wait_ok && steal_ok && throughput_ran && stop_ok ? 0 : 2;
+}
@@ -0,0 +1,179 @@
+#include <ftw.h>
+#include <sys/resource.h>
+
+/*
+* Pieces shared by the benchmarks: synthetic images, latency percentiles, CPU time and the
+* scratch directory every run works in.
+*/
+
+static size_t bench_put16(unsigned char *p, unsigned value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+    return 2;
+}
+
+static size_t bench_put32(unsigned char *p, uint32_t value)
+{
+    bench_put16(p, value >> 16);
+    return 2 + bench_put16(p + 2, value);
+}
+
+static size_t bench_put_entry(unsigned char *p, unsigned tag, unsigned type, uint32_t count, uint32_t value)
+{
+    bench_put16(p, tag);
+    bench_put16(p + 2, type);
+    bench_put32(p + 4, count);
+    if (type == 3)
+    {
+        bench_put16(p + 8, value);
+        bench_put16(p + 10, 0);
+    }
+    else
+    {
+        bench_put32(p + 8, value);
+    }
+    return 12;
+}
+
+// an APP1 segment as cameras write it: orientation and time in IFD0, capture time and serial in the Exif IFD
+static size_t bench_make_exif(unsigned char *out, time_t captured, const char *serial)
+{
+    char datetime[20];
+    struct tm tm;
+    localtime_r(&captured, &tm);
+    strftime(datetime, sizeof(datetime), "%Y:%m:%d %H:%M:%S", &tm);
+    uint32_t serial_length = strlen(serial) + 1;
+
+    unsigned char *tiff = out + 10;
+    size_t n = 0;
+    n += bench_put16(tiff + n, 0x4D4D); // "MM", big-endian like most bodies
+    n += bench_put16(tiff + n, 42);
+    n += bench_put32(tiff + n, 8);
+    n += bench_put16(tiff + n, 3); // IFD0 at 8, 42 bytes, then its date at 50
+    n += bench_put_entry(tiff + n, 0x0112, 3, 1, 1);
+    n += bench_put_entry(tiff + n, 0x0132, 2, 20, 50);
+    n += bench_put_entry(tiff + n, 0x8769, 4, 1, 70);
+    n += bench_put32(tiff + n, 0);
+    memcpy(tiff + n, datetime, 20);
+    n += 20;
+    n += bench_put16(tiff + n, 2); // Exif IFD at 70, 30 bytes, then its values at 100 and 120
+    n += bench_put_entry(tiff + n, 0x9003, 2, 20, 100);
+    n += bench_put_entry(tiff + n, 0xA431, 2, serial_length, 120);
+    n += bench_put32(tiff + n, 0);
+    memcpy(tiff + n, datetime, 20);
+    n += 20;
+    memcpy(tiff + n, serial, serial_length);
+    n += serial_length;
+
+    bench_put16(out, 0xFFE1);
+    bench_put16(out + 2, 8 + n);
+    memcpy(out + 4, "Exif\0\0", 6);
+    return 10 + n;
+}
+
+// a valid JPEG frame around pseudo-random entropy data, which like real scan data barely compresses
+void bench_make_jpeg(unsigned char *out, unsigned long size, uint32_t seed)
+{
+    static const unsigned char segments[] = {
+        0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x48, 0x00, 0x48, 0x00, 0x00, // APP0
+        0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00,                   // SOS
+    };
+    out[0] = 0xFF; // SOI
+    out[1] = 0xD8;
+    // a shot a second from a fixed morning, so capture order follows the seed
+    unsigned long header = 2 + bench_make_exif(out + 2, 1717225200 + seed % 86400, "BENCH0001");
+    memcpy(out + header, segments, sizeof(segments));
+    header += sizeof(segments);
+
+    uint32_t state = seed ? seed : 1;
+    for (unsigned long i = header; i < size - 2; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        // 0xFF in scan data is always followed by a stuffed 0x00
+        out[i] = out[i - 1] == 0xFF ? 0x00 : (unsigned char)state;
+    }
+    out[size - 3] = out[size - 3] == 0xFF ? 0x00 : out[size - 3];
+    out[size - 2] = 0xFF;
+    out[size - 1] = 0xD9; // EOI
+}
+
+// a little endian TIFF holding 12 bit sensor data in 16 bit words: smooth rows plus a few bits of noise, as a RAW would
+void bench_make_raw(unsigned char *out, unsigned long size, uint32_t seed)
+{
+    static const unsigned char header[] = {'I', 'I', '*', 0x00, 0x08, 0x00, 0x00, 0x00};
+    memcpy(out, header, sizeof(header));
+
+    uint32_t state = seed ? seed : 1;
+    unsigned long pixel = 0;
+    for (unsigned long i = sizeof(header); i + 1 < size; i += 2, pixel++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        unsigned value = (unsigned)(1024 + (pixel % 4000) / 2 + (pixel / 4000) % 1024 + (state & 0x1F)) & 0xFFF;
+        out[i] = value;
+        out[i + 1] = value >> 8;
+    }
+    out[size - 1] = size % 2 ? 0 : out[size - 1];
+}
+
+static int bench_compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// p50, p90, p99 and max of count values, sorted in place
+struct json_object *bench_percentiles(double *values, int count)
+{
+    struct json_object *out = json_object_new_object();
+    if (count == 0)
+    {
+        return out;
+    }
+    qsort(values, count, sizeof(double), bench_compare_double);
+    const char *names[] = {"p50", "p90", "p99"};
+    const double ranks[] = {0.50, 0.90, 0.99};
+    for (int i = 0; i < 3; i++)
+    {
+        int rank = (int)(ranks[i] * count + 0.999999) - 1; // nearest rank
+        json_object_object_add(out, names[i], json_object_new_double(values[rank < 0 ? 0 : rank]));
+    }
+    json_object_object_add(out, "max", json_object_new_double(values[count - 1]));
+    return out;
+}
+
+double bench_cpu_s(const struct rusage *usage)
+{
+    return usage->ru_utime.tv_sec + usage->ru_stime.tv_sec + (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1000000.0;
+}
+
+// creates <dir>/<name>.XXXXXX and moves into it, so the import folder, track file and log stay there
+int bench_enter_scratch(char *scratch, size_t size, const char *dir, const char *name)
+{
+    snprintf(scratch, size, "%s/%s.XXXXXX", dir, name);
+    if (!mkdtemp(scratch) || chdir(scratch) != 0)
+    {
+        fprintf(stderr, "Could not create a scratch directory in %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+void bench_remove_scratch(const char *scratch)
+{
+    nftw(scratch, bench_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
@@ -0,0 +1,420 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+/*
+* In-process FTP server for the benchmarks: enough of RFC 959 for curl's upload path
+* (USER, PASS, PWD, CWD, MKD, TYPE, EPSV/PASV, STOR, QUIT) on 127.0.0.1 with passive data
+* connections. Uploaded data is counted and thrown away so the server never competes with
+* the uploader for the disk. Directories live in memory, so CWD into one that was never
+* made fails the way a real server's does and curl's create-missing-dirs path is exercised.
+* Each finished STOR is reported through the received callback with the time it completed.
+*/
+
+#define FTP_STANDIN_LINE_MAX 1024
+#define FTP_STANDIN_DATA_TIMEOUT_MS 30000
+#define FTP_STANDIN_PASSIVE_TURNAROUND_US 50 // see ftp_standin_open_passive()
+
+typedef void (*Ftp_standin_received)(const char *path, unsigned long long bytes, int complete, void *ctx);
+
+// lets something in front of the server (netem_proxy.h) carry data connections too: returns the port to advertise
+typedef int (*Ftp_standin_passive)(int port, void *ctx);
+
+typedef struct
+{
+    int listen_fd;
+    int port;
+    pthread_t thread;
+    atomic_int stopping;
+    atomic_int sessions;
+    Ftp_standin_received received;
+    void *ctx;
+    Ftp_standin_passive passive; // set after ftp_standin_start(), NULL to advertise the real port
+    void *passive_ctx;
+
+    pthread_mutex_t dirs_mutex;
+    GHashTable *dirs; // absolute paths without a trailing slash, "" for the root
+} Ftp_standin;
+
+typedef struct
+{
+    Ftp_standin *server;
+    int fd;
+    char cwd[FTP_STANDIN_LINE_MAX];
+    int passive_fd;
+} Ftp_standin_session;
+
+static void ftp_standin_reply(Ftp_standin_session *session, const char *format, ...)
+{
+    char line[FTP_STANDIN_LINE_MAX + 64];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line) - 2, format, args);
+    va_end(args);
+    if (length > (int)sizeof(line) - 3)
+    {
+        length = sizeof(line) - 3;
+    }
+    memcpy(line + length, "\r\n", 2);
+    send(session->fd, line, length + 2, MSG_NOSIGNAL);
+}
+
+// joins argument onto the session's directory and folds away "." and ".."; out has no trailing slash
+static void ftp_standin_resolve(const Ftp_standin_session *session, const char *argument, char *out, size_t size)
+{
+    char joined[FTP_STANDIN_LINE_MAX * 2];
+    if (argument[0] == '/')
+    {
+        snprintf(joined, sizeof(joined), "%s", argument);
+    }
+    else
+    {
+        snprintf(joined, sizeof(joined), "%s/%s", session->cwd, argument);
+    }
+
+    size_t length = 0;
+    out[0] = '\0';
+    char *saveptr = NULL;
+    for (char *part = strtok_r(joined, "/", &saveptr); part; part = strtok_r(NULL, "/", &saveptr))
+    {
+        if (strcmp(part, ".") == 0)
+        {
+            continue;
+        }
+        if (strcmp(part, "..") == 0)
+        {
+            char *slash = strrchr(out, '/');
+            length = slash ? (size_t)(slash - out) : 0;
+            out[length] = '\0';
+            continue;
+        }
+        length += snprintf(out + length, size - length, "/%s", part);
+        if (length >= size)
+        {
+            length = size - 1;
+        }
+    }
+}
+
+static int ftp_standin_dir_exists(Ftp_standin *server, const char *path)
+{
+    pthread_mutex_lock(&server->dirs_mutex);
+    int exists = g_hash_table_contains(server->dirs, path);
+    pthread_mutex_unlock(&server->dirs_mutex);
+    return exists;
+}
+
+static int ftp_standin_open_passive(Ftp_standin_session *session)
+{
+    if (session->passive_fd >= 0)
+    {
+        close(session->passive_fd);
+    }
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+
+    session->passive_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (session->passive_fd < 0 || bind(session->passive_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(session->passive_fd, 1) != 0 || getsockname(session->passive_fd, (struct sockaddr *)&address, &length) != 0)
+    {
+        if (session->passive_fd >= 0)
+        {
+            close(session->passive_fd);
+        }
+        session->passive_fd = -1;
+        return -1;
+    }
+
+    /*
+    * Answered at once, the passive reply can reach curl before it returns from sending EPSV,
+    * which no server across a network manages. libcurl 7.88 then sets up the data connection
+    * without starting it, and only its 200ms timer gets it going. CWD's round trip in a
+    * layout with directories hid that, so "{name}" alone measured 5 images/s against 180.
+    */
+    usleep(FTP_STANDIN_PASSIVE_TURNAROUND_US);
+
+    int port = ntohs(address.sin_port);
+    Ftp_standin *server = session->server;
+    return server->passive ? server->passive(port, server->passive_ctx) : port;
+}
+
+static void ftp_standin_store(Ftp_standin_session *session, const char *argument)
+{
+    char path[FTP_STANDIN_LINE_MAX];
+    ftp_standin_resolve(session, argument, path, sizeof(path));
+
+    char parent[FTP_STANDIN_LINE_MAX];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char *slash = strrchr(parent, '/');
+    *(slash ? slash : parent) = '\0';
+
+    if (session->passive_fd < 0)
+    {
+        ftp_standin_reply(session, "425 Use EPSV or PASV first.");
+        return;
+    }
+    if (!ftp_standin_dir_exists(session->server, parent))
+    {
+        ftp_standin_reply(session, "553 No such directory.");
+        return;
+    }
+
+    ftp_standin_reply(session, "150 Ok to send data.");
+    struct pollfd accept_poll = {session->passive_fd, POLLIN, 0};
+    int data_fd = poll(&accept_poll, 1, FTP_STANDIN_DATA_TIMEOUT_MS) == 1 ? accept(session->passive_fd, NULL, NULL) : -1;
+    close(session->passive_fd);
+    session->passive_fd = -1;
+    if (data_fd < 0)
+    {
+        ftp_standin_reply(session, "425 No data connection.");
+        return;
+    }
+
+    char buffer[65536];
+    unsigned long long bytes = 0;
+    ssize_t n = -1;
+    struct pollfd data_poll = {data_fd, POLLIN, 0};
+    while (poll(&data_poll, 1, FTP_STANDIN_DATA_TIMEOUT_MS) == 1 && (n = recv(data_fd, buffer, sizeof(buffer), 0)) > 0)
+    {
+        bytes += n;
+    }
+    // a clean end of stream is the only way an upload completes; a reset or stall aborts it
+    int complete = n == 0;
+    close(data_fd);
+
+    if (session->server->received)
+    {
+        session->server->received(path, bytes, complete, session->server->ctx);
+    }
+    ftp_standin_reply(session, complete ? "226 Transfer complete." : "426 Connection closed; transfer aborted.");
+}
+
+static void ftp_standin_command(Ftp_standin_session *session, char *command, char *argument, int *quit)
+{
+    Ftp_standin *server = session->server;
+    char path[FTP_STANDIN_LINE_MAX];
+
+    if (strcasecmp(command, "USER") == 0)
+    {
+        ftp_standin_reply(session, "331 Password please.");
+    }
+    else if (strcasecmp(command, "PASS") == 0)
+    {
+        ftp_standin_reply(session, "230 Logged in.");
+    }
+    else if (strcasecmp(command, "PWD") == 0)
+    {
+        ftp_standin_reply(session, "257 \"%s\"", session->cwd[0] ? session->cwd : "/");
+    }
+    else if (strcasecmp(command, "CWD") == 0)
+    {
+        ftp_standin_resolve(session, argument, path, sizeof(path));
+        if (ftp_standin_dir_exists(server, path))
+        {
+            snprintf(session->cwd, sizeof(session->cwd), "%s", path);
+            ftp_standin_reply(session, "250 Directory changed.");
+        }
+        else
+        {
+            ftp_standin_reply(session, "550 No such directory.");
+        }
+    }
+    else if (strcasecmp(command, "MKD") == 0)
+    {
+        ftp_standin_resolve(session, argument, path, sizeof(path));
+        pthread_mutex_lock(&server->dirs_mutex);
+        g_hash_table_add(server->dirs, g_strdup(path));
+        pthread_mutex_unlock(&server->dirs_mutex);
+        ftp_standin_reply(session, "257 \"%s\" created.", path);
+    }
+    else if (strcasecmp(command, "TYPE") == 0)
+    {
+        ftp_standin_reply(session, "200 Type set.");
+    }
+    else if (strcasecmp(command, "EPSV") == 0)
+    {
+        int port = ftp_standin_open_passive(session);
+        if (port < 0)
+        {
+            ftp_standin_reply(session, "425 Cannot open data connection.");
+        }
+        else
+        {
+            ftp_standin_reply(session, "229 Entering Extended Passive Mode (|||%d|)", port);
+        }
+    }
+    else if (strcasecmp(command, "PASV") == 0)
+    {
+        int port = ftp_standin_open_passive(session);
+        if (port < 0)
+        {
+            ftp_standin_reply(session, "425 Cannot open data connection.");
+        }
+        else
+        {
+            ftp_standin_reply(session, "227 Entering Passive Mode (127,0,0,1,%d,%d)", port >> 8, port & 0xff);
+        }
+    }
+    else if (strcasecmp(command, "STOR") == 0)
+    {
+        ftp_standin_store(session, argument);
+    }
+    else if (strcasecmp(command, "QUIT") == 0)
+    {
+        ftp_standin_reply(session, "221 Bye.");
+        *quit = 1;
+    }
+    else
+    {
+        ftp_standin_reply(session, "502 Not implemented.");
+    }
+}
+
+static void *ftp_standin_session_thread(void *arg)
+{
+    Ftp_standin_session *session = arg;
+    ftp_standin_reply(session, "220 Stand-in ready.");
+
+    char buffer[FTP_STANDIN_LINE_MAX];
+    size_t used = 0;
+    int quit = 0;
+    while (!quit && !atomic_load(&session->server->stopping))
+    {
+        ssize_t n = recv(session->fd, buffer + used, sizeof(buffer) - 1 - used, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        used += n;
+        buffer[used] = '\0';
+
+        char *newline;
+        while (!quit && (newline = strstr(buffer, "\r\n")) != NULL)
+        {
+            *newline = '\0';
+            char *argument = buffer + strcspn(buffer, " ");
+            if (*argument)
+            {
+                *argument++ = '\0';
+            }
+            ftp_standin_command(session, buffer, argument, &quit);
+
+            used -= newline + 2 - buffer;
+            memmove(buffer, newline + 2, used + 1);
+        }
+        if (used == sizeof(buffer) - 1)
+        {
+            break;
+        }
+    }
+
+    if (session->passive_fd >= 0)
+    {
+        close(session->passive_fd);
+    }
+    close(session->fd);
+    atomic_fetch_sub(&session->server->sessions, 1);
+    free(session);
+    return NULL;
+}
+
+static void *ftp_standin_accept_thread(void *arg)
+{
+    Ftp_standin *server = arg;
+    while (!atomic_load(&server->stopping))
+    {
+        struct pollfd listen_poll = {server->listen_fd, POLLIN, 0};
+        if (poll(&listen_poll, 1, 100) != 1)
+        {
+            continue;
+        }
+        int fd = accept(server->listen_fd, NULL, NULL);
+        Ftp_standin_session *session = fd >= 0 ? calloc(1, sizeof(Ftp_standin_session)) : NULL;
+        if (!session)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            continue;
+        }
+
+        // replies go out at once like a real server's, instead of waiting on the client's delayed ack
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        session->server = server;
+        session->fd = fd;
+        session->passive_fd = -1;
+        atomic_fetch_add(&server->sessions, 1);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ftp_standin_session_thread, session) == 0)
+        {
+            pthread_detach(thread);
+        }
+        else
+        {
+            atomic_fetch_sub(&server->sessions, 1);
+            close(fd);
+            free(session);
+        }
+    }
+    return NULL;
+}
+
+// listens on an ephemeral loopback port, found in server->port; returns 0 or -1
+int ftp_standin_start(Ftp_standin *server, Ftp_standin_received received, void *ctx)
+{
+    memset(server, 0, sizeof(*server));
+    server->received = received;
+    server->ctx = ctx;
+    pthread_mutex_init(&server->dirs_mutex, NULL);
+    server->dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_add(server->dirs, g_strdup(""));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0 || bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(server->listen_fd, 16) != 0 || getsockname(server->listen_fd, (struct sockaddr *)&address, &length) != 0)
+    {
+        if (server->listen_fd >= 0)
+        {
+            close(server->listen_fd);
+        }
+        return -1;
+    }
+    server->port = ntohs(address.sin_port);
+
+    if (pthread_create(&server->thread, NULL, ftp_standin_accept_thread, server) != 0)
+    {
+        close(server->listen_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// stops accepting and waits up to a few seconds for open sessions to end
+void ftp_standin_stop(Ftp_standin *server)
+{
+    atomic_store(&server->stopping, 1);
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    for (int i = 0; i < 50 && atomic_load(&server->sessions) > 0; i++)
+    {
+        usleep(100000);
+    }
+}
@@ -0,0 +1,619 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+* TCP proxy on 127.0.0.1 that makes loopback behave like a poor link, for putting in front
+* of the FTP stand-in. Each direction of each connection passes through its own queue:
+* a reader takes data off one socket in small chunks and stamps each with when it may leave,
+* a writer sleeps until then and sends it on. The stamp adds
+*   latency and jitter    one way delay plus a uniform random extra, order always kept
+*   a rate cap            chunks serialize at rate_kbit, and the queue (about one
+*                         bandwidth-delay product) fills and pushes back on the sender
+*   stalls                a chunk is held stall_ms more now and then, the way a lost
+*                         segment holds everything behind it until the retransmit
+* and with resets_per_mb a connection is torn down with a RST part way through. While a
+* phase is "down" new connections are refused and traffic already in flight is held.
+*
+* A link profile is a list of phases, each lasting some seconds, played in a loop from when
+* the proxy starts. Random choices come from --seed, so a run can be repeated; thread
+* scheduling still varies a little between runs.
+*/
+
+#define NETEM_CHUNK_BYTES 16384
+#define NETEM_CHUNK_MS 10 // with a rate cap, chunks are cut to about this much link time
+#define NETEM_QUEUE_MIN_BYTES 65536
+#define NETEM_PHASES_MAX 16
+
+typedef struct
+{
+    int seconds;
+    int latency_ms; // one way, each direction
+    int jitter_ms;
+    int rate_kbit; // each direction, 0 for no cap
+    double stall_percent; // chance per chunk
+    int stall_ms;
+    double resets_per_mb; // chance per MB carried that the connection is reset
+    int down;
+} Netem_phase;
+
+typedef struct
+{
+    const char *name;
+    int phase_count;
+    Netem_phase phases[NETEM_PHASES_MAX];
+} Netem_profile;
+
+const Netem_profile netem_profiles[] = {
+    {"loopback", 1, {{60, 0, 0, 0, 0, 0, 0, 0}}},
+    {"venue_wifi", 2, {{45, 15, 25, 8000, 2, 300, 0.02, 0}, {15, 40, 120, 2000, 8, 600, 0.05, 0}}},
+    {"hotspot_3g", 1, {{60, 150, 80, 1500, 1, 1000, 0.05, 0}}},
+    {"flaky", 3, {{40, 80, 40, 4000, 1, 500, 0.1, 0}, {10, 80, 40, 4000, 0, 0, 0, 1}, {30, 300, 200, 500, 5, 1500, 0.2, 0}}},
+};
+
+typedef struct Netem_chunk
+{
+    struct Netem_chunk *next;
+    uint64_t release_us;
+    size_t length; // 0 marks the end of the stream
+    char data[];
+} Netem_chunk;
+
+typedef struct Netem_proxy Netem_proxy;
+typedef struct Netem_connection Netem_connection;
+
+typedef struct
+{
+    Netem_connection *connection;
+    int from;
+    int to;
+    uint32_t random;
+    uint64_t link_free_us; // when the link finishes serializing what is already queued
+    uint64_t last_release_us;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Netem_chunk *head;
+    Netem_chunk *tail;
+    size_t queued;
+} Netem_pipe;
+
+struct Netem_connection
+{
+    Netem_proxy *proxy;
+    int client;
+    int server;
+    atomic_int aborted;
+    atomic_int threads;
+    Netem_pipe up; // client to server
+    Netem_pipe down;
+};
+
+struct Netem_proxy
+{
+    Netem_profile profile;
+    int target_port;
+    int port;
+    int listen_fd;
+    pthread_t thread;
+    uint64_t started_us;
+    atomic_int stopping;
+    atomic_uint seed;
+
+    atomic_ullong bytes_up;
+    atomic_ullong bytes_down;
+    atomic_uint connections;
+    atomic_uint stalls;
+    atomic_uint resets;
+    pthread_mutex_t events_mutex;
+    uint64_t *reset_times_us; // for recovery times, grown as resets happen
+    int reset_time_count;
+    int reset_time_capacity;
+};
+
+static uint64_t netem_now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static double netem_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state / 4294967296.0;
+}
+
+static int netem_profile_seconds(const Netem_profile *profile)
+{
+    int total = 0;
+    for (int i = 0; i < profile->phase_count; i++)
+    {
+        total += profile->phases[i].seconds;
+    }
+    return total;
+}
+
+// the phase in effect at now_us, with the profile looping from the start
+const Netem_phase *netem_phase_at(const Netem_proxy *proxy, uint64_t now_us, uint64_t *phase_end_us)
+{
+    int total = netem_profile_seconds(&proxy->profile);
+    uint64_t elapsed_us = now_us - proxy->started_us;
+    uint64_t loop_start_us = now_us - (total > 0 ? elapsed_us % (total * 1000000ULL) : 0);
+    uint64_t offset_us = now_us - loop_start_us;
+
+    uint64_t end_us = 0;
+    for (int i = 0; i < proxy->profile.phase_count; i++)
+    {
+        end_us += proxy->profile.phases[i].seconds * 1000000ULL;
+        if (offset_us < end_us || i == proxy->profile.phase_count - 1)
+        {
+            if (phase_end_us)
+            {
+                *phase_end_us = loop_start_us + end_us;
+            }
+            return &proxy->profile.phases[i];
+        }
+    }
+    return &proxy->profile.phases[0];
+}
+
+// wakes every thread of the connection and makes both peers see a reset
+static void netem_abort(Netem_connection *connection)
+{
+    if (atomic_exchange(&connection->aborted, 1))
+    {
+        return;
+    }
+    // disconnecting a TCP socket sends a RST, where shutdown() would send a FIN and the
+    // stand-in would take the cut off upload for a complete one; it also wakes the other threads
+    struct sockaddr unspecified = {.sa_family = AF_UNSPEC};
+    connect(connection->client, &unspecified, sizeof(unspecified));
+    connect(connection->server, &unspecified, sizeof(unspecified));
+
+    Netem_pipe *pipes[] = {&connection->up, &connection->down};
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_mutex_lock(&pipes[i]->mutex);
+        pthread_cond_broadcast(&pipes[i]->cond);
+        pthread_mutex_unlock(&pipes[i]->mutex);
+    }
+}
+
+static void netem_record_reset(Netem_proxy *proxy)
+{
+    atomic_fetch_add(&proxy->resets, 1);
+    pthread_mutex_lock(&proxy->events_mutex);
+    if (proxy->reset_time_count == proxy->reset_time_capacity)
+    {
+        int capacity = proxy->reset_time_capacity ? proxy->reset_time_capacity * 2 : 64;
+        uint64_t *grown = realloc(proxy->reset_times_us, capacity * sizeof(uint64_t));
+        if (grown)
+        {
+            proxy->reset_times_us = grown;
+            proxy->reset_time_capacity = capacity;
+        }
+    }
+    if (proxy->reset_time_count < proxy->reset_time_capacity)
+    {
+        proxy->reset_times_us[proxy->reset_time_count++] = netem_now_us();
+    }
+    pthread_mutex_unlock(&proxy->events_mutex);
+}
+
+static void netem_release_connection(Netem_connection *connection)
+{
+    if (atomic_fetch_sub(&connection->threads, 1) != 1)
+    {
+        return;
+    }
+    close(connection->client);
+    close(connection->server);
+    Netem_pipe *pipes[] = {&connection->up, &connection->down};
+    for (int i = 0; i < 2; i++)
+    {
+        while (pipes[i]->head)
+        {
+            Netem_chunk *chunk = pipes[i]->head;
+            pipes[i]->head = chunk->next;
+            free(chunk);
+        }
+        pthread_mutex_destroy(&pipes[i]->mutex);
+        pthread_cond_destroy(&pipes[i]->cond);
+    }
+    free(connection);
+}
+
+// when a chunk read now may leave, given the phase; 0 if the connection should be reset instead
+static uint64_t netem_stamp(Netem_pipe *pipe, size_t length, uint64_t now_us)
+{
+    Netem_proxy *proxy = pipe->connection->proxy;
+    uint64_t phase_end_us;
+    const Netem_phase *phase = netem_phase_at(proxy, now_us, &phase_end_us);
+
+    if (phase->resets_per_mb > 0 && netem_random(&pipe->random) < phase->resets_per_mb * length / (1024.0 * 1024.0))
+    {
+        return 0;
+    }
+
+    uint64_t start_us = pipe->link_free_us > now_us ? pipe->link_free_us : now_us;
+    if (phase->down)
+    {
+        start_us = phase_end_us > start_us ? phase_end_us : start_us;
+    }
+    if (phase->stall_percent > 0 && netem_random(&pipe->random) * 100 < phase->stall_percent)
+    {
+        atomic_fetch_add(&proxy->stalls, 1);
+        start_us += phase->stall_ms * 1000ULL;
+    }
+    pipe->link_free_us = start_us + (phase->rate_kbit > 0 ? length * 8000ULL / phase->rate_kbit : 0);
+
+    uint64_t release_us = pipe->link_free_us + phase->latency_ms * 1000ULL + (uint64_t)(netem_random(&pipe->random) * phase->jitter_ms * 1000);
+    release_us = release_us < pipe->last_release_us ? pipe->last_release_us : release_us;
+    pipe->last_release_us = release_us;
+    return release_us;
+}
+
+static size_t netem_chunk_size(const Netem_proxy *proxy)
+{
+    const Netem_phase *phase = netem_phase_at(proxy, netem_now_us(), NULL);
+    size_t size = phase->rate_kbit > 0 ? (size_t)phase->rate_kbit * NETEM_CHUNK_MS / 8 : NETEM_CHUNK_BYTES;
+    return size < 512 ? 512 : (size > NETEM_CHUNK_BYTES ? NETEM_CHUNK_BYTES : size);
+}
+
+static size_t netem_queue_limit(const Netem_proxy *proxy)
+{
+    const Netem_phase *phase = netem_phase_at(proxy, netem_now_us(), NULL);
+    size_t bdp = (size_t)phase->rate_kbit * (phase->latency_ms + phase->jitter_ms) / 8;
+    return bdp > NETEM_QUEUE_MIN_BYTES ? bdp : NETEM_QUEUE_MIN_BYTES;
+}
+
+static void *netem_reader(void *arg)
+{
+    Netem_pipe *pipe = arg;
+    Netem_connection *connection = pipe->connection;
+    Netem_proxy *proxy = connection->proxy;
+    atomic_ullong *counter = pipe == &connection->up ? &proxy->bytes_up : &proxy->bytes_down;
+
+    while (!atomic_load(&connection->aborted))
+    {
+        size_t size = netem_chunk_size(proxy);
+        Netem_chunk *chunk = malloc(sizeof(Netem_chunk) + size);
+        if (!chunk)
+        {
+            netem_abort(connection);
+            break;
+        }
+        ssize_t n = recv(pipe->from, chunk->data, size, 0);
+        if (n < 0 || atomic_load(&connection->aborted))
+        {
+            free(chunk);
+            netem_abort(connection);
+            break;
+        }
+
+        chunk->next = NULL;
+        chunk->length = n;
+        chunk->release_us = netem_stamp(pipe, n, netem_now_us());
+        if (n > 0 && chunk->release_us == 0)
+        {
+            free(chunk);
+            netem_record_reset(proxy);
+            netem_abort(connection);
+            break;
+        }
+        atomic_fetch_add(counter, n);
+
+        // a full queue stops the reading, so the sender's socket fills as it would behind a slow link
+        size_t limit = netem_queue_limit(proxy);
+        pthread_mutex_lock(&pipe->mutex);
+        while (pipe->queued >= limit && !atomic_load(&connection->aborted))
+        {
+            pthread_cond_wait(&pipe->cond, &pipe->mutex);
+        }
+        if (pipe->tail)
+        {
+            pipe->tail->next = chunk;
+        }
+        else
+        {
+            pipe->head = chunk;
+        }
+        pipe->tail = chunk;
+        pipe->queued += n;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->mutex);
+
+        if (n == 0)
+        {
+            break;
+        }
+    }
+    netem_release_connection(connection);
+    return NULL;
+}
+
+static void *netem_writer(void *arg)
+{
+    Netem_pipe *pipe = arg;
+    Netem_connection *connection = pipe->connection;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pipe->mutex);
+        while (!pipe->head && !atomic_load(&connection->aborted))
+        {
+            pthread_cond_wait(&pipe->cond, &pipe->mutex);
+        }
+        Netem_chunk *chunk = pipe->head;
+        if (!chunk || atomic_load(&connection->aborted))
+        {
+            pthread_mutex_unlock(&pipe->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&pipe->mutex);
+
+        uint64_t now_us = netem_now_us();
+        if (chunk->release_us > now_us)
+        {
+            // in slices, so a reset elsewhere on the connection is noticed
+            uint64_t wait_us = chunk->release_us - now_us;
+            usleep(wait_us > 50000 ? 50000 : wait_us);
+            continue;
+        }
+
+        pthread_mutex_lock(&pipe->mutex);
+        pipe->head = chunk->next;
+        pipe->tail = pipe->head ? pipe->tail : NULL;
+        pipe->queued -= chunk->length;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->mutex);
+
+        int ended = chunk->length == 0;
+        int failed = 0;
+        if (ended)
+        {
+            shutdown(pipe->to, SHUT_WR);
+        }
+        for (size_t sent = 0; sent < chunk->length && !failed;)
+        {
+            ssize_t n = send(pipe->to, chunk->data + sent, chunk->length - sent, MSG_NOSIGNAL);
+            failed = n <= 0;
+            sent += n > 0 ? n : 0;
+        }
+        free(chunk);
+        if (failed)
+        {
+            netem_abort(connection);
+            break;
+        }
+        if (ended)
+        {
+            break;
+        }
+    }
+    netem_release_connection(connection);
+    return NULL;
+}
+
+static int netem_connect_target(int port)
+{
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void netem_pipe_init(Netem_pipe *pipe, Netem_connection *connection, int from, int to, uint32_t seed)
+{
+    pipe->connection = connection;
+    pipe->from = from;
+    pipe->to = to;
+    pipe->random = seed ? seed : 1;
+    pthread_mutex_init(&pipe->mutex, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+}
+
+// carries client, an accepted socket, to the target port through the impairments
+static void netem_carry(Netem_proxy *proxy, int client, int target_port)
+{
+    int server = netem_connect_target(target_port);
+    Netem_connection *connection = server >= 0 ? calloc(1, sizeof(Netem_connection)) : NULL;
+    if (!connection)
+    {
+        close(client);
+        if (server >= 0)
+        {
+            close(server);
+        }
+        return;
+    }
+
+    int one = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    connection->proxy = proxy;
+    connection->client = client;
+    connection->server = server;
+    unsigned seed = atomic_fetch_add(&proxy->seed, 2654435761u);
+    netem_pipe_init(&connection->up, connection, client, server, seed);
+    netem_pipe_init(&connection->down, connection, server, client, seed ^ 0x9E3779B9u);
+    atomic_store(&connection->threads, 4);
+    atomic_fetch_add(&proxy->connections, 1);
+
+    void *(*roles[])(void *) = {netem_reader, netem_writer, netem_reader, netem_writer};
+    Netem_pipe *pipes[] = {&connection->up, &connection->up, &connection->down, &connection->down};
+    for (int i = 0; i < 4; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, roles[i], pipes[i]) == 0)
+        {
+            pthread_detach(thread);
+        }
+        else
+        {
+            netem_abort(connection);
+            netem_release_connection(connection);
+        }
+    }
+}
+
+static int netem_listen(int port)
+{
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 16) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int netem_bound_port(int fd)
+{
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    return getsockname(fd, (struct sockaddr *)&address, &length) == 0 ? ntohs(address.sin_port) : -1;
+}
+
+static void *netem_accept_thread(void *arg)
+{
+    Netem_proxy *proxy = arg;
+    while (!atomic_load(&proxy->stopping))
+    {
+        // the listener is closed while the link is down, so connecting is refused like an unreachable host
+        int down = netem_phase_at(proxy, netem_now_us(), NULL)->down;
+        if (down && proxy->listen_fd >= 0)
+        {
+            close(proxy->listen_fd);
+            proxy->listen_fd = -1;
+        }
+        else if (!down && proxy->listen_fd < 0)
+        {
+            proxy->listen_fd = netem_listen(proxy->port);
+        }
+        if (proxy->listen_fd < 0)
+        {
+            usleep(100000);
+            continue;
+        }
+
+        struct pollfd listen_poll = {proxy->listen_fd, POLLIN, 0};
+        if (poll(&listen_poll, 1, 100) == 1)
+        {
+            int client = accept(proxy->listen_fd, NULL, NULL);
+            if (client >= 0)
+            {
+                netem_carry(proxy, client, proxy->target_port);
+            }
+        }
+    }
+    if (proxy->listen_fd >= 0)
+    {
+        close(proxy->listen_fd);
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    Netem_proxy *proxy;
+    int listen_fd;
+    int target_port;
+} Netem_passive;
+
+static void *netem_passive_thread(void *arg)
+{
+    Netem_passive *passive = arg;
+    struct pollfd listen_poll = {passive->listen_fd, POLLIN, 0};
+    if (poll(&listen_poll, 1, FTP_STANDIN_DATA_TIMEOUT_MS) == 1)
+    {
+        int client = accept(passive->listen_fd, NULL, NULL);
+        if (client >= 0)
+        {
+            netem_carry(passive->proxy, client, passive->target_port);
+        }
+    }
+    close(passive->listen_fd);
+    free(passive);
+    return NULL;
+}
+
+// Ftp_standin_passive: puts a one-connection proxy in front of a data port
+int netem_proxy_passive(int port, void *ctx)
+{
+    Netem_passive *passive = malloc(sizeof(Netem_passive));
+    int fd = passive ? netem_listen(0) : -1;
+    if (fd < 0)
+    {
+        free(passive);
+        return -1;
+    }
+    passive->proxy = ctx;
+    passive->listen_fd = fd;
+    passive->target_port = port;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, netem_passive_thread, passive) != 0)
+    {
+        close(fd);
+        free(passive);
+        return -1;
+    }
+    pthread_detach(thread);
+    return netem_bound_port(fd);
+}
+
+// listens on an ephemeral loopback port, found in proxy->port, in front of target_port
+int netem_proxy_start(Netem_proxy *proxy, const Netem_profile *profile, int target_port, unsigned seed)
+{
+    memset(proxy, 0, sizeof(*proxy));
+    proxy->profile = *profile;
+    proxy->target_port = target_port;
+    proxy->started_us = netem_now_us();
+    atomic_store(&proxy->seed, seed ? seed : 1);
+    pthread_mutex_init(&proxy->events_mutex, NULL);
+
+    proxy->listen_fd = netem_listen(0);
+    if (proxy->listen_fd < 0)
+    {
+        return -1;
+    }
+    proxy->port = netem_bound_port(proxy->listen_fd);
+    if (pthread_create(&proxy->thread, NULL, netem_accept_thread, proxy) != 0)
+    {
+        close(proxy->listen_fd);
+        return -1;
+    }
+    return 0;
+}
+
+void netem_proxy_stop(Netem_proxy *proxy)
+{
+    atomic_store(&proxy->stopping, 1);
+    pthread_join(proxy->thread, NULL);
+}
@@ -14,6 +14,8 @@ typedef struct
     Button confirm_clear_imports;
     Button retry;
     Button clear_import;
+    Button gallery;
+    Button gallery_next;
 } Navigation_buttons;
 
 
@@ -64,5 +66,20 @@ Navigation_buttons initialize_navigation_buttons( int screen_width, int screen_h
     navigation_buttons.confirm_clear_imports.label = "Clear all";
     navigation_buttons.confirm_clear_imports.target_screen = SCREEN_CLEAR_IMPORTS_COMPLETE;
 
+    navigation_buttons.gallery_next.x = margin + btn_w + spacing;
+    navigation_buttons.gallery_next.y = y;
+    navigation_buttons.gallery_next.w = btn_w;
+    navigation_buttons.gallery_next.h = btn_h;
+    navigation_buttons.gallery_next.label = "Older";
+    navigation_buttons.gallery_next.target_screen = SCREEN_GALLERY;
+
+    // above the right hand button on the main screen
+    navigation_buttons.gallery.x = margin + btn_w + spacing;
+    navigation_buttons.gallery.y = y - btn_h - spacing;
+    navigation_buttons.gallery.w = btn_w;
+    navigation_buttons.gallery.h = btn_h;
+    navigation_buttons.gallery.label = "Recent imports";
+    navigation_buttons.gallery.target_screen = SCREEN_GALLERY;
+
     return navigation_buttons;
 }
\ No newline at end of file
@@ -0,0 +1,335 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+#include <zstd.h>
+
+/*
+* Optional zstd compression of uploads on the fly, for images that compress: TIFF and the
+* RAW formats built on it, and Fuji RAF. JPEGs and anything else go as they are. Set
+* UPLOAD_COMPRESSION in config.json to "auto" (default "off"); a compressed image is
+* uploaded as its name plus ".zst", one frame with the content size and a checksum, so
+* "zstd -d" on the server restores it.
+*
+* The level is chosen per destination from what its uploads measure. After each upload
+* the time spent compressing is set against the time the link needed for the compressed
+* bytes at the destination's measured rate (destination.h). A compressor using well under
+* half of that steps up a level while the CPU is not saturated, judged by the process's CPU
+* time over that upload. One slower than the link steps down, and one that is still too
+* slow at the fastest level, or data that hardly shrinks, sends the following images as
+* they are, trying compression again every COMPRESS_RETRY_EVERY.
+*
+* A failed upload leaves a partial NAME or NAME.zst on the server, so an image whose upload
+* failed is sent the same way, compressed or not, until it gets through; the server then
+* holds one complete copy under one name.
+*/
+
+#define COMPRESS_LEVEL_START 2 // index into compress_levels, zstd's default 3
+#define COMPRESS_BUSY_LOW 0.4 // compressing took under this share of the link's time: go up a level
+#define COMPRESS_BUSY_HIGH 0.9 // over this share the link waited on the compressor: go down
+#define COMPRESS_RATIO_WORTHWHILE 0.95 // compressed to raw size above this sends the next ones raw
+#define COMPRESS_RETRY_EVERY 16
+#define COMPRESS_CPU_SATURATED 0.9 // share of all cores the process used over an upload above which no level goes up
+#define COMPRESS_POOL_SIZE UPLOAD_TRANSFERS_MAX
+
+const int compress_levels[] = {1, 2, 3, 5, 7, 9}; // fastest first; zstd's negative levels skip entropy coding, which is most of what sensor data gains
+#define COMPRESS_LEVEL_COUNT (int)(sizeof(compress_levels) / sizeof(compress_levels[0]))
+
+typedef struct
+{
+    int started;
+    int step; // index into compress_levels, -1 while sending as is
+    int raw_since; // compressible images sent as is since compression was last tried
+} Compress_link;
+
+// guarded by compress_mutex
+pthread_mutex_t compress_mutex = PTHREAD_MUTEX_INITIALIZER;
+Compress_link compress_links[DESTINATIONS_MAX];
+ZSTD_CCtx *compress_pool[COMPRESS_POOL_SIZE]; // idle contexts, kept so each upload does not allocate its window again
+int compress_pool_count = 0;
+GHashTable *compress_pinned = NULL; // "destination/name" of failed uploads to 1 if sent compressed, 2 if as is
+
+atomic_ullong compress_bytes_in;
+atomic_ullong compress_bytes_out;
+
+typedef size_t (*Compress_input)(void *ctx, char *out, size_t size);
+
+typedef struct
+{
+    ZSTD_CCtx *cctx;
+    int level;
+    Compress_input input;
+    void *input_ctx;
+    char *in;
+    char *out;
+    size_t in_capacity;
+    size_t out_capacity;
+    ZSTD_inBuffer pending_in;
+    size_t out_length;
+    size_t out_sent;
+    int input_done;
+    int finished;
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+    uint64_t busy_us; // wall time inside zstd, including any wait for a core
+    uint64_t cpu_start_us; // the process's CPU time when the upload started
+} Compress_stream;
+
+int compress_enabled()
+{
+    return strcmp(UPLOAD_COMPRESSION, "auto") == 0;
+}
+
+// from the first bytes of the file: TIFF in either byte order, Olympus ORF, Panasonic RW2, Fuji RAF
+int compress_worthwhile(const unsigned char *head, size_t size)
+{
+    if (size >= 4 && (memcmp(head, "II*\0", 4) == 0 || memcmp(head, "MM\0*", 4) == 0 || memcmp(head, "IIRO", 4) == 0 ||
+        memcmp(head, "IIRS", 4) == 0 || memcmp(head, "IIU\0", 4) == 0))
+    {
+        return 1;
+    }
+    return size >= 15 && memcmp(head, "FUJIFILMCCD-RAW", 15) == 0;
+}
+
+static void compress_pinned_key(char *key, size_t size, Destination *d, const char *name)
+{
+    snprintf(key, size, "%d/%s", destination_index(d), name);
+}
+
+// zstd level for the compressible image name to d, 0 to send it as is
+int compress_level_for(Destination *d, const char *name)
+{
+    char key[1024];
+    compress_pinned_key(key, sizeof(key), d, name);
+    int index = destination_index(d);
+    pthread_mutex_lock(&compress_mutex);
+    Compress_link *link = &compress_links[index];
+    if (!link->started)
+    {
+        link->started = 1;
+        link->step = COMPRESS_LEVEL_START;
+    }
+
+    // a retry goes the way the failed attempt went, at whatever level the link is at now
+    int pinned = compress_pinned ? GPOINTER_TO_INT(g_hash_table_lookup(compress_pinned, key)) : 0;
+    if (pinned)
+    {
+        int level = pinned == 2 ? 0 : compress_levels[link->step < 0 ? 0 : link->step];
+        pthread_mutex_unlock(&compress_mutex);
+        return level;
+    }
+
+    if (link->step < 0 && ++link->raw_since > COMPRESS_RETRY_EVERY)
+    {
+        link->step = 0;
+        link->raw_since = 0;
+    }
+    int level = link->step < 0 ? 0 : compress_levels[link->step];
+    pthread_mutex_unlock(&compress_mutex);
+    return level;
+}
+
+// after an upload of the compressible image name: a failure fixes how its retries are sent, a success frees them
+void compress_settle(Destination *d, const char *name, int compressed, int success)
+{
+    char key[1024];
+    compress_pinned_key(key, sizeof(key), d, name);
+    pthread_mutex_lock(&compress_mutex);
+    if (!compress_pinned)
+    {
+        compress_pinned = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    if (success)
+    {
+        g_hash_table_remove(compress_pinned, key);
+    }
+    else
+    {
+        g_hash_table_replace(compress_pinned, g_strdup(key), GINT_TO_POINTER(compressed ? 1 : 2));
+    }
+    pthread_mutex_unlock(&compress_mutex);
+}
+
+// the level in use for destination index i, for metrics; 0 while sending as is or before the first image
+int compress_level_of(int i)
+{
+    pthread_mutex_lock(&compress_mutex);
+    int level = compress_links[i].started && compress_links[i].step >= 0 ? compress_levels[compress_links[i].step] : 0;
+    pthread_mutex_unlock(&compress_mutex);
+    return level;
+}
+
+static uint64_t compress_cpu_now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// whether the process, compressor and other lanes included, left part of the cores idle over an upload of elapsed_us
+static int compress_core_free(const Compress_stream *s, uint64_t elapsed_us)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t cpu_us = compress_cpu_now_us() - s->cpu_start_us;
+    return cpu_us < elapsed_us * (cores < 1 ? 1 : cores) * COMPRESS_CPU_SATURATED;
+}
+
+void compress_stream_end(Compress_stream *s)
+{
+    if (s->cctx)
+    {
+        pthread_mutex_lock(&compress_mutex);
+        if (compress_pool_count < COMPRESS_POOL_SIZE)
+        {
+            compress_pool[compress_pool_count++] = s->cctx;
+            s->cctx = NULL;
+        }
+        pthread_mutex_unlock(&compress_mutex);
+        ZSTD_freeCCtx(s->cctx);
+    }
+    free(s->in);
+    free(s->out);
+    s->cctx = NULL;
+    s->in = NULL;
+    s->out = NULL;
+}
+
+// input is read from until it returns 0; returns 0 if no context could be had
+int compress_stream_begin(Compress_stream *s, int level, unsigned long long raw_size, Compress_input input, void *input_ctx)
+{
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_lock(&compress_mutex);
+    s->cctx = compress_pool_count > 0 ? compress_pool[--compress_pool_count] : NULL;
+    pthread_mutex_unlock(&compress_mutex);
+    if (!s->cctx && !(s->cctx = ZSTD_createCCtx()))
+    {
+        return 0;
+    }
+
+    ZSTD_CCtx_reset(s->cctx, ZSTD_reset_session_and_parameters);
+    ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_checksumFlag, 1);
+    ZSTD_CCtx_setPledgedSrcSize(s->cctx, raw_size);
+
+    s->level = level;
+    s->cpu_start_us = compress_cpu_now_us();
+    s->input = input;
+    s->input_ctx = input_ctx;
+    s->in_capacity = ZSTD_CStreamInSize();
+    s->out_capacity = ZSTD_CStreamOutSize();
+    s->in = malloc(s->in_capacity);
+    s->out = malloc(s->out_capacity);
+    if (!s->in || !s->out)
+    {
+        compress_stream_end(s);
+        return 0;
+    }
+    return 1;
+}
+
+// compresses until there is output or the frame is complete; returns 0, or -1 on a zstd error
+static int compress_stream_fill(Compress_stream *s)
+{
+    s->out_length = 0;
+    s->out_sent = 0;
+    while (s->out_length == 0 && !s->finished)
+    {
+        if (s->pending_in.pos == s->pending_in.size && !s->input_done)
+        {
+            size_t n = s->input(s->input_ctx, s->in, s->in_capacity);
+            s->pending_in = (ZSTD_inBuffer){s->in, n, 0};
+            s->input_done = n == 0;
+            s->raw_bytes += n;
+        }
+
+        ZSTD_outBuffer output = {s->out, s->out_capacity, 0};
+        uint64_t start_us = usb_stats_now_us();
+        size_t remaining = ZSTD_compressStream2(s->cctx, &output, &s->pending_in, s->input_done ? ZSTD_e_end : ZSTD_e_continue);
+        s->busy_us += usb_stats_now_us() - start_us;
+        if (ZSTD_isError(remaining))
+        {
+            _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_ERROR, "Compression failed: %s.", ZSTD_getErrorName(remaining));
+            return -1;
+        }
+        s->out_length = output.pos;
+        s->finished = s->input_done && remaining == 0;
+    }
+    return 0;
+}
+
+// compressed bytes ready to send, compressing more when none are; 0 once the frame is complete, -1 on an error
+long compress_stream_pending(Compress_stream *s)
+{
+    if (s->out_sent == s->out_length && compress_stream_fill(s) != 0)
+    {
+        return -1;
+    }
+    return (long)(s->out_length - s->out_sent);
+}
+
+// copies up to size of the pending bytes into out
+size_t compress_stream_take(Compress_stream *s, char *out, size_t size)
+{
+    size_t n = s->out_length - s->out_sent;
+    n = n < size ? n : size;
+    memcpy(out, s->out + s->out_sent, n);
+    s->out_sent += n;
+    s->wire_bytes += n;
+    return n;
+}
+
+// steps d's level after a compressed upload that completed in elapsed_us
+void compress_report(Destination *d, const Compress_stream *s, uint64_t elapsed_us)
+{
+    atomic_fetch_add(&compress_bytes_in, s->raw_bytes);
+    atomic_fetch_add(&compress_bytes_out, s->wire_bytes);
+    if (s->raw_bytes == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&destinations_mutex);
+    double rate_bps = d->rate_bps;
+    pthread_mutex_unlock(&destinations_mutex);
+
+    // the link's share of the upload: the compressed bytes at its measured rate, or what is left when not yet measured
+    double ratio = (double)s->wire_bytes / s->raw_bytes;
+    double link_us = rate_bps > 0 ? s->wire_bytes * 1000000.0 / rate_bps : (double)(elapsed_us > s->busy_us ? elapsed_us - s->busy_us : 1);
+    double busy = s->busy_us / (link_us > 1 ? link_us : 1);
+    int core_free = compress_core_free(s, elapsed_us);
+
+    pthread_mutex_lock(&compress_mutex);
+    Compress_link *link = &compress_links[destination_index(d)];
+    int step = link->step;
+    if (ratio > COMPRESS_RATIO_WORTHWHILE || (busy > COMPRESS_BUSY_HIGH && link->step == 0))
+    {
+        link->step = -1;
+        link->raw_since = 0;
+    }
+    else if (busy > COMPRESS_BUSY_HIGH && link->step > 0)
+    {
+        link->step--;
+    }
+    else if (busy < COMPRESS_BUSY_LOW && core_free && link->step >= 0 && link->step < COMPRESS_LEVEL_COUNT - 1)
+    {
+        link->step++;
+    }
+    int changed = step != link->step;
+    int next_level = link->step < 0 ? 0 : compress_levels[link->step];
+    pthread_mutex_unlock(&compress_mutex);
+
+    _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_STATS, "Compressed %llu to %llu bytes (%.0f%%) at level %d for %s, compressing %.0f%% of the link's time%s.",
+        (unsigned long long)s->raw_bytes, (unsigned long long)s->wire_bytes, ratio * 100, s->level, d->name, busy * 100, core_free ? "" : ", CPU saturated");
+    if (changed)
+    {
+        if (next_level)
+        {
+            _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_GENERAL, "Compression level for %s now %d.", d->name, next_level);
+        }
+        else
+        {
+            _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_GENERAL, "Sending images to %s uncompressed, %s.", d->name, ratio > COMPRESS_RATIO_WORTHWHILE ? "they hardly compress" : "the link outpaces compression");
+        }
+    }
+}
@@ -0,0 +1,351 @@
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <json-c/json.h>
+
+/*
+* Local control socket for field techs: a unix stream socket at CONTROL_SOCKET ("off" to
+* disable) taking one command per line and answering each with one line of JSON, e.g.
+*   echo queue | socat - UNIX-CONNECT:control.sock
+* Commands:
+*   queue                          upload queue in send order with each image's state, destination and Exif data
+*   pause import|upload            stop starting new imports or uploads; running ones finish
+*   resume import|upload
+*   front <name>                   send the queued image <name> (as listed by queue) next
+*   release <name>|all             upload images the reject filter is holding back (reject.h)
+*   set concurrency <1-4>          parallel uploads, applied as lanes finish or start
+*   set rate_limit_kb_s <n>        total upload rate cap, 0 for none; applies mid-transfer
+* Settings changed here last until restart; config.json holds the defaults.
+*/
+
+#define CONTROL_IDLE_TIMEOUT_S 60
+#define CONTROL_SEND_TIMEOUT_S 2 // a client not reading its replies cannot hold up the others for longer
+#define CONTROL_LINE_MAX 512
+#define CONTROL_CLIENTS_MAX 8
+
+typedef struct
+{
+    int fd;
+    char buffer[CONTROL_LINE_MAX];
+    size_t used;
+    uint64_t last_us;
+} Control_client;
+
+int control_server = -1;
+
+static struct json_object *control_error(const char *message)
+{
+    struct json_object *reply = json_object_new_object();
+    json_object_object_add(reply, "ok", json_object_new_boolean(0));
+    json_object_object_add(reply, "error", json_object_new_string(message));
+    return reply;
+}
+
+static struct json_object *control_ok()
+{
+    struct json_object *reply = json_object_new_object();
+    json_object_object_add(reply, "ok", json_object_new_boolean(1));
+    return reply;
+}
+
+static struct json_object *control_queue()
+{
+    struct json_object *reply = control_ok();
+    json_object_object_add(reply, "imports_paused", json_object_new_boolean(atomic_load(&imports_paused)));
+    json_object_object_add(reply, "uploads_paused", json_object_new_boolean(atomic_load(&uploads_paused)));
+    json_object_object_add(reply, "concurrency", json_object_new_int(atomic_load(&upload_concurrency)));
+    json_object_object_add(reply, "rate_limit_kb_s", json_object_new_int(atomic_load(&upload_rate_limit_kb_s)));
+
+    struct json_object *files = json_object_new_array();
+    pthread_mutex_lock(&upload_queue_mutex);
+    for (int i = 0; i < pending_upload_count; i++)
+    {
+        const Pending_upload *item = &pending_uploads[i];
+        struct json_object *file = json_object_new_object();
+        json_object_object_add(file, "name", json_object_new_string(item->name));
+        json_object_object_add(file, "size", json_object_new_int64(item->size));
+        json_object_object_add(file, "state", json_object_new_string(upload_state_names[item->state]));
+        int destination = item->destination >= 0 ? item->destination : item->sent_to;
+        json_object_object_add(file, "destination", destination >= 0 ? json_object_new_string(destinations[destination].name) : NULL);
+        json_object_object_add(file, "captured", item->exif.captured ? json_object_new_int64(item->exif.captured) : NULL);
+        json_object_object_add(file, "serial", item->exif.serial[0] ? json_object_new_string(item->exif.serial) : NULL);
+        json_object_object_add(file, "orientation", item->exif.orientation ? json_object_new_int(item->exif.orientation) : NULL);
+        json_object_object_add(file, "rejected", json_object_new_boolean(item->rejected));
+        if (item->state == UPLOAD_SENDING)
+        {
+            json_object_object_add(file, "percent", json_object_new_int(upload_progress_file_percent(item->name)));
+        }
+        json_object_array_add(files, file);
+    }
+    pthread_mutex_unlock(&upload_queue_mutex);
+    json_object_object_add(reply, "files", files);
+    return reply;
+}
+
+static struct json_object *control_pause(const char *what, int paused)
+{
+    atomic_int *flag = strcmp(what, "import") == 0 ? &imports_paused : (strcmp(what, "upload") == 0 ? &uploads_paused : NULL);
+    if (!flag)
+    {
+        return control_error("expected import or upload");
+    }
+
+    atomic_store(flag, paused);
+    _log(LOG_GENERAL, "Control socket: %s %s.", paused ? "paused" : "resumed", what);
+
+    // wakes the worker if it is waiting on upload lanes
+    pthread_mutex_lock(&upload_queue_mutex);
+    pthread_cond_broadcast(&upload_queue_cond);
+    pthread_mutex_unlock(&upload_queue_mutex);
+    return control_ok();
+}
+
+static struct json_object *control_front(const char *name)
+{
+    int moved = 0;
+    pthread_mutex_lock(&upload_queue_mutex);
+    for (int i = pending_upload_next; i < pending_upload_count; i++)
+    {
+        if (strcmp(pending_uploads[i].name, name) == 0)
+        {
+            // remembered, so the next scan keeps it in front
+            Queued_image *image = queued_image_get(name);
+            Pending_upload item = pending_uploads[i];
+            item.front = ++upload_front_moves;
+            if (image)
+            {
+                image->front = item.front;
+            }
+            memmove(&pending_uploads[pending_upload_next + 1], &pending_uploads[pending_upload_next], (i - pending_upload_next) * sizeof(Pending_upload));
+            pending_uploads[pending_upload_next] = item;
+            moved = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&upload_queue_mutex);
+
+    if (!moved)
+    {
+        return control_error("not queued");
+    }
+    _log(LOG_GENERAL, "Control socket: %s moved to the front of the upload queue.", name);
+    return control_ok();
+}
+
+static struct json_object *control_set(const char *key, const char *value)
+{
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (!value[0] || *end != '\0')
+    {
+        return control_error("expected a number");
+    }
+
+    if (strcmp(key, "concurrency") == 0)
+    {
+        if (number < 1 || number > UPLOAD_TRANSFERS_MAX)
+        {
+            return control_error("concurrency must be 1 to 4");
+        }
+        atomic_store(&upload_concurrency, (int)number);
+        pthread_mutex_lock(&upload_queue_mutex);
+        pthread_cond_broadcast(&upload_queue_cond);
+        pthread_mutex_unlock(&upload_queue_mutex);
+    }
+    else if (strcmp(key, "rate_limit_kb_s") == 0)
+    {
+        if (number < 0 || number > INT32_MAX / 1000)
+        {
+            return control_error("rate_limit_kb_s out of range");
+        }
+        atomic_store(&upload_rate_limit_kb_s, (int)number);
+    }
+    else
+    {
+        return control_error("unknown setting");
+    }
+
+    _log(LOG_GENERAL, "Control socket: %s set to %ld.", key, number);
+    return control_ok();
+}
+
+static struct json_object *control_run(char *line)
+{
+    line[strcspn(line, "\r")] = '\0';
+    char *command = line + strspn(line, " \t");
+    char *argument = command + strcspn(command, " \t");
+    if (*argument)
+    {
+        *argument++ = '\0';
+        argument += strspn(argument, " \t");
+    }
+
+    if (strcmp(command, "queue") == 0)
+    {
+        return control_queue();
+    }
+    if (strcmp(command, "pause") == 0 || strcmp(command, "resume") == 0)
+    {
+        return control_pause(argument, command[0] == 'p');
+    }
+    if (strcmp(command, "front") == 0)
+    {
+        // the whole rest of the line, since a name may contain spaces
+        return control_front(argument);
+    }
+    if (strcmp(command, "release") == 0)
+    {
+        int released = reject_release(strcmp(argument, "all") == 0 ? NULL : argument);
+        if (released == 0)
+        {
+            return control_error("nothing held");
+        }
+        struct json_object *reply = control_ok();
+        json_object_object_add(reply, "released", json_object_new_int(released));
+        return reply;
+    }
+    if (strcmp(command, "set") == 0)
+    {
+        char *value = argument + strcspn(argument, " \t");
+        if (*value)
+        {
+            *value++ = '\0';
+            value += strspn(value, " \t");
+        }
+        return control_set(argument, value);
+    }
+    return control_error(command[0] ? "unknown command" : "empty command");
+}
+
+// answers every complete line received; returns 0 once the client should be dropped
+static int control_serve_client(Control_client *client)
+{
+    ssize_t n = recv(client->fd, client->buffer + client->used, sizeof(client->buffer) - 1 - client->used, MSG_DONTWAIT);
+    if (n <= 0)
+    {
+        return n < 0 && (errno == EAGAIN || errno == EINTR);
+    }
+    client->used += n;
+    client->buffer[client->used] = '\0';
+    client->last_us = usb_stats_now_us();
+
+    char *newline;
+    while ((newline = strchr(client->buffer, '\n')) != NULL)
+    {
+        *newline = '\0';
+        Trace_span span = trace_begin("control command", "control");
+        struct json_object *reply = control_run(client->buffer);
+        const char *text = json_object_to_json_string_ext(reply, JSON_C_TO_STRING_PLAIN);
+        send(client->fd, text, strlen(text), MSG_NOSIGNAL);
+        send(client->fd, "\n", 1, MSG_NOSIGNAL);
+        json_object_put(reply);
+        trace_end(span);
+
+        client->used -= newline + 1 - client->buffer;
+        memmove(client->buffer, newline + 1, client->used + 1);
+    }
+
+    if (client->used == sizeof(client->buffer) - 1)
+    {
+        const char *error = "{\"ok\":false,\"error\":\"line too long\"}\n";
+        send(client->fd, error, strlen(error), MSG_NOSIGNAL);
+        return 0;
+    }
+    return 1;
+}
+
+// binds the socket; called from main before the other threads start, since the umask is process wide
+void control_listen()
+{
+    if (strcmp(CONTROL_SOCKET, "off") == 0)
+    {
+        return;
+    }
+
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", CONTROL_SOCKET);
+    unlink(address.sun_path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // owner and group only from the moment it exists
+    mode_t umask_before = umask(0007);
+    int bound = server >= 0 && bind(server, (struct sockaddr *)&address, sizeof(address)) == 0;
+    umask(umask_before);
+    if (!bound || listen(server, 4) != 0)
+    {
+        _log(LOG_ERROR, "Control socket could not listen on %s: %s", CONTROL_SOCKET, strerror(errno));
+        if (server >= 0)
+        {
+            close(server);
+        }
+        return;
+    }
+    control_server = server;
+    _log(LOG_GENERAL, "Control socket listening on %s.", CONTROL_SOCKET);
+}
+
+static void control_drop_client(Control_client *clients, int *count, int i)
+{
+    close(clients[i].fd);
+    clients[i] = clients[--*count];
+}
+
+// serves every connected client from one poll loop, so an idle one holds up nobody, and sees stop_requested within a second
+void *control_thread()
+{
+    if (control_server < 0)
+    {
+        return NULL;
+    }
+    trace_name_thread("control");
+
+    Control_client clients[CONTROL_CLIENTS_MAX];
+    int count = 0;
+    while (!stop_requested)
+    {
+        struct pollfd fds[CONTROL_CLIENTS_MAX + 1];
+        fds[0] = (struct pollfd){control_server, count < CONTROL_CLIENTS_MAX ? POLLIN : 0, 0};
+        for (int i = 0; i < count; i++)
+        {
+            fds[i + 1] = (struct pollfd){clients[i].fd, POLLIN, 0};
+        }
+        if (poll(fds, count + 1, 1000) < 0)
+        {
+            usleep(100000);
+            continue;
+        }
+
+        // backwards, as dropping a client moves the last one into its place
+        uint64_t now_us = usb_stats_now_us();
+        for (int i = count - 1; i >= 0; i--)
+        {
+            int keep = fds[i + 1].revents ? control_serve_client(&clients[i]) : 1;
+            if (!keep || now_us - clients[i].last_us > CONTROL_IDLE_TIMEOUT_S * 1000000ULL)
+            {
+                control_drop_client(clients, &count, i);
+            }
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int client = accept4(control_server, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0)
+            {
+                struct timeval timeout = {CONTROL_SEND_TIMEOUT_S, 0};
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                clients[count] = (Control_client){.fd = client, .last_us = now_us};
+                count++;
+            }
+        }
+    }
+
+    while (count > 0)
+    {
+        control_drop_client(clients, &count, count - 1);
+    }
+    close(control_server);
+    unlink(CONTROL_SOCKET);
+    return NULL;
+}
@@ -0,0 +1,294 @@
+#include <pthread.h>
+#include <time.h>
+#include <glib.h>
+
+/*
+* Upload destinations, from DESTINATIONS in config.json as a list of
+* {"name": ..., "url": ..., "userpwd": ..., "role": ...} where role is one of:
+*   "primary"   each image goes to the fastest healthy primary
+*   "fallback"  used only while no primary is healthy
+*   "mirror"    gets its own copy of every image, queued behind images still to deliver
+* Without DESTINATIONS, FTP_URL and FTP_USERPWD form a single primary, as before.
+*
+* An image counts as uploaded (TRACK_FILE) once a primary or fallback has it. Each
+* destination also keeps a ledger of what it received, TRACK_FILE.<name>, which is how a
+* mirror knows what it still needs. Eviction goes by TRACK_FILE alone, so a mirror that is
+* down for days never fills the card.
+*
+* Health comes from the connectivity probe's handshake time to each host (net_probe.h) and
+* from every upload: DESTINATION_FAILURES_UNHEALTHY failures in a row take a destination
+* out of rotation for a cool-down that doubles with each further failure. Among healthy
+* destinations the one with the best measured throughput wins, probe latency breaks ties
+* and decides before anything is measured, and every DESTINATION_EXPLORE_EVERY uploads the
+* least recently used one is tried again so its numbers do not go stale. Both are weighed
+* by the smoothed share of uploads that fail, as a failed upload is sent again, so a
+* flaky host that stays just under the cool-down loses to a slower reliable one.
+*/
+
+#define DESTINATIONS_MAX 8
+#define DESTINATION_FAILURES_UNHEALTHY 2
+#define DESTINATION_COOLDOWN_S 30
+#define DESTINATION_COOLDOWN_MAX_S 600
+#define DESTINATION_EXPLORE_EVERY 25
+#define DESTINATION_RATE_MIN_BYTES (256 * 1024) // smaller uploads measure latency more than throughput
+#define DESTINATION_SMOOTHING 0.3
+
+typedef enum
+{
+    DESTINATION_PRIMARY,
+    DESTINATION_MIRROR,
+    DESTINATION_FALLBACK
+} DESTINATION_ROLE;
+
+const char *destination_role_names[] = {"primary", "mirror", "fallback"};
+
+typedef struct
+{
+    char name[64];
+    char url[512];
+    char userpwd[256];
+    DESTINATION_ROLE role;
+    char track_file[1024];
+    GHashTable *remote_dirs; // remote directories known to exist, see ftp.h
+
+    // guarded by destinations_mutex
+    int reachable; // last probe result, 1 until probed
+    double rtt_ms; // smoothed probe handshake time, 0 until probed
+    double rate_bps; // smoothed throughput of uploads of at least DESTINATION_RATE_MIN_BYTES, 0 until measured
+    double error_rate; // smoothed fraction of uploads that failed
+    int consecutive_failures;
+    time_t cooldown_until;
+    unsigned long last_routed;
+    unsigned long long uploads;
+    unsigned long long failures;
+    unsigned long long bytes;
+} Destination;
+
+Destination destinations[DESTINATIONS_MAX];
+int destination_count = 0;
+pthread_mutex_t destinations_mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned long destination_routes = 0;
+
+// from load_config(); returns 0, or -1 with the reason logged
+int destination_add(const char *name, const char *url, const char *userpwd, const char *role)
+{
+    if (destination_count == DESTINATIONS_MAX)
+    {
+        _log(LOG_ERROR, "More than %d destinations, ignoring %s.", DESTINATIONS_MAX, name);
+        return -1;
+    }
+    if (!name || !name[0] || strlen(name) >= sizeof(destinations[0].name) || strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != strlen(name))
+    {
+        _log(LOG_ERROR, "Destination name \"%s\" must be letters, digits, _ or -.", name ? name : "");
+        return -1;
+    }
+    if (!url || strlen(url) >= sizeof(destinations[0].url) || (userpwd && strlen(userpwd) >= sizeof(destinations[0].userpwd)))
+    {
+        _log(LOG_ERROR, "Destination %s needs a url, and url and userpwd must fit.", name);
+        return -1;
+    }
+
+    DESTINATION_ROLE parsed = DESTINATION_PRIMARY;
+    int role_found = !role;
+    for (int i = 0; role && i < 3; i++)
+    {
+        if (strcmp(role, destination_role_names[i]) == 0)
+        {
+            parsed = (DESTINATION_ROLE)i;
+            role_found = 1;
+        }
+    }
+    if (!role_found)
+    {
+        _log(LOG_ERROR, "Destination %s has unknown role %s.", name, role);
+        return -1;
+    }
+
+    for (int i = 0; i < destination_count; i++)
+    {
+        if (strcmp(destinations[i].name, name) == 0)
+        {
+            _log(LOG_ERROR, "Destination name %s is used twice.", name);
+            return -1;
+        }
+    }
+
+    Destination *d = &destinations[destination_count++];
+    memset(d, 0, sizeof(*d));
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    snprintf(d->url, sizeof(d->url), "%s", url);
+    snprintf(d->userpwd, sizeof(d->userpwd), "%s", userpwd ? userpwd : "");
+    d->role = parsed;
+    d->reachable = 1;
+    return 0;
+}
+
+// once TRACK_FILE is known; a lone destination from FTP_URL keeps using TRACK_FILE as its ledger
+void destination_init_ledgers(int legacy)
+{
+    for (int i = 0; i < destination_count; i++)
+    {
+        Destination *d = &destinations[i];
+        if (legacy)
+        {
+            snprintf(d->track_file, sizeof(d->track_file), "%s", TRACK_FILE);
+        }
+        else
+        {
+            snprintf(d->track_file, sizeof(d->track_file), "%s.%s", TRACK_FILE, d->name);
+        }
+    }
+}
+
+int destination_index(const Destination *d)
+{
+    return (int)(d - destinations);
+}
+
+static int destination_healthy_locked(const Destination *d, time_t now)
+{
+    return d->reachable && now >= d->cooldown_until;
+}
+
+int destination_healthy(const Destination *d)
+{
+    pthread_mutex_lock(&destinations_mutex);
+    int healthy = destination_healthy_locked(d, time(NULL));
+    pthread_mutex_unlock(&destinations_mutex);
+    return healthy;
+}
+
+static int destination_faster(const Destination *a, const Destination *b)
+{
+    // a destination never tried goes first so it gets measured
+    int a_new = a->uploads == 0 && a->failures == 0;
+    int b_new = b->uploads == 0 && b->failures == 0;
+    if (a_new != b_new)
+    {
+        return a_new;
+    }
+
+    // what gets through: a share error_rate of the time goes on uploads that are sent again
+    double a_success = 1.0 - a->error_rate;
+    double b_success = 1.0 - b->error_rate;
+    if (a->rate_bps > 0 && b->rate_bps > 0 && a->rate_bps * a_success != b->rate_bps * b_success)
+    {
+        return a->rate_bps * a_success > b->rate_bps * b_success;
+    }
+    return a->rtt_ms * b_success < b->rtt_ms * a_success;
+}
+
+// picks where the next image is delivered: a primary or fallback, never a mirror
+Destination *destination_route()
+{
+    pthread_mutex_lock(&destinations_mutex);
+    time_t now = time(NULL);
+    unsigned long route = ++destination_routes;
+    Destination *best = NULL;
+
+    DESTINATION_ROLE roles[] = {DESTINATION_PRIMARY, DESTINATION_FALLBACK};
+    for (int r = 0; r < 2 && !best; r++)
+    {
+        for (int i = 0; i < destination_count; i++)
+        {
+            Destination *d = &destinations[i];
+            if (d->role == roles[r] && destination_healthy_locked(d, now) && (!best || destination_faster(d, best)))
+            {
+                best = d;
+            }
+        }
+    }
+
+    if (best && route % DESTINATION_EXPLORE_EVERY == 0)
+    {
+        for (int i = 0; i < destination_count; i++)
+        {
+            Destination *d = &destinations[i];
+            if (d->role == best->role && destination_healthy_locked(d, now) && d->last_routed < best->last_routed)
+            {
+                best = d;
+            }
+        }
+    }
+
+    // nothing healthy: keep trying whichever comes out of its cool-down first
+    if (!best)
+    {
+        for (int i = 0; i < destination_count; i++)
+        {
+            Destination *d = &destinations[i];
+            if (d->role != DESTINATION_MIRROR && (!best || d->cooldown_until < best->cooldown_until))
+            {
+                best = d;
+            }
+        }
+    }
+
+    if (best)
+    {
+        best->last_routed = route;
+    }
+    pthread_mutex_unlock(&destinations_mutex);
+    return best;
+}
+
+void destination_report_upload(Destination *d, int success, unsigned long long bytes, uint64_t elapsed_us)
+{
+    pthread_mutex_lock(&destinations_mutex);
+    d->error_rate += DESTINATION_SMOOTHING * ((success ? 0.0 : 1.0) - d->error_rate);
+    if (success)
+    {
+        if (d->consecutive_failures >= DESTINATION_FAILURES_UNHEALTHY)
+        {
+            _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_GENERAL, "Destination %s is accepting uploads again.", d->name);
+        }
+        d->uploads++;
+        d->bytes += bytes;
+        d->consecutive_failures = 0;
+        d->cooldown_until = 0;
+        if (bytes >= DESTINATION_RATE_MIN_BYTES && elapsed_us > 0)
+        {
+            double rate = bytes * 1000000.0 / elapsed_us;
+            d->rate_bps = d->rate_bps > 0 ? d->rate_bps + DESTINATION_SMOOTHING * (rate - d->rate_bps) : rate;
+        }
+    }
+    else
+    {
+        d->failures++;
+        if (++d->consecutive_failures >= DESTINATION_FAILURES_UNHEALTHY)
+        {
+            int doublings = d->consecutive_failures - DESTINATION_FAILURES_UNHEALTHY;
+            int cooldown = DESTINATION_COOLDOWN_S << (doublings > 5 ? 5 : doublings);
+            cooldown = cooldown > DESTINATION_COOLDOWN_MAX_S ? DESTINATION_COOLDOWN_MAX_S : cooldown;
+            d->cooldown_until = time(NULL) + cooldown;
+            _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_ERROR, "Destination %s failed %d uploads in a row, retrying it in %ds.", d->name, d->consecutive_failures, cooldown);
+        }
+    }
+    pthread_mutex_unlock(&destinations_mutex);
+}
+
+// rtt_ms < 0 when the host did not answer
+void destination_report_probe(Destination *d, double rtt_ms)
+{
+    pthread_mutex_lock(&destinations_mutex);
+    if ((rtt_ms >= 0) != d->reachable)
+    {
+        _log_sub(LOG_SUBSYSTEM_NETWORK, rtt_ms >= 0 ? LOG_GENERAL : LOG_ERROR, "Destination %s %s.", d->name, rtt_ms >= 0 ? "reachable" : "unreachable");
+    }
+    d->reachable = rtt_ms >= 0;
+    if (rtt_ms >= 0)
+    {
+        d->rtt_ms = d->rtt_ms > 0 ? d->rtt_ms + DESTINATION_SMOOTHING * (rtt_ms - d->rtt_ms) : rtt_ms;
+    }
+    pthread_mutex_unlock(&destinations_mutex);
+}
+
+// copies the destinations for metrics and the status file; returns the count
+int destination_snapshot(Destination *out)
+{
+    pthread_mutex_lock(&destinations_mutex);
+    memcpy(out, destinations, destination_count * sizeof(Destination));
+    int count = destination_count;
+    pthread_mutex_unlock(&destinations_mutex);
+    return count;
+}
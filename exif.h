@@ -0,0 +1,242 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+* Capture time, body serial number and orientation from an image's Exif data, without
+* decoding the image and without allocating. A JPEG carries a TIFF structure in its APP1
+* segment, and the TIFF based RAW formats (CR2, NEF, ARW, DNG, ORF, RW2) are one. Only the
+* first EXIF_READ_BYTES are looked at and every offset is checked against them, so a value
+* stored further into the file counts as missing. The tags needed sit in IFD0 and the Exif
+* IFD, well inside that on every camera seen so far.
+*/
+
+#define EXIF_READ_BYTES 8192
+
+typedef struct
+{
+    time_t captured; // DateTimeOriginal, else DateTime, read as local time; 0 if missing
+    char serial[32]; // BodySerialNumber, else the DNG CameraSerialNumber; "" if missing
+    int orientation; // 1 to 8 as in the TIFF spec, 0 if missing
+} Exif_info;
+
+typedef struct
+{
+    const unsigned char *base; // start of the TIFF header, which offsets count from
+    size_t size;
+    int big_endian;
+} Exif_tiff;
+
+static unsigned exif_u16(const Exif_tiff *tiff, size_t offset)
+{
+    const unsigned char *p = tiff->base + offset;
+    return tiff->big_endian ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+}
+
+static uint32_t exif_u32(const Exif_tiff *tiff, size_t offset)
+{
+    const unsigned char *p = tiff->base + offset;
+    return tiff->big_endian ? ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) : ((uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+}
+
+// copies an ASCII entry into out without trailing spaces; returns 0 if it is not one or lies beyond the data
+static int exif_ascii(const Exif_tiff *tiff, size_t entry, char *out, size_t size)
+{
+    uint32_t count = exif_u32(tiff, entry + 4);
+    if (exif_u16(tiff, entry + 2) != 2 || count == 0)
+    {
+        return 0;
+    }
+    size_t offset = count <= 4 ? entry + 8 : exif_u32(tiff, entry + 8);
+    if (offset > tiff->size || count > tiff->size - offset)
+    {
+        return 0;
+    }
+
+    size_t length = 0;
+    while (length < count && length + 1 < size && tiff->base[offset + length])
+    {
+        out[length] = tiff->base[offset + length];
+        length++;
+    }
+    while (length > 0 && out[length - 1] == ' ')
+    {
+        length--;
+    }
+    out[length] = '\0';
+    return length > 0;
+}
+
+// "YYYY:MM:DD HH:MM:SS" as local time, 0 if malformed or blank
+static time_t exif_datetime(const Exif_tiff *tiff, size_t entry)
+{
+    char text[20];
+    if (!exif_ascii(tiff, entry, text, sizeof(text)) || strlen(text) != 19)
+    {
+        return 0;
+    }
+
+    int fields[6];
+    const int starts[] = {0, 5, 8, 11, 14, 17};
+    const int lengths[] = {4, 2, 2, 2, 2, 2};
+    for (int i = 0; i < 6; i++)
+    {
+        fields[i] = 0;
+        for (int j = starts[i]; j < starts[i] + lengths[i]; j++)
+        {
+            if (text[j] < '0' || text[j] > '9')
+            {
+                return 0;
+            }
+            fields[i] = fields[i] * 10 + text[j] - '0';
+        }
+    }
+    if (fields[0] < 1970 || fields[1] < 1 || fields[1] > 12 || fields[2] < 1 || fields[2] > 31)
+    {
+        return 0;
+    }
+
+    // days since 1970 of the civil date, then the local offset; mktime() would reload the time zone every call
+    int year = fields[0] - (fields[1] <= 2);
+    int era_year = year - 1600; // a 400 year cycle starting with a leap year, before 1970
+    int day_of_year = (153 * (fields[1] + (fields[1] > 2 ? -3 : 9)) + 2) / 5 + fields[2] - 1;
+    long days = era_year * 365L + era_year / 4 - era_year / 100 + era_year / 400 + day_of_year - 135080;
+    time_t wall = days * 86400 + fields[3] * 3600 + fields[4] * 60 + fields[5];
+
+    struct tm tm;
+    time_t captured = wall;
+    for (int i = 0; i < 2; i++) // the second pass settles times near a DST change; ones inside the skipped or repeated hour may land an hour off
+    {
+        localtime_r(&captured, &tm);
+        captured = wall - tm.tm_gmtoff;
+    }
+    return captured > 0 ? captured : 0;
+}
+
+// returns the offset of the Exif IFD if this IFD points to one, 0 otherwise
+static uint32_t exif_read_ifd(const Exif_tiff *tiff, uint32_t ifd, int exif_ifd, Exif_info *out, size_t *modified)
+{
+    if (ifd < 8 || ifd > tiff->size - 2)
+    {
+        return 0;
+    }
+
+    uint32_t sub_ifd = 0;
+    unsigned count = exif_u16(tiff, ifd);
+    for (unsigned i = 0; i < count; i++)
+    {
+        size_t entry = ifd + 2 + i * 12;
+        if (entry + 12 > tiff->size)
+        {
+            break;
+        }
+
+        unsigned tag = exif_u16(tiff, entry);
+        if (!exif_ifd && tag == 0x0112 && exif_u16(tiff, entry + 2) == 3)
+        {
+            unsigned orientation = exif_u16(tiff, entry + 8);
+            out->orientation = orientation >= 1 && orientation <= 8 ? orientation : 0;
+        }
+        else if (!exif_ifd && tag == 0x0132)
+        {
+            *modified = entry; // only needed without DateTimeOriginal
+        }
+        else if (!exif_ifd && tag == 0x8769)
+        {
+            sub_ifd = exif_u32(tiff, entry + 8);
+        }
+        else if (!exif_ifd && tag == 0xC62F && !out->serial[0])
+        {
+            exif_ascii(tiff, entry, out->serial, sizeof(out->serial));
+        }
+        else if (exif_ifd && tag == 0x9003)
+        {
+            out->captured = exif_datetime(tiff, entry);
+        }
+        else if (exif_ifd && tag == 0xA431)
+        {
+            exif_ascii(tiff, entry, out->serial, sizeof(out->serial));
+        }
+    }
+    return sub_ifd;
+}
+
+static int exif_read_tiff(const unsigned char *data, size_t size, Exif_info *out)
+{
+    if (size < 8 || !((data[0] == 'I' && data[1] == 'I') || (data[0] == 'M' && data[1] == 'M')))
+    {
+        return 0;
+    }
+
+    Exif_tiff tiff = {data, size, data[0] == 'M'};
+    unsigned magic = exif_u16(&tiff, 2);
+    if (magic != 42 && magic != 0x4F52 && magic != 0x5352 && magic != 0x55) // TIFF, ORF, ORF, RW2
+    {
+        return 0;
+    }
+
+    size_t modified = 0;
+    uint32_t exif_ifd = exif_read_ifd(&tiff, exif_u32(&tiff, 4), 0, out, &modified);
+    if (exif_ifd)
+    {
+        exif_read_ifd(&tiff, exif_ifd, 1, out, &modified);
+    }
+    if (!out->captured && modified)
+    {
+        out->captured = exif_datetime(&tiff, modified);
+    }
+    return out->captured || out->serial[0] || out->orientation;
+}
+
+// fills out from the start of an image file; returns 1 if anything was found
+int exif_parse(const unsigned char *data, size_t size, Exif_info *out)
+{
+    memset(out, 0, sizeof(*out));
+    size = size > EXIF_READ_BYTES ? EXIF_READ_BYTES : size;
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+    {
+        return exif_read_tiff(data, size, out);
+    }
+
+    // JPEG: segments up to the start of the scan, looking for APP1 "Exif\0\0"
+    size_t pos = 2;
+    while (pos + 4 <= size && data[pos] == 0xFF)
+    {
+        unsigned char marker = data[pos + 1];
+        if (marker == 0xFF)
+        {
+            pos++; // fill byte
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9)
+        {
+            break;
+        }
+
+        size_t length = data[pos + 2] << 8 | data[pos + 3];
+        if (marker == 0xE1 && length >= 16 && pos + 10 <= size && memcmp(data + pos + 4, "Exif\0\0", 6) == 0)
+        {
+            size_t end = pos + 2 + length < size ? pos + 2 + length : size;
+            return exif_read_tiff(data + pos + 10, end - (pos + 10), out);
+        }
+        pos += 2 + length;
+    }
+    return 0;
+}
+
+// reads the start of the file at path with a single pread(); returns 1 if anything was found
+int exif_read_file(const char *path, Exif_info *out)
+{
+    unsigned char header[EXIF_READ_BYTES];
+    memset(out, 0, sizeof(*out));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    close(fd);
+    return n > 0 ? exif_parse(header, n, out) : 0;
+}
@@ -0,0 +1,514 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+* Asynchronous file I/O for the SD card: import writes and upload read-ahead are submitted
+* here and finish on another thread, so the worker can fetch the next image over USB or
+* keep an upload streaming while the card is busy. Requests go through io_uring (set up
+* with the raw syscalls, so there is no liburing dependency) and a completion thread runs
+* each request's callback. Kernels without io_uring, or sandboxes that forbid it, get a
+* small thread pool doing pread/pwrite/fsync with the same callbacks. Reads and writes
+* complete only once the whole buffer is transferred, at end of file, or on error.
+*/
+
+#define FILE_IO_RING_ENTRIES 32
+#define FILE_IO_THREADS 2
+#define FILE_IO_READAHEAD_MAX_BYTES (24 * 1024 * 1024) // larger files are streamed as before; with the slots and staging, under 100MB in flight on a Pi
+#define FILE_IO_READAHEAD_SLOTS 2
+
+typedef enum
+{
+    FILE_IO_READ,
+    FILE_IO_WRITE,
+    FILE_IO_FSYNC
+} FILE_IO_OP;
+
+typedef struct File_io_request File_io_request;
+
+// result is the bytes transferred (0 for fsync) or a negative errno
+typedef void (*File_io_done)(File_io_request *request, int result);
+
+struct File_io_request
+{
+    FILE_IO_OP op;
+    int fd;
+    char *buf;
+    size_t len;
+    off_t offset;
+    size_t transferred;
+    File_io_done done;
+    void *ctx;
+    struct iovec iov;
+    File_io_request *next;
+};
+
+typedef struct
+{
+    int ring_fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+    unsigned entries;
+} File_io_ring;
+
+File_io_ring file_io_ring;
+int file_io_uring = 0; // 1 once io_uring is set up, otherwise the thread pool is used
+int file_io_started = 0;
+pthread_mutex_t file_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t file_io_cond = PTHREAD_COND_INITIALIZER;
+File_io_request *file_io_queue_head = NULL; // thread pool queue
+File_io_request *file_io_queue_tail = NULL;
+
+__thread int file_io_completion_thread = 0;
+
+atomic_int file_io_inflight; // requests submitted and not yet completed, the card's queue depth
+atomic_int file_io_inflight_peak;
+atomic_ullong file_io_bytes_read;
+atomic_ullong file_io_bytes_written;
+
+static void file_io_complete(File_io_request *request, int result)
+{
+    if (result > 0 && request->op != FILE_IO_FSYNC)
+    {
+        atomic_fetch_add(request->op == FILE_IO_READ ? &file_io_bytes_read : &file_io_bytes_written, result);
+    }
+    atomic_fetch_sub(&file_io_inflight, 1);
+    request->done(request, result);
+}
+
+static void file_io_count_submit()
+{
+    int inflight = atomic_fetch_add(&file_io_inflight, 1) + 1;
+    int peak = atomic_load(&file_io_inflight_peak);
+    while (inflight > peak && !atomic_compare_exchange_weak(&file_io_inflight_peak, &peak, inflight));
+}
+
+static int file_io_ring_setup()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, FILE_IO_RING_ENTRIES, &params);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq
+        : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    File_io_ring *ring = &file_io_ring;
+    ring->ring_fd = fd;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sqes = sqes;
+    ring->entries = params.sq_entries;
+    return 0;
+}
+
+// queues one request on the ring; called with file_io_mutex held
+static int file_io_ring_push(File_io_request *request)
+{
+    File_io_ring *ring = &file_io_ring;
+
+    /*
+    * The completion queue is twice the submission queue, so bounding in-flight requests keeps
+    * it from overflowing. Callbacks that chain a request never wait: they run on the thread
+    * that frees slots, and the request they just completed already gave one back.
+    */
+    while (!file_io_completion_thread && atomic_load(&file_io_inflight) > (int)ring->entries)
+    {
+        pthread_cond_wait(&file_io_cond, &file_io_mutex);
+    }
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    request->iov.iov_base = request->buf + request->transferred;
+    request->iov.iov_len = request->len - request->transferred;
+    sqe->fd = request->fd;
+    sqe->user_data = (unsigned long long)(uintptr_t)request;
+    if (request->op == FILE_IO_FSYNC)
+    {
+        sqe->opcode = IORING_OP_FSYNC;
+    }
+    else
+    {
+        // the vectored forms work on every kernel with io_uring (5.1 and later)
+        sqe->opcode = request->op == FILE_IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->addr = (unsigned long long)(uintptr_t)&request->iov;
+        sqe->len = 1;
+        sqe->off = request->offset + request->transferred;
+    }
+
+    ring->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail + 1, memory_order_release);
+
+    int ret;
+    do
+    {
+        ret = (int)syscall(__NR_io_uring_enter, ring->ring_fd, 1, 0, 0, NULL, 0);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if (ret < 0)
+    {
+        int err = errno;
+        // not consumed by the kernel, so take it back rather than have a later enter pick it up
+        if (atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire) == tail)
+        {
+            atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail, memory_order_release);
+        }
+        return -err;
+    }
+    return 0;
+}
+
+// returns 1 when the request is finished, 0 if the rest of a short transfer was queued again
+static int file_io_partial(File_io_request *request, int *result)
+{
+    if (request->op == FILE_IO_FSYNC || *result <= 0)
+    {
+        if (*result == 0 && request->op != FILE_IO_FSYNC)
+        {
+            *result = (int)request->transferred; // end of file
+        }
+        return 1;
+    }
+
+    request->transferred += *result;
+    if (request->transferred >= request->len)
+    {
+        *result = (int)request->transferred;
+        return 1;
+    }
+    return 0;
+}
+
+static void *file_io_ring_thread()
+{
+    trace_name_thread("file io");
+    File_io_ring *ring = &file_io_ring;
+    file_io_completion_thread = 1;
+
+    while (1)
+    {
+        int ret = (int)syscall(__NR_io_uring_enter, ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR)
+        {
+            _log(LOG_ERROR, "io_uring wait failed: %s", strerror(errno));
+            return NULL;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire);
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            File_io_request *request = (File_io_request *)(uintptr_t)cqe->user_data;
+            int result = cqe->res;
+            head++;
+            atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head, memory_order_release);
+
+            if (!file_io_partial(request, &result))
+            {
+                // still counted in flight, the remainder reuses its slot
+                pthread_mutex_lock(&file_io_mutex);
+                result = file_io_ring_push(request);
+                pthread_mutex_unlock(&file_io_mutex);
+                if (result == 0)
+                {
+                    continue;
+                }
+            }
+
+            file_io_complete(request, result);
+            pthread_mutex_lock(&file_io_mutex);
+            pthread_cond_broadcast(&file_io_cond);
+            pthread_mutex_unlock(&file_io_mutex);
+        }
+    }
+    return NULL;
+}
+
+static int file_io_run_sync(File_io_request *request)
+{
+    if (request->op == FILE_IO_FSYNC)
+    {
+        return fsync(request->fd) == 0 ? 0 : -errno;
+    }
+
+    while (request->transferred < request->len)
+    {
+        ssize_t n = request->op == FILE_IO_READ
+            ? pread(request->fd, request->buf + request->transferred, request->len - request->transferred, request->offset + request->transferred)
+            : pwrite(request->fd, request->buf + request->transferred, request->len - request->transferred, request->offset + request->transferred);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -errno;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        request->transferred += n;
+    }
+    return (int)request->transferred;
+}
+
+static void *file_io_pool_thread()
+{
+    trace_name_thread("file io");
+
+    while (1)
+    {
+        pthread_mutex_lock(&file_io_mutex);
+        while (!file_io_queue_head)
+        {
+            pthread_cond_wait(&file_io_cond, &file_io_mutex);
+        }
+        File_io_request *request = file_io_queue_head;
+        file_io_queue_head = request->next;
+        if (!file_io_queue_head)
+        {
+            file_io_queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&file_io_mutex);
+
+        file_io_complete(request, file_io_run_sync(request));
+    }
+    return NULL;
+}
+
+void file_io_init()
+{
+    pthread_mutex_lock(&file_io_mutex);
+    if (file_io_started)
+    {
+        pthread_mutex_unlock(&file_io_mutex);
+        return;
+    }
+    file_io_started = 1;
+    file_io_uring = file_io_ring_setup() == 0;
+    pthread_mutex_unlock(&file_io_mutex);
+
+    pthread_t thread;
+    if (file_io_uring)
+    {
+        pthread_create(&thread, NULL, file_io_ring_thread, NULL);
+        pthread_detach(thread);
+    }
+    else
+    {
+        for (int i = 0; i < FILE_IO_THREADS; i++)
+        {
+            pthread_create(&thread, NULL, file_io_pool_thread, NULL);
+            pthread_detach(thread);
+        }
+    }
+    _log(LOG_GENERAL, "File I/O using %s.", file_io_uring ? "io_uring" : "a thread pool");
+}
+
+// starts request; its done callback runs on an I/O thread
+void file_io_submit(File_io_request *request)
+{
+    request->transferred = 0;
+    request->next = NULL;
+
+    pthread_mutex_lock(&file_io_mutex);
+    file_io_count_submit();
+    if (file_io_uring)
+    {
+        int ret = file_io_ring_push(request);
+        pthread_mutex_unlock(&file_io_mutex);
+        if (ret < 0)
+        {
+            file_io_complete(request, ret);
+        }
+        return;
+    }
+
+    if (file_io_queue_tail)
+    {
+        file_io_queue_tail->next = request;
+    }
+    else
+    {
+        file_io_queue_head = request;
+    }
+    file_io_queue_tail = request;
+    pthread_cond_signal(&file_io_cond);
+    pthread_mutex_unlock(&file_io_mutex);
+}
+
+/*
+* Upload read-ahead: while one image uploads, the next is read into memory so the
+* transfer that follows is fed from RAM instead of competing with import writes for the
+* card. A slot holds one file from upload_prefetch_start() until upload_prefetch_take()
+* hands its buffer to the upload, or upload_prefetch_discard() drops it.
+*/
+
+typedef enum
+{
+    PREFETCH_EMPTY,
+    PREFETCH_READING,
+    PREFETCH_READY,
+    PREFETCH_FAILED
+} PREFETCH_STATE;
+
+typedef struct
+{
+    PREFETCH_STATE state;
+    char path[1024];
+    File_io_request request;
+} Upload_prefetch;
+
+Upload_prefetch upload_prefetches[FILE_IO_READAHEAD_SLOTS];
+pthread_mutex_t upload_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t upload_prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static void upload_prefetch_done(File_io_request *request, int result)
+{
+    Upload_prefetch *slot = request->ctx;
+    close(request->fd);
+
+    pthread_mutex_lock(&upload_prefetch_mutex);
+    slot->state = result == (int)request->len ? PREFETCH_READY : PREFETCH_FAILED;
+    pthread_cond_broadcast(&upload_prefetch_cond);
+    pthread_mutex_unlock(&upload_prefetch_mutex);
+}
+
+void upload_prefetch_start(const char *path, long long size)
+{
+    if (size <= 0 || size > FILE_IO_READAHEAD_MAX_BYTES)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&upload_prefetch_mutex);
+    Upload_prefetch *slot = NULL;
+    for (int i = 0; i < FILE_IO_READAHEAD_SLOTS; i++)
+    {
+        if (upload_prefetches[i].state != PREFETCH_EMPTY && strcmp(upload_prefetches[i].path, path) == 0)
+        {
+            pthread_mutex_unlock(&upload_prefetch_mutex);
+            return;
+        }
+        if (!slot && upload_prefetches[i].state == PREFETCH_EMPTY)
+        {
+            slot = &upload_prefetches[i];
+        }
+    }
+
+    char *buf = slot ? malloc(size) : NULL;
+    int fd = buf ? open(path, O_RDONLY) : -1;
+    if (fd < 0)
+    {
+        free(buf);
+        pthread_mutex_unlock(&upload_prefetch_mutex);
+        return;
+    }
+
+    slot->state = PREFETCH_READING;
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    memset(&slot->request, 0, sizeof(slot->request));
+    slot->request.op = FILE_IO_READ;
+    slot->request.fd = fd;
+    slot->request.buf = buf;
+    slot->request.len = size;
+    slot->request.done = upload_prefetch_done;
+    slot->request.ctx = slot;
+    pthread_mutex_unlock(&upload_prefetch_mutex);
+
+    file_io_submit(&slot->request);
+}
+
+// waits for a read-ahead of path and hands over its buffer; returns 0 when there is none
+int upload_prefetch_take(const char *path, char **buf, size_t *size)
+{
+    int taken = 0;
+    pthread_mutex_lock(&upload_prefetch_mutex);
+    for (int i = 0; i < FILE_IO_READAHEAD_SLOTS; i++)
+    {
+        Upload_prefetch *slot = &upload_prefetches[i];
+        if (slot->state == PREFETCH_EMPTY || strcmp(slot->path, path) != 0)
+        {
+            continue;
+        }
+
+        while (slot->state == PREFETCH_READING)
+        {
+            pthread_cond_wait(&upload_prefetch_cond, &upload_prefetch_mutex);
+        }
+        if (slot->state == PREFETCH_READY)
+        {
+            *buf = slot->request.buf;
+            *size = slot->request.len;
+            taken = 1;
+        }
+        else
+        {
+            free(slot->request.buf);
+        }
+        slot->state = PREFETCH_EMPTY;
+        break;
+    }
+    pthread_mutex_unlock(&upload_prefetch_mutex);
+    return taken;
+}
+
+// drops read-ahead nobody will take, waiting for reads still in flight
+void upload_prefetch_discard()
+{
+    pthread_mutex_lock(&upload_prefetch_mutex);
+    for (int i = 0; i < FILE_IO_READAHEAD_SLOTS; i++)
+    {
+        Upload_prefetch *slot = &upload_prefetches[i];
+        while (slot->state == PREFETCH_READING)
+        {
+            pthread_cond_wait(&upload_prefetch_cond, &upload_prefetch_mutex);
+        }
+        if (slot->state != PREFETCH_EMPTY)
+        {
+            free(slot->request.buf);
+            slot->state = PREFETCH_EMPTY;
+        }
+    }
+    pthread_mutex_unlock(&upload_prefetch_mutex);
+}
@@ -1,16 +1,48 @@
 #include <curl/curl.h>
 #include <sys/stat.h>
+#include <glib.h>
 
 pthread_mutex_t track_file_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// remote directories known to exist on each destination, so curl only has to create (MKD) each one once
+pthread_mutex_t ftp_remote_dirs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int ftp_remote_dir_known(Destination *d, const char *dir)
+{
+    pthread_mutex_lock(&ftp_remote_dirs_mutex);
+    int known = d->remote_dirs && g_hash_table_contains(d->remote_dirs, dir);
+    pthread_mutex_unlock(&ftp_remote_dirs_mutex);
+    return known;
+}
+
+static void ftp_remote_dir_set_known(Destination *d, const char *dir, int known)
+{
+    pthread_mutex_lock(&ftp_remote_dirs_mutex);
+    if (!d->remote_dirs)
+    {
+        d->remote_dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    if (known)
+    {
+        g_hash_table_add(d->remote_dirs, g_strdup(dir));
+    }
+    else
+    {
+        g_hash_table_remove(d->remote_dirs, dir);
+    }
+    pthread_mutex_unlock(&ftp_remote_dirs_mutex);
+}
+
 int is_uploaded(const char *filename) 
 {
+    Trace_span span = trace_begin("is_uploaded", "upload");
     pthread_mutex_lock(&track_file_mutex);
 
     FILE *f = fopen(TRACK_FILE, "r");
     if (!f) 
     {
         pthread_mutex_unlock(&track_file_mutex);
+        trace_end(span);
         return 0;
     }
 
@@ -28,95 +60,290 @@ int is_uploaded(const char *filename)
 
     fclose(f);
     pthread_mutex_unlock(&track_file_mutex);
+    trace_end(span);
     return found;
 }
 
-int upload_file(const char *filepath, const char *filename) 
+typedef struct
+{
+    const char *data; // read-ahead buffer, or NULL to stream from file
+    size_t size;
+    size_t sent;
+    FILE *file;
+    int progress_slot;
+    int compressing;
+    Compress_stream compress; // when compressing, what curl reads
+} Upload_source;
+
+static int upload_file_progress(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    Upload_source *source = clientp;
+    upload_progress_update(source->progress_slot, source->compressing ? source->compress.raw_bytes : (uint64_t)ulnow);
+    return 0;
+}
+
+// the image itself, from the read-ahead buffer or the card
+static size_t upload_source_read(void *userdata, char *out, size_t n)
+{
+    Upload_source *source = userdata;
+    if (source->file)
+    {
+        return fread(out, 1, n, source->file);
+    }
+
+    if (n > source->size - source->sent)
+    {
+        n = source->size - source->sent;
+    }
+    memcpy(out, source->data + source->sent, n);
+    source->sent += n;
+    return n;
+}
+
+// feeds curl the image or its compressed form, within the shared rate limit
+static size_t upload_file_read(char *out, size_t size, size_t nmemb, void *userdata)
+{
+    Upload_source *source = userdata;
+    if (!source->compressing)
+    {
+        return upload_source_read(source, out, upload_throttle(size * nmemb));
+    }
+
+    long pending = compress_stream_pending(&source->compress);
+    if (pending <= 0)
+    {
+        return pending < 0 ? CURL_READFUNC_ABORT : 0;
+    }
+    size_t want = size * nmemb < (size_t)pending ? size * nmemb : (size_t)pending;
+    return compress_stream_take(&source->compress, out, upload_throttle(want));
+}
+
+int upload_file(Destination *d, const char *filepath, const char *filename) 
 {
     CURL *curl = curl_easy_init();
     int success = 0;
     if (curl) 
     {
-        char url[1024];
-        snprintf(url, sizeof(url), "%s%s", FTP_URL, filename);
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_USERPWD, FTP_USERPWD);
-        FILE *hd_src = fopen(filepath, "rb");
+        curl_easy_setopt(curl, CURLOPT_USERPWD, d->userpwd);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, net_probe_connect_timeout_ms());
+
+        // a directory already seen is entered with a single CWD; a new one is created on the way
+        char remote_dir[1024] = {0};
+        const char *slash = strrchr(filename, '/');
+        if (slash)
+        {
+            snprintf(remote_dir, sizeof(remote_dir), "%.*s", (int)(slash - filename), filename);
+        }
+        int remote_dir_known = !remote_dir[0] || ftp_remote_dir_known(d, remote_dir);
+        if (!remote_dir_known)
+        {
+            curl_easy_setopt(curl, CURLOPT_FTP_CREATE_MISSING_DIRS, (long)CURLFTP_CREATE_DIR_RETRY);
+        }
+        else if (remote_dir[0])
+        {
+            curl_easy_setopt(curl, CURLOPT_FTP_FILEMETHOD, (long)CURLFTPMETHOD_SINGLECWD);
+        }
+
+        // read ahead by file_io.h while the previous image was uploading, or streamed from the card
+        Upload_source source = {NULL, 0, 0, NULL, -1, 0, {0}};
+        char *prefetched = NULL;
+        if (upload_prefetch_take(filepath, &prefetched, &source.size))
+        {
+            source.data = prefetched;
+        }
+        else
+        {
+            source.file = fopen(filepath, "rb");
+            if (!source.file) 
+            {
+                _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_ERROR, "Failed to open file: %s.", filepath);
+                metrics_count_failure(FAILURE_UPLOAD_OPEN);
+                curl_easy_cleanup(curl);
+                return 0;
+            }
+
+            struct stat st;
+            source.size = fstat(fileno(source.file), &st) == 0 ? (size_t)st.st_size : 0;
+        }
+        unsigned long long file_size = source.size;
 
-        if (!hd_src) 
+        // TIFF based RAW files go as NAME.zst when compression pays on this link, see compress.h
+        int level = 0;
+        int compressible = 0;
+        if (compress_enabled())
+        {
+            unsigned char head[16];
+            ssize_t head_size = source.data ? (ssize_t)(source.size < sizeof(head) ? source.size : sizeof(head)) : pread(fileno(source.file), head, sizeof(head), 0);
+            if (source.data)
+            {
+                memcpy(head, source.data, head_size);
+            }
+            if (head_size > 0 && compress_worthwhile(head, head_size))
+            {
+                compressible = 1;
+                level = compress_level_for(d, filename);
+            }
+        }
+        source.compressing = level != 0 && compress_stream_begin(&source.compress, level, file_size, upload_source_read, &source);
+        if (level != 0 && !source.compressing)
         {
-            _log(LOG_ERROR, "Failed to open file: %s.", filepath);
+            // sending it as is instead could leave a partial NAME.zst beside NAME; a later pass tries again
+            _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_ERROR, "No memory to compress %s, retrying later.", filepath);
+            if (source.file)
+            {
+                fclose(source.file);
+            }
+            free(prefetched);
             curl_easy_cleanup(curl);
             return 0;
         }
 
+        char url[1024];
+        snprintf(url, sizeof(url), "%s%s%s", d->url, filename, source.compressing ? ".zst" : "");
+        curl_easy_setopt(curl, CURLOPT_URL, url);
         curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
-        curl_easy_setopt(curl, CURLOPT_READDATA, hd_src);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_file_read);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &source);
+        if (!source.compressing)
+        {
+            curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)file_size);
+        }
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, upload_file_progress);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &source);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
 
-        if (curl_easy_perform(curl) == CURLE_OK)
+        source.progress_slot = upload_progress_begin(filename, file_size);
+        uint64_t start_us = usb_stats_now_us();
+        CURLcode res = curl_easy_perform(curl);
+        upload_progress_end(source.progress_slot);
+        trace_complete("upload_file", "upload", start_us, usb_stats_now_us());
+        if (res == CURLE_OK)
         {
-            _log(LOG_GENERAL, "FTP of file complete for image %s to %s.", filepath, FTP_URL);
+            _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_GENERAL, "FTP of file complete for image %s to %s.", filepath, d->name);
             success = 1;
+            if (!remote_dir_known)
+            {
+                ftp_remote_dir_set_known(d, remote_dir, 1);
+            }
+        }
+        else
+        {
+            _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_ERROR, "FTP of file %s to %s failed: %s.", filepath, d->name, curl_easy_strerror(res));
+            metrics_count_failure(FAILURE_UPLOAD_TRANSFER);
+            if (remote_dir[0] && res == CURLE_REMOTE_ACCESS_DENIED)
+            {
+                // the directory may have been removed on the server; create it again next time
+                ftp_remote_dir_set_known(d, remote_dir, 0);
+            }
+        }
+        uint64_t elapsed_us = usb_stats_now_us() - start_us;
+        unsigned long long sent_size = source.compressing ? source.compress.wire_bytes : file_size;
+        metrics_count_upload(sent_size, elapsed_us, success);
+        // time spent compressing is the CPU's, not the link's, so it stays out of the destination's rate
+        destination_report_upload(d, success, sent_size, elapsed_us - (source.compressing ? source.compress.busy_us : 0));
+        net_probe_report_upload_result(success);
+        if (compressible)
+        {
+            compress_settle(d, filename, source.compressing, success);
+        }
+        if (source.compressing)
+        {
+            if (success)
+            {
+                compress_report(d, &source.compress, elapsed_us);
+            }
+            compress_stream_end(&source.compress);
         }
 
-        fclose(hd_src);
+        if (source.file)
+        {
+            fclose(source.file);
+        }
+        free(prefetched);
         curl_easy_cleanup(curl);
     }
     else
     {
-        _log(LOG_ERROR, "CURL failed to initialize.");
+        _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_ERROR, "CURL failed to initialize.");
     }
 
     return success;
 }
 
-void mark_uploaded(const char *filename) 
+static void track_file_append(const char *track_file, const char *filename)
 {
     pthread_mutex_lock(&track_file_mutex);
 
-    FILE *f = fopen(TRACK_FILE, "a");
+    FILE *f = fopen(track_file, "a");
     if (f) 
     {
         fprintf(f, "%s\n", filename);
         fclose(f);
-        _log(LOG_GENERAL, "Tracked upload for %s in track file.", filename);
+        _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_GENERAL, "Tracked upload for %s in track file %s.", filename, track_file);
     } 
     else 
     {
-        _log(LOG_ERROR, "Unable to log upload in track file (%s) for %s.", TRACK_FILE, filename);
+        _log_sub(LOG_SUBSYSTEM_UPLOAD, LOG_ERROR, "Unable to log upload in track file (%s) for %s.", track_file, filename);
+        metrics_count_failure(FAILURE_TRACK_WRITE);
     }
 
     pthread_mutex_unlock(&track_file_mutex);
 }
 
-int count_imported_images()
+void mark_uploaded(const char *filename) 
 {
-    int count = 0;
-    DIR *d = opendir(LOCAL_DIR);
-    if (!d)
+    track_file_append(TRACK_FILE, filename);
+}
+
+// records filename in d's own ledger, which for a lone legacy destination is TRACK_FILE itself
+void mark_sent_to(Destination *d, const char *filename)
+{
+    if (strcmp(d->track_file, TRACK_FILE) != 0)
     {
-        return 0;
+        track_file_append(d->track_file, filename);
     }
+}
+
+// every name in a track file, for checking many images against it at once
+GHashTable *track_file_load(const char *track_file)
+{
+    GHashTable *names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
-    struct dirent *dir;
-    while ((dir = readdir(d)) != NULL) 
+    pthread_mutex_lock(&track_file_mutex);
+    FILE *f = fopen(track_file, "r");
+    if (f)
     {
-        if (dir->d_type != DT_REG)
-        {
-            continue;
-        }
-        const char *ext = strrchr(dir->d_name, '.');
-        if (!ext)
+        char line[512];
+        while (fgets(line, sizeof(line), f))
         {
-            continue;
-        }
-        if (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"))
-        {
-            count++;
+            line[strcspn(line, "\n")] = 0;
+            if (line[0])
+            {
+                g_hash_table_add(names, g_strdup(line));
+            }
         }
+        fclose(f);
     }
+    pthread_mutex_unlock(&track_file_mutex);
+    return names;
+}
 
-    closedir(d);
+static void count_imported_image(const char *relative, const char *path, int is_dir, void *ctx)
+{
+    (void)path;
+    if (!is_dir && import_is_upload(relative))
+    {
+        (*(int *)ctx)++;
+    }
+}
+
+int count_imported_images()
+{
+    int count = 0;
+    import_walk(count_imported_image, &count);
     return count;
 }
 
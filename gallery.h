@@ -0,0 +1,688 @@
+#include <dirent.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+/*
+* Thumbnails for the recent imports gallery. A background thread keeps the list of the
+* newest GALLERY_MAX_IMAGES imports with their upload state, and hands thumbnails the UI
+* asks for to the task pool at background priority, GALLERY_DECODES_MAX at a time so the
+* newest request still goes first after a scroll. Each is decoded from the EXIF preview
+* embedded in the JPEG when it is large enough, otherwise the image itself decoded at 1/2,
+* 1/4 or 1/8 scale by libjpeg's reduced-size IDCT and box filtered down to the cell size.
+* Decoded pixels are handed to the UI thread, which turns at most GALLERY_UPLOADS_PER_FRAME
+* of them into textures per frame. Thumbnails live in GALLERY_CACHE_SLOTS slots recycled
+* least recently drawn first.
+*/
+
+#define GALLERY_MAX_IMAGES 48
+#define GALLERY_CACHE_SLOTS 32
+#define GALLERY_UPLOADS_PER_FRAME 2
+#define GALLERY_REFRESH_S 3
+#define GALLERY_EXIF_SCAN_BYTES 65536
+#define GALLERY_DECODES_MAX 2
+
+int is_uploaded(const char *filename); // ftp.h
+
+typedef struct
+{
+    char name[256];
+    time_t mtime;
+    int uploaded;
+} Gallery_item;
+
+typedef enum
+{
+    THUMB_EMPTY,
+    THUMB_WANTED,
+    THUMB_DECODING,
+    THUMB_DECODED,
+    THUMB_READY,
+    THUMB_FAILED
+} THUMB_STATE;
+
+typedef struct
+{
+    char name[256];
+    time_t mtime; // part of the key so a re-imported file with the same name is decoded again
+    THUMB_STATE state;
+    unsigned long requested; // newest request is decoded first, so the page on screen wins after a scroll
+    unsigned long last_used; // gallery frame it was last drawn in
+    unsigned char *pixels; // RGB24 from the decoder, waiting for the UI thread
+    int w;
+    int h;
+    SDL_Texture *texture; // UI thread only
+} Gallery_thumb;
+
+Gallery_item gallery_items[GALLERY_MAX_IMAGES];
+int gallery_item_count = 0;
+Gallery_thumb gallery_thumbs[GALLERY_CACHE_SLOTS];
+
+pthread_mutex_t gallery_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gallery_wake = PTHREAD_COND_INITIALIZER;
+int gallery_active = 0;
+int gallery_refresh_requested = 0;
+int gallery_thumb_w = 96;
+int gallery_thumb_h = 72;
+unsigned long gallery_request_seq = 0;
+int gallery_decoding = 0; // thumbnails queued or running on the task pool
+
+// UI thread only
+unsigned long gallery_frame = 0;
+int gallery_uploads_left = 0;
+
+static unsigned gallery_exif_u16(const unsigned char *p, int little_endian)
+{
+    return little_endian ? (unsigned)(p[0] | p[1] << 8) : (unsigned)(p[0] << 8 | p[1]);
+}
+
+static uint32_t gallery_exif_u32(const unsigned char *p, int little_endian)
+{
+    return little_endian
+        ? (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24
+        : (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+// finds the JPEG preview in IFD1 of an EXIF TIFF block; offsets are relative to the block
+static int gallery_exif_ifd1_thumbnail(const unsigned char *tiff, size_t length, size_t *thumb_offset, size_t *thumb_length)
+{
+    if (length < 8)
+    {
+        return 0;
+    }
+
+    int little_endian = tiff[0] == 'I' && tiff[1] == 'I';
+    if (!little_endian && !(tiff[0] == 'M' && tiff[1] == 'M'))
+    {
+        return 0;
+    }
+
+    uint64_t ifd0 = gallery_exif_u32(tiff + 4, little_endian);
+    if (ifd0 + 2 > length)
+    {
+        return 0;
+    }
+
+    uint64_t next = ifd0 + 2 + (uint64_t)gallery_exif_u16(tiff + ifd0, little_endian) * 12;
+    if (next + 4 > length)
+    {
+        return 0;
+    }
+
+    uint64_t ifd1 = gallery_exif_u32(tiff + next, little_endian);
+    if (ifd1 == 0 || ifd1 + 2 > length)
+    {
+        return 0;
+    }
+
+    uint64_t offset = 0, size = 0;
+    unsigned entries = gallery_exif_u16(tiff + ifd1, little_endian);
+    for (unsigned i = 0; i < entries && ifd1 + 2 + (uint64_t)(i + 1) * 12 <= length; i++)
+    {
+        const unsigned char *entry = tiff + ifd1 + 2 + i * 12;
+        unsigned tag = gallery_exif_u16(entry, little_endian);
+        if (tag == 0x0201)
+        {
+            offset = gallery_exif_u32(entry + 8, little_endian);
+        }
+        else if (tag == 0x0202)
+        {
+            size = gallery_exif_u32(entry + 8, little_endian);
+        }
+    }
+
+    if (offset == 0 || size == 0 || offset + size > length)
+    {
+        return 0;
+    }
+
+    *thumb_offset = offset;
+    *thumb_length = size;
+    return 1;
+}
+
+// locates the EXIF preview within the first bytes of a JPEG file
+int gallery_exif_thumbnail(const unsigned char *data, size_t length, size_t *thumb_offset, size_t *thumb_length)
+{
+    if (length < 4 || data[0] != 0xFF || data[1] != 0xD8)
+    {
+        return 0;
+    }
+
+    size_t pos = 2;
+    while (pos + 4 <= length && data[pos] == 0xFF)
+    {
+        unsigned marker = data[pos + 1];
+        size_t segment_length = (size_t)data[pos + 2] << 8 | data[pos + 3];
+        if (marker == 0xDA || marker == 0xD9 || segment_length < 2)
+        {
+            break; // image data starts, no more metadata
+        }
+
+        if (marker == 0xE1 && segment_length >= 8 && pos + 2 + segment_length <= length && memcmp(data + pos + 4, "Exif\0\0", 6) == 0)
+        {
+            if (!gallery_exif_ifd1_thumbnail(data + pos + 10, segment_length - 8, thumb_offset, thumb_length))
+            {
+                return 0;
+            }
+            *thumb_offset += pos + 10;
+            return 1;
+        }
+        pos += 2 + segment_length;
+    }
+    return 0;
+}
+
+typedef struct
+{
+    struct jpeg_error_mgr base;
+    jmp_buf jump;
+} Gallery_jpeg_error;
+
+static void gallery_jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((Gallery_jpeg_error *)cinfo->err)->jump, 1);
+}
+
+static void gallery_jpeg_silent(j_common_ptr cinfo)
+{
+    (void)cinfo; // corrupt or truncated files just fall back to a placeholder
+}
+
+static void gallery_flush_band(unsigned char *out, unsigned *sums, const int *column_counts, int rows, int w)
+{
+    for (int x = 0; x < w; x++)
+    {
+        unsigned count = (unsigned)(column_counts[x] * rows);
+        for (int c = 0; c < 3; c++)
+        {
+            out[x * 3 + c] = count ? (unsigned char)(sums[x * 3 + c] / count) : 0;
+            sums[x * 3 + c] = 0;
+        }
+    }
+}
+
+// decodes a JPEG from memory (file NULL) or from file to RGB24 fitting inside max_w x max_h
+unsigned char *gallery_decode_jpeg(const unsigned char *data, size_t length, FILE *file, int max_w, int max_h, int *out_w, int *out_h)
+{
+    struct jpeg_decompress_struct cinfo;
+    Gallery_jpeg_error error;
+    unsigned char *volatile row = NULL;
+    unsigned char *volatile pixels = NULL;
+    unsigned *volatile sums = NULL;
+    int *volatile column_counts = NULL;
+
+    cinfo.err = jpeg_std_error(&error.base);
+    error.base.error_exit = gallery_jpeg_error_exit;
+    error.base.output_message = gallery_jpeg_silent;
+    if (setjmp(error.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        free(row);
+        free(pixels);
+        free(sums);
+        free(column_counts);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    if (file)
+    {
+        jpeg_stdio_src(&cinfo, file);
+    }
+    else
+    {
+        jpeg_mem_src(&cinfo, (unsigned char *)data, length);
+    }
+    jpeg_read_header(&cinfo, TRUE);
+
+    // let the IDCT do most of the shrinking: the smallest 1/2^n scale still at least the thumbnail size
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    while (cinfo.scale_denom < 8 && cinfo.image_width / (cinfo.scale_denom * 2) >= (unsigned)max_w && cinfo.image_height / (cinfo.scale_denom * 2) >= (unsigned)max_h)
+    {
+        cinfo.scale_denom *= 2;
+    }
+    cinfo.dct_method = JDCT_IFAST;
+    cinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&cinfo);
+
+    int src_w = cinfo.output_width;
+    int src_h = cinfo.output_height;
+    int w = max_w;
+    int h = (int)((long)src_h * max_w / src_w);
+    if (h > max_h)
+    {
+        h = max_h;
+        w = (int)((long)src_w * max_h / src_h);
+    }
+    if (w > src_w || h > src_h)
+    {
+        w = src_w;
+        h = src_h;
+    }
+    w = w < 1 ? 1 : w;
+    h = h < 1 ? 1 : h;
+
+    row = malloc((size_t)src_w * 3);
+    pixels = calloc((size_t)w * h, 3);
+    sums = calloc((size_t)w * 3, sizeof(unsigned));
+    column_counts = calloc(w, sizeof(int));
+    if (!row || !pixels || !sums || !column_counts)
+    {
+        longjmp(error.jump, 1);
+    }
+
+    for (int x = 0; x < src_w; x++)
+    {
+        column_counts[(long)x * w / src_w]++;
+    }
+
+    int band = 0;
+    int band_rows = 0;
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW rows[1] = {row};
+        jpeg_read_scanlines(&cinfo, rows, 1);
+
+        int y = (int)((long)(cinfo.output_scanline - 1) * h / src_h);
+        if (y != band)
+        {
+            gallery_flush_band(pixels + (size_t)band * w * 3, sums, column_counts, band_rows, w);
+            band = y;
+            band_rows = 0;
+        }
+
+        for (int x = 0; x < src_w; x++)
+        {
+            unsigned *sum = sums + ((long)x * w / src_w) * 3;
+            sum[0] += row[x * 3];
+            sum[1] += row[x * 3 + 1];
+            sum[2] += row[x * 3 + 2];
+        }
+        band_rows++;
+    }
+    gallery_flush_band(pixels + (size_t)band * w * 3, sums, column_counts, band_rows, w);
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+    free(sums);
+    free(column_counts);
+
+    *out_w = w;
+    *out_h = h;
+    return pixels;
+}
+
+unsigned char *gallery_decode_thumbnail(const char *path, int max_w, int max_h, int *out_w, int *out_h)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        return NULL;
+    }
+
+    unsigned char *head = malloc(GALLERY_EXIF_SCAN_BYTES);
+    size_t head_length = head ? fread(head, 1, GALLERY_EXIF_SCAN_BYTES, f) : 0;
+    unsigned char *pixels = NULL;
+
+    // the embedded preview is usually 160x120, enough unless the cells are much larger
+    size_t thumb_offset, thumb_length;
+    if (head && gallery_exif_thumbnail(head, head_length, &thumb_offset, &thumb_length))
+    {
+        pixels = gallery_decode_jpeg(head + thumb_offset, thumb_length, NULL, max_w, max_h, out_w, out_h);
+        if (pixels && *out_w < max_w / 2 && *out_h < max_h / 2)
+        {
+            free(pixels);
+            pixels = NULL;
+        }
+    }
+
+    if (!pixels)
+    {
+        rewind(f);
+        pixels = gallery_decode_jpeg(NULL, 0, f, max_w, max_h, out_w, out_h);
+    }
+
+    free(head);
+    fclose(f);
+    return pixels;
+}
+
+typedef struct
+{
+    Gallery_item items[GALLERY_MAX_IMAGES];
+    int count;
+} Gallery_scan;
+
+static void gallery_visit(const char *relative, const char *path, int is_dir, void *ctx)
+{
+    Gallery_scan *scan = ctx;
+    Gallery_item *newest = scan->items;
+    if (is_dir || !import_is_image(relative) || strlen(relative) >= sizeof(newest[0].name))
+    {
+        return;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return;
+    }
+
+    // insertion into the bounded newest-first list
+    int i = scan->count < GALLERY_MAX_IMAGES ? scan->count++ : GALLERY_MAX_IMAGES;
+    if (i == GALLERY_MAX_IMAGES && st.st_mtime <= newest[GALLERY_MAX_IMAGES - 1].mtime)
+    {
+        return;
+    }
+    if (i == GALLERY_MAX_IMAGES)
+    {
+        i--;
+    }
+    for (; i > 0 && newest[i - 1].mtime < st.st_mtime; i--)
+    {
+        newest[i] = newest[i - 1];
+    }
+    memset(&newest[i], 0, sizeof(newest[i]));
+    strcpy(newest[i].name, relative);
+    newest[i].mtime = st.st_mtime;
+}
+
+// rebuilds the newest-first list of imports when images were added or removed or the track file changed
+void gallery_refresh_items(int force)
+{
+    static unsigned last_generation = 0;
+    static time_t last_track_mtime = 0;
+
+    struct stat track_st;
+    unsigned generation = atomic_load(&import_generation);
+    time_t track_mtime = stat(TRACK_FILE, &track_st) == 0 ? track_st.st_mtime : 0;
+    if (!force && generation == last_generation && track_mtime == last_track_mtime)
+    {
+        return;
+    }
+    last_generation = generation;
+    last_track_mtime = track_mtime;
+
+    Trace_span span = trace_begin("gallery refresh", "ui");
+    Gallery_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    import_walk(gallery_visit, &scan);
+    Gallery_item *newest = scan.items;
+    int count = scan.count;
+
+    for (int i = 0; i < count; i++)
+    {
+        newest[i].uploaded = is_uploaded(newest[i].name);
+    }
+
+    pthread_mutex_lock(&gallery_mutex);
+    int changed = count != gallery_item_count || memcmp(newest, gallery_items, sizeof(Gallery_item) * count) != 0;
+    memcpy(gallery_items, newest, sizeof(Gallery_item) * count);
+    gallery_item_count = count;
+    pthread_mutex_unlock(&gallery_mutex);
+    trace_end(span);
+
+    if (changed)
+    {
+        ui_request_redraw();
+    }
+}
+
+int gallery_copy_items(Gallery_item *out, int max)
+{
+    pthread_mutex_lock(&gallery_mutex);
+    int count = gallery_item_count < max ? gallery_item_count : max;
+    memcpy(out, gallery_items, sizeof(Gallery_item) * count);
+    pthread_mutex_unlock(&gallery_mutex);
+    return count;
+}
+
+void gallery_set_active(int active)
+{
+    pthread_mutex_lock(&gallery_mutex);
+    if (active && !gallery_active)
+    {
+        gallery_refresh_requested = 1;
+        pthread_cond_signal(&gallery_wake);
+    }
+    gallery_active = active;
+    pthread_mutex_unlock(&gallery_mutex);
+}
+
+void gallery_set_thumbnail_size(int w, int h)
+{
+    pthread_mutex_lock(&gallery_mutex);
+    gallery_thumb_w = w;
+    gallery_thumb_h = h;
+    pthread_mutex_unlock(&gallery_mutex);
+}
+
+// releases a slot's thumbnail; called with gallery_mutex held, on the UI thread when a texture exists
+static void gallery_release_slot(Gallery_thumb *thumb)
+{
+    if (thumb->texture)
+    {
+        SDL_DestroyTexture(thumb->texture);
+    }
+    free(thumb->pixels);
+    memset(thumb, 0, sizeof(*thumb));
+}
+
+static Gallery_thumb *gallery_claim_slot()
+{
+    Gallery_thumb *victim = NULL;
+    for (int i = 0; i < GALLERY_CACHE_SLOTS; i++)
+    {
+        Gallery_thumb *thumb = &gallery_thumbs[i];
+        if (thumb->state == THUMB_EMPTY)
+        {
+            return thumb;
+        }
+        // never the one being decoded, nor one already drawn this frame
+        if (thumb->state != THUMB_DECODING && thumb->last_used != gallery_frame && (!victim || thumb->last_used < victim->last_used))
+        {
+            victim = thumb;
+        }
+    }
+
+    if (victim)
+    {
+        gallery_release_slot(victim);
+    }
+    return victim;
+}
+
+void gallery_begin_frame()
+{
+    gallery_frame++;
+    gallery_uploads_left = GALLERY_UPLOADS_PER_FRAME;
+}
+
+void gallery_end_frame()
+{
+    // thumbnails over this frame's upload budget go out on the next one
+    pthread_mutex_lock(&gallery_mutex);
+    int waiting = 0;
+    for (int i = 0; i < GALLERY_CACHE_SLOTS && !waiting; i++)
+    {
+        waiting = gallery_thumbs[i].state == THUMB_DECODED && gallery_thumbs[i].last_used == gallery_frame;
+    }
+    pthread_mutex_unlock(&gallery_mutex);
+
+    if (waiting)
+    {
+        ui_request_redraw();
+    }
+}
+
+// returns the thumbnail texture for an item, or NULL while it is decoding (UI thread only)
+SDL_Texture *gallery_thumbnail(SDL_Renderer *renderer, const Gallery_item *item, int *w, int *h, int *failed)
+{
+    Gallery_thumb *thumb = NULL;
+    unsigned char *upload = NULL;
+    int ready = 0;
+    *failed = 0;
+
+    pthread_mutex_lock(&gallery_mutex);
+    for (int i = 0; i < GALLERY_CACHE_SLOTS; i++)
+    {
+        if (gallery_thumbs[i].state != THUMB_EMPTY && gallery_thumbs[i].mtime == item->mtime && strcmp(gallery_thumbs[i].name, item->name) == 0)
+        {
+            thumb = &gallery_thumbs[i];
+            break;
+        }
+    }
+
+    if (!thumb && (thumb = gallery_claim_slot()) != NULL)
+    {
+        strcpy(thumb->name, item->name);
+        thumb->mtime = item->mtime;
+        thumb->state = THUMB_WANTED;
+        thumb->requested = ++gallery_request_seq;
+        pthread_cond_signal(&gallery_wake);
+    }
+
+    if (thumb)
+    {
+        thumb->last_used = gallery_frame;
+        if (thumb->state == THUMB_DECODED && gallery_uploads_left > 0)
+        {
+            // the decoder leaves READY slots alone, so the texture can be made outside the lock
+            upload = thumb->pixels;
+            thumb->pixels = NULL;
+            thumb->state = THUMB_READY;
+            gallery_uploads_left--;
+        }
+        ready = thumb->state == THUMB_READY;
+        *failed = thumb->state == THUMB_FAILED;
+    }
+    pthread_mutex_unlock(&gallery_mutex);
+
+    if (!thumb)
+    {
+        return NULL;
+    }
+
+    if (upload)
+    {
+        Trace_span span = trace_begin("thumbnail upload", "ui");
+        thumb->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STATIC, thumb->w, thumb->h);
+        if (thumb->texture)
+        {
+            SDL_UpdateTexture(thumb->texture, NULL, upload, thumb->w * 3);
+        }
+        free(upload);
+        trace_end(span);
+    }
+
+    if (ready && thumb->texture)
+    {
+        *w = thumb->w;
+        *h = thumb->h;
+        return thumb->texture;
+    }
+    return NULL;
+}
+
+static Gallery_thumb *gallery_next_wanted()
+{
+    Gallery_thumb *next = NULL;
+    for (int i = 0; i < GALLERY_CACHE_SLOTS; i++)
+    {
+        if (gallery_thumbs[i].state == THUMB_WANTED && (!next || gallery_thumbs[i].requested > next->requested))
+        {
+            next = &gallery_thumbs[i];
+        }
+    }
+    return next;
+}
+
+void gallery_clear()
+{
+    pthread_mutex_lock(&gallery_mutex);
+    for (int i = 0; i < GALLERY_CACHE_SLOTS; i++)
+    {
+        if (gallery_thumbs[i].state != THUMB_DECODING)
+        {
+            gallery_release_slot(&gallery_thumbs[i]);
+        }
+    }
+    pthread_mutex_unlock(&gallery_mutex);
+}
+
+// task pool job decoding one WANTED slot the gallery thread marked DECODING
+static void gallery_decode_task(void *arg)
+{
+    Gallery_thumb *thumb = arg;
+    pthread_mutex_lock(&gallery_mutex);
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", LOCAL_DIR, thumb->name);
+    int max_w = gallery_thumb_w;
+    int max_h = gallery_thumb_h;
+    pthread_mutex_unlock(&gallery_mutex);
+
+    int w = 0, h = 0;
+    unsigned char *pixels = gallery_decode_thumbnail(path, max_w, max_h, &w, &h);
+
+    pthread_mutex_lock(&gallery_mutex);
+    thumb->pixels = pixels;
+    thumb->w = w;
+    thumb->h = h;
+    thumb->state = pixels ? THUMB_DECODED : THUMB_FAILED;
+    if (!pixels)
+    {
+        _log_sub(LOG_SUBSYSTEM_UI, LOG_GENERAL, "Could not decode a thumbnail for %s.", thumb->name);
+    }
+    gallery_decoding--;
+    pthread_cond_signal(&gallery_wake);
+    pthread_mutex_unlock(&gallery_mutex);
+    ui_request_redraw();
+}
+
+void* gallery_thread()
+{
+    trace_name_thread("gallery");
+    time_t last_refresh = 0;
+
+    pthread_mutex_lock(&gallery_mutex);
+    while (!stop_requested)
+    {
+        if (gallery_active && (gallery_refresh_requested || time(NULL) - last_refresh >= GALLERY_REFRESH_S))
+        {
+            int force = gallery_refresh_requested;
+            gallery_refresh_requested = 0;
+            pthread_mutex_unlock(&gallery_mutex);
+            gallery_refresh_items(force);
+            last_refresh = time(NULL);
+            pthread_mutex_lock(&gallery_mutex);
+            continue;
+        }
+
+        Gallery_thumb *thumb = gallery_active && gallery_decoding < GALLERY_DECODES_MAX ? gallery_next_wanted() : NULL;
+        if (thumb)
+        {
+            // the UI never recycles a DECODING slot, so it stays the task's until decoded
+            thumb->state = THUMB_DECODING;
+            gallery_decoding++;
+            pthread_mutex_unlock(&gallery_mutex);
+            int queued = task_pool_submit(TASK_KIND_THUMBNAIL, TASK_PRIORITY_BACKGROUND, gallery_decode_task, thumb);
+            pthread_mutex_lock(&gallery_mutex);
+            if (queued)
+            {
+                continue;
+            }
+            thumb->state = THUMB_WANTED;
+            gallery_decoding--;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&gallery_wake, &gallery_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&gallery_mutex);
+    return NULL;
+}
@@ -0,0 +1,209 @@
+#include <stdatomic.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/*
+* Where an imported image lives, locally under LOCAL_DIR and remotely under each destination url. LAYOUT
+* in config.json is a template of placeholders and literal text, for example
+* "{date}/{camera_serial}/{name}":
+*   {date}           capture date from the image's Exif data, else from the camera (import
+*                    date if neither has one), YYYY-MM-DD
+*   {camera_serial}  the camera's serial number, else the one in the Exif data, or "unknown"
+*   {name}           the file name on the camera (required)
+* The default "{name}" keeps the flat layout. The path relative to the import folder is
+* the image's identity everywhere else: the track file, the gallery and the upload URL.
+* Names starting with a dot are skipped by import_walk() so tools can keep files beside images.
+*/
+
+#define IMPORT_WALK_MAX_DEPTH 8
+
+// bumped whenever images are added to or removed from the import folder
+atomic_uint import_generation;
+
+// replaces anything that would change the directory structure in a substituted value
+static void layout_append_component(char *out, size_t size, size_t *length, const char *value)
+{
+    if (!value || !value[0])
+    {
+        value = "unknown";
+    }
+
+    for (const char *p = value; *p && *length + 1 < size; p++)
+    {
+        char c = *p;
+        if (c == '/' || c == '\\' || (p == value && c == '.') || (unsigned char)c < 32)
+        {
+            c = '_';
+        }
+        out[(*length)++] = c;
+    }
+    out[*length] = '\0';
+}
+
+// expands LAYOUT for one image; returns 0 if the result does not fit in out
+int layout_expand(char *out, size_t size, const char *name, const char *serial, time_t captured)
+{
+    size_t length = 0;
+    out[0] = '\0';
+
+    for (const char *p = LAYOUT; *p; p++)
+    {
+        if (*p == '{')
+        {
+            const char *end = strchr(p, '}');
+            if (end)
+            {
+                size_t key_length = end - p - 1;
+                char date[16];
+                const char *value = NULL;
+                int matched = 1;
+
+                if (key_length == 4 && strncmp(p + 1, "date", 4) == 0)
+                {
+                    struct tm tm;
+                    localtime_r(&captured, &tm);
+                    strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+                    value = date;
+                }
+                else if (key_length == 13 && strncmp(p + 1, "camera_serial", 13) == 0)
+                {
+                    value = serial;
+                }
+                else if (key_length == 4 && strncmp(p + 1, "name", 4) == 0)
+                {
+                    value = name;
+                }
+                else
+                {
+                    matched = 0;
+                }
+
+                if (matched)
+                {
+                    layout_append_component(out, size, &length, value);
+                    p = end;
+                    continue;
+                }
+            }
+        }
+
+        if (length + 1 >= size)
+        {
+            return 0;
+        }
+        out[length++] = *p;
+        out[length] = '\0';
+    }
+    return length + 1 < size;
+}
+
+int layout_uses_date()
+{
+    return strstr(LAYOUT, "{date}") != NULL;
+}
+
+// checked once at start up: the template must name the file and stay inside the import folder
+int layout_valid(const char *layout)
+{
+    return strstr(layout, "{name}") != NULL && layout[0] != '/' && strstr(layout, "..") == NULL;
+}
+
+// creates the directories above path that are below LOCAL_DIR
+int layout_make_parent_dirs(const char *path)
+{
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    size_t root_length = strlen(LOCAL_DIR);
+    for (char *p = dir + root_length + 1; *p; p++)
+    {
+        if (*p != '/')
+        {
+            continue;
+        }
+        *p = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        {
+            return -1;
+        }
+        *p = '/';
+    }
+    return 0;
+}
+
+typedef void (*Import_visit)(const char *relative, const char *path, int is_dir, void *ctx);
+
+static void import_walk_dir(const char *relative, int depth, Import_visit visit, void *ctx)
+{
+    char dir_path[1024];
+    snprintf(dir_path, sizeof(dir_path), relative[0] ? "%s/%s" : "%s%s", LOCAL_DIR, relative);
+
+    DIR *d = opendir(dir_path);
+    if (!d)
+    {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        char child[1024];
+        char path[2048];
+        int written = snprintf(child, sizeof(child), relative[0] ? "%s/%s" : "%s%s", relative, entry->d_name);
+        if (written < 0 || (size_t)written >= sizeof(child))
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", LOCAL_DIR, child);
+
+        if (entry->d_type == DT_DIR && depth < IMPORT_WALK_MAX_DEPTH)
+        {
+            import_walk_dir(child, depth + 1, visit, ctx);
+            visit(child, path, 1, ctx);
+        }
+        else if (entry->d_type == DT_REG)
+        {
+            visit(child, path, 0, ctx);
+        }
+    }
+    closedir(d);
+}
+
+// calls visit for every file under the import folder, and for each directory after its contents
+void import_walk(Import_visit visit, void *ctx)
+{
+    import_walk_dir("", 0, visit, ctx);
+}
+
+int import_is_image(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    return ext && (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0);
+}
+
+// RAW and TIFF files, uploaded beside the JPEGs when UPLOAD_RAW is set
+int import_is_raw(const char *name)
+{
+    const char *raw_extensions[] = {".tif", ".tiff", ".dng", ".nef", ".nrw", ".cr2", ".arw", ".srf", ".sr2", ".orf", ".rw2", ".pef", ".raf", ".3fr", ".erf", ".iiq"};
+    const char *ext = strrchr(name, '.');
+    for (size_t i = 0; ext && i < sizeof(raw_extensions) / sizeof(raw_extensions[0]); i++)
+    {
+        if (strcasecmp(ext, raw_extensions[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// what the upload scans pick up
+int import_is_upload(const char *name)
+{
+    return import_is_image(name) || (UPLOAD_RAW && import_is_raw(name));
+}
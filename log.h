@@ -1,9 +1,34 @@
 #include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+* Logging is asynchronous. _log() formats the message straight into a slot of a lock-free
+* ring buffer (no locks, no file I/O, the timestamp comes from the vDSO clock) and returns.
+* A background writer drains the ring in batches, writes them to stdout and log.txt with
+* one write each, and rotates log.txt once it passes LOG_MAX_BYTES. If producers outrun
+* the writer the message is dropped and counted rather than blocking the caller; the
+* writer reports how many were lost.
+*/
+
+#define LOG_MESSAGE_MAX 512
+#define LOG_RING_SIZE 1024 // must be a power of two
+#define LOG_BATCH_BYTES 65536
+#define LOG_WRITER_IDLE_MS 20
+#define LOG_ROTATE_KEEP 3
+#define LOG_FILE "log.txt"
 
 typedef enum
 {
     LOG_GENERAL,
-    LOG_ERROR
+    LOG_ERROR,
+    LOG_STATS // always written, like errors
 } LOG_TYPE;
 
 typedef enum
@@ -12,42 +37,296 @@ typedef enum
     LOGGIN_ERROR_ONLY,
 } LOGGING_TYPE;
 
+typedef enum
+{
+    LOG_SUBSYSTEM_GENERAL,
+    LOG_SUBSYSTEM_CAMERA,
+    LOG_SUBSYSTEM_UPLOAD,
+    LOG_SUBSYSTEM_NETWORK,
+    LOG_SUBSYSTEM_UI,
+    LOG_SUBSYSTEM_FILTER,
+    LOG_SUBSYSTEM_COUNT
+} LOG_SUBSYSTEM;
+
+const char *log_subsystem_names[LOG_SUBSYSTEM_COUNT] = {"general", "camera", "upload", "network", "ui", "filter"};
+
 LOGGING_TYPE logging_status;
+int log_level_override[LOG_SUBSYSTEM_COUNT] = {-1, -1, -1, -1, -1, -1}; // -1 follows logging_status
+long LOG_MAX_BYTES = 5 * 1024 * 1024;
+
+/*
+* Ring slots carry a sequence number relative to the start of the lap (pos & ~mask): a
+* slot is free for position pos when sequence == lap, published when it is lap + 1, and
+* handed back for the next lap by the writer. Zero initialized slots are therefore ready
+* for the first lap and _log() works before log_start() is called.
+*/
+typedef struct
+{
+    atomic_size_t sequence;
+    struct timespec timestamp;
+    unsigned char subsystem;
+    unsigned char truncate; // clear_log_file() marker, kept in order with the messages around it
+    char msg[LOG_MESSAGE_MAX];
+} Log_slot;
+
+Log_slot log_ring[LOG_RING_SIZE];
+atomic_size_t log_ring_head;
+size_t log_ring_tail = 0;
+atomic_ulong log_dropped;
+unsigned long log_dropped_reported = 0;
+
+pthread_mutex_t log_consumer_mutex = PTHREAD_MUTEX_INITIALIZER;
+FILE *log_file = NULL;
+long log_file_size = 0;
+
+#define LOG_RING_LAP(pos) ((pos) & ~(size_t)(LOG_RING_SIZE - 1))
+
+static Log_slot *log_ring_claim()
+{
+    size_t pos = atomic_load_explicit(&log_ring_head, memory_order_relaxed);
+    for (;;)
+    {
+        Log_slot *slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)LOG_RING_LAP(pos);
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&log_ring_head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                return slot;
+            }
+        }
+        else if (diff < 0)
+        {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return NULL; // ring full
+        }
+        else
+        {
+            pos = atomic_load_explicit(&log_ring_head, memory_order_relaxed);
+        }
+    }
+}
+
+static void log_ring_publish(Log_slot *slot)
+{
+    size_t lap = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, lap + 1, memory_order_release);
+}
+
+int log_enabled(LOG_SUBSYSTEM subsystem, LOG_TYPE log_type)
+{
+    int level = log_level_override[subsystem] >= 0 ? log_level_override[subsystem] : (int)logging_status;
+    return log_type != LOG_GENERAL || level == LOGGIN_ALL;
+}
 
-void _log(LOG_TYPE log_type, const char *fmt, ...) 
+void _vlog_sub(LOG_SUBSYSTEM subsystem, LOG_TYPE log_type, const char *fmt, va_list args)
 {
-    if (logging_status != LOGGIN_ALL && log_type != LOG_ERROR)
+    if (!log_enabled(subsystem, log_type))
     {
         return;
     }
 
+    Log_slot *slot = log_ring_claim();
+    if (!slot)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &slot->timestamp);
+    slot->subsystem = subsystem;
+    slot->truncate = 0;
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, args);
+    log_ring_publish(slot);
+}
+
+void _log_sub(LOG_SUBSYSTEM subsystem, LOG_TYPE log_type, const char *fmt, ...)
+{
     va_list args;
     va_start(args, fmt);
+    _vlog_sub(subsystem, log_type, fmt, args);
+    va_end(args);
+}
 
-    char msg[512];
-    vsnprintf(msg, sizeof(msg), fmt, args);
+void _log(LOG_TYPE log_type, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    _vlog_sub(LOG_SUBSYSTEM_GENERAL, log_type, fmt, args);
     va_end(args);
+}
 
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", t);
+void clear_log_file()
+{
+    // unlike a message this must not be dropped, so wait for the writer to free a slot
+    Log_slot *slot;
+    while (!(slot = log_ring_claim()))
+    {
+        usleep(LOG_WRITER_IDLE_MS * 1000);
+    }
 
-    printf("[%s] %s\n", timestamp, msg);
+    slot->truncate = 1;
+    slot->msg[0] = '\0';
+    log_ring_publish(slot);
+}
 
-    FILE *f = fopen("log.txt", "a");
-    if (f)
+static void log_open_file(const char *mode)
+{
+    log_file = fopen(LOG_FILE, mode);
+    log_file_size = 0;
+
+    struct stat st;
+    if (log_file && fstat(fileno(log_file), &st) == 0)
     {
-        fprintf(f, "[%s] %s\n", timestamp, msg);
-        fclose(f);
+        log_file_size = st.st_size;
     }
 }
 
-void clear_log_file()
+static void log_rotate()
+{
+    if (log_file)
+    {
+        fclose(log_file);
+    }
+
+    char from[32], to[32];
+    for (int i = LOG_ROTATE_KEEP - 1; i >= 1; i--)
+    {
+        snprintf(from, sizeof(from), "%s.%d", LOG_FILE, i);
+        snprintf(to, sizeof(to), "%s.%d", LOG_FILE, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", LOG_FILE);
+    rename(LOG_FILE, to);
+
+    log_open_file("a");
+}
+
+static void log_write_batch(const char *batch, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    fwrite(batch, 1, length, stdout);
+    fflush(stdout);
+
+    if (!log_file)
+    {
+        log_open_file("a");
+    }
+    else if (LOG_MAX_BYTES > 0 && log_file_size + (long)length > LOG_MAX_BYTES)
+    {
+        log_rotate();
+    }
+
+    if (log_file)
+    {
+        fwrite(batch, 1, length, log_file);
+        fflush(log_file);
+        log_file_size += length;
+    }
+}
+
+static size_t log_format_line(char *out, size_t size, const struct timespec *timestamp, int subsystem, const char *msg)
+{
+    struct tm t;
+    char stamp[32];
+    localtime_r(&timestamp->tv_sec, &t);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &t);
+
+    int written = subsystem == LOG_SUBSYSTEM_GENERAL
+        ? snprintf(out, size, "[%s] %s\n", stamp, msg)
+        : snprintf(out, size, "[%s] [%s] %s\n", stamp, log_subsystem_names[subsystem], msg);
+
+    return written < 0 ? 0 : ((size_t)written < size ? (size_t)written : size - 1);
+}
+
+int log_drain()
 {
-    FILE *f = fopen("log.txt", "w");
-    if (f)
+    static char batch[LOG_BATCH_BYTES];
+    size_t length = 0;
+    int drained = 0;
+
+    pthread_mutex_lock(&log_consumer_mutex);
+
+    for (;;)
     {
-        fclose(f);
+        Log_slot *slot = &log_ring[log_ring_tail & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != LOG_RING_LAP(log_ring_tail) + 1)
+        {
+            break; // empty, or the next producer has not finished formatting
+        }
+
+        if (slot->truncate)
+        {
+            log_write_batch(batch, length);
+            length = 0;
+            if (log_file)
+            {
+                fclose(log_file);
+            }
+            log_open_file("w");
+        }
+        else
+        {
+            if (LOG_BATCH_BYTES - length < LOG_MESSAGE_MAX + 64)
+            {
+                log_write_batch(batch, length);
+                length = 0;
+            }
+            length += log_format_line(batch + length, LOG_BATCH_BYTES - length, &slot->timestamp, slot->subsystem, slot->msg);
+        }
+
+        atomic_store_explicit(&slot->sequence, LOG_RING_LAP(log_ring_tail) + LOG_RING_SIZE, memory_order_release);
+        log_ring_tail++;
+        drained++;
+    }
+
+    unsigned long dropped = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+    if (dropped != log_dropped_reported)
+    {
+        char msg[96];
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        snprintf(msg, sizeof(msg), "Log ring overflowed: %lu message(s) dropped.", dropped - log_dropped_reported);
+        if (LOG_BATCH_BYTES - length < sizeof(msg) + 64)
+        {
+            log_write_batch(batch, length);
+            length = 0;
+        }
+        length += log_format_line(batch + length, LOG_BATCH_BYTES - length, &now, LOG_SUBSYSTEM_GENERAL, msg);
+        log_dropped_reported = dropped;
     }
+
+    log_write_batch(batch, length);
+    pthread_mutex_unlock(&log_consumer_mutex);
+    return drained;
+}
+
+void log_flush()
+{
+    log_drain();
+}
+
+void* log_writer_thread()
+{
+    for (;;)
+    {
+        if (log_drain() == 0)
+        {
+            usleep(LOG_WRITER_IDLE_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+void log_start()
+{
+    pthread_t writer;
+    pthread_create(&writer, NULL, log_writer_thread, NULL);
+    pthread_detach(writer);
+    atexit(log_flush);
 }
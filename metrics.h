@@ -0,0 +1,344 @@
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+* Prometheus text exposition of pipeline counters, gauges and latency histograms. The
+* listener is set with METRICS_ADDRESS in config.json: "host:port" for TCP (default
+* 127.0.0.1:9273, use 0.0.0.0 to allow fleet scraping), "unix:/path" for a unix socket,
+* or "off". Any HTTP request on the socket gets the current metrics.
+*/
+
+typedef enum
+{
+    FAILURE_CAMERA_FETCH,
+    FAILURE_CAMERA_IO,
+    FAILURE_FILE_SAVE,
+    FAILURE_UPLOAD_OPEN,
+    FAILURE_UPLOAD_TRANSFER,
+    FAILURE_TRACK_WRITE,
+    FAILURE_CAUSE_COUNT
+} FAILURE_CAUSE;
+
+const char *failure_cause_names[FAILURE_CAUSE_COUNT] = {
+    "camera_fetch",
+    "camera_io",
+    "file_save",
+    "upload_open",
+    "upload_transfer",
+    "track_write"
+};
+
+atomic_ullong metrics_images_imported;
+atomic_ullong metrics_bytes_imported;
+atomic_ullong metrics_images_uploaded;
+atomic_ullong metrics_bytes_uploaded;
+atomic_ullong metrics_failures[FAILURE_CAUSE_COUNT];
+atomic_ullong metrics_camera_reconnects;
+
+Usb_op_stats metrics_upload_latency; // same log2 buckets as the camera transfer histograms
+pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void metrics_count_import(unsigned long long bytes)
+{
+    atomic_fetch_add(&metrics_images_imported, 1);
+    atomic_fetch_add(&metrics_bytes_imported, bytes);
+}
+
+void metrics_count_upload(unsigned long long bytes, uint64_t elapsed_us, int success)
+{
+    if (success)
+    {
+        atomic_fetch_add(&metrics_images_uploaded, 1);
+        atomic_fetch_add(&metrics_bytes_uploaded, bytes);
+    }
+
+    pthread_mutex_lock(&metrics_mutex);
+    usb_stats_add(&metrics_upload_latency, elapsed_us, !success, success ? bytes : 0);
+    pthread_mutex_unlock(&metrics_mutex);
+}
+
+void metrics_count_failure(FAILURE_CAUSE cause)
+{
+    atomic_fetch_add(&metrics_failures[cause], 1);
+}
+
+void metrics_count_camera_reconnect()
+{
+    atomic_fetch_add(&metrics_camera_reconnects, 1);
+}
+
+// one series of a histogram; label is "" or a label pair such as kind="thumbnail"
+static void metrics_write_histogram_series(FILE *out, const char *name, const char *label, const Usb_op_stats *stats)
+{
+    const char *separator = label[0] ? "," : "";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < USB_STATS_BUCKETS - 1; i++)
+    {
+        cumulative += stats->buckets[i];
+        fprintf(out, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, label, separator, usb_stats_bucket_upper_us(i) / 1000000.0, (unsigned long long)cumulative);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, separator, (unsigned long long)stats->count);
+    fprintf(out, label[0] ? "%s_sum{%s} %g\n" : "%s_sum%s %g\n", name, label, stats->total_us / 1000000.0);
+    fprintf(out, label[0] ? "%s_count{%s} %llu\n" : "%s_count%s %llu\n", name, label, (unsigned long long)stats->count);
+}
+
+static void metrics_write_histogram(FILE *out, const char *name, const char *help, const Usb_op_stats *stats)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    metrics_write_histogram_series(out, name, "", stats);
+}
+
+static void metrics_write_counter(FILE *out, const char *name, const char *help, unsigned long long value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, value);
+}
+
+static void metrics_write_gauge(FILE *out, const char *name, const char *help, double value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %g\n", name, help, name, name, value);
+}
+
+void metrics_render(FILE *out)
+{
+    metrics_write_counter(out, "uploader_images_imported_total", "Images saved from the camera to local storage.", atomic_load(&metrics_images_imported));
+    metrics_write_counter(out, "uploader_bytes_imported_total", "Bytes saved from the camera to local storage.", atomic_load(&metrics_bytes_imported));
+    metrics_write_counter(out, "uploader_images_uploaded_total", "Images uploaded to the server.", atomic_load(&metrics_images_uploaded));
+    metrics_write_counter(out, "uploader_bytes_uploaded_total", "Bytes uploaded to the server.", atomic_load(&metrics_bytes_uploaded));
+
+    fprintf(out, "# HELP uploader_failures_total Failures by cause.\n# TYPE uploader_failures_total counter\n");
+    for (int i = 0; i < FAILURE_CAUSE_COUNT; i++)
+    {
+        fprintf(out, "uploader_failures_total{cause=\"%s\"} %llu\n", failure_cause_names[i], atomic_load(&metrics_failures[i]));
+    }
+
+    Net_probe_stats probe;
+    net_probe_get(&probe);
+
+    fprintf(out, "# HELP uploader_reconnects_total Camera and network links re-established after being lost.\n# TYPE uploader_reconnects_total counter\n");
+    fprintf(out, "uploader_reconnects_total{link=\"camera\"} %llu\n", atomic_load(&metrics_camera_reconnects));
+    fprintf(out, "uploader_reconnects_total{link=\"network\"} %lu\n", probe.reconnects);
+
+    metrics_write_gauge(out, "uploader_backlog_images", "Imported images not yet uploaded.", atomic_load(&upload_backlog_images));
+    metrics_write_gauge(out, "uploader_backlog_bytes", "Bytes of imported images not yet uploaded.", atomic_load(&upload_backlog_bytes));
+    metrics_write_gauge(out, "uploader_storage_free_bytes", "Space available on the import filesystem.", atomic_load(&storage_free_bytes));
+    metrics_write_gauge(out, "uploader_storage_total_bytes", "Size of the import filesystem.", atomic_load(&storage_total_bytes));
+    metrics_write_gauge(out, "uploader_imports_paused", "1 while imports wait for uploads to make room.", atomic_load(&storage_imports_paused));
+    metrics_write_counter(out, "uploader_images_evicted_total", "Uploaded images deleted to free space.", atomic_load(&storage_evicted_images));
+    metrics_write_counter(out, "uploader_bytes_evicted_total", "Bytes of uploaded images deleted to free space.", atomic_load(&storage_evicted_bytes));
+    metrics_write_gauge(out, "uploader_file_io_inflight", "File reads and writes queued on the card.", atomic_load(&file_io_inflight));
+    metrics_write_gauge(out, "uploader_file_io_inflight_peak", "Most file reads and writes queued at once.", atomic_load(&file_io_inflight_peak));
+    metrics_write_gauge(out, "uploader_file_io_uring", "1 when file I/O goes through io_uring, 0 for the thread pool.", file_io_uring);
+    metrics_write_counter(out, "uploader_file_io_read_bytes_total", "Bytes read ahead for uploads.", atomic_load(&file_io_bytes_read));
+    metrics_write_counter(out, "uploader_file_io_written_bytes_total", "Bytes of imports written.", atomic_load(&file_io_bytes_written));
+    metrics_write_counter(out, "uploader_compression_input_bytes_total", "Bytes of images uploaded compressed, before compression.", atomic_load(&compress_bytes_in));
+    metrics_write_counter(out, "uploader_compression_output_bytes_total", "Bytes those images took on the wire.", atomic_load(&compress_bytes_out));
+    Upload_snapshot upload_rate;
+    upload_progress_snapshot(&upload_rate);
+    metrics_write_gauge(out, "uploader_upload_rate_bytes_per_second", "Upload throughput averaged over the last minute.", upload_rate.rate_bps);
+    Status_snapshot status;
+    status_read(&status);
+    metrics_write_gauge(out, "uploader_link_strength_percent", "Wi-Fi link quality from /proc/net/wireless.", status.link_strength);
+    metrics_write_gauge(out, "uploader_internet_up", "1 when the upload server answers the connectivity probe.", status.internet_up);
+    metrics_write_gauge(out, "uploader_camera_connected", "1 when a camera is initialized and communicating.", status.camera_found > 0);
+
+    metrics_write_gauge(out, "uploader_probe_rtt_seconds", "Smoothed connect time to the upload server.", probe.srtt_ms / 1000.0);
+    metrics_write_gauge(out, "uploader_probe_loss_ratio", "Smoothed fraction of failed connectivity probes.", probe.loss);
+
+    Destination snapshot[DESTINATIONS_MAX];
+    int count = destination_snapshot(snapshot);
+    time_t now = time(NULL);
+    const char *destination_metrics[][3] = {
+        {"uploader_destination_healthy", "gauge", "1 while a destination is reachable and not cooling down after failures."},
+        {"uploader_destination_rtt_seconds", "gauge", "Smoothed connect time to each destination."},
+        {"uploader_destination_rate_bytes_per_second", "gauge", "Smoothed upload throughput to each destination."},
+        {"uploader_destination_error_ratio", "gauge", "Smoothed fraction of failed uploads to each destination."},
+        {"uploader_destination_uploads_total", "counter", "Images uploaded to each destination."},
+        {"uploader_destination_failures_total", "counter", "Failed uploads to each destination."},
+        {"uploader_destination_bytes_total", "counter", "Bytes uploaded to each destination."},
+        {"uploader_destination_compression_level", "gauge", "zstd level for compressible images to each destination, 0 when sent as is."},
+    };
+    for (int m = 0; m < 8; m++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", destination_metrics[m][0], destination_metrics[m][2], destination_metrics[m][0], destination_metrics[m][1]);
+        for (int i = 0; i < count; i++)
+        {
+            const Destination *d = &snapshot[i];
+            double values[] = {destination_healthy_locked(d, now), d->rtt_ms / 1000.0, d->rate_bps, d->error_rate, (double)d->uploads, (double)d->failures, (double)d->bytes, compress_level_of(i)};
+            fprintf(out, "%s{destination=\"%s\",role=\"%s\"} %.17g\n", destination_metrics[m][0], d->name, destination_role_names[d->role], values[m]);
+        }
+    }
+#ifndef HEADLESS
+    metrics_write_counter(out, "uploader_ui_frames_total", "Frames rendered by the UI.", atomic_load(&ui_frames_rendered));
+    metrics_write_counter(out, "uploader_ui_wakeups_total", "Times the UI loop woke for input, state changes, animation or the idle timeout.", atomic_load(&ui_wakeups));
+    fprintf(out, "# HELP uploader_ui_cpu_seconds_total CPU time used by the UI thread.\n# TYPE uploader_ui_cpu_seconds_total counter\nuploader_ui_cpu_seconds_total %g\n", atomic_load(&ui_cpu_us) / 1000000.0);
+    metrics_write_counter(out, "uploader_ui_text_cache_hits_total", "Text draws served from the texture cache.", atomic_load(&text_cache_hits));
+    metrics_write_counter(out, "uploader_ui_text_cache_misses_total", "Text draws that had to rasterize a new texture.", atomic_load(&text_cache_misses));
+#endif
+    metrics_write_counter(out, "uploader_log_dropped_total", "Log messages dropped because the log ring was full.", atomic_load(&log_dropped));
+
+    // fetch latency covers every camera transfer attempt, across the normal, preview and raw file types
+    Usb_op_stats fetch = {0};
+    Usb_op_stats upload;
+    pthread_mutex_lock(&usb_stats_mutex);
+    for (int op = USB_OP_FILE_GET; op <= USB_OP_FILE_GET_RAW; op++)
+    {
+        const Usb_op_stats *stats = &usb_stats_total.ops[op];
+        fetch.count += stats->count;
+        fetch.total_us += stats->total_us;
+        for (int i = 0; i < USB_STATS_BUCKETS; i++)
+        {
+            fetch.buckets[i] += stats->buckets[i];
+        }
+    }
+    pthread_mutex_unlock(&usb_stats_mutex);
+
+    pthread_mutex_lock(&metrics_mutex);
+    upload = metrics_upload_latency;
+    pthread_mutex_unlock(&metrics_mutex);
+
+    metrics_write_histogram(out, "uploader_fetch_duration_seconds", "Time to transfer one file from the camera.", &fetch);
+    metrics_write_histogram(out, "uploader_upload_duration_seconds", "Time to upload one file to the server.", &upload);
+
+    Task_kind_stats tasks[TASK_KIND_COUNT];
+    task_pool_snapshot(tasks);
+    metrics_write_gauge(out, "uploader_task_pool_workers", "Threads in the shared task pool.", task_pool_workers);
+    metrics_write_gauge(out, "uploader_task_pool_queued", "Tasks waiting for a task pool worker.", atomic_load(&task_pool_queued));
+    const char *task_histograms[][2] = {
+        {"uploader_task_wait_seconds", "Time tasks spent queued, by kind."},
+        {"uploader_task_run_seconds", "Time tasks took to run, by kind."},
+    };
+    for (int m = 0; m < 2; m++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", task_histograms[m][0], task_histograms[m][1], task_histograms[m][0]);
+        for (int kind = 0; kind < TASK_KIND_COUNT; kind++)
+        {
+            char label[64];
+            snprintf(label, sizeof(label), "kind=\"%s\"", task_kind_names[kind]);
+            metrics_write_histogram_series(out, task_histograms[m][0], label, m == 0 ? &tasks[kind].wait : &tasks[kind].run);
+        }
+    }
+    const char *task_counters[][2] = {
+        {"uploader_tasks_refused_total", "Tasks turned away because the task pool was full, by kind."},
+        {"uploader_tasks_stolen_total", "Tasks run by a worker other than the one they were queued on, by kind."},
+    };
+    for (int m = 0; m < 2; m++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", task_counters[m][0], task_counters[m][1], task_counters[m][0]);
+        for (int kind = 0; kind < TASK_KIND_COUNT; kind++)
+        {
+            fprintf(out, "%s{kind=\"%s\"} %llu\n", task_counters[m][0], task_kind_names[kind], (unsigned long long)(m == 0 ? tasks[kind].refused : tasks[kind].stolen));
+        }
+    }
+}
+
+int metrics_listen()
+{
+    int fd;
+
+    if (strncmp(METRICS_ADDRESS, "unix:", 5) == 0)
+    {
+        struct sockaddr_un address = {0};
+        address.sun_family = AF_UNIX;
+        snprintf(address.sun_path, sizeof(address.sun_path), "%s", METRICS_ADDRESS + 5);
+        unlink(address.sun_path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+        {
+            return fd < 0 ? -1 : (close(fd), -1);
+        }
+    }
+    else
+    {
+        char host[64];
+        int port = 0;
+        if (sscanf(METRICS_ADDRESS, "%63[^:]:%d", host, &port) != 2)
+        {
+            return -1;
+        }
+
+        struct sockaddr_in address = {0};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &address.sin_addr) != 1)
+        {
+            return -1;
+        }
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+        {
+            return fd < 0 ? -1 : (close(fd), -1);
+        }
+    }
+
+    if (listen(fd, 4) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void metrics_serve_client(int client)
+{
+    // we answer every request the same way, so only wait long enough to consume the request line
+    struct timeval timeout = {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[1024];
+    recv(client, request, sizeof(request), 0);
+
+    char *body = NULL;
+    size_t body_length = 0;
+    FILE *out = open_memstream(&body, &body_length);
+    if (!out)
+    {
+        return;
+    }
+    metrics_render(out);
+    fclose(out);
+
+    char header[128];
+    int header_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_length);
+    send(client, header, header_length, MSG_NOSIGNAL);
+    send(client, body, body_length, MSG_NOSIGNAL);
+    free(body);
+}
+
+void* metrics_thread()
+{
+    if (strcmp(METRICS_ADDRESS, "off") == 0)
+    {
+        return NULL;
+    }
+
+    int server = metrics_listen();
+    if (server < 0)
+    {
+        _log(LOG_ERROR, "Metrics exporter could not listen on %s.", METRICS_ADDRESS);
+        return NULL;
+    }
+    _log(LOG_GENERAL, "Metrics exporter listening on %s.", METRICS_ADDRESS);
+    trace_name_thread("metrics");
+
+    while (!stop_requested)
+    {
+        int client = accept(server, NULL, NULL);
+        if (client < 0)
+        {
+            usleep(100000);
+            continue;
+        }
+        Trace_span span = trace_begin("metrics scrape", "metrics");
+        metrics_serve_client(client);
+        trace_end(span);
+        close(client);
+    }
+
+    close(server);
+    return NULL;
+}
@@ -0,0 +1,456 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+
+/*
+* Connectivity probe for the upload server. Instead of forking ping against a public host,
+* this opens a non-blocking TCP connection to the host and port of each destination's url and
+* measures how long the handshake takes, so "Internet connected" means a server we deliver to
+* is reachable; each destination's result also feeds its health (destination.h). If the
+* connect fails and PROBE_ICMP_FALLBACK is set in config.json, an unprivileged ICMP echo is
+* tried instead (requires net.ipv4.ping_group_range to include our group).
+*
+* The probe keeps a smoothed RTT and loss estimate for the uploader, backs off while the
+* link is healthy and nothing is uploading, and tightens to once a second while uploads fail.
+*/
+
+#define PROBE_TIMEOUT_MS 3000
+#define PROBE_INTERVAL_FAILING 1
+#define PROBE_INTERVAL_DOWN 2
+#define PROBE_INTERVAL_ACTIVE 5
+#define PROBE_INTERVAL_IDLE_MAX 30
+#define PROBE_LINK_STRENGTH_INTERVAL 2
+#define PROBE_UPLOAD_ACTIVE_WINDOW 30
+
+typedef enum
+{
+    PROBE_METHOD_NONE,
+    PROBE_METHOD_TCP,
+    PROBE_METHOD_ICMP
+} PROBE_METHOD;
+
+typedef struct
+{
+    double srtt_ms;         // smoothed round trip time of successful probes
+    double rttvar_ms;       // smoothed mean deviation of the round trip time
+    double loss;            // smoothed fraction of failed probes, 0.0 - 1.0
+    PROBE_METHOD last_method;
+    int consecutive_failures;
+    unsigned long probes_sent;
+    unsigned long probes_failed;
+    unsigned long reconnects; // server reachable again after being lost
+} Net_probe_stats;
+
+Net_probe_stats net_probe_stats = {0};
+pthread_mutex_t net_probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t net_probe_wake = PTHREAD_COND_INITIALIZER;
+
+int consecutive_upload_failures = 0;
+int net_probe_requested = 0;
+time_t last_upload_activity = 0;
+
+char probe_host[256];
+char probe_port[8];
+
+void net_probe_get(Net_probe_stats *stats)
+{
+    pthread_mutex_lock(&net_probe_mutex);
+    *stats = net_probe_stats;
+    pthread_mutex_unlock(&net_probe_mutex);
+}
+
+void net_probe_report_upload_result(int success)
+{
+    pthread_mutex_lock(&net_probe_mutex);
+    last_upload_activity = time(NULL);
+    if (success)
+    {
+        consecutive_upload_failures = 0;
+    }
+    else if (consecutive_upload_failures++ == 0)
+    {
+        // first failure after a good run; re-probe now rather than waiting out an idle back off
+        net_probe_requested = 1;
+        pthread_cond_signal(&net_probe_wake);
+    }
+    pthread_mutex_unlock(&net_probe_mutex);
+}
+
+int net_probe_parse_url(const char *url)
+{
+    // accepts scheme://[user[:pass]@]host[:port][/path], with [v6] literal hosts
+    const char *host_start = strstr(url, "://");
+    const char *scheme_end = host_start;
+    host_start = host_start ? host_start + 3 : url;
+
+    const char *path_start = strchr(host_start, '/');
+    const char *host_end = path_start ? path_start : host_start + strlen(host_start);
+
+    for (const char *at = host_start; at < host_end; at++)
+    {
+        if (*at == '@')
+        {
+            host_start = at + 1;
+        }
+    }
+
+    const char *port_start = NULL;
+    if (*host_start == '[')
+    {
+        const char *bracket = memchr(host_start, ']', host_end - host_start);
+        if (!bracket)
+        {
+            return -1;
+        }
+        port_start = (bracket + 1 < host_end && bracket[1] == ':') ? bracket + 2 : NULL;
+        host_start++;
+        host_end = bracket;
+    }
+    else
+    {
+        const char *colon = memchr(host_start, ':', host_end - host_start);
+        if (colon)
+        {
+            port_start = colon + 1;
+            host_end = colon;
+        }
+    }
+
+    size_t host_len = host_end - host_start;
+    if (host_len == 0 || host_len >= sizeof(probe_host))
+    {
+        return -1;
+    }
+    memcpy(probe_host, host_start, host_len);
+    probe_host[host_len] = '\0';
+
+    if (port_start)
+    {
+        snprintf(probe_port, sizeof(probe_port), "%.*s", (int)strspn(port_start, "0123456789"), port_start);
+    }
+    else if (scheme_end == url + 4 && strncasecmp(url, "ftps", 4) == 0)
+    {
+        strcpy(probe_port, "990");
+    }
+    else if (scheme_end == url + 4 && strncasecmp(url, "sftp", 4) == 0)
+    {
+        strcpy(probe_port, "22");
+    }
+    else
+    {
+        strcpy(probe_port, "21");
+    }
+
+    return 0;
+}
+
+double net_probe_elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+int net_probe_wait(int fd, short events, const struct timespec *start)
+{
+    int remaining_ms = PROBE_TIMEOUT_MS - (int)net_probe_elapsed_ms(start);
+    if (remaining_ms <= 0)
+    {
+        return 0;
+    }
+
+    struct pollfd pfd = {fd, events, 0};
+    int ret;
+    do
+    {
+        ret = poll(&pfd, 1, remaining_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret > 0;
+}
+
+double net_probe_tcp(const struct addrinfo *address)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int ret = connect(fd, address->ai_addr, address->ai_addrlen);
+    if (ret < 0 && errno == EINPROGRESS && net_probe_wait(fd, POLLOUT, &start))
+    {
+        int so_error = 0;
+        socklen_t len = sizeof(so_error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+        ret = so_error == 0 ? 0 : -1;
+    }
+    else if (ret < 0)
+    {
+        ret = -1;
+    }
+
+    double elapsed = net_probe_elapsed_ms(&start);
+    close(fd);
+    return ret == 0 ? elapsed : -1;
+}
+
+double net_probe_icmp(const struct addrinfo *address)
+{
+    if (address->ai_family != AF_INET)
+    {
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    static uint16_t sequence = 0;
+    struct icmphdr request = {0};
+    request.type = ICMP_ECHO;
+    request.un.echo.sequence = htons(++sequence); // the kernel fills in id and checksum for ping sockets
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    double result = -1;
+    if (sendto(fd, &request, sizeof(request), 0, address->ai_addr, address->ai_addrlen) == sizeof(request))
+    {
+        while (net_probe_wait(fd, POLLIN, &start))
+        {
+            struct icmphdr reply;
+            if (recv(fd, &reply, sizeof(reply), 0) >= (ssize_t)sizeof(reply) && reply.type == ICMP_ECHOREPLY && reply.un.echo.sequence == request.un.echo.sequence)
+            {
+                result = net_probe_elapsed_ms(&start);
+                break;
+            }
+        }
+    }
+
+    close(fd);
+    return result;
+}
+
+void net_probe_record(double rtt_ms, PROBE_METHOD method)
+{
+    pthread_mutex_lock(&net_probe_mutex);
+
+    Net_probe_stats *stats = &net_probe_stats;
+    stats->probes_sent++;
+
+    if (rtt_ms >= 0)
+    {
+        // same smoothing TCP uses for its retransmit timer (RFC 6298)
+        if (stats->srtt_ms == 0)
+        {
+            stats->srtt_ms = rtt_ms;
+            stats->rttvar_ms = rtt_ms / 2;
+        }
+        else
+        {
+            double deviation = rtt_ms > stats->srtt_ms ? rtt_ms - stats->srtt_ms : stats->srtt_ms - rtt_ms;
+            stats->rttvar_ms = 0.75 * stats->rttvar_ms + 0.25 * deviation;
+            stats->srtt_ms = 0.875 * stats->srtt_ms + 0.125 * rtt_ms;
+        }
+        stats->loss = 0.9 * stats->loss;
+        stats->consecutive_failures = 0;
+        stats->last_method = method;
+    }
+    else
+    {
+        stats->loss = 0.9 * stats->loss + 0.1;
+        stats->consecutive_failures++;
+        stats->probes_failed++;
+        stats->last_method = PROBE_METHOD_NONE;
+    }
+
+    pthread_mutex_unlock(&net_probe_mutex);
+}
+
+// handshake time to probe_host and probe_port in ms, or -1
+static double net_probe_measure(PROBE_METHOD *method)
+{
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addresses = NULL;
+    *method = PROBE_METHOD_NONE;
+    if (getaddrinfo(probe_host, probe_port, &hints, &addresses) != 0)
+    {
+        return -1;
+    }
+
+    double rtt_ms = -1;
+    for (struct addrinfo *address = addresses; address && rtt_ms < 0; address = address->ai_next)
+    {
+        rtt_ms = net_probe_tcp(address);
+        *method = PROBE_METHOD_TCP;
+    }
+
+    for (struct addrinfo *address = addresses; address && rtt_ms < 0 && PROBE_ICMP_FALLBACK; address = address->ai_next)
+    {
+        rtt_ms = net_probe_icmp(address);
+        *method = PROBE_METHOD_ICMP;
+    }
+
+    freeaddrinfo(addresses);
+    return rtt_ms >= 0 ? rtt_ms : -1;
+}
+
+// probes every destination; the link counts as up while any primary or fallback answers
+int net_probe_once()
+{
+    double rtt_ms = -1;
+    PROBE_METHOD method = PROBE_METHOD_NONE;
+
+    for (int i = 0; i < destination_count; i++)
+    {
+        Destination *d = &destinations[i];
+        PROBE_METHOD d_method = PROBE_METHOD_NONE;
+        double d_rtt_ms = net_probe_parse_url(d->url) == 0 ? net_probe_measure(&d_method) : -1;
+        destination_report_probe(d, d_rtt_ms);
+        if (d->role != DESTINATION_MIRROR && rtt_ms < 0 && d_rtt_ms >= 0)
+        {
+            rtt_ms = d_rtt_ms;
+            method = d_method;
+        }
+    }
+
+    net_probe_record(rtt_ms, method);
+    return rtt_ms >= 0;
+}
+
+int net_probe_next_interval(int reachable)
+{
+    // returns 0 when the link is healthy and idle, meaning the caller's back off applies
+    pthread_mutex_lock(&net_probe_mutex);
+    int uploads_failing = consecutive_upload_failures > 0;
+    int uploads_active = time(NULL) - last_upload_activity < PROBE_UPLOAD_ACTIVE_WINDOW;
+    pthread_mutex_unlock(&net_probe_mutex);
+
+    if (uploads_failing)
+    {
+        return PROBE_INTERVAL_FAILING;
+    }
+    if (!reachable)
+    {
+        return PROBE_INTERVAL_DOWN;
+    }
+    if (uploads_active)
+    {
+        return PROBE_INTERVAL_ACTIVE;
+    }
+    return 0;
+}
+
+long net_probe_connect_timeout_ms()
+{
+    // give curl room for a few handshakes on a slow link, but never less than the old default feel
+    Net_probe_stats stats;
+    net_probe_get(&stats);
+
+    long timeout_ms = (long)(4 * (stats.srtt_ms + 4 * stats.rttvar_ms));
+    if (timeout_ms < 5000)
+    {
+        timeout_ms = 5000;
+    }
+    if (timeout_ms > 30000)
+    {
+        timeout_ms = 30000;
+    }
+    return timeout_ms;
+}
+
+void* internet_poll_thread()
+{
+    for (int i = 0; i < destination_count; i++)
+    {
+        if (net_probe_parse_url(destinations[i].url) != 0)
+        {
+            _log_sub(LOG_SUBSYSTEM_NETWORK, LOG_ERROR, "Could not parse host from %s url %s; it will count as unreachable.", destinations[i].name, destinations[i].url);
+            continue;
+        }
+        _log_sub(LOG_SUBSYSTEM_NETWORK, LOG_GENERAL, "Probing connectivity to %s at %s port %s.", destinations[i].name, probe_host, probe_port);
+    }
+    trace_name_thread("network probe");
+
+    time_t next_probe = 0;
+    int idle_interval = PROBE_INTERVAL_ACTIVE;
+
+    while (!stop_requested)
+    {
+        time_t now = time(NULL);
+        if (now >= next_probe)
+        {
+            Trace_span probe_span = trace_begin("probe", "network");
+            int reachable = net_probe_once();
+            trace_end(probe_span);
+            if (reachable != internet_up)
+            {
+                Net_probe_stats stats;
+                net_probe_get(&stats);
+                _log_sub(LOG_SUBSYSTEM_NETWORK, reachable ? LOG_GENERAL : LOG_ERROR, "Upload server %s (srtt %.1fms, loss %.0f%%).", reachable ? "reachable" : "unreachable", stats.srtt_ms, stats.loss * 100);
+            }
+            if (reachable && !internet_up && net_probe_stats.probes_sent > 1)
+            {
+                pthread_mutex_lock(&net_probe_mutex);
+                net_probe_stats.reconnects++;
+                pthread_mutex_unlock(&net_probe_mutex);
+            }
+            if (reachable != internet_up)
+            {
+                internet_up = reachable;
+                status_publish_network(internet_up, link_strength_value);
+                ui_request_redraw();
+            }
+
+            // double the interval after each healthy idle probe, start over once anything happens
+            int interval = net_probe_next_interval(reachable);
+            if (interval == 0)
+            {
+                interval = idle_interval;
+                idle_interval = idle_interval * 2 > PROBE_INTERVAL_IDLE_MAX ? PROBE_INTERVAL_IDLE_MAX : idle_interval * 2;
+            }
+            else
+            {
+                idle_interval = PROBE_INTERVAL_ACTIVE;
+            }
+            next_probe = time(NULL) + interval;
+        }
+
+        int strength = get_link_strength();
+        if (strength != link_strength_value)
+        {
+            link_strength_value = strength;
+            status_publish_network(internet_up, link_strength_value);
+            ui_request_redraw();
+        }
+
+        // sleep until the next link strength refresh, or earlier if an upload failure asks for a probe
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += PROBE_LINK_STRENGTH_INTERVAL;
+
+        pthread_mutex_lock(&net_probe_mutex);
+        while (!net_probe_requested && !stop_requested && pthread_cond_timedwait(&net_probe_wake, &net_probe_mutex, &deadline) == 0);
+        if (net_probe_requested)
+        {
+            net_probe_requested = 0;
+            next_probe = 0;
+        }
+        pthread_mutex_unlock(&net_probe_mutex);
+    }
+    return NULL;
+}
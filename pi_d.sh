@@ -4,7 +4,7 @@
 # Update and install necessary libraries
 sudo apt update
 sudo apt upgrade -y
-sudo apt install -y libsdl2-dev libsdl2-ttf-dev libusb-1.0-0-dev libjson-c-dev libgphoto2-dev gphoto2 onboard unclutter
+sudo apt install -y libsdl2-dev libsdl2-ttf-dev libusb-1.0-0-dev libjson-c-dev libgphoto2-dev libnm-dev libglib2.0-dev libjpeg-dev gphoto2 onboard unclutter
 
 
 # Set Raspberry Pi to autologin to desktop
@@ -0,0 +1,510 @@
+#include <setjmp.h>
+#include <stdint.h>
+#include <jpeglib.h>
+#include <glib.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define REJECT_KERNELS "neon"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define REJECT_KERNELS "sse2"
+#else
+#define REJECT_KERNELS "scalar"
+#endif
+
+/*
+* Optional reject filter between import and upload, for bursts where most frames missed
+* focus or repeat the one before. REJECT_FILTER in config.json:
+*   "off"    the default, every image is uploaded in capture order
+*   "defer"  rejected images are still uploaded, after everything else waiting
+*   "hold"   rejected images stay on the card until released with "release" on the
+*            control socket; they count as not uploaded, so storage never evicts them
+* Each new JPEG is scored on the task pool (task_pool.h), several at once when there are
+* cores for it. Only the luma plane is decoded, at the smallest 1/2^n libjpeg IDCT scale
+* that keeps REJECT_DECODE_MIN_SIDE pixels (1/8, which is just the DC coefficients, for
+* any camera image). Its sharpness is the variance of the Laplacian
+* of that plane, and its 64 bit difference hash compares it with the last REJECT_RECENT
+* frames kept. A frame is rejected as blurry below REJECT_SHARPNESS_MIN, or as a near
+* duplicate within REJECT_DUPLICATE_BITS of a kept frame. Scores may finish out of order,
+* but decisions are taken in import order, since each frame is compared with the ones
+* kept before it. Every decision is logged with its scores so the thresholds can be tuned
+* from a session's log.
+*
+* Decisions are in memory only: after a restart, images waiting are uploaded as usual.
+* The upload scan leaves out images the filter has not reached yet, and picks them up on
+* a later pass. If imports outrun the filter by REJECT_QUEUE_MAX images, the extra ones
+* are uploaded unfiltered rather than held up.
+*/
+
+#define REJECT_DECODE_MIN_SIDE 256
+#define REJECT_QUEUE_MAX 64
+#define REJECT_RECENT 16
+#define REJECT_SIMD_BLOCK 1024 // pixels per 32 bit accumulation, well short of overflow
+
+typedef enum
+{
+    REJECT_MODE_OFF,
+    REJECT_MODE_DEFER,
+    REJECT_MODE_HOLD
+} REJECT_MODE;
+
+typedef enum
+{
+    REJECT_KEEP,
+    REJECT_BLURRY,
+    REJECT_DUPLICATE
+} REJECT_REASON;
+
+const char *reject_reason_names[] = {"keep", "blurry", "duplicate"};
+
+typedef struct
+{
+    REJECT_REASON reason;
+    double sharpness;
+    uint64_t hash;
+} Reject_verdict;
+
+typedef struct
+{
+    char name[256];
+    uint64_t hash;
+} Reject_recent;
+
+typedef enum
+{
+    REJECT_ENTRY_SCORING,
+    REJECT_ENTRY_SCORED,
+    REJECT_ENTRY_UNREADABLE
+} REJECT_ENTRY_STATE;
+
+typedef struct
+{
+    char name[256];
+    REJECT_ENTRY_STATE state;
+    Reject_verdict verdict; // sharpness and hash once scored
+    int w;
+    int h;
+    uint64_t start_us;
+} Reject_entry;
+
+// guarded by reject_mutex
+pthread_mutex_t reject_mutex = PTHREAD_MUTEX_INITIALIZER;
+GHashTable *reject_verdicts = NULL; // relative name to Reject_verdict
+Reject_entry reject_queue[REJECT_QUEUE_MAX]; // images not decided yet, in import order
+int reject_queue_head = 0;
+int reject_queue_count = 0;
+Reject_recent reject_recent[REJECT_RECENT];
+int reject_recent_count = 0;
+int reject_recent_next = 0;
+
+REJECT_MODE reject_mode()
+{
+    if (strcmp(REJECT_FILTER, "defer") == 0)
+    {
+        return REJECT_MODE_DEFER;
+    }
+    return strcmp(REJECT_FILTER, "hold") == 0 ? REJECT_MODE_HOLD : REJECT_MODE_OFF;
+}
+
+typedef struct
+{
+    struct jpeg_error_mgr base;
+    jmp_buf jump;
+} Reject_jpeg_error;
+
+static void reject_jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((Reject_jpeg_error *)cinfo->err)->jump, 1);
+}
+
+static void reject_jpeg_silent(j_common_ptr cinfo)
+{
+    (void)cinfo;
+}
+
+// the luma plane at reduced scale, or NULL if the file is not a readable JPEG
+unsigned char *reject_decode_luma(const char *path, int *out_w, int *out_h)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    Reject_jpeg_error error;
+    unsigned char *volatile pixels = NULL;
+    cinfo.err = jpeg_std_error(&error.base);
+    error.base.error_exit = reject_jpeg_error_exit;
+    error.base.output_message = reject_jpeg_silent;
+    if (setjmp(error.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(file);
+        free(pixels);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // grayscale output skips the chroma IDCTs and colour conversion altogether
+    unsigned short_side = cinfo.image_width < cinfo.image_height ? cinfo.image_width : cinfo.image_height;
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    while (cinfo.scale_denom < 8 && short_side / (cinfo.scale_denom * 2) >= REJECT_DECODE_MIN_SIDE)
+    {
+        cinfo.scale_denom *= 2;
+    }
+    cinfo.dct_method = JDCT_IFAST;
+    cinfo.do_fancy_upsampling = FALSE;
+    cinfo.do_block_smoothing = FALSE;
+    jpeg_start_decompress(&cinfo);
+
+    int w = cinfo.output_width;
+    int h = cinfo.output_height;
+    pixels = malloc((size_t)w * h);
+    if (!pixels || w < 3 || h < 3)
+    {
+        longjmp(error.jump, 1);
+    }
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW rows[1] = {pixels + (size_t)cinfo.output_scanline * w};
+        jpeg_read_scanlines(&cinfo, rows, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    *out_w = w;
+    *out_h = h;
+    return pixels;
+}
+
+// sum and sum of squares of 4c - up - down - left - right over mid[from, to), with 1 <= from and to <= w - 1
+static void reject_laplacian_span(const uint8_t *up, const uint8_t *mid, const uint8_t *down, int from, int to, int64_t *sum, int64_t *squares)
+{
+    int x = from;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int32x4_t sums = vdupq_n_s32(0);
+    int32x4_t square_sums = vdupq_n_s32(0);
+    for (; x + 8 <= to; x += 8)
+    {
+        int16x8_t c = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(mid + x)));
+        int16x8_t l = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(mid + x - 1)));
+        int16x8_t r = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(mid + x + 1)));
+        int16x8_t u = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(up + x)));
+        int16x8_t d = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(down + x)));
+        int16x8_t lap = vsubq_s16(vshlq_n_s16(c, 2), vaddq_s16(vaddq_s16(l, r), vaddq_s16(u, d)));
+        sums = vpadalq_s16(sums, lap);
+        square_sums = vmlal_s16(square_sums, vget_low_s16(lap), vget_low_s16(lap));
+        square_sums = vmlal_s16(square_sums, vget_high_s16(lap), vget_high_s16(lap));
+    }
+    int32_t lanes[4];
+    vst1q_s32(lanes, sums);
+    *sum += (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    vst1q_s32(lanes, square_sums);
+    *squares += (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i sums = zero;
+    __m128i square_sums = zero;
+    for (; x + 8 <= to; x += 8)
+    {
+        __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x)), zero);
+        __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x - 1)), zero);
+        __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x + 1)), zero);
+        __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(up + x)), zero);
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(down + x)), zero);
+        __m128i lap = _mm_sub_epi16(_mm_slli_epi16(c, 2), _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+        sums = _mm_add_epi32(sums, _mm_madd_epi16(lap, ones));
+        square_sums = _mm_add_epi32(square_sums, _mm_madd_epi16(lap, lap));
+    }
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, sums);
+    *sum += (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128((__m128i *)lanes, square_sums);
+    *squares += (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; x < to; x++)
+    {
+        int lap = 4 * mid[x] - mid[x - 1] - mid[x + 1] - up[x] - down[x];
+        *sum += lap;
+        *squares += lap * lap;
+    }
+}
+
+// variance of the Laplacian over the interior of a w x h luma plane
+double reject_sharpness(const unsigned char *luma, int w, int h)
+{
+    int64_t sum = 0;
+    int64_t squares = 0;
+    for (int y = 1; y < h - 1; y++)
+    {
+        const uint8_t *mid = luma + (size_t)y * w;
+        for (int from = 1; from < w - 1; from += REJECT_SIMD_BLOCK)
+        {
+            int to = from + REJECT_SIMD_BLOCK < w - 1 ? from + REJECT_SIMD_BLOCK : w - 1;
+            reject_laplacian_span(mid - w, mid, mid + w, from, to, &sum, &squares);
+        }
+    }
+    double count = (double)(w - 2) * (h - 2);
+    double mean = sum / count;
+    return squares / count - mean * mean;
+}
+
+// difference hash: each bit says whether a cell of a 9 x 8 grid of means is darker than its right neighbour
+uint64_t reject_hash(const unsigned char *luma, int w, int h)
+{
+    uint32_t cells[8][9] = {{0}};
+    for (int y = 0; y < h; y++)
+    {
+        const unsigned char *row = luma + (size_t)y * w;
+        uint32_t *band = cells[(long)y * 8 / h];
+        for (int c = 0; c < 9; c++)
+        {
+            uint32_t total = 0;
+            for (int x = (long)c * w / 9; x < (long)(c + 1) * w / 9; x++) // vectorized by the compiler
+            {
+                total += row[x];
+            }
+            band[c] += total;
+        }
+    }
+
+    // cells in a band are within a pixel of the same size, so sums compare like means
+    uint64_t hash = 0;
+    for (int r = 0; r < 8; r++)
+    {
+        for (int c = 0; c < 8; c++)
+        {
+            uint64_t width = (long)(c + 1) * w / 9 - (long)c * w / 9;
+            uint64_t next_width = (long)(c + 2) * w / 9 - (long)(c + 1) * w / 9;
+            hash = hash << 1 | ((uint64_t)cells[r][c] * next_width < (uint64_t)cells[r][c + 1] * width);
+        }
+    }
+    return hash;
+}
+
+// decodes one imported image and measures it; returns 0 if it could not be read
+int reject_score(const char *relative, Reject_verdict *verdict, int *w, int *h)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", LOCAL_DIR, relative);
+
+    unsigned char *luma = reject_decode_luma(path, w, h);
+    if (!luma)
+    {
+        _log_sub(LOG_SUBSYSTEM_FILTER, LOG_ERROR, "%s: could not be decoded, uploading it unfiltered.", relative);
+        return 0;
+    }
+    verdict->sharpness = reject_sharpness(luma, *w, *h);
+    verdict->hash = reject_hash(luma, *w, *h);
+    free(luma);
+    return 1;
+}
+
+// decides on a scored image against the frames kept before it and logs why; called in import order with reject_mutex held
+static void reject_decide_locked(const char *relative, Reject_verdict *verdict, int w, int h, uint64_t start_us)
+{
+    int closest = -1;
+    int closest_bits = 65;
+    for (int i = 0; i < reject_recent_count; i++)
+    {
+        int bits = __builtin_popcountll(verdict->hash ^ reject_recent[i].hash);
+        if (bits < closest_bits)
+        {
+            closest = i;
+            closest_bits = bits;
+        }
+    }
+
+    verdict->reason = REJECT_KEEP;
+    if (verdict->sharpness < REJECT_SHARPNESS_MIN)
+    {
+        verdict->reason = REJECT_BLURRY;
+    }
+    else if (closest >= 0 && closest_bits <= REJECT_DUPLICATE_BITS)
+    {
+        verdict->reason = REJECT_DUPLICATE;
+    }
+    else
+    {
+        // only kept frames are compared against, so a run of repeats all point back to the frame uploaded
+        snprintf(reject_recent[reject_recent_next].name, sizeof(reject_recent[0].name), "%s", relative);
+        reject_recent[reject_recent_next].hash = verdict->hash;
+        reject_recent_next = (reject_recent_next + 1) % REJECT_RECENT;
+        reject_recent_count = reject_recent_count < REJECT_RECENT ? reject_recent_count + 1 : REJECT_RECENT;
+    }
+
+    _log_sub(LOG_SUBSYSTEM_FILTER, LOG_STATS, "%s: %s, sharpness %.1f, hash %016llx, %d bits from %s, %dx%d in %.1fms.", relative,
+        reject_reason_names[verdict->reason], verdict->sharpness, (unsigned long long)verdict->hash, closest >= 0 ? closest_bits : 64,
+        closest >= 0 ? reject_recent[closest].name : "nothing", w, h, (usb_stats_now_us() - start_us) / 1000.0);
+}
+
+
+// decides on the images at the head of the queue whose scores are in; called with reject_mutex held
+static void reject_drain_locked()
+{
+    while (reject_queue_count > 0 && reject_queue[reject_queue_head].state != REJECT_ENTRY_SCORING)
+    {
+        Reject_entry *entry = &reject_queue[reject_queue_head];
+        if (entry->state == REJECT_ENTRY_SCORED)
+        {
+            reject_decide_locked(entry->name, &entry->verdict, entry->w, entry->h, entry->start_us);
+            Reject_verdict *stored = g_new(Reject_verdict, 1);
+            *stored = entry->verdict;
+            g_hash_table_replace(reject_verdicts, g_strdup(entry->name), stored);
+        }
+        reject_queue_head = (reject_queue_head + 1) % REJECT_QUEUE_MAX;
+        reject_queue_count--;
+    }
+}
+
+// task pool job for one queue entry; entries are not reused before they are decided, so the index stays valid
+static void reject_score_task(void *arg)
+{
+    Reject_entry *entry = arg;
+    pthread_mutex_lock(&reject_mutex);
+    char relative[256];
+    strcpy(relative, entry->name);
+    pthread_mutex_unlock(&reject_mutex);
+
+    Reject_verdict verdict = {REJECT_KEEP, 0, 0};
+    int w = 0, h = 0;
+    int scored = reject_score(relative, &verdict, &w, &h);
+
+    pthread_mutex_lock(&reject_mutex);
+    entry->verdict = verdict;
+    entry->w = w;
+    entry->h = h;
+    entry->state = scored ? REJECT_ENTRY_SCORED : REJECT_ENTRY_UNREADABLE;
+    reject_drain_locked();
+    pthread_mutex_unlock(&reject_mutex);
+}
+
+// queues a newly imported image for the filter; called as it is published, so it never waits
+void reject_submit(const char *relative)
+{
+    if (reject_mode() == REJECT_MODE_OFF || !import_is_image(relative))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&reject_mutex);
+    if (reject_queue_count == REJECT_QUEUE_MAX)
+    {
+        pthread_mutex_unlock(&reject_mutex);
+        _log_sub(LOG_SUBSYSTEM_FILTER, LOG_STATS, "%s: filter %d images behind, uploading it unfiltered.", relative, REJECT_QUEUE_MAX);
+        return;
+    }
+    Reject_entry *entry = &reject_queue[(reject_queue_head + reject_queue_count) % REJECT_QUEUE_MAX];
+    snprintf(entry->name, sizeof(entry->name), "%s", relative);
+    entry->state = REJECT_ENTRY_SCORING;
+    entry->start_us = usb_stats_now_us();
+    reject_queue_count++;
+
+    // uploads wait on the verdict, so scoring goes ahead of background work; never waits for room
+    if (!task_pool_submit(TASK_KIND_REJECT_SCORE, TASK_PRIORITY_HIGH, reject_score_task, entry))
+    {
+        reject_queue_count--;
+        pthread_mutex_unlock(&reject_mutex);
+        _log_sub(LOG_SUBSYSTEM_FILTER, LOG_STATS, "%s: task pool full, uploading it unfiltered.", relative);
+        return;
+    }
+    pthread_mutex_unlock(&reject_mutex);
+}
+
+// whether the filter has yet to decide on relative
+static int reject_waiting_locked(const char *relative)
+{
+    for (int i = 0; i < reject_queue_count; i++)
+    {
+        if (strcmp(reject_queue[(reject_queue_head + i) % REJECT_QUEUE_MAX].name, relative) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+* For the upload scan: 1 if relative should wait for a later pass (not analysed yet, or
+* held), with *rejected set if it goes to the back of the queue.
+*/
+int reject_hold_back(const char *relative, int *rejected)
+{
+    *rejected = 0;
+    REJECT_MODE mode = reject_mode();
+    if (mode == REJECT_MODE_OFF)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&reject_mutex);
+    int hold = reject_waiting_locked(relative);
+    Reject_verdict *verdict = !hold && reject_verdicts ? g_hash_table_lookup(reject_verdicts, relative) : NULL;
+    if (verdict && verdict->reason != REJECT_KEEP)
+    {
+        hold = mode == REJECT_MODE_HOLD;
+        *rejected = 1;
+    }
+    pthread_mutex_unlock(&reject_mutex);
+    return hold;
+}
+
+// lets held images upload: one by name, or all of them for NULL; returns how many
+int reject_release(const char *relative)
+{
+    int released = 0;
+    pthread_mutex_lock(&reject_mutex);
+    GHashTableIter iter;
+    gpointer key, value;
+    if (reject_verdicts)
+    {
+        g_hash_table_iter_init(&iter, reject_verdicts);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+        {
+            Reject_verdict *verdict = value;
+            if (verdict->reason != REJECT_KEEP && (!relative || strcmp(key, relative) == 0))
+            {
+                verdict->reason = REJECT_KEEP;
+                released++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&reject_mutex);
+
+    _log_sub(LOG_SUBSYSTEM_FILTER, LOG_STATS, "Released %d held image(s)%s%s.", released, relative ? " matching " : "", relative ? relative : "");
+    return released;
+}
+
+// drops the verdict on an image once it is uploaded; storage only evicts uploaded images, so the table stays as small as the backlog
+void reject_forget(const char *relative)
+{
+    pthread_mutex_lock(&reject_mutex);
+    if (reject_verdicts)
+    {
+        g_hash_table_remove(reject_verdicts, relative);
+    }
+    pthread_mutex_unlock(&reject_mutex);
+}
+
+// called once the task pool is running; does nothing while the filter is off
+void reject_start()
+{
+    if (reject_mode() == REJECT_MODE_OFF)
+    {
+        return;
+    }
+    _log_sub(LOG_SUBSYSTEM_FILTER, LOG_GENERAL, "Reject filter on (%s, %s kernels): sharpness below %.1f or within %d bits of a kept frame.",
+        REJECT_FILTER, REJECT_KERNELS, REJECT_SHARPNESS_MIN, REJECT_DUPLICATE_BITS);
+
+    pthread_mutex_lock(&reject_mutex);
+    reject_verdicts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    pthread_mutex_unlock(&reject_mutex);
+}
@@ -1,6 +1,7 @@
 typedef enum
 { 
     SCREEN_MAIN, 
+    SCREEN_GALLERY,
     SCREEN_NETWORK_CONFIG,
     SCREEN_CLEAR_IMPORTS_CONFIRMATION,
     SCREEN_CLEAR_IMPORTS_COMPLETE
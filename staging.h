@@ -0,0 +1,376 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+* Imports are written under LOCAL_DIR/.staging and renamed to their layout path only once
+* complete, so anything that scans the import folder (uploads, counts, gallery, eviction)
+* never sees a partial file. IMPORT_DURABILITY in config.json trades power-loss safety for
+* SD card write latency:
+*   "file"   fsync each image before its rename and its directory after
+*   "batch"  (default) hold up to IMPORT_SYNC_BATCH written images in staging, make them
+*            durable with one syncfs, then rename them all; an image is only visible once
+*            it is on disk, at the cost of a short delay before upload
+*   "none"   rename as soon as written and leave flushing to the kernel
+* Writes go through file_io.h, so the next image is fetched over USB while the card is
+* still writing the last. Batches are synced and renamed on a thread of their own, so the
+* syncfs never holds up file_io.h's completions or the writes queued behind it. Whatever
+* is left in staging after a crash is incomplete or unsynced and is removed at start up;
+* those images are fetched from the camera again.
+*/
+
+#define STAGING_DIR_NAME ".staging"
+#define STAGING_BATCH_MAX 64
+#define STAGING_INFLIGHT_MAX_BYTES (32 * 1024 * 1024) // images handed to file_io.h and not yet on the card
+
+typedef enum
+{
+    DURABILITY_NONE,
+    DURABILITY_BATCH,
+    DURABILITY_FILE
+} DURABILITY;
+
+// err is 0 once the image is written (and for "batch", queued for the next flush), otherwise an errno
+typedef void (*Staging_done)(void *owner, const char *final_path, int err);
+
+// called once the image is in place at final_path, for whatever needs to read it back
+typedef void (*Staging_published)(const char *final_path);
+
+typedef struct
+{
+    char staged[1024];
+    char final[1024];
+    Staging_published published; // may be NULL
+} Staged_import;
+
+typedef struct
+{
+    File_io_request request;
+    Staged_import paths;
+    DURABILITY durability;
+    Staging_done done;
+    void *owner;
+} Staged_write;
+
+Staged_import staged_imports[STAGING_BATCH_MAX];
+int staged_import_count = 0;
+unsigned long staging_sequence = 0;
+
+// the batch being synced and renamed, outside staging_mutex
+Staged_import staging_flushing_imports[STAGING_BATCH_MAX];
+int staging_flushing = 0;
+
+// writes in flight, so the worker can keep fetching from the camera while the card catches up
+pthread_mutex_t staging_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t staging_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t staging_flush_wake = PTHREAD_COND_INITIALIZER;
+int staging_writes_inflight = 0;
+unsigned long long staging_bytes_inflight = 0;
+unsigned long long staging_bytes_inflight_peak = 0;
+pthread_t staging_flusher;
+int staging_flusher_running = 0;
+int staging_flusher_stop = 0;
+
+DURABILITY staging_durability()
+{
+    if (strcmp(IMPORT_DURABILITY, "file") == 0)
+    {
+        return DURABILITY_FILE;
+    }
+    return strcmp(IMPORT_DURABILITY, "none") == 0 ? DURABILITY_NONE : DURABILITY_BATCH;
+}
+
+static int staging_sync_dir(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+static int staging_publish(const Staged_import *import)
+{
+    if (rename(import->staged, import->final) != 0)
+    {
+        _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Failed to move %s into place: %s", import->final, strerror(errno));
+        unlink(import->staged);
+        return -1;
+    }
+    atomic_fetch_add(&import_generation, 1);
+    if (import->published)
+    {
+        import->published(import->final);
+    }
+    return 0;
+}
+
+/*
+* Makes every batched image durable with one syncfs, then moves them all into place. Called
+* with staging_mutex held and no other flush running; the mutex is released while the card
+* syncs, so writes keep completing and a new batch fills meanwhile.
+*/
+static void staging_flush_locked()
+{
+    int count = staged_import_count;
+    if (count == 0)
+    {
+        return;
+    }
+    memcpy(staging_flushing_imports, staged_imports, count * sizeof(Staged_import));
+    staged_import_count = 0;
+    staging_flushing = 1;
+    pthread_mutex_unlock(&staging_mutex);
+
+    Trace_span span = trace_begin("staging flush", "camera");
+    int fd = open(LOCAL_DIR, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
+    {
+        syncfs(fd);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        staging_publish(&staging_flushing_imports[i]);
+    }
+
+    // and a second one for the renames themselves
+    if (fd >= 0)
+    {
+        syncfs(fd);
+        close(fd);
+    }
+    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Synced and published %d imported images.", count);
+    trace_end(span);
+
+    pthread_mutex_lock(&staging_mutex);
+    staging_flushing = 0;
+    pthread_cond_broadcast(&staging_cond);
+}
+
+static int staging_batch_full_locked()
+{
+    return staged_import_count >= IMPORT_SYNC_BATCH || staged_import_count >= STAGING_BATCH_MAX;
+}
+
+// flushes each batch as it fills, off file_io.h's completion thread
+static void *staging_flush_thread()
+{
+    trace_name_thread("staging");
+    pthread_mutex_lock(&staging_mutex);
+    while (!staging_flusher_stop)
+    {
+        if (!staging_flushing && staging_batch_full_locked())
+        {
+            staging_flush_locked();
+        }
+        else
+        {
+            pthread_cond_wait(&staging_flush_wake, &staging_mutex);
+        }
+    }
+    pthread_mutex_unlock(&staging_mutex);
+    return NULL;
+}
+
+// waits for every staging_write() and any flush under way to finish, then publishes the batch
+void staging_flush()
+{
+    pthread_mutex_lock(&staging_mutex);
+    while (staging_writes_inflight > 0 || staging_flushing)
+    {
+        pthread_cond_wait(&staging_cond, &staging_mutex);
+    }
+    staging_flush_locked();
+    pthread_mutex_unlock(&staging_mutex);
+}
+
+// runs on a file_io.h thread once the data, and for "file" the fsync, are done
+static void staging_finish(Staged_write *write, int err)
+{
+    Staged_import *paths = &write->paths;
+    if (err)
+    {
+        unlink(paths->staged);
+    }
+    else if (write->durability != DURABILITY_BATCH)
+    {
+        if (staging_publish(paths) != 0)
+        {
+            err = errno ? errno : EIO;
+        }
+        else if (write->durability == DURABILITY_FILE)
+        {
+            char dir[1024];
+            snprintf(dir, sizeof(dir), "%s", paths->final);
+            char *slash = strrchr(dir, '/');
+            if (slash)
+            {
+                *slash = '\0';
+                staging_sync_dir(dir);
+            }
+        }
+    }
+
+    if (!err && write->durability == DURABILITY_BATCH)
+    {
+        // staging_write() keeps writes and batched images within STAGING_BATCH_MAX, so there is room
+        pthread_mutex_lock(&staging_mutex);
+        staged_imports[staged_import_count++] = *paths;
+        if (staging_batch_full_locked())
+        {
+            pthread_cond_signal(&staging_flush_wake);
+        }
+        pthread_mutex_unlock(&staging_mutex);
+    }
+
+    // before the write stops counting, so staging_flush() returns with every callback run
+    write->done(write->owner, paths->final, err);
+
+    pthread_mutex_lock(&staging_mutex);
+    staging_writes_inflight--;
+    staging_bytes_inflight -= write->request.len;
+    pthread_cond_broadcast(&staging_cond);
+    pthread_mutex_unlock(&staging_mutex);
+    free(write);
+}
+
+static void staging_write_done(File_io_request *request, int result)
+{
+    Staged_write *write = request->ctx;
+    int err = result < 0 ? -result : 0;
+    if (!err && request->op == FILE_IO_WRITE && result != (int)request->len)
+    {
+        err = EIO;
+    }
+
+    if (!err && request->op == FILE_IO_WRITE && write->durability == DURABILITY_FILE)
+    {
+        request->op = FILE_IO_FSYNC;
+        file_io_submit(request);
+        return;
+    }
+
+    if (close(request->fd) != 0 && !err)
+    {
+        err = errno;
+    }
+    staging_finish(write, err);
+}
+
+/*
+* Writes data to staging and publishes it at final_path according to IMPORT_DURABILITY. The
+* write is asynchronous: data must stay valid until done(owner, ...) is called, which
+* happens exactly once, on another thread, or before this returns if the file cannot be
+* created. published(final_path), if given, follows on another thread once the file is
+* in place, which for "batch" is after done. Blocks while STAGING_INFLIGHT_MAX_BYTES are
+* already queued, or while the batch awaiting its flush is full.
+*/
+void staging_write(const char *final_path, const char *data, unsigned long size, Staging_done done, void *owner, Staging_published published)
+{
+    Staged_write *write = calloc(1, sizeof(Staged_write));
+    if (!write)
+    {
+        done(owner, final_path, ENOMEM);
+        return;
+    }
+    write->durability = staging_durability();
+    write->done = done;
+    write->owner = owner;
+
+    const char *base = strrchr(final_path, '/');
+    snprintf(write->paths.staged, sizeof(write->paths.staged), "%s/%s/%lu-%s", LOCAL_DIR, STAGING_DIR_NAME, staging_sequence++, base ? base + 1 : final_path);
+    snprintf(write->paths.final, sizeof(write->paths.final), "%s", final_path);
+    write->paths.published = published;
+
+    int fd = open(write->paths.staged, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        int err = errno;
+        free(write);
+        done(owner, final_path, err);
+        return;
+    }
+
+    pthread_mutex_lock(&staging_mutex);
+    while ((staging_writes_inflight > 0 && staging_bytes_inflight + size > STAGING_INFLIGHT_MAX_BYTES) ||
+        staging_writes_inflight + staged_import_count >= STAGING_BATCH_MAX)
+    {
+        pthread_cond_wait(&staging_cond, &staging_mutex);
+    }
+    staging_writes_inflight++;
+    staging_bytes_inflight += size;
+    if (staging_bytes_inflight > staging_bytes_inflight_peak)
+    {
+        staging_bytes_inflight_peak = staging_bytes_inflight;
+    }
+    pthread_mutex_unlock(&staging_mutex);
+
+    write->request.op = FILE_IO_WRITE;
+    write->request.fd = fd;
+    write->request.buf = (char *)data;
+    write->request.len = size;
+    write->request.done = staging_write_done;
+    write->request.ctx = write;
+    file_io_submit(&write->request);
+}
+
+// at start up: creates the staging directory, drops anything a previous run left in it and starts the flush thread
+void staging_init()
+{
+    if (!staging_flusher_running)
+    {
+        staging_flusher_running = pthread_create(&staging_flusher, NULL, staging_flush_thread, NULL) == 0;
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", LOCAL_DIR, STAGING_DIR_NAME);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+    {
+        _log(LOG_ERROR, "Could not create staging directory %s: %s", path, strerror(errno));
+        return;
+    }
+
+    DIR *d = opendir(path);
+    if (!d)
+    {
+        return;
+    }
+
+    int removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (entry->d_type == DT_REG)
+        {
+            char file[2048];
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            removed += unlink(file) == 0;
+        }
+    }
+    closedir(d);
+
+    if (removed)
+    {
+        _log(LOG_GENERAL, "Removed %d incomplete imports left in staging.", removed);
+    }
+}
+
+// at shutdown, after the last staging_flush()
+void staging_stop()
+{
+    if (!staging_flusher_running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&staging_mutex);
+    staging_flusher_stop = 1;
+    pthread_cond_signal(&staging_flush_wake);
+    pthread_mutex_unlock(&staging_mutex);
+    pthread_join(staging_flusher, NULL);
+    staging_flusher_running = 0;
+}
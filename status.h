@@ -0,0 +1,142 @@
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+* State shared between the worker, the network threads and whatever presents it: the SDL
+* UI, the status file in headless mode and the metrics exporter.
+*
+* Each writer keeps its own working values and publishes them into one Status_snapshot
+* under a sequence lock. Readers copy the record without taking a lock and retry if a
+* writer was part way through, so the UI never draws a half-written camera name or an
+* internet flag from a different moment than the counts beside it. Writers (the worker
+* and the probe thread) take a mutex between themselves; readers never do.
+*/
+
+// working values of the threads that own them; other threads read them through status_read()
+volatile int link_strength_value = 0;
+volatile int internet_up = 0;
+volatile int camera_found = 0;
+
+typedef enum
+{
+    CAMERA_STATUS_NO_CAMERA,
+    CAMERA_STATUS_WAITING,
+    CAMERA_STATUS_IMPORTING,
+    CAMERA_STATUS_UPLOADING,
+    CAMERA_STATUS_IMPORT_ONLY,
+    CAMERA_STATUS_STORAGE_FULL,
+    CAMERA_STATUS_PAUSED
+} Camera_status;
+
+const char *camera_status_names[] = {"no_camera", "waiting", "importing", "uploading", "import_only", "storage_full", "paused"};
+
+typedef struct
+{
+    int imported;
+    int uploaded;
+    Camera_status status;
+    char camera_name[256];
+    char camera_serial_number[32];
+} Program_status;
+
+typedef struct
+{
+    Program_status program;
+    int camera_found;
+    int internet_up;
+    int link_strength;
+} Status_snapshot;
+
+atomic_uint status_sequence; // odd while a writer is updating status_published
+Status_snapshot status_published;
+pthread_mutex_t status_publish_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void status_publish_begin()
+{
+    pthread_mutex_lock(&status_publish_mutex);
+    unsigned sequence = atomic_load_explicit(&status_sequence, memory_order_relaxed);
+    atomic_store_explicit(&status_sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void status_publish_end()
+{
+    unsigned sequence = atomic_load_explicit(&status_sequence, memory_order_relaxed);
+    atomic_store_explicit(&status_sequence, sequence + 1, memory_order_release);
+    pthread_mutex_unlock(&status_publish_mutex);
+}
+
+// called by the worker with its own copy of the program status
+void status_publish_program(const Program_status *program_status, int camera)
+{
+    status_publish_begin();
+    status_published.program = *program_status;
+    status_published.camera_found = camera;
+    status_publish_end();
+}
+
+void status_publish_network(int up, int strength)
+{
+    status_publish_begin();
+    status_published.internet_up = up;
+    status_published.link_strength = strength;
+    status_publish_end();
+}
+
+void status_read(Status_snapshot *out)
+{
+    unsigned before, after = 0;
+    do
+    {
+        before = atomic_load_explicit(&status_sequence, memory_order_acquire);
+        if (before & 1)
+        {
+            continue;
+        }
+        memcpy(out, &status_published, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&status_sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+int get_link_strength()
+{
+    if (!internet_up)
+    {
+        return 0;
+    }
+
+    FILE *f = fopen("/proc/net/wireless", "r");
+    if (!f)
+    {
+        return 0;
+    }
+
+    char line[256];
+    fgets(line, sizeof(line), f);
+    fgets(line, sizeof(line), f);
+    fgets(line, sizeof(line), f);
+
+    char iface[16];
+    float status, link, level, noise;
+    if (sscanf(line, " %15[^:]: %f %f %f %f %f %f", iface, &status, &link, &level, &noise, &noise, &noise) < 4)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    fclose(f);
+    int strength = (int)(link * 100 / 70);
+
+    if (strength > 100)
+    {
+        strength = 100;
+    }
+
+    if (strength < 0)
+    {
+        strength = 0;
+    }
+
+    return strength;
+}
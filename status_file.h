@@ -0,0 +1,144 @@
+/*
+* Headless mode: no window, the main thread instead keeps STATUS_FILE current for other
+* tools to read and logs each change of camera or connectivity state. The file is
+* replaced atomically (written to a temporary file, then renamed over the old one) so a
+* reader never sees a partial document. It is rewritten whenever displayed state changes
+* and at least every STATUS_FILE_INTERVAL_S, so its updated_at also shows the process is alive.
+*/
+
+#define STATUS_FILE_INTERVAL_S 5
+
+time_t status_started_at = 0;
+
+int status_file_write(const Status_snapshot *status)
+{
+    const Program_status *program_status = &status->program;
+    Net_probe_stats probe;
+    net_probe_get(&probe);
+
+    struct json_object *root = json_object_new_object();
+    json_object_object_add(root, "updated_at", json_object_new_int64(time(NULL)));
+    json_object_object_add(root, "uptime_s", json_object_new_int64(time(NULL) - status_started_at));
+    json_object_object_add(root, "pid", json_object_new_int(getpid()));
+
+    struct json_object *camera = json_object_new_object();
+    json_object_object_add(camera, "status", json_object_new_string(camera_status_names[program_status->status]));
+    json_object_object_add(camera, "connected", json_object_new_boolean(status->camera_found > 0));
+    json_object_object_add(camera, "name", json_object_new_string(program_status->camera_name));
+    json_object_object_add(camera, "serial_number", json_object_new_string(program_status->camera_serial_number));
+    json_object_object_add(root, "camera", camera);
+
+    struct json_object *images = json_object_new_object();
+    json_object_object_add(images, "imported", json_object_new_int(program_status->imported));
+    json_object_object_add(images, "uploaded", json_object_new_int(program_status->uploaded));
+    json_object_object_add(images, "backlog", json_object_new_int64(atomic_load(&upload_backlog_images)));
+    json_object_object_add(images, "backlog_bytes", json_object_new_int64(atomic_load(&upload_backlog_bytes)));
+    json_object_object_add(root, "images", images);
+
+    Upload_snapshot upload;
+    upload_progress_snapshot(&upload);
+    struct json_object *uploading = json_object_new_object();
+    json_object_object_add(uploading, "file", upload.active ? json_object_new_string(upload.file) : NULL);
+    json_object_object_add(uploading, "file_percent", json_object_new_int(upload.active ? upload.file_percent : 0));
+    json_object_object_add(uploading, "transfers", json_object_new_int(upload.active));
+    json_object_object_add(uploading, "rate_bytes_per_second", json_object_new_double(upload.rate_bps));
+    json_object_object_add(uploading, "eta_s", upload.eta_s >= 0 && upload.backlog_bytes > 0 ? json_object_new_int64(upload.eta_s) : NULL);
+    json_object_object_add(root, "upload", uploading);
+
+    struct json_object *storage = json_object_new_object();
+    json_object_object_add(storage, "free_bytes", json_object_new_int64(atomic_load(&storage_free_bytes)));
+    json_object_object_add(storage, "total_bytes", json_object_new_int64(atomic_load(&storage_total_bytes)));
+    json_object_object_add(storage, "imports_paused", json_object_new_boolean(atomic_load(&storage_imports_paused)));
+    json_object_object_add(storage, "evicted_images", json_object_new_int64(atomic_load(&storage_evicted_images)));
+    json_object_object_add(root, "storage", storage);
+
+    struct json_object *network = json_object_new_object();
+    json_object_object_add(network, "internet_up", json_object_new_boolean(status->internet_up));
+    json_object_object_add(network, "link_strength", json_object_new_int(status->link_strength));
+    json_object_object_add(network, "probe_rtt_ms", json_object_new_double(probe.srtt_ms));
+    json_object_object_add(network, "probe_loss", json_object_new_double(probe.loss));
+    json_object_object_add(root, "network", network);
+
+    Destination snapshot[DESTINATIONS_MAX];
+    int count = destination_snapshot(snapshot);
+    struct json_object *destinations_json = json_object_new_array();
+    for (int i = 0; i < count; i++)
+    {
+        const Destination *d = &snapshot[i];
+        struct json_object *destination = json_object_new_object();
+        json_object_object_add(destination, "name", json_object_new_string(d->name));
+        json_object_object_add(destination, "role", json_object_new_string(destination_role_names[d->role]));
+        json_object_object_add(destination, "healthy", json_object_new_boolean(destination_healthy_locked(d, time(NULL))));
+        json_object_object_add(destination, "rtt_ms", json_object_new_double(d->rtt_ms));
+        json_object_object_add(destination, "rate_bytes_per_second", json_object_new_double(d->rate_bps));
+        json_object_object_add(destination, "error_rate", json_object_new_double(d->error_rate));
+        json_object_object_add(destination, "uploads", json_object_new_int64(d->uploads));
+        json_object_object_add(destination, "failures", json_object_new_int64(d->failures));
+        json_object_array_add(destinations_json, destination);
+    }
+    json_object_object_add(root, "destinations", destinations_json);
+
+    struct json_object *failures = json_object_new_object();
+    for (int i = 0; i < FAILURE_CAUSE_COUNT; i++)
+    {
+        json_object_object_add(failures, failure_cause_names[i], json_object_new_int64(atomic_load(&metrics_failures[i])));
+    }
+    json_object_object_add(root, "failures", failures);
+
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", STATUS_FILE);
+
+    int ok = 0;
+    FILE *f = fopen(tmp_path, "w");
+    if (f)
+    {
+        ok = fprintf(f, "%s\n", json_object_to_json_string_ext(root, JSON_C_TO_STRING_PRETTY)) > 0;
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmp_path, STATUS_FILE) == 0;
+    }
+    json_object_put(root);
+
+    if (!ok)
+    {
+        unlink(tmp_path);
+    }
+    return ok;
+}
+
+void run_headless()
+{
+    status_started_at = time(NULL);
+    _log(LOG_GENERAL, "Running headless, status written to %s.", STATUS_FILE);
+
+    int last_status = -1;
+    int last_camera_found = -2;
+    int last_internet_up = -1;
+    int write_failed = 0;
+    unsigned long seen_version = 0;
+
+    while (!stop_requested)
+    {
+        Status_snapshot status;
+        status_read(&status);
+
+        if ((int)status.program.status != last_status || status.camera_found != last_camera_found || status.internet_up != last_internet_up)
+        {
+            last_status = status.program.status;
+            last_camera_found = status.camera_found;
+            last_internet_up = status.internet_up;
+            _log(LOG_STATS, "Status: %s, camera %s, %d imported, %d uploaded, internet %s.", camera_status_names[status.program.status],
+                status.camera_found > 0 ? "connected" : (status.camera_found < 0 ? "not communicating" : "not detected"),
+                status.program.imported, status.program.uploaded, status.internet_up ? "up" : "down");
+        }
+
+        // report a failing status file once, not every interval
+        int ok = status_file_write(&status);
+        if (!ok && !write_failed)
+        {
+            _log(LOG_ERROR, "Could not write status file %s.", STATUS_FILE);
+        }
+        write_failed = !ok;
+
+        ui_wait_for_state_change(&seen_version, STATUS_FILE_INTERVAL_S);
+    }
+}
@@ -0,0 +1,246 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include <glib.h>
+
+/*
+* Keeps the import folder's filesystem from filling up on multi-day events. Once used
+* space reaches STORAGE_HIGH_WATERMARK percent, a background thread deletes images that
+* are already on the server, oldest first, in small batches until usage is back down to
+* STORAGE_LOW_WATERMARK. Images not yet uploaded are never deleted. If only those remain
+* and the disk is still above the high watermark, or free space falls below
+* STORAGE_RESERVE_MB, imports pause until uploads make room to evict.
+*/
+
+#define STORAGE_CHECK_INTERVAL_S 10
+#define STORAGE_EVICT_BATCH 16
+#define STORAGE_EVICT_PAUSE_US 50000 // between batches, so eviction never hogs the SD card
+
+pthread_mutex_t storage_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t storage_wake = PTHREAD_COND_INITIALIZER;
+int storage_check_requested = 0;
+
+atomic_ullong storage_free_bytes;
+atomic_ullong storage_total_bytes;
+atomic_ullong storage_evicted_images;
+atomic_ullong storage_evicted_bytes;
+atomic_int storage_imports_paused;
+
+typedef struct
+{
+    char name[256];
+    time_t mtime;
+    long long size;
+} Storage_candidate;
+
+extern pthread_mutex_t track_file_mutex; // ftp.h
+
+// refreshes the free space gauges and returns the used percentage, or -1 if the filesystem cannot be read
+int storage_update()
+{
+    struct statvfs fs;
+    if (statvfs(LOCAL_DIR, &fs) != 0 || fs.f_blocks == 0)
+    {
+        return -1;
+    }
+
+    unsigned long long total = (unsigned long long)fs.f_blocks * fs.f_frsize;
+    unsigned long long available = (unsigned long long)fs.f_bavail * fs.f_frsize;
+    atomic_store(&storage_total_bytes, total);
+    atomic_store(&storage_free_bytes, available);
+
+    // matches df: reserved root blocks count as neither used nor available
+    unsigned long long used = (unsigned long long)(fs.f_blocks - fs.f_bfree) * fs.f_frsize;
+    return (int)(used * 100 / (used + available));
+}
+
+static int storage_below_reserve()
+{
+    return atomic_load(&storage_free_bytes) < (unsigned long long)STORAGE_RESERVE_MB * 1024 * 1024;
+}
+
+void storage_request_check()
+{
+    pthread_mutex_lock(&storage_mutex);
+    storage_check_requested = 1;
+    pthread_cond_signal(&storage_wake);
+    pthread_mutex_unlock(&storage_mutex);
+}
+
+// wakes the storage thread to see stop_requested instead of finishing its timed wait
+void storage_stop()
+{
+    pthread_mutex_lock(&storage_mutex);
+    stop_requested = 1;
+    pthread_cond_broadcast(&storage_wake);
+    pthread_mutex_unlock(&storage_mutex);
+}
+
+// called by the worker before each import; cheap enough to run per file
+int storage_import_allowed()
+{
+    int used_percent = storage_update();
+    if (used_percent < 0)
+    {
+        return 1; // let the save itself report the problem
+    }
+    if (used_percent >= STORAGE_HIGH_WATERMARK || storage_below_reserve())
+    {
+        storage_request_check();
+        return 0;
+    }
+    return !atomic_load(&storage_imports_paused);
+}
+
+static GHashTable *storage_load_uploaded()
+{
+    GHashTable *uploaded = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    pthread_mutex_lock(&track_file_mutex);
+    FILE *f = fopen(TRACK_FILE, "r");
+    if (f)
+    {
+        char line[512];
+        while (fgets(line, sizeof(line), f))
+        {
+            line[strcspn(line, "\n")] = 0;
+            if (line[0])
+            {
+                g_hash_table_add(uploaded, g_strdup(line));
+            }
+        }
+        fclose(f);
+    }
+    pthread_mutex_unlock(&track_file_mutex);
+    return uploaded;
+}
+
+static int storage_candidate_compare(const void *a, const void *b)
+{
+    time_t ta = ((const Storage_candidate *)a)->mtime;
+    time_t tb = ((const Storage_candidate *)b)->mtime;
+    return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+typedef struct
+{
+    GHashTable *uploaded;
+    Storage_candidate *candidates;
+    int count;
+    int capacity;
+} Storage_scan;
+
+static void storage_visit(const char *relative, const char *path, int is_dir, void *ctx)
+{
+    Storage_scan *scan = ctx;
+    struct stat st;
+    if (is_dir || !g_hash_table_contains(scan->uploaded, relative) || strlen(relative) >= sizeof(scan->candidates[0].name) || stat(path, &st) != 0)
+    {
+        return;
+    }
+
+    if (scan->count == scan->capacity)
+    {
+        int capacity = scan->capacity ? scan->capacity * 2 : 64;
+        Storage_candidate *grown = realloc(scan->candidates, capacity * sizeof(Storage_candidate));
+        if (!grown)
+        {
+            return;
+        }
+        scan->candidates = grown;
+        scan->capacity = capacity;
+    }
+
+    Storage_candidate *candidate = &scan->candidates[scan->count++];
+    strcpy(candidate->name, relative);
+    candidate->mtime = st.st_mtime;
+    candidate->size = st.st_size;
+}
+
+// lists uploaded images oldest first; returns the count, with *out owned by the caller
+static int storage_list_evictable(Storage_candidate **out)
+{
+    Storage_scan scan = {storage_load_uploaded(), NULL, 0, 0};
+    import_walk(storage_visit, &scan);
+    g_hash_table_destroy(scan.uploaded);
+
+    qsort(scan.candidates, scan.count, sizeof(Storage_candidate), storage_candidate_compare);
+    *out = scan.candidates;
+    return scan.count;
+}
+
+static void storage_set_paused(int paused)
+{
+    if (atomic_exchange(&storage_imports_paused, paused) != paused)
+    {
+        _log(paused ? LOG_ERROR : LOG_GENERAL, "%s", paused ? "Storage full of images not yet uploaded, imports paused." : "Storage space available, imports resumed.");
+        ui_request_redraw();
+    }
+}
+
+static void storage_evict()
+{
+    Storage_candidate *candidates;
+    int count = storage_list_evictable(&candidates);
+    int evicted = 0;
+    long long evicted_bytes = 0;
+    int used_percent = storage_update();
+
+    for (int i = 0; i < count && (used_percent > STORAGE_LOW_WATERMARK || storage_below_reserve()) && !stop_requested; i++)
+    {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", LOCAL_DIR, candidates[i].name);
+        if (unlink(path) == 0)
+        {
+            evicted++;
+            evicted_bytes += candidates[i].size;
+            atomic_fetch_add(&storage_evicted_images, 1);
+            atomic_fetch_add(&storage_evicted_bytes, candidates[i].size);
+        }
+
+        if ((i + 1) % STORAGE_EVICT_BATCH == 0)
+        {
+            used_percent = storage_update();
+            usleep(STORAGE_EVICT_PAUSE_US);
+        }
+    }
+    free(candidates);
+
+    used_percent = storage_update();
+    if (evicted)
+    {
+        atomic_fetch_add(&import_generation, 1);
+        _log(LOG_GENERAL, "Evicted %d uploaded images (%lld bytes), storage now %d%% used.", evicted, evicted_bytes, used_percent);
+        ui_request_redraw();
+    }
+}
+
+void *storage_thread()
+{
+    trace_name_thread("storage");
+
+    while (!stop_requested)
+    {
+        int used_percent = storage_update();
+        if (used_percent >= STORAGE_HIGH_WATERMARK || (used_percent >= 0 && storage_below_reserve()))
+        {
+            Trace_span span = trace_begin("evict", "storage");
+            storage_evict();
+            trace_end(span);
+            used_percent = storage_update();
+        }
+
+        // whatever is still over the limits after eviction is images waiting to upload
+        storage_set_paused(used_percent >= STORAGE_HIGH_WATERMARK || (used_percent >= 0 && storage_below_reserve()));
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += STORAGE_CHECK_INTERVAL_S;
+
+        pthread_mutex_lock(&storage_mutex);
+        while (!storage_check_requested && !stop_requested && pthread_cond_timedwait(&storage_wake, &storage_mutex, &deadline) == 0);
+        storage_check_requested = 0;
+        pthread_mutex_unlock(&storage_mutex);
+    }
+    return NULL;
+}
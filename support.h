@@ -13,42 +13,52 @@ void clear_track_file()
     {
         fclose(f);
     }
+
+    // and each destination's own ledger, or mirrors would skip new images reusing a name
+    for (int i = 0; i < destination_count; i++)
+    {
+        f = fopen(destinations[i].track_file, "w");
+        if (f)
+        {
+            fclose(f);
+        }
+    }
 }
 
+// the first signal lets running transfers finish and threads wind down, a second one exits at once
 void handle_sigint(int sig)
 {
+    if (stop_requested)
+    {
+        _exit(1);
+    }
     _log(LOG_GENERAL, "Logging signal interrupt: %i", sig);
     stop_requested = 1;
-    exit(1); // kill the progam.
 }
 
-void delete_images_in_import_folder()
+static void delete_import_entry(const char *relative, const char *path, int is_dir, void *ctx)
 {
-    DIR *dir = opendir(LOCAL_DIR);
-    if (!dir)
+    (void)relative;
+    (void)ctx;
+    if (is_dir)
     {
+        rmdir(path); // only succeeds once the layout directory is empty
         return;
     }
 
-    struct dirent *entry;
-    char path[1024];
-
-    while ((entry = readdir(dir)) != NULL)
+    // everything the counts and the upload scan can see (layout.h), RAW files whether or not UPLOAD_RAW is set now
+    const char *ext = strrchr(path, '.');
+    if (import_is_image(path) || import_is_raw(path) || (ext && (strcasecmp(ext, ".png") == 0 ||
+                strcasecmp(ext, ".bmp") == 0 || strcasecmp(ext, ".gif") == 0)))
     {
-        if (entry->d_type == DT_REG)
-        {
-            const char *ext = strrchr(entry->d_name, '.');
-            if (ext && (strcasecmp(ext, ".png") == 0 || strcasecmp(ext, ".jpg") == 0 || 
-                        strcasecmp(ext, ".jpeg") == 0 || strcasecmp(ext, ".bmp") == 0 || 
-                        strcasecmp(ext, ".gif") == 0))
-            {
-                snprintf(path, sizeof(path), "%s/%s", LOCAL_DIR, entry->d_name);
-                unlink(path);
-            }
-        }
+        unlink(path);
     }
+}
 
-    closedir(dir);
+void delete_images_in_import_folder()
+{
+    import_walk(delete_import_entry, NULL);
+    atomic_fetch_add(&import_generation, 1);
 }
 
 char *get_import_directory() 
@@ -93,18 +103,203 @@ void load_config()
     struct json_object *parsed_json = json_tokener_parse(data);
     free(data);
 
-    struct json_object *j_ftp_url, *j_ftp_userpwd;
+    struct json_object *j_ftp_url, *j_ftp_userpwd, *j_probe_icmp_fallback, *j_log_levels, *j_log_max_bytes, *j_metrics_address, *j_status_file, *j_layout;
+    struct json_object *j_import_durability, *j_import_sync_batch;
+    struct json_object *j_storage_high_watermark, *j_storage_low_watermark, *j_storage_reserve_mb;
+    struct json_object *j_control_socket, *j_upload_concurrency, *j_upload_rate_limit, *j_destinations;
+    struct json_object *j_reject_filter, *j_reject_sharpness_min, *j_reject_duplicate_bits;
+    struct json_object *j_upload_raw, *j_upload_compression;
+
+    // optional when DESTINATIONS is given
+    int has_ftp_url = json_object_object_get_ex(parsed_json, "FTP_URL", &j_ftp_url);
+    int has_ftp_userpwd = json_object_object_get_ex(parsed_json, "FTP_USERPWD", &j_ftp_userpwd);
+
+    // optional settings keep their defaults when absent
+    if (json_object_object_get_ex(parsed_json, "PROBE_ICMP_FALLBACK", &j_probe_icmp_fallback))
+    {
+        PROBE_ICMP_FALLBACK = json_object_get_boolean(j_probe_icmp_fallback);
+    }
+
+    // per subsystem overrides of --log-all, e.g. "LOG_LEVELS": {"camera": "all", "network": "error"}
+    if (json_object_object_get_ex(parsed_json, "LOG_LEVELS", &j_log_levels))
+    {
+        for (int i = 0; i < LOG_SUBSYSTEM_COUNT; i++)
+        {
+            struct json_object *j_level;
+            if (json_object_object_get_ex(j_log_levels, log_subsystem_names[i], &j_level))
+            {
+                log_level_override[i] = strcmp(json_object_get_string(j_level), "all") == 0 ? LOGGIN_ALL : LOGGIN_ERROR_ONLY;
+            }
+        }
+    }
+
+    if (json_object_object_get_ex(parsed_json, "LOG_MAX_BYTES", &j_log_max_bytes))
+    {
+        LOG_MAX_BYTES = json_object_get_int(j_log_max_bytes);
+    }
+
+    if (json_object_object_get_ex(parsed_json, "METRICS_ADDRESS", &j_metrics_address))
+    {
+        METRICS_ADDRESS = strdup(json_object_get_string(j_metrics_address));
+    }
+
+    if (json_object_object_get_ex(parsed_json, "STATUS_FILE", &j_status_file))
+    {
+        STATUS_FILE = strdup(json_object_get_string(j_status_file));
+    }
+
+    if (json_object_object_get_ex(parsed_json, "LAYOUT", &j_layout))
+    {
+        const char *layout = json_object_get_string(j_layout);
+        if (layout && layout_valid(layout))
+        {
+            LAYOUT = strdup(layout);
+        }
+        else
+        {
+            _log(LOG_ERROR, "LAYOUT must contain {name} and stay inside the import folder, using %s.", LAYOUT);
+        }
+    }
+
+    if (json_object_object_get_ex(parsed_json, "IMPORT_DURABILITY", &j_import_durability))
+    {
+        const char *durability = json_object_get_string(j_import_durability);
+        if (strcmp(durability, "file") == 0 || strcmp(durability, "batch") == 0 || strcmp(durability, "none") == 0)
+        {
+            IMPORT_DURABILITY = strdup(durability);
+        }
+        else
+        {
+            _log(LOG_ERROR, "IMPORT_DURABILITY must be \"file\", \"batch\" or \"none\", not \"%s\"; using %s.", durability, IMPORT_DURABILITY);
+        }
+    }
 
-    json_object_object_get_ex(parsed_json, "FTP_URL", &j_ftp_url);
-    json_object_object_get_ex(parsed_json, "FTP_USERPWD", &j_ftp_userpwd);
+    if (json_object_object_get_ex(parsed_json, "IMPORT_SYNC_BATCH", &j_import_sync_batch))
+    {
+        IMPORT_SYNC_BATCH = json_object_get_int(j_import_sync_batch);
+        IMPORT_SYNC_BATCH = IMPORT_SYNC_BATCH < 1 ? 1 : IMPORT_SYNC_BATCH;
+    }
+
+    if (json_object_object_get_ex(parsed_json, "STORAGE_HIGH_WATERMARK", &j_storage_high_watermark))
+    {
+        STORAGE_HIGH_WATERMARK = json_object_get_int(j_storage_high_watermark);
+    }
+
+    if (json_object_object_get_ex(parsed_json, "STORAGE_LOW_WATERMARK", &j_storage_low_watermark))
+    {
+        STORAGE_LOW_WATERMARK = json_object_get_int(j_storage_low_watermark);
+    }
+
+    if (json_object_object_get_ex(parsed_json, "STORAGE_RESERVE_MB", &j_storage_reserve_mb))
+    {
+        STORAGE_RESERVE_MB = json_object_get_int(j_storage_reserve_mb);
+    }
+
+    if (json_object_object_get_ex(parsed_json, "CONTROL_SOCKET", &j_control_socket))
+    {
+        CONTROL_SOCKET = strdup(json_object_get_string(j_control_socket));
+    }
+
+    if (json_object_object_get_ex(parsed_json, "UPLOAD_CONCURRENCY", &j_upload_concurrency))
+    {
+        UPLOAD_CONCURRENCY = json_object_get_int(j_upload_concurrency);
+    }
+
+    if (json_object_object_get_ex(parsed_json, "UPLOAD_RATE_LIMIT_KB_S", &j_upload_rate_limit))
+    {
+        UPLOAD_RATE_LIMIT_KB_S = json_object_get_int(j_upload_rate_limit);
+    }
+
+    if (json_object_object_get_ex(parsed_json, "REJECT_FILTER", &j_reject_filter))
+    {
+        const char *filter = json_object_get_string(j_reject_filter);
+        if (strcmp(filter, "off") == 0 || strcmp(filter, "defer") == 0 || strcmp(filter, "hold") == 0)
+        {
+            REJECT_FILTER = strdup(filter);
+        }
+        else
+        {
+            _log(LOG_ERROR, "REJECT_FILTER must be \"off\", \"defer\" or \"hold\", not \"%s\"; using %s.", filter, REJECT_FILTER);
+        }
+    }
+
+    if (json_object_object_get_ex(parsed_json, "REJECT_SHARPNESS_MIN", &j_reject_sharpness_min))
+    {
+        REJECT_SHARPNESS_MIN = json_object_get_double(j_reject_sharpness_min);
+    }
+
+    if (json_object_object_get_ex(parsed_json, "REJECT_DUPLICATE_BITS", &j_reject_duplicate_bits))
+    {
+        REJECT_DUPLICATE_BITS = json_object_get_int(j_reject_duplicate_bits);
+    }
+
+    if (json_object_object_get_ex(parsed_json, "UPLOAD_RAW", &j_upload_raw))
+    {
+        UPLOAD_RAW = json_object_get_boolean(j_upload_raw);
+    }
+
+    if (json_object_object_get_ex(parsed_json, "UPLOAD_COMPRESSION", &j_upload_compression))
+    {
+        const char *compression = json_object_get_string(j_upload_compression);
+        if (strcmp(compression, "off") == 0 || strcmp(compression, "auto") == 0)
+        {
+            UPLOAD_COMPRESSION = strdup(compression);
+        }
+        else
+        {
+            _log(LOG_ERROR, "UPLOAD_COMPRESSION must be \"off\" or \"auto\", not \"%s\"; using %s.", compression, UPLOAD_COMPRESSION);
+        }
+    }
+
+    if (STORAGE_LOW_WATERMARK >= STORAGE_HIGH_WATERMARK)
+    {
+        _log(LOG_ERROR, "STORAGE_LOW_WATERMARK must be below STORAGE_HIGH_WATERMARK, using %d.", STORAGE_HIGH_WATERMARK - 10);
+        STORAGE_LOW_WATERMARK = STORAGE_HIGH_WATERMARK - 10;
+    }
 
     LOCAL_DIR = get_import_directory();
 
     char *track_buf = malloc(strlen(LOCAL_DIR) + strlen(".uploaded") + 1);
     sprintf(track_buf, "%s.uploaded", LOCAL_DIR);
 
-    FTP_URL = strdup(json_object_get_string(j_ftp_url));
-    FTP_USERPWD = strdup(json_object_get_string(j_ftp_userpwd));
+    FTP_URL = has_ftp_url ? strdup(json_object_get_string(j_ftp_url)) : NULL;
+    FTP_USERPWD = has_ftp_userpwd ? strdup(json_object_get_string(j_ftp_userpwd)) : NULL;
+
+    // e.g. "DESTINATIONS": [{"name": "venue", "url": "ftp://...", "userpwd": "user:pass", "role": "primary"}]
+    int legacy_destination = !json_object_object_get_ex(parsed_json, "DESTINATIONS", &j_destinations);
+    if (legacy_destination)
+    {
+        if (FTP_URL)
+        {
+            destination_add("default", FTP_URL, FTP_USERPWD, "primary");
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < json_object_array_length(j_destinations); i++)
+        {
+            struct json_object *j_destination = json_object_array_get_idx(j_destinations, i);
+            struct json_object *j_name = NULL, *j_url = NULL, *j_userpwd = NULL, *j_role = NULL;
+            json_object_object_get_ex(j_destination, "name", &j_name);
+            json_object_object_get_ex(j_destination, "url", &j_url);
+            json_object_object_get_ex(j_destination, "userpwd", &j_userpwd);
+            json_object_object_get_ex(j_destination, "role", &j_role);
+            destination_add(j_name ? json_object_get_string(j_name) : NULL, j_url ? json_object_get_string(j_url) : NULL,
+                j_userpwd ? json_object_get_string(j_userpwd) : NULL, j_role ? json_object_get_string(j_role) : NULL);
+        }
+    }
+
+    int deliverable = 0;
+    for (int i = 0; i < destination_count; i++)
+    {
+        deliverable |= destinations[i].role != DESTINATION_MIRROR;
+    }
+    if (!deliverable)
+    {
+        _log(LOG_ERROR, "Configuration has no FTP_URL or primary/fallback destination.");
+        exit(1);
+    }
+    destination_init_ledgers(legacy_destination);
 
     json_object_put(parsed_json);
 }
\ No newline at end of file
@@ -0,0 +1,250 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+* A shared pool for CPU bound work (the reject filter's scoring, gallery thumbnails) so it
+* spreads over every core instead of queueing behind one thread each. There is a worker
+* per online core, up to TASK_POOL_WORKERS_MAX, each with a bounded queue per priority. A
+* worker takes the oldest task of the highest priority it can find, from its own queue
+* first and otherwise stolen from another's, so an idle core never waits while work is
+* queued elsewhere and background work only runs when nothing more urgent is waiting.
+*
+* Queues hold TASK_POOL_QUEUE_MAX tasks per worker and priority. A full pool refuses a
+* task rather than block the producer, which is the backpressure: the reject filter then
+* passes the image unfiltered and the gallery keeps the thumbnail wanted for later. Time
+* spent queued and running is recorded per kind of task, for the metrics endpoint and for
+* the log on SIGUSR1. bench/bench_task_pool.c checks refusal, stealing and priority order.
+*/
+
+#define TASK_POOL_WORKERS_MAX 8
+#define TASK_POOL_QUEUE_MAX 32
+
+typedef enum
+{
+    TASK_PRIORITY_HIGH, // holds up uploads
+    TASK_PRIORITY_BACKGROUND, // only for the screen
+    TASK_PRIORITY_COUNT
+} TASK_PRIORITY;
+
+typedef enum
+{
+    TASK_KIND_REJECT_SCORE,
+    TASK_KIND_THUMBNAIL,
+    TASK_KIND_COUNT
+} TASK_KIND;
+
+const char *task_kind_names[TASK_KIND_COUNT] = {"reject_score", "thumbnail"};
+
+typedef void (*Task_fn)(void *arg);
+
+typedef struct
+{
+    Task_fn fn;
+    void *arg;
+    TASK_KIND kind;
+    uint64_t queued_us;
+} Task;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    Task tasks[TASK_PRIORITY_COUNT][TASK_POOL_QUEUE_MAX]; // rings, oldest at head
+    int head[TASK_PRIORITY_COUNT];
+    int count[TASK_PRIORITY_COUNT];
+    pthread_t thread;
+} Task_worker;
+
+typedef struct
+{
+    uint64_t refused;
+    uint64_t stolen;
+    Usb_op_stats wait; // same log2 buckets as the camera transfers
+    Usb_op_stats run;
+} Task_kind_stats;
+
+Task_worker task_workers[TASK_POOL_WORKERS_MAX];
+int task_pool_workers = 0; // 0 until task_pool_start(), and tasks are refused until then
+atomic_int task_pool_queued;
+atomic_uint task_pool_next_worker;
+__thread int task_pool_self = -1; // the worker running on this thread
+
+// for sleeping workers
+pthread_mutex_t task_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t task_pool_work = PTHREAD_COND_INITIALIZER;
+
+Task_kind_stats task_pool_stats[TASK_KIND_COUNT];
+pthread_mutex_t task_pool_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int task_pool_pop(Task_worker *worker, int priority, Task *out)
+{
+    pthread_mutex_lock(&worker->mutex);
+    int found = worker->count[priority] > 0;
+    if (found)
+    {
+        *out = worker->tasks[priority][worker->head[priority]];
+        worker->head[priority] = (worker->head[priority] + 1) % TASK_POOL_QUEUE_MAX;
+        worker->count[priority]--;
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    return found;
+}
+
+// the next task for worker self, highest priority first; *stolen is set when it came from another queue
+static int task_pool_take(int self, Task *out, int *stolen)
+{
+    for (int priority = 0; priority < TASK_PRIORITY_COUNT; priority++)
+    {
+        for (int i = 0; i < task_pool_workers; i++)
+        {
+            if (task_pool_pop(&task_workers[(self + i) % task_pool_workers], priority, out))
+            {
+                *stolen = i > 0;
+                atomic_fetch_sub(&task_pool_queued, 1);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void *task_pool_worker(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    char name[32];
+    snprintf(name, sizeof(name), "task %d", self);
+    trace_name_thread(name);
+    task_pool_self = self;
+
+    while (!stop_requested)
+    {
+        Task task;
+        int stolen;
+        if (!task_pool_take(self, &task, &stolen))
+        {
+            pthread_mutex_lock(&task_pool_mutex);
+            if (atomic_load(&task_pool_queued) == 0 && !stop_requested)
+            {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += 1;
+                pthread_cond_timedwait(&task_pool_work, &task_pool_mutex, &deadline);
+            }
+            pthread_mutex_unlock(&task_pool_mutex);
+            continue;
+        }
+
+        uint64_t start_us = usb_stats_now_us();
+        Trace_span span = trace_begin(task_kind_names[task.kind], "task");
+        task.fn(task.arg);
+        trace_end(span);
+        uint64_t end_us = usb_stats_now_us();
+
+        pthread_mutex_lock(&task_pool_stats_mutex);
+        Task_kind_stats *stats = &task_pool_stats[task.kind];
+        stats->stolen += stolen;
+        usb_stats_add(&stats->wait, start_us - task.queued_us, 0, 0);
+        usb_stats_add(&stats->run, end_us - start_us, 0, 0);
+        pthread_mutex_unlock(&task_pool_stats_mutex);
+    }
+    return NULL;
+}
+
+// starts that many workers, or with 0 one per online core
+void task_pool_start(int workers)
+{
+    long cores = workers > 0 ? workers : sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cores < 1 ? 1 : (cores > TASK_POOL_WORKERS_MAX ? TASK_POOL_WORKERS_MAX : (int)cores);
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_mutex_init(&task_workers[i].mutex, NULL);
+    }
+    task_pool_workers = workers;
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_create(&task_workers[i].thread, NULL, task_pool_worker, (void *)(intptr_t)i);
+    }
+    _log(LOG_GENERAL, "Task pool started with %d worker%s.", workers, workers == 1 ? "" : "s");
+}
+
+// wakes the workers once stop_requested is set and waits for them; tasks still queued are dropped
+void task_pool_stop()
+{
+    pthread_mutex_lock(&task_pool_mutex);
+    pthread_cond_broadcast(&task_pool_work);
+    pthread_mutex_unlock(&task_pool_mutex);
+    for (int i = 0; i < task_pool_workers; i++)
+    {
+        pthread_join(task_workers[i].thread, NULL);
+    }
+}
+
+// queues fn(arg) to run on a worker; returns 1 once queued, 0 if the pool is full, not started or shutting down
+int task_pool_submit(TASK_KIND kind, TASK_PRIORITY priority, Task_fn fn, void *arg)
+{
+    Task task = {fn, arg, kind, usb_stats_now_us()};
+    if (task_pool_workers > 0 && !stop_requested)
+    {
+        // a worker adds to its own queue, anyone else spreads tasks round the workers
+        int start = task_pool_self >= 0 ? task_pool_self : (int)(atomic_fetch_add(&task_pool_next_worker, 1) % task_pool_workers);
+        for (int i = 0; i < task_pool_workers; i++)
+        {
+            Task_worker *worker = &task_workers[(start + i) % task_pool_workers];
+            pthread_mutex_lock(&worker->mutex);
+            int queued = worker->count[priority] < TASK_POOL_QUEUE_MAX;
+            if (queued)
+            {
+                worker->tasks[priority][(worker->head[priority] + worker->count[priority]) % TASK_POOL_QUEUE_MAX] = task;
+                worker->count[priority]++;
+            }
+            pthread_mutex_unlock(&worker->mutex);
+
+            if (queued)
+            {
+                atomic_fetch_add(&task_pool_queued, 1);
+                pthread_mutex_lock(&task_pool_mutex);
+                pthread_cond_signal(&task_pool_work);
+                pthread_mutex_unlock(&task_pool_mutex);
+                return 1;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&task_pool_stats_mutex);
+    task_pool_stats[kind].refused++;
+    pthread_mutex_unlock(&task_pool_stats_mutex);
+    return 0;
+}
+
+void task_pool_snapshot(Task_kind_stats *out)
+{
+    pthread_mutex_lock(&task_pool_stats_mutex);
+    memcpy(out, task_pool_stats, sizeof(task_pool_stats));
+    pthread_mutex_unlock(&task_pool_stats_mutex);
+}
+
+void task_pool_log_stats()
+{
+    Task_kind_stats stats[TASK_KIND_COUNT];
+    task_pool_snapshot(stats);
+
+    _log(LOG_STATS, "Task pool statistics since start (%d workers, %d queued)", task_pool_workers, atomic_load(&task_pool_queued));
+    for (int kind = 0; kind < TASK_KIND_COUNT; kind++)
+    {
+        const Task_kind_stats *s = &stats[kind];
+        if (s->run.count == 0 && s->refused == 0)
+        {
+            continue;
+        }
+        _log(LOG_STATS, "  %-16s n=%llu refused=%llu stolen=%llu wait avg=%.1fms p95<=%.1fms run avg=%.1fms p95<=%.1fms max=%.1fms",
+            task_kind_names[kind],
+            (unsigned long long)s->run.count,
+            (unsigned long long)s->refused,
+            (unsigned long long)s->stolen,
+            s->wait.count ? (double)s->wait.total_us / s->wait.count / 1000.0 : 0.0,
+            usb_stats_percentile_us(&s->wait, 95) / 1000.0,
+            s->run.count ? (double)s->run.total_us / s->run.count / 1000.0 : 0.0,
+            usb_stats_percentile_us(&s->run, 95) / 1000.0,
+            s->run.max_us / 1000.0);
+    }
+}
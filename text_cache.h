@@ -0,0 +1,322 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+* Rendered text is cached as textures so a frame only rasterizes strings it has not drawn
+* recently. Entries are keyed by string, font (an opened TTF_Font is one face at one size),
+* color and wrap width, live in a small hash table, and the least recently used entry is
+* evicted once TEXT_CACHE_MAX textures exist. Counters that change every pass are drawn
+* from a per font and color digit atlas instead, so they never create new entries.
+* Only the UI thread touches the cache; textures belong to that thread's renderer.
+*/
+
+#define TEXT_CACHE_MAX 128
+#define TEXT_CACHE_BUCKETS 256 // power of two
+#define DIGIT_ATLAS_MAX 4
+
+typedef struct
+{
+    char *text;
+    TTF_Font *font;
+    SDL_Color color;
+    int wrap_width; // 0 for single line text
+    uint32_t hash;
+    SDL_Texture *texture;
+    int w;
+    int h;
+    int bucket_next;
+    int lru_prev;
+    int lru_next;
+} Text_cache_entry;
+
+typedef struct
+{
+    TTF_Font *font;
+    SDL_Color color;
+    SDL_Texture *texture;
+    int offsets[11]; // digit d spans offsets[d] to offsets[d + 1] in the atlas
+    int h;
+} Digit_atlas;
+
+Text_cache_entry text_cache[TEXT_CACHE_MAX];
+int text_cache_buckets[TEXT_CACHE_BUCKETS];
+int text_cache_count = 0;
+int text_cache_lru_head = -1; // most recently used
+int text_cache_lru_tail = -1;
+int text_cache_initialized = 0;
+
+atomic_ullong text_cache_hits; // read by the metrics exporter
+atomic_ullong text_cache_misses;
+unsigned long long text_cache_evictions = 0;
+
+Digit_atlas digit_atlases[DIGIT_ATLAS_MAX];
+int digit_atlas_count = 0;
+
+static uint32_t text_cache_hash(const char *text, TTF_Font *font, SDL_Color color, int wrap_width)
+{
+    // FNV-1a over the string, then the rest of the key
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++)
+    {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    uintptr_t font_bits = (uintptr_t)font;
+    hash = (hash ^ (uint32_t)(font_bits >> 4)) * 16777619u;
+    hash = (hash ^ ((uint32_t)color.r << 24 | (uint32_t)color.g << 16 | (uint32_t)color.b << 8 | color.a)) * 16777619u;
+    hash = (hash ^ (uint32_t)wrap_width) * 16777619u;
+    return hash;
+}
+
+static void text_cache_init()
+{
+    for (int i = 0; i < TEXT_CACHE_BUCKETS; i++)
+    {
+        text_cache_buckets[i] = -1;
+    }
+    text_cache_initialized = 1;
+}
+
+static void text_cache_lru_unlink(int index)
+{
+    Text_cache_entry *entry = &text_cache[index];
+    if (entry->lru_prev >= 0)
+    {
+        text_cache[entry->lru_prev].lru_next = entry->lru_next;
+    }
+    else
+    {
+        text_cache_lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next >= 0)
+    {
+        text_cache[entry->lru_next].lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        text_cache_lru_tail = entry->lru_prev;
+    }
+}
+
+static void text_cache_lru_push_front(int index)
+{
+    Text_cache_entry *entry = &text_cache[index];
+    entry->lru_prev = -1;
+    entry->lru_next = text_cache_lru_head;
+    if (text_cache_lru_head >= 0)
+    {
+        text_cache[text_cache_lru_head].lru_prev = index;
+    }
+    text_cache_lru_head = index;
+    if (text_cache_lru_tail < 0)
+    {
+        text_cache_lru_tail = index;
+    }
+}
+
+static void text_cache_bucket_unlink(int index)
+{
+    int *link = &text_cache_buckets[text_cache[index].hash & (TEXT_CACHE_BUCKETS - 1)];
+    while (*link >= 0 && *link != index)
+    {
+        link = &text_cache[*link].bucket_next;
+    }
+    if (*link == index)
+    {
+        *link = text_cache[index].bucket_next;
+    }
+}
+
+static int text_cache_evict()
+{
+    int index = text_cache_lru_tail;
+    text_cache_lru_unlink(index);
+    text_cache_bucket_unlink(index);
+    SDL_DestroyTexture(text_cache[index].texture);
+    free(text_cache[index].text);
+    text_cache_evictions++;
+    return index;
+}
+
+Text_cache_entry *text_cache_get(SDL_Renderer *renderer, TTF_Font *font, const char *text, SDL_Color color, int wrap_width)
+{
+    if (!text_cache_initialized)
+    {
+        text_cache_init();
+    }
+
+    uint32_t hash = text_cache_hash(text, font, color, wrap_width);
+    int bucket = hash & (TEXT_CACHE_BUCKETS - 1);
+
+    for (int i = text_cache_buckets[bucket]; i >= 0; i = text_cache[i].bucket_next)
+    {
+        Text_cache_entry *entry = &text_cache[i];
+        if (entry->hash == hash && entry->font == font && entry->wrap_width == wrap_width
+            && entry->color.r == color.r && entry->color.g == color.g && entry->color.b == color.b && entry->color.a == color.a
+            && strcmp(entry->text, text) == 0)
+        {
+            if (text_cache_lru_head != i)
+            {
+                text_cache_lru_unlink(i);
+                text_cache_lru_push_front(i);
+            }
+            text_cache_hits++;
+            return entry;
+        }
+    }
+
+    text_cache_misses++;
+    Trace_span span = trace_begin("rasterize text", "ui");
+    SDL_Surface *surface = wrap_width > 0
+        ? TTF_RenderText_Blended_Wrapped(font, text, color, wrap_width)
+        : TTF_RenderUTF8_Solid(font, text, color);
+    if (!surface)
+    {
+        trace_end(span);
+        return NULL;
+    }
+    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+    int w = surface->w;
+    int h = surface->h;
+    SDL_FreeSurface(surface);
+    trace_end(span);
+
+    char *copy = strdup(text);
+    if (!texture || !copy)
+    {
+        SDL_DestroyTexture(texture);
+        free(copy);
+        return NULL;
+    }
+
+    int index = text_cache_count < TEXT_CACHE_MAX ? text_cache_count++ : text_cache_evict();
+    Text_cache_entry *entry = &text_cache[index];
+    entry->text = copy;
+    entry->font = font;
+    entry->color = color;
+    entry->wrap_width = wrap_width;
+    entry->hash = hash;
+    entry->texture = texture;
+    entry->w = w;
+    entry->h = h;
+    entry->bucket_next = text_cache_buckets[bucket];
+    text_cache_buckets[bucket] = index;
+    text_cache_lru_push_front(index);
+    return entry;
+}
+
+// draws cached text with its top left corner at x, y and returns its size through w and h (either may be NULL)
+void text_cache_draw(SDL_Renderer *renderer, TTF_Font *font, const char *text, SDL_Color color, int wrap_width, int x, int y, int *w, int *h)
+{
+    Text_cache_entry *entry = text_cache_get(renderer, font, text, color, wrap_width);
+    if (!entry)
+    {
+        return;
+    }
+
+    SDL_Rect dst = {x, y, entry->w, entry->h};
+    SDL_RenderCopy(renderer, entry->texture, NULL, &dst);
+    if (w)
+    {
+        *w = entry->w;
+    }
+    if (h)
+    {
+        *h = entry->h;
+    }
+}
+
+static Digit_atlas *digit_atlas_get(SDL_Renderer *renderer, TTF_Font *font, SDL_Color color)
+{
+    for (int i = 0; i < digit_atlas_count; i++)
+    {
+        Digit_atlas *atlas = &digit_atlases[i];
+        if (atlas->font == font && atlas->color.r == color.r && atlas->color.g == color.g && atlas->color.b == color.b && atlas->color.a == color.a)
+        {
+            return atlas;
+        }
+    }
+
+    if (digit_atlas_count >= DIGIT_ATLAS_MAX)
+    {
+        return NULL;
+    }
+
+    // the digits are rasterized as one string so the atlas keeps the font's own spacing
+    const char digits[] = "0123456789";
+    SDL_Surface *surface = TTF_RenderUTF8_Solid(font, digits, color);
+    if (!surface)
+    {
+        return NULL;
+    }
+
+    Digit_atlas *atlas = &digit_atlases[digit_atlas_count];
+    atlas->offsets[0] = 0;
+    for (int d = 1; d <= 10; d++)
+    {
+        char prefix[11];
+        memcpy(prefix, digits, d);
+        prefix[d] = '\0';
+        TTF_SizeUTF8(font, prefix, &atlas->offsets[d], NULL);
+    }
+
+    atlas->texture = SDL_CreateTextureFromSurface(renderer, surface);
+    atlas->h = surface->h;
+    SDL_FreeSurface(surface);
+    if (!atlas->texture)
+    {
+        return NULL;
+    }
+
+    atlas->font = font;
+    atlas->color = color;
+    digit_atlas_count++;
+    return atlas;
+}
+
+// draws a non-negative integer from the digit atlas and returns the width drawn
+int render_number(SDL_Renderer *renderer, TTF_Font *font, long value, int x, int y, SDL_Color color)
+{
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%ld", value < 0 ? 0 : value);
+
+    Digit_atlas *atlas = digit_atlas_get(renderer, font, color);
+    if (!atlas)
+    {
+        int w = 0;
+        text_cache_draw(renderer, font, digits, color, 0, x, y, &w, NULL);
+        return w;
+    }
+
+    int start_x = x;
+    for (const char *p = digits; *p; p++)
+    {
+        int d = *p - '0';
+        int glyph_w = atlas->offsets[d + 1] - atlas->offsets[d];
+        SDL_Rect src = {atlas->offsets[d], 0, glyph_w, atlas->h};
+        SDL_Rect dst = {x, y, glyph_w, atlas->h};
+        SDL_RenderCopy(renderer, atlas->texture, &src, &dst);
+        x += glyph_w;
+    }
+    return x - start_x;
+}
+
+void text_cache_clear()
+{
+    for (int i = 0; i < text_cache_count; i++)
+    {
+        SDL_DestroyTexture(text_cache[i].texture);
+        free(text_cache[i].text);
+    }
+    for (int i = 0; i < digit_atlas_count; i++)
+    {
+        SDL_DestroyTexture(digit_atlases[i].texture);
+    }
+
+    text_cache_count = 0;
+    digit_atlas_count = 0;
+    text_cache_lru_head = -1;
+    text_cache_lru_tail = -1;
+    text_cache_init();
+}
@@ -0,0 +1,216 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+/*
+* Optional span tracing in Chrome trace-event format, enabled with --trace. Spans from the
+* worker, network and UI threads are recorded as complete ("X") events into a fixed size
+* ring that keeps the most recent TRACE_MAX_EVENTS; the ring is written to trace.json at
+* exit or on SIGUSR2, and the file opens directly in Perfetto or chrome://tracing. When
+* tracing is off every span costs a single predictable branch. Each slot carries the
+* sequence number of the event in it, published after the fields, so the writer skips
+* slots still being filled or overwritten while it reads them.
+*/
+
+#define TRACE_MAX_EVENTS (1 << 17) // power of two, ~4 MB when enabled
+#define TRACE_MAX_THREADS 16
+#define TRACE_FILE "trace.json"
+
+typedef struct
+{
+    atomic_ulong seq; // event index + 1 once the fields below are written, 0 while they are being written
+    const char *name; // string literals only; events hold the pointer, not a copy
+    const char *category;
+    uint64_t start_us;
+    uint32_t duration_us;
+    int32_t tid;
+} Trace_event;
+
+typedef struct
+{
+    const char *name;
+    const char *category;
+    uint64_t start_us;
+} Trace_span;
+
+typedef struct
+{
+    int32_t tid;
+    char name[32]; // a copy, as threads such as the upload lanes name themselves from a stack buffer
+} Trace_thread;
+
+int trace_enabled = 0;
+Trace_event *trace_events = NULL;
+atomic_ulong trace_next_event;
+
+Trace_thread trace_threads[TRACE_MAX_THREADS];
+int trace_thread_count = 0;
+pthread_mutex_t trace_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+__thread int32_t trace_tid = 0;
+
+volatile sig_atomic_t trace_dump_requested = 0;
+
+uint64_t trace_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static int32_t trace_current_tid()
+{
+    if (!trace_tid)
+    {
+        trace_tid = (int32_t)syscall(SYS_gettid);
+    }
+    return trace_tid;
+}
+
+void trace_name_thread(const char *name)
+{
+    if (!trace_enabled)
+    {
+        return;
+    }
+
+    // threads started again and again (upload lanes each pass) take over the slot of an exited one of the same name
+    pid_t pid = getpid();
+    pthread_mutex_lock(&trace_threads_mutex);
+    int slot = trace_thread_count;
+    for (int i = 0; i < trace_thread_count; i++)
+    {
+        if (strcmp(trace_threads[i].name, name) == 0 && syscall(SYS_tgkill, pid, trace_threads[i].tid, 0) != 0 && errno == ESRCH)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < TRACE_MAX_THREADS)
+    {
+        trace_threads[slot].tid = trace_current_tid();
+        snprintf(trace_threads[slot].name, sizeof(trace_threads[slot].name), "%s", name);
+        trace_thread_count += slot == trace_thread_count;
+    }
+    pthread_mutex_unlock(&trace_threads_mutex);
+}
+
+void trace_complete(const char *name, const char *category, uint64_t start_us, uint64_t end_us)
+{
+    if (!trace_enabled)
+    {
+        return;
+    }
+
+    unsigned long index = atomic_fetch_add_explicit(&trace_next_event, 1, memory_order_relaxed);
+    Trace_event *event = &trace_events[index & (TRACE_MAX_EVENTS - 1)];
+    atomic_store_explicit(&event->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    event->name = name;
+    event->category = category;
+    event->start_us = start_us;
+    event->duration_us = (uint32_t)(end_us - start_us);
+    event->tid = trace_current_tid();
+    atomic_store_explicit(&event->seq, index + 1, memory_order_release);
+}
+
+Trace_span trace_begin(const char *name, const char *category)
+{
+    Trace_span span = {NULL, NULL, 0};
+    if (trace_enabled)
+    {
+        span.name = name;
+        span.category = category;
+        span.start_us = trace_now_us();
+    }
+    return span;
+}
+
+void trace_end(Trace_span span)
+{
+    if (span.name)
+    {
+        trace_complete(span.name, span.category, span.start_us, trace_now_us());
+    }
+}
+
+void trace_write()
+{
+    if (!trace_enabled)
+    {
+        return;
+    }
+
+    FILE *f = fopen(TRACE_FILE, "w");
+    if (!f)
+    {
+        _log(LOG_ERROR, "Could not write %s.", TRACE_FILE);
+        return;
+    }
+
+    unsigned long end = atomic_load(&trace_next_event);
+    unsigned long begin = end > TRACE_MAX_EVENTS ? end - TRACE_MAX_EVENTS : 0;
+    int pid = getpid();
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"uploader_gui\"}}", pid);
+
+    pthread_mutex_lock(&trace_threads_mutex);
+    for (int i = 0; i < trace_thread_count; i++)
+    {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, trace_threads[i].tid, trace_threads[i].name);
+    }
+    pthread_mutex_unlock(&trace_threads_mutex);
+
+    unsigned long written = 0;
+    for (unsigned long i = begin; i < end; i++)
+    {
+        // a copy taken while the slot held event i throughout, else skipped as claimed but unwritten or overwritten
+        Trace_event *slot = &trace_events[i & (TRACE_MAX_EVENTS - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != i + 1)
+        {
+            continue;
+        }
+        const char *name = slot->name;
+        const char *category = slot->category;
+        uint64_t start_us = slot->start_us;
+        uint32_t duration_us = slot->duration_us;
+        int32_t tid = slot->tid;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != i + 1)
+        {
+            continue;
+        }
+
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":%d,\"tid\":%d}",
+            name, category, (unsigned long long)start_us, duration_us, pid, tid);
+        written++;
+    }
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    _log(LOG_STATS, "Wrote %lu trace event(s) to %s (%lu older event(s) overwritten, %lu in progress skipped).", written, TRACE_FILE, begin, end - begin - written);
+}
+
+void trace_start()
+{
+    trace_events = calloc(TRACE_MAX_EVENTS, sizeof(Trace_event));
+    if (!trace_events)
+    {
+        _log(LOG_ERROR, "Could not allocate trace buffer; tracing disabled.");
+        return;
+    }
+
+    trace_enabled = 1;
+    trace_name_thread("main/ui");
+    atexit(trace_write);
+    _log(LOG_GENERAL, "Tracing enabled, writing %s at exit or on SIGUSR2.", TRACE_FILE);
+}
+
+void handle_sigusr2(int sig)
+{
+    (void)sig;
+    trace_dump_requested = 1;
+}
@@ -21,20 +21,13 @@ UI_parameters ui_parameters;
 // use vilatilie ints because these will be accessed directly without optimization. (variable updated across threads)
 volatile int selected_network = -1;
 volatile int net_count = 0;
-volatile int link_strength_value = 0;
-volatile int internet_up = 0;
 volatile int networks_ready = 0;
-volatile int networks_scanned = 0;
 volatile int select_network_index = -1;
 volatile int has_attempted_connection = 0;
 volatile int network_connect_complete_status = 0;
 volatile int network_connect_complete = 0;
-volatile int camera_found = 0;
 volatile int clear_all_imports = 0;
 
-pid_t conn_pid = 0;
-int conn_status = -1;
-
 typedef struct
 {
     volatile int x;
@@ -43,35 +36,29 @@ typedef struct
 
 LastClick last_click = {0, 0};
 
-typedef struct
-{
-    char ssid[128];
-} WifiNetwork;
+WifiNetwork networks[MAX_NETWORKS]; // the list as last drawn, which taps are matched against
+char select_network_ssid[128]; // the network tapped, kept apart from the list wifi.h keeps re-sorting
 
-WifiNetwork networks[MAX_NETWORKS];
+Screen current_screen = SCREEN_MAIN;
 
-typedef enum
-{
-    CAMERA_STATUS_NO_CAMERA,
-    CAMERA_STATUS_WAITING,
-    CAMERA_STATUS_IMPORTING,
-    CAMERA_STATUS_UPLOADING,
-    CAMERA_STATUS_IMPORT_ONLY
-} Camera_status;
+int ui_animating = 0; // set while drawing a frame that shows the loading ellipsis
+int ui_upload_graph_shown = 0; // set while drawing a frame that shows the upload history
+
+#define GALLERY_COLUMNS 4
 
 typedef struct
 {
-    int imported;
-    int uploaded;
-    Camera_status status;
-    char camera_name[256];
-    char camera_serial_number[32];
-} Program_status;
-
-Screen current_screen = SCREEN_MAIN;
+    int x;
+    int y;
+    int cell_w;
+    int cell_h;
+    int gap;
+    int rows;
+} Gallery_layout;
 
-int number_dots_for_loading_screen = 1;
-int screen_refresh_count = 0;
+int gallery_first_row = 0;
+int gallery_total_rows = 0;
+int swipe_start_y = -1;
 
 int navigation_button_is_pressed(Button button, int mx, int my)
 {
@@ -81,48 +68,35 @@ int navigation_button_is_pressed(Button button, int mx, int my)
 
 void render_wrappable_text(SDL_Renderer *renderer, TTF_Font *font, const char *text, int x, int y, int wrap_width)
 {
-    SDL_Surface *surf = TTF_RenderText_Blended_Wrapped(font, text, ui_colors.white, wrap_width);
-    SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf);
-    SDL_Rect dst = {x, y, surf->w, surf->h};
-    SDL_RenderCopy(renderer, tex, NULL, &dst);
-    SDL_FreeSurface(surf);
-    SDL_DestroyTexture(tex);
+    Trace_span span = trace_begin("render_text", "ui");
+    text_cache_draw(renderer, font, text, ui_colors.white, wrap_width, x, y, NULL, NULL);
+    trace_end(span);
 }
 
 void render_colored_text(SDL_Renderer *renderer, TTF_Font *font, const char *text, int x, int y, SDL_Color color) 
 {
-    SDL_Surface *surface = TTF_RenderUTF8_Solid(font, text, color);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-    SDL_Rect dst = {x, y, surface->w, surface->h};
-    SDL_RenderCopy(renderer, texture, NULL, &dst);
-    SDL_FreeSurface(surface);
-    SDL_DestroyTexture(texture);
+    Trace_span span = trace_begin("render_text", "ui");
+    text_cache_draw(renderer, font, text, color, 0, x, y, NULL, NULL);
+    trace_end(span);
 }
 
 void render_text(SDL_Renderer *renderer, TTF_Font *font, const char *text, int x, int y) 
 {
-    SDL_Surface *surface = TTF_RenderUTF8_Solid(font, text, ui_colors.white);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-    SDL_Rect dst = {x, y, surface->w, surface->h};
-    SDL_RenderCopy(renderer, texture, NULL, &dst);
-    SDL_FreeSurface(surface);
-    SDL_DestroyTexture(texture);
+    Trace_span span = trace_begin("render_text", "ui");
+    text_cache_draw(renderer, font, text, ui_colors.white, 0, x, y, NULL, NULL);
+    trace_end(span);
 }
 
 void create_text_with_dynamic_elipsis(char *str, int max_string_length)
 {
+    // one to four dots, stepping every UI_ANIMATION_TICK_MS; the UI loop wakes for each step while this is on screen
     char dots[5] = {0};
-    for (int x = 0; x < number_dots_for_loading_screen && x < 4; x++)
+    int number_dots = 1 + (SDL_GetTicks() / UI_ANIMATION_TICK_MS) % 4;
+    for (int x = 0; x < number_dots; x++)
     {
         dots[x] = '.';
     }
-
-    if (screen_refresh_count++ > 30)
-    {
-        // roughly once per half second based on 60 refreshes / sec
-        number_dots_for_loading_screen = (number_dots_for_loading_screen >= 4) ? 1 : number_dots_for_loading_screen + 1;
-        screen_refresh_count = 0;
-    }
+    ui_animating = 1;
 
     char original[max_string_length];
     strncpy(original, str, max_string_length - 1);
@@ -137,66 +111,6 @@ void render_loading_network_text(SDL_Renderer *renderer, TTF_Font *font)
     render_text(renderer, font, loading_statement, ui_parameters.ui_padding_left, ui_parameters.ui_top_bar_height);
 }
 
-int list_networks(int max)
-{
-    // reset array to empty
-    memset(networks, 0, sizeof(networks));
-
-    FILE *fp = popen("nmcli -t -f SSID dev wifi", "r");
-    if (!fp)
-    {
-        _log(LOG_ERROR, "Can not open file tto read Wifi status.");
-        return 0;
-    }
-
-    _log(LOG_GENERAL, "Attempting to read Wifi information...");
-
-    int count = 0;
-    char line[256];
-
-    while (fgets(line, sizeof(line), fp) && count < max)
-    {
-        line[strcspn(line, "\n")] = 0;
-        if (strlen(line) > 0)
-        {
-            int number_networks = count;
-
-            int add_to_network_list = 1;
-            for (int x=0; x<number_networks; x++)
-            {
-                if (strcmp(networks[x].ssid, line) == 0)
-                {
-                    // already in network list (avoid duplicates)
-                    add_to_network_list = 0;
-                    break;
-                }
-            }
-
-            if (add_to_network_list)
-            {
-                _log(LOG_GENERAL, "Adding network %s to network list.", line);
-                strncpy(networks[count].ssid, line, sizeof(networks[count].ssid));
-                networks[count].ssid[sizeof(networks[count].ssid)-1] = 0;
-                count++;
-            }
-            else
-            {
-                _log(LOG_GENERAL, "Declining to add network %s to network list because it is a duplicate.", line);
-            }
-        }
-    }
-
-    pclose(fp);
-    return count;
-}
-
-void* scan_networks_thread()
-{
-    net_count = list_networks(MAX_NETWORKS);
-    networks_ready = 1;
-    return NULL;
-}
-
 void clip_string(char *dest, const char *src, int n)
 {
     int i;
@@ -207,36 +121,9 @@ void clip_string(char *dest, const char *src, int n)
     dest[i] = '\0';
 }
 
-int connect_to_network(const char *ssid)
-{
-    pid_t pid = fork();
-    if (pid < 0)
-    {
-        return -1;
-    }
-    if (pid == 0)
-    {
-        execlp("nmcli", "nmcli", "device", "wifi", "connect", ssid, NULL);
-        _exit(127);
-    } 
-    else
-    {
-        int status;
-        waitpid(pid, &status, 0);
-
-        if (WIFEXITED(status))
-        {
-            return WEXITSTATUS(status);
-        }
-        else
-        {
-            return -1;
-        }
-    }
-}
-
 void render_button(SDL_Renderer *renderer, TTF_Font *font, Button btn)
 {
+    Trace_span span = trace_begin("render_text", "ui");
     SDL_Rect rect = {btn.x, btn.y, btn.w, btn.h};
     SDL_SetRenderDrawColor(renderer, 80, 80, 80, 255);
     SDL_RenderFillRect(renderer, &rect);
@@ -244,16 +131,15 @@ void render_button(SDL_Renderer *renderer, TTF_Font *font, Button btn)
     SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
     SDL_RenderDrawRect(renderer, &rect);
 
-    SDL_Surface *surface = TTF_RenderText_Solid(font, btn.label, ui_colors.white);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-
-    int tx = btn.x + (btn.w - surface->w) / 2;
-    int ty = btn.y + (btn.h - surface->h) / 2;
-    SDL_Rect dst = {tx, ty, surface->w, surface->h};
-    SDL_RenderCopy(renderer, texture, NULL, &dst);
-
-    SDL_FreeSurface(surface);
-    SDL_DestroyTexture(texture);
+    Text_cache_entry *label = text_cache_get(renderer, font, btn.label, ui_colors.white, 0);
+    if (label)
+    {
+        int tx = btn.x + (btn.w - label->w) / 2;
+        int ty = btn.y + (btn.h - label->h) / 2;
+        SDL_Rect dst = {tx, ty, label->w, label->h};
+        SDL_RenderCopy(renderer, label->texture, NULL, &dst);
+    }
+    trace_end(span);
 }
 
 void render_signal_indicator(SDL_Renderer *renderer, int x, int y, int total_height, int total_width, int strength_percent)
@@ -286,65 +172,12 @@ void render_signal_indicator(SDL_Renderer *renderer, int x, int y, int total_hei
     }
 }
 
-int get_link_strength()
-{
-    if (!internet_up)
-    {
-        return 0;
-    }
-
-    FILE *f = fopen("/proc/net/wireless", "r");
-    if (!f)
-    {
-        return 0;
-    }
-
-    char line[256];
-    fgets(line, sizeof(line), f);
-    fgets(line, sizeof(line), f);
-    fgets(line, sizeof(line), f);
-
-    char iface[16];
-    float status, link, level, noise;
-    if (sscanf(line, " %15[^:]: %f %f %f %f %f %f", iface, &status, &link, &level, &noise, &noise, &noise) < 4)
-    {
-        fclose(f);
-        return 0;
-    }
-
-    fclose(f);
-    int strength = (int)(link * 100 / 70);
-
-    if (strength > 100)
-    {
-        strength = 100;
-    }
-
-    if (strength < 0)
-    {
-        strength = 0;
-    }
-
-    return strength;
-}
-
-void* internet_poll_thread()
-{
-    while (!stop_requested)
-    {
-        internet_up = (system("ping -c 1 8.8.8.8 > /dev/null 2>&1") == 0);
-        link_strength_value = get_link_strength();
-        sleep(2);
-    }
-    return NULL;
-}
-
-void render_camera_status(SDL_Renderer *renderer, TTF_Font *font)
+void render_camera_status(SDL_Renderer *renderer, TTF_Font *font, const Status_snapshot *status)
 {
     SDL_Color font_color;
     const char *status_text;
 
-    switch (camera_found)
+    switch (status->camera_found)
     {
         case -1:
             status_text = "Camera detected - no communication";
@@ -363,33 +196,35 @@ void render_camera_status(SDL_Renderer *renderer, TTF_Font *font)
     render_colored_text(renderer, font, status_text, ui_parameters.ui_padding_left, ui_parameters.ui_padding_top, font_color);
 }
 
-void render_connection_status(SDL_Renderer *renderer, TTF_Font *font)
+void render_connection_status(SDL_Renderer *renderer, TTF_Font *font, const Status_snapshot *status)
 {
-    SDL_Color font_color = internet_up ? ui_colors.green : ui_colors.red;
-    const char *status_text = internet_up ? "Internet connected" : "No internet";
+    SDL_Color font_color = status->internet_up ? ui_colors.green : ui_colors.red;
+    const char *status_text = status->internet_up ? "Internet connected" : "No internet";
 
     int screen_width, screen_height;
     SDL_GetRendererOutputSize(renderer, &screen_width, &screen_height);
 
-    SDL_Surface *surface = TTF_RenderText_Solid(font, status_text, font_color);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+    Text_cache_entry *text = text_cache_get(renderer, font, status_text, font_color, 0);
+    if (!text)
+    {
+        return;
+    }
 
-    int bar_size = (int)(surface->h * 0.66);
+    int bar_size = (int)(text->h * 0.66);
     int spacing = 10;
-    int total_width = surface->w + spacing + bar_size;
+    int total_width = text->w + spacing + bar_size;
     int start_x = screen_width - total_width - ui_parameters.ui_padding_left;
 
-    render_colored_text(renderer, font, status_text, start_x, ui_parameters.ui_padding_top, font_color);
+    SDL_Rect dst = {start_x, ui_parameters.ui_padding_top, text->w, text->h};
+    SDL_RenderCopy(renderer, text->texture, NULL, &dst);
 
-    int text_center_y = ui_parameters.ui_padding_top + surface->h / 2;
+    int text_center_y = ui_parameters.ui_padding_top + text->h / 2;
     int bar_y = text_center_y - bar_size / 2;
-    render_signal_indicator(renderer, start_x + surface->w + spacing, bar_y, bar_size, bar_size, link_strength_value);
-
-    SDL_FreeSurface(surface);
-    SDL_DestroyTexture(texture);
+    render_signal_indicator(renderer, start_x + text->w + spacing, bar_y, bar_size, bar_size, status->link_strength);
 }
 
-void render_status_box(SDL_Renderer *renderer, TTF_Font *font, Program_status *program_status)
+// returns the y just below the status box
+int render_status_box(SDL_Renderer *renderer, TTF_Font *font, const Program_status *program_status)
 {
     char camera_name[512] = {0};
     int y_offset = ui_parameters.ui_top_bar_height;
@@ -401,15 +236,13 @@ void render_status_box(SDL_Renderer *renderer, TTF_Font *font, Program_status *p
         y_offset += ui_parameters.font_size + (ui_parameters.font_size / 25);
     }
 
-    char imported_text[64];
-    snprintf(imported_text, sizeof(imported_text), "%i image%s imported", program_status->imported, program_status->imported == 1 ? "" : "s");
-    char uploaded_text[64];
-    snprintf(uploaded_text, sizeof(uploaded_text), "%i image%s sent to server", program_status->uploaded, program_status->uploaded == 1 ? "" : "s");
-
-    render_text(renderer, font, imported_text, ui_parameters.ui_padding_left, y_offset);
+    // the counts change every pass, so they come from the digit atlas and only the fixed suffix is cached
+    int number_width = render_number(renderer, font, program_status->imported, ui_parameters.ui_padding_left, y_offset, ui_colors.white);
+    render_text(renderer, font, program_status->imported == 1 ? " image imported" : " images imported", ui_parameters.ui_padding_left + number_width, y_offset);
     y_offset += ui_parameters.font_size + (ui_parameters.font_size / 25);
 
-    render_text(renderer, font, uploaded_text, ui_parameters.ui_padding_left, y_offset);
+    number_width = render_number(renderer, font, program_status->uploaded, ui_parameters.ui_padding_left, y_offset, ui_colors.white);
+    render_text(renderer, font, program_status->uploaded == 1 ? " image sent to server" : " images sent to server", ui_parameters.ui_padding_left + number_width, y_offset);
     y_offset += ui_parameters.font_size + (ui_parameters.font_size / 25);
 
     SDL_Color color;
@@ -437,25 +270,208 @@ void render_status_box(SDL_Renderer *renderer, TTF_Font *font, Program_status *p
             strcpy(status_str, "Importing images only - no internet");
             color = ui_colors.yellow;
             break;
+        case CAMERA_STATUS_STORAGE_FULL:
+            strcpy(status_str, "Storage full - waiting for uploads");
+            color = ui_colors.red;
+            break;
+        case CAMERA_STATUS_PAUSED:
+            strcpy(status_str, "Paused from the control socket");
+            color = ui_colors.yellow;
+            break;
     }
     
     create_text_with_dynamic_elipsis(status_str, 64);
     render_colored_text(renderer, font, status_str, ui_parameters.ui_padding_left, y_offset, color);
+    return y_offset + ui_parameters.font_size + (ui_parameters.font_size / 25);
+}
+
+void render_upload_sparkline(SDL_Renderer *renderer, const uint64_t *history, int count, SDL_Rect area)
+{
+    uint64_t peak = 0;
+    for (int i = 0; i < count; i++)
+    {
+        peak = history[i] > peak ? history[i] : peak;
+    }
+
+    SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
+    SDL_RenderDrawLine(renderer, area.x, area.y + area.h - 1, area.x + area.w - 1, area.y + area.h - 1);
+    if (peak == 0)
+    {
+        return;
+    }
+
+    // one bar per bucket, newest on the right, scaled to the busiest bucket shown
+    SDL_SetRenderDrawColor(renderer, ui_colors.green.r, ui_colors.green.g, ui_colors.green.b, 255);
+    for (int i = 0; i < count; i++)
+    {
+        int x0 = area.x + i * area.w / count;
+        int x1 = area.x + (i + 1) * area.w / count;
+        int h = (int)(history[i] * (uint64_t)area.h / peak);
+        if (h > 0)
+        {
+            SDL_Rect bar = {x0, area.y + area.h - h, x1 - x0 > 1 ? x1 - x0 - 1 : 1, h};
+            SDL_RenderFillRect(renderer, &bar);
+        }
+    }
 }
 
-void render_header(SDL_Renderer *renderer, TTF_Font *font)
+void render_upload_progress(SDL_Renderer *renderer, TTF_Font *font, int y, Button below)
 {
-    render_camera_status(renderer, font); 
-    render_connection_status(renderer, font);   
+    Upload_snapshot upload;
+    upload_progress_snapshot(&upload);
+
+    int has_history = 0;
+    for (int i = 0; i < UPLOAD_RATE_BUCKETS && !has_history; i++)
+    {
+        has_history = upload.history[i] != 0;
+    }
+    if (!upload.active && upload.backlog_images == 0 && !has_history)
+    {
+        return;
+    }
+    ui_upload_graph_shown = 1;
+
+    int line_height = ui_parameters.font_size + (ui_parameters.font_size / 25);
+    char line[320];
+    if (upload.active)
+    {
+        char name[40];
+        clip_string(name, upload.file, 24);
+        if (upload.active > 1)
+        {
+            snprintf(line, sizeof(line), "Sending %s %d%% +%d", name, upload.file_percent, upload.active - 1);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "Sending %s %d%%", name, upload.file_percent);
+        }
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "%lld waiting to send", upload.backlog_images);
+    }
+    render_text(renderer, font, line, ui_parameters.ui_padding_left, y);
+    y += line_height;
+
+    char rate[32], left[32], eta[32];
+    format_bytes(rate, sizeof(rate), upload.rate_bps);
+    format_bytes(left, sizeof(left), upload.backlog_bytes);
+    if (upload.backlog_bytes > 0 && upload.eta_s >= 0)
+    {
+        format_duration(eta, sizeof(eta), upload.eta_s);
+        snprintf(line, sizeof(line), "%s/s, %s left, about %s", rate, left, eta);
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "%s/s, %s left", rate, left);
+    }
+    render_text(renderer, font, line, ui_parameters.ui_padding_left, y);
+    y += line_height + ui_parameters.font_size / 4;
+
+    // the graph fills the space left above the bottom left button, capped at three lines of text
+    int graph_h = below.y - ui_parameters.ui_padding_left - y;
+    graph_h = graph_h > ui_parameters.font_size * 3 ? ui_parameters.font_size * 3 : graph_h;
+    if (graph_h >= ui_parameters.font_size / 2)
+    {
+        SDL_Rect area = {below.x, y, below.w, graph_h};
+        render_upload_sparkline(renderer, upload.history, UPLOAD_RATE_BUCKETS, area);
+    }
 }
 
-void render_main_screen(SDL_Renderer * renderer, TTF_Font * font, Program_status *program_status, Navigation_buttons navigation_buttons)
+void render_header(SDL_Renderer *renderer, TTF_Font *font, const Status_snapshot *status)
 {
-    render_status_box(renderer, font, program_status);
+    render_camera_status(renderer, font, status); 
+    render_connection_status(renderer, font, status);   
+}
+
+void render_main_screen(SDL_Renderer * renderer, TTF_Font * font, const Status_snapshot *status, Navigation_buttons navigation_buttons)
+{
+    int y = render_status_box(renderer, font, &status->program);
+    render_upload_progress(renderer, font, y, navigation_buttons.select_network);
+    render_button(renderer, font, navigation_buttons.gallery);
     render_button(renderer, font, navigation_buttons.select_network);
     render_button(renderer, font, navigation_buttons.clear_import);
 }
 
+Gallery_layout gallery_layout(Navigation_buttons navigation_buttons)
+{
+    // the grid spans the width of the bottom buttons, between the title and the buttons
+    Gallery_layout layout;
+    layout.gap = ui_parameters.ui_padding_left;
+    layout.x = navigation_buttons.back.x;
+    int width = navigation_buttons.gallery_next.x + navigation_buttons.gallery_next.w - layout.x;
+    layout.cell_w = (width - (GALLERY_COLUMNS - 1) * layout.gap) / GALLERY_COLUMNS;
+    layout.cell_h = layout.cell_w * 3 / 4;
+    layout.y = ui_parameters.ui_top_bar_height + ui_parameters.font_size + (ui_parameters.font_size / 4);
+    int height = navigation_buttons.back.y - layout.gap - layout.y;
+    layout.rows = (height + layout.gap) / (layout.cell_h + layout.gap);
+    layout.rows = layout.rows < 1 ? 1 : layout.rows;
+    return layout;
+}
+
+void render_gallery_screen(SDL_Renderer * renderer, TTF_Font * font, Navigation_buttons navigation_buttons)
+{
+    static Gallery_item items[GALLERY_MAX_IMAGES];
+    int count = gallery_copy_items(items, GALLERY_MAX_IMAGES);
+    Gallery_layout layout = gallery_layout(navigation_buttons);
+
+    gallery_total_rows = (count + GALLERY_COLUMNS - 1) / GALLERY_COLUMNS;
+    int max_first_row = gallery_total_rows > layout.rows ? gallery_total_rows - layout.rows : 0;
+    gallery_first_row = gallery_first_row < 0 ? 0 : (gallery_first_row > max_first_row ? max_first_row : gallery_first_row);
+
+    int first = gallery_first_row * GALLERY_COLUMNS;
+    int last = first + layout.rows * GALLERY_COLUMNS;
+    last = last > count ? count : last;
+
+    char title[64];
+    if (count == 0)
+    {
+        strcpy(title, "No images imported yet.");
+    }
+    else
+    {
+        snprintf(title, sizeof(title), "Recent imports %d-%d of %d", first + 1, last, count);
+    }
+    render_text(renderer, font, title, ui_parameters.ui_padding_left, ui_parameters.ui_top_bar_height);
+
+    gallery_begin_frame();
+    for (int i = first; i < last; i++)
+    {
+        int cell = i - first;
+        SDL_Rect r = {layout.x + (cell % GALLERY_COLUMNS) * (layout.cell_w + layout.gap), layout.y + (cell / GALLERY_COLUMNS) * (layout.cell_h + layout.gap), layout.cell_w, layout.cell_h};
+
+        int w, h, failed;
+        SDL_Texture *thumbnail = gallery_thumbnail(renderer, &items[i], &w, &h, &failed);
+        if (thumbnail)
+        {
+            SDL_Rect dst = {r.x + (r.w - w) / 2, r.y + (r.h - h) / 2, w, h};
+            SDL_RenderCopy(renderer, thumbnail, NULL, &dst);
+        }
+        else
+        {
+            // placeholder while decoding, tinted red if the file could not be decoded
+            SDL_SetRenderDrawColor(renderer, failed ? 90 : 40, 40, 40, 255);
+            SDL_RenderFillRect(renderer, &r);
+        }
+
+        // green once sent to the server, yellow while pending
+        SDL_Color badge_color = items[i].uploaded ? ui_colors.green : ui_colors.yellow;
+        int badge_size = r.h / 5;
+        SDL_Rect badge = {r.x + r.w - badge_size - 3, r.y + 3, badge_size, badge_size};
+        SDL_SetRenderDrawColor(renderer, badge_color.r, badge_color.g, badge_color.b, 255);
+        SDL_RenderFillRect(renderer, &badge);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderDrawRect(renderer, &badge);
+    }
+    gallery_end_frame();
+
+    render_button(renderer, font, navigation_buttons.back);
+    if (gallery_total_rows > layout.rows)
+    {
+        render_button(renderer, font, navigation_buttons.gallery_next);
+    }
+}
+
 void render_network_connection_complete_screen(SDL_Renderer * renderer, TTF_Font * font, Navigation_buttons navigation_buttons)
 {
     char loading_statement[64];
@@ -476,27 +492,16 @@ void render_network_connection_complete_screen(SDL_Renderer * renderer, TTF_Font
 
 void render_loading_network_list_screen(SDL_Renderer * renderer, TTF_Font * font, Navigation_buttons navigation_buttons)
 {
+    // only shown until the Wi-Fi backend has its first access point list from NetworkManager
     render_loading_network_text(renderer, font);
-    if (!networks_scanned)
-    {
-        networks_scanned = 1;
-        pthread_t scan_networks;
-        pthread_create(&scan_networks, NULL, scan_networks_thread, NULL);
-        pthread_detach(scan_networks);
-    }
+    networks_ready = wifi_backend_ready;
 
     render_button(renderer, font, navigation_buttons.back);
 }
 
 void render_no_network_found(SDL_Renderer * renderer, TTF_Font * font, Navigation_buttons navigation_buttons)
 {
-    SDL_Surface *title_surf = TTF_RenderText_Solid(font, "No networks found. Retry?", ui_colors.white);
-    SDL_Texture *title_tex = SDL_CreateTextureFromSurface(renderer, title_surf);
-    SDL_Rect title_rect = {ui_parameters.ui_padding_left, ui_parameters.ui_top_bar_height, title_surf->w, title_surf->h};
-
-    SDL_RenderCopy(renderer, title_tex, NULL, &title_rect);
-    SDL_FreeSurface(title_surf);
-    SDL_DestroyTexture(title_tex);
+    render_text(renderer, font, "No networks found. Retry?", ui_parameters.ui_padding_left, ui_parameters.ui_top_bar_height);
 
     render_button(renderer, font, navigation_buttons.back);
     render_button(renderer, font, navigation_buttons.retry);
@@ -504,8 +509,18 @@ void render_no_network_found(SDL_Renderer * renderer, TTF_Font * font, Navigatio
     SDL_RenderPresent(renderer);
 }
 
+SDL_Rect select_network_row(int i)
+{
+    int select_text_height = ui_parameters.font_size + (ui_parameters.font_size / 20);
+    SDL_Rect r = {ui_parameters.ui_padding_left, (ui_parameters.font_size / 2) + (ui_parameters.ui_top_bar_height + select_text_height) + i * 2 * select_text_height, (ui_parameters.ui_padding_left * 48), ui_parameters.font_size * 1.5};
+    return r;
+}
+
 void render_select_network_screen(SDL_Renderer * renderer, TTF_Font * font, Navigation_buttons navigation_buttons)
 {
+    // the cache is kept current by NetworkManager signals, so every frame shows the latest list; taps are matched in the event loop against this copy
+    net_count = wifi_copy_networks(networks, MAX_NETWORKS);
+
     if (net_count < 1)
     {
         select_network_index = -1;
@@ -513,18 +528,11 @@ void render_select_network_screen(SDL_Renderer * renderer, TTF_Font * font, Navi
         return;
     }
 
-    int select_text_height = ui_parameters.font_size + (ui_parameters.font_size / 20);
-
-    SDL_Surface *title_surf = TTF_RenderText_Solid(font, "Select Wi-Fi network:", ui_colors.white);
-    SDL_Texture *title_tex = SDL_CreateTextureFromSurface(renderer, title_surf);
-    SDL_Rect title_rect = {ui_parameters.ui_padding_left, ui_parameters.ui_top_bar_height, title_surf->w, title_surf->h};
-    SDL_RenderCopy(renderer, title_tex, NULL, &title_rect);
-    SDL_FreeSurface(title_surf);
-    SDL_DestroyTexture(title_tex);
+    render_text(renderer, font, "Select Wi-Fi network:", ui_parameters.ui_padding_left, ui_parameters.ui_top_bar_height);
 
     for (int i = 0; i < net_count; i++)
     {
-        SDL_Rect r = {ui_parameters.ui_padding_left, (ui_parameters.font_size / 2) + (ui_parameters.ui_top_bar_height + select_text_height) + i * 2 * select_text_height, (ui_parameters.ui_padding_left * 48), ui_parameters.font_size * 1.5};
+        SDL_Rect r = select_network_row(i);
 
         SDL_SetRenderDrawColor(renderer, 40, 40, 40, 255);
         SDL_RenderFillRect(renderer, &r);
@@ -532,18 +540,18 @@ void render_select_network_screen(SDL_Renderer * renderer, TTF_Font * font, Navi
         SDL_RenderDrawRect(renderer, &r);
 
         char network_name[32];
-        clip_string(network_name, networks[i].ssid, 32);
-        SDL_Surface *s = TTF_RenderText_Solid(font, network_name, ui_colors.white);
-        SDL_Texture *t = SDL_CreateTextureFromSurface(renderer, s);
-        SDL_Rect dst = {r.x + 10, r.y + (r.h - s->h)/2, s->w, s->h};
-        SDL_RenderCopy(renderer, t, NULL, &dst);
-        SDL_FreeSurface(s);
-        SDL_DestroyTexture(t);
-
-        if (last_click.x >= r.x && last_click.x <= r.x + r.w && last_click.y >= r.y && last_click.y <= r.y + r.h)
+        char network_label[64];
+        clip_string(network_name, networks[i].ssid, 24);
+        snprintf(network_label, sizeof(network_label), "%s (%s)", network_name, networks[i].security);
+        Text_cache_entry *label = text_cache_get(renderer, font, network_label, ui_colors.white, 0);
+        if (label)
         {
-            select_network_index = i;
+            SDL_Rect dst = {r.x + 10, r.y + (r.h - label->h)/2, label->w, label->h};
+            SDL_RenderCopy(renderer, label->texture, NULL, &dst);
         }
+
+        int bar_size = (int)(r.h * 0.66);
+        render_signal_indicator(renderer, r.x + r.w - bar_size - 10, r.y + (r.h - bar_size) / 2, bar_size, bar_size, networks[i].strength);
     }
 
     render_button(renderer, font, navigation_buttons.back);
@@ -552,65 +560,27 @@ void render_select_network_screen(SDL_Renderer * renderer, TTF_Font * font, Navi
 
 void render_attempting_network_connection_screen(SDL_Renderer *renderer, TTF_Font *font, Navigation_buttons navigation_buttons)
 {
-    networks_scanned = 0; // reset networks have been scanned. If they hit back, or the scan completes, we want a new network list
-
     char loading_statement[64] = "Attempting to connect to network";
     create_text_with_dynamic_elipsis(loading_statement, 64);
-
-    SDL_Surface *title_surf = TTF_RenderText_Solid(font, loading_statement, ui_colors.white);
-    SDL_Texture *title_tex = SDL_CreateTextureFromSurface(renderer, title_surf);
-    SDL_Rect title_rect = {ui_parameters.ui_padding_left, ui_parameters.ui_top_bar_height, title_surf->w, title_surf->h};
-
-    SDL_RenderCopy(renderer, title_tex, NULL, &title_rect);
-    SDL_FreeSurface(title_surf);
-    SDL_DestroyTexture(title_tex);
+    render_text(renderer, font, loading_statement, ui_parameters.ui_padding_left, ui_parameters.ui_top_bar_height);
     SDL_RenderPresent(renderer);
 
     if (!has_attempted_connection)
     {
-        _log(LOG_GENERAL, "Attempting to connect to network...");
         network_connect_complete_status = 0;
         network_connect_complete = 0;
         has_attempted_connection = 1;
-        conn_pid = fork();
-        if (conn_pid == 0)
-        {
-            // call the existing blocking function in the child
-            _log(LOG_GENERAL, "Connection attempt initiated.");
-            int ret = connect_to_network(networks[select_network_index].ssid);
-            _exit(ret);
-        }
+        wifi_connect_async(select_network_ssid);
     }
 
-    if (conn_pid > 0)
+    // the result is delivered by NetworkManager's state-changed signal on the wifi thread
+    if (wifi_connect_state == WIFI_CONNECT_SUCCEEDED || wifi_connect_state == WIFI_CONNECT_FAILED)
     {
-        int status;
-        pid_t result = waitpid(conn_pid, &status, WNOHANG);
-        if (result > 0)
-        {
-            if (WIFEXITED(status))
-            {
-                conn_status = WEXITSTATUS(status);
-            }
-
-            conn_pid = 0;
-
-            if (conn_status != 0)
-            {
-                _log(LOG_GENERAL, "Network connection failed: %d", conn_status);
-                network_connect_complete_status = -1;
-            }
-            else
-            {
-                _log(LOG_ERROR, "Network connected successfully");
-                network_connect_complete_status = 1;
-            }
-
-            network_connect_complete = 1;
-            networks_ready = 0;
-            select_network_index = -1;
-            has_attempted_connection = 0;
-        }
+        network_connect_complete_status = wifi_connect_state == WIFI_CONNECT_SUCCEEDED ? 1 : -1;
+        network_connect_complete = 1;
+        wifi_connect_state = WIFI_CONNECT_IDLE;
+        select_network_index = -1;
+        has_attempted_connection = 0;
     }
 
     render_button(renderer, font, navigation_buttons.back);
@@ -680,7 +650,7 @@ void render_clear_imports_complete_screen(SDL_Renderer * renderer, TTF_Font * fo
         delete_images_in_import_folder();
         clear_track_file();
         clear_log_file();
-        _log(LOG_GENERAL, "Log file cleared by user.");
+        _log_sub(LOG_SUBSYSTEM_UI, LOG_GENERAL, "Log file cleared by user.");
     }
 
     char confirmation_text[] = "Imported images have been deleted from device.";
@@ -689,17 +659,29 @@ void render_clear_imports_complete_screen(SDL_Renderer * renderer, TTF_Font * fo
     render_button(renderer, font, navigation_buttons.back);
 }
 
-void render_frame(SDL_Renderer * renderer, TTF_Font * font, Program_status *program_status, Navigation_buttons navigation_buttons)
+void render_frame(SDL_Renderer * renderer, TTF_Font * font, Navigation_buttons navigation_buttons)
 {
+    Trace_span span = trace_begin("render_frame", "ui");
+
+    // one consistent copy of the shared status for the whole frame
+    Status_snapshot status;
+    status_read(&status);
+
+    ui_animating = 0;
+    ui_upload_graph_shown = 0;
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
 
-    render_header(renderer, font);
+    render_header(renderer, font, &status);
 
     switch (current_screen)
     {
         case SCREEN_MAIN:
-            render_main_screen(renderer, font, program_status, navigation_buttons);
+            render_main_screen(renderer, font, &status, navigation_buttons);
+            break;
+
+        case SCREEN_GALLERY:
+            render_gallery_screen(renderer, font, navigation_buttons);
             break;
 
         case SCREEN_NETWORK_CONFIG:
@@ -716,43 +698,112 @@ void render_frame(SDL_Renderer * renderer, TTF_Font * font, Program_status *prog
     }
 
     SDL_RenderPresent(renderer);
-    SDL_Delay(16);
+    atomic_fetch_add(&ui_frames_rendered, 1);
+    trace_end(span);
+}
+
+int ui_screen_state_changed()
+{
+    // render functions advance some navigation state themselves, and each change needs one more frame
+    static int last_state[6] = {-2, -2, -2, -2, -2, -2};
+    int state[6] = {current_screen, select_network_index, network_connect_complete, networks_ready, has_attempted_connection, clear_all_imports};
+
+    int changed = memcmp(state, last_state, sizeof(state)) != 0;
+    memcpy(last_state, state, sizeof(state));
+    return changed;
 }
 
-void handle_events(SDL_Event e, Navigation_buttons navigation_buttons)
+// handles the event that woke the UI loop and any queued behind it, returning 1 if the screen needs redrawing
+int handle_events(SDL_Event *first, Navigation_buttons navigation_buttons)
 {
-    while (SDL_PollEvent(&e)) 
+    Trace_span span = trace_begin("handle_events", "ui");
+    int redraw = 0;
+    SDL_Event event = *first;
+    SDL_Event *e = &event;
+
+    do
     {
+        if (e->type == ui_redraw_event_type)
+        {
+            atomic_store(&ui_redraw_pending, 0);
+            redraw = 1;
+        }
+        else if (e->type == SDL_WINDOWEVENT)
+        {
+            redraw = 1;
+        }
+
         // Detect if program has been closed by user
-        if (e.type == SDL_QUIT)
+        if (e->type == SDL_QUIT)
         {
             stop_requested = 1;
         }
 
+        // the gallery scrolls with the mouse wheel or a vertical swipe
+        if (current_screen == SCREEN_GALLERY && e->type == SDL_MOUSEWHEEL)
+        {
+            gallery_first_row -= e->wheel.y;
+            redraw = 1;
+        }
+        else if (current_screen == SCREEN_GALLERY && e->type == SDL_MOUSEBUTTONUP && swipe_start_y >= 0)
+        {
+            Gallery_layout layout = gallery_layout(navigation_buttons);
+            int dy = e->button.y - swipe_start_y;
+            if (dy > layout.cell_h / 2 || dy < -layout.cell_h / 2)
+            {
+                int rows = -dy / (layout.cell_h + layout.gap);
+                gallery_first_row += rows != 0 ? rows : (dy < 0 ? 1 : -1);
+                redraw = 1;
+            }
+            swipe_start_y = -1;
+        }
+
         // determine if a button was clicked
-        if (e.type == SDL_MOUSEBUTTONDOWN)
+        if (e->type == SDL_MOUSEBUTTONDOWN)
         {
-            last_click.x = e.button.x;
-            last_click.y = e.button.y;
+            redraw = 1;
+            last_click.x = e->button.x;
+            last_click.y = e->button.y;
+            swipe_start_y = e->button.y;
 
             switch (current_screen)
             {
                 case SCREEN_MAIN:
                     if (navigation_button_is_pressed(navigation_buttons.select_network, last_click.x, last_click.y))
                     {
+                        wifi_request_scan();
                         current_screen = navigation_buttons.select_network.target_screen;
                     }
                     else if (navigation_button_is_pressed(navigation_buttons.clear_import, last_click.x, last_click.y))
                     {
                         current_screen = navigation_buttons.clear_import.target_screen;
                     }
+                    else if (navigation_button_is_pressed(navigation_buttons.gallery, last_click.x, last_click.y))
+                    {
+                        gallery_first_row = 0;
+                        gallery_set_active(1);
+                        current_screen = navigation_buttons.gallery.target_screen;
+                    }
+                    break;
+
+                case SCREEN_GALLERY:
+                    if (navigation_button_is_pressed(navigation_buttons.back, last_click.x, last_click.y))
+                    {
+                        gallery_set_active(0);
+                        current_screen = navigation_buttons.back.target_screen;
+                    }
+                    else if (navigation_button_is_pressed(navigation_buttons.gallery_next, last_click.x, last_click.y))
+                    {
+                        // a page further back, wrapping to the newest after the oldest
+                        int rows = gallery_layout(navigation_buttons).rows;
+                        gallery_first_row = gallery_first_row + rows >= gallery_total_rows ? 0 : gallery_first_row + rows;
+                        swipe_start_y = -1;
+                    }
                     break;
 
                 case SCREEN_NETWORK_CONFIG:
                     if (navigation_button_is_pressed(navigation_buttons.back, last_click.x, last_click.y))
                     {
-                        networks_ready = 0;
-                        networks_scanned = 0; // reset network scan status
                         select_network_index = -1;
                         network_connect_complete = 0;
                         network_connect_complete_status = 0;
@@ -760,8 +811,26 @@ void handle_events(SDL_Event e, Navigation_buttons navigation_buttons)
                     }
                     else if (navigation_button_is_pressed(navigation_buttons.retry, last_click.x, last_click.y))
                     {
+                        select_network_index = -1;
+                        network_connect_complete = 0;
+                        network_connect_complete_status = 0;
+                        wifi_request_scan();
                         current_screen = navigation_buttons.retry.target_screen;
                     }
+                    else if (networks_ready && select_network_index < 0 && !(network_connect_complete == 1 && network_connect_complete_status != 0))
+                    {
+                        // the rows on screen are the last copy drawn; the next frame re-copies the cache, which may have been re-sorted
+                        for (int i = 0; i < net_count; i++)
+                        {
+                            SDL_Rect r = select_network_row(i);
+                            if (last_click.x >= r.x && last_click.x <= r.x + r.w && last_click.y >= r.y && last_click.y <= r.y + r.h)
+                            {
+                                snprintf(select_network_ssid, sizeof(select_network_ssid), "%s", networks[i].ssid);
+                                select_network_index = i;
+                                break;
+                            }
+                        }
+                    }
                     break;
 
                 case SCREEN_CLEAR_IMPORTS_CONFIRMATION:
@@ -786,10 +855,41 @@ void handle_events(SDL_Event e, Navigation_buttons navigation_buttons)
                     break;
             }
         }
+    } while (SDL_PollEvent(e));
+
+    trace_end(span);
+    return redraw;
+}
+
+void ui_log_stats(time_t *window_start, unsigned long long *window_frames, uint64_t *window_cpu_us)
+{
+    time_t now = time(NULL);
+    if (now - *window_start < UI_STATS_INTERVAL_S)
+    {
+        return;
     }
+
+    unsigned long long frames = atomic_load(&ui_frames_rendered);
+    uint64_t cpu_us = atomic_load(&ui_cpu_us);
+    double elapsed_s = (double)(now - *window_start);
+    _log_sub(LOG_SUBSYSTEM_UI, LOG_GENERAL, "UI rendered %.0f frame(s) per minute using %.1f%% CPU.",
+        (frames - *window_frames) * 60.0 / elapsed_s, (cpu_us - *window_cpu_us) / (elapsed_s * 10000.0));
+
+    *window_start = now;
+    *window_frames = frames;
+    *window_cpu_us = cpu_us;
+}
+
+// scales the font and spacing to the screen; the font has to be opened at ui_parameters.font_size afterwards
+void ui_size_parameters(int screen_width, int screen_height)
+{
+    ui_parameters.font_size = screen_height / 20;
+    ui_parameters.ui_padding_top = screen_width / 50; // font size + 2%
+    ui_parameters.ui_padding_left = screen_width / 50; // 2%
+    ui_parameters.ui_top_bar_height = ui_parameters.ui_padding_top + ui_parameters.font_size + (ui_parameters.font_size / 4);
 }
 
-void run_UI(Program_status *program_status, int full_screen_mode)
+void run_UI(int full_screen_mode)
 {
     SDL_Window *window;
     SDL_Renderer *renderer;
@@ -807,11 +907,7 @@ void run_UI(Program_status *program_status, int full_screen_mode)
 
     int screen_width, screen_height;
     SDL_GetRendererOutputSize(renderer, &screen_width, &screen_height);
-
-    ui_parameters.font_size = screen_height / 20;
-    ui_parameters.ui_padding_top = screen_width / 50; // font size + 2%
-    ui_parameters.ui_padding_left = screen_width / 50; // 2%
-    ui_parameters.ui_top_bar_height = ui_parameters.ui_padding_top + ui_parameters.font_size + (ui_parameters.font_size / 4);
+    ui_size_parameters(screen_width, screen_height);
 
     TTF_Font *font = TTF_OpenFont("Rubik/Rubik-VariableFont_wght.ttf", ui_parameters.font_size);
     if (!font)
@@ -825,15 +921,61 @@ void run_UI(Program_status *program_status, int full_screen_mode)
     }
 
     Navigation_buttons navigation_buttons = initialize_navigation_buttons(screen_width, screen_height);
+    Gallery_layout layout = gallery_layout(navigation_buttons);
+    gallery_set_thumbnail_size(layout.cell_w, layout.cell_h);
     SDL_Event e;
+    int redraw = 1;
+    Uint32 animation_step = 0;
+    long upload_bucket = 0;
+
+    time_t stats_start = time(NULL);
+    unsigned long long stats_frames = 0;
+    uint64_t stats_cpu_us = ui_thread_cpu_us();
 
     while (!stop_requested) 
     {
-        // run the program continuously unless a program stop has been requested
-        handle_events(e, navigation_buttons);
-        render_frame(renderer, font, program_status, navigation_buttons);
+        // sleep until input, a state change from another thread, or the next ellipsis step
+        if (redraw)
+        {
+            render_frame(renderer, font, navigation_buttons);
+            animation_step = SDL_GetTicks() / UI_ANIMATION_TICK_MS;
+            upload_bucket = upload_rate_bucket_now();
+            redraw = ui_screen_state_changed();
+        }
+
+        int timeout = redraw ? 0 : UI_IDLE_WAKE_MS;
+        if (ui_animating && !redraw)
+        {
+            int until_step = UI_ANIMATION_TICK_MS - SDL_GetTicks() % UI_ANIMATION_TICK_MS;
+            timeout = until_step < timeout ? until_step : timeout;
+        }
+        if (ui_upload_graph_shown && !redraw)
+        {
+            int until_bucket = upload_rate_ms_until_next_bucket();
+            timeout = until_bucket < timeout ? until_bucket : timeout;
+        }
+
+        if (SDL_WaitEventTimeout(&e, timeout))
+        {
+            redraw |= handle_events(&e, navigation_buttons);
+        }
+        atomic_fetch_add(&ui_wakeups, 1);
+
+        if (ui_animating && SDL_GetTicks() / UI_ANIMATION_TICK_MS != animation_step)
+        {
+            redraw = 1;
+        }
+        if (ui_upload_graph_shown && upload_rate_bucket_now() != upload_bucket)
+        {
+            redraw = 1;
+        }
+
+        atomic_store(&ui_cpu_us, ui_thread_cpu_us());
+        ui_log_stats(&stats_start, &stats_frames, &stats_cpu_us);
     }
 
+    gallery_clear();
+    text_cache_clear();
     TTF_CloseFont(font);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
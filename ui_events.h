@@ -0,0 +1,77 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+* The UI only redraws when something it shows has changed. Threads that change displayed
+* state call ui_request_redraw(), which pushes one SDL user event to wake the UI loop out of
+* SDL_WaitEventTimeout; requests made before that event is handled are coalesced into it.
+* In headless mode the same call wakes the status file writer instead. Frame and CPU
+* counters make the redraw rate visible in the metrics and the log.
+*/
+
+#define UI_ANIMATION_TICK_MS 500 // loading ellipsis step
+#define UI_IDLE_WAKE_MS 250 // upper bound on how long a stop request can go unnoticed
+#define UI_STATS_INTERVAL_S 60
+
+pthread_mutex_t ui_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ui_state_cond = PTHREAD_COND_INITIALIZER;
+unsigned long ui_state_version = 0;
+
+#ifndef HEADLESS
+Uint32 ui_redraw_event_type = 0; // 0 until ui_events_init() registers it after SDL_Init
+atomic_int ui_redraw_pending;
+
+atomic_ullong ui_frames_rendered;
+atomic_ullong ui_wakeups;
+atomic_ullong ui_cpu_us; // CPU time used by the UI thread, sampled by the UI loop
+
+void ui_events_init()
+{
+    Uint32 type = SDL_RegisterEvents(1);
+    ui_redraw_event_type = type == (Uint32)-1 ? 0 : type;
+}
+#endif
+
+void ui_request_redraw()
+{
+    pthread_mutex_lock(&ui_state_mutex);
+    ui_state_version++;
+    pthread_cond_broadcast(&ui_state_cond);
+    pthread_mutex_unlock(&ui_state_mutex);
+
+#ifndef HEADLESS
+    if (!ui_redraw_event_type || atomic_exchange(&ui_redraw_pending, 1))
+    {
+        return;
+    }
+
+    SDL_Event event;
+    memset(&event, 0, sizeof(event));
+    event.type = ui_redraw_event_type;
+    if (SDL_PushEvent(&event) != 1)
+    {
+        atomic_store(&ui_redraw_pending, 0);
+    }
+#endif
+}
+
+// blocks until ui_request_redraw() is called after *seen_version was taken, or timeout_s passes
+void ui_wait_for_state_change(unsigned long *seen_version, int timeout_s)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_s;
+
+    pthread_mutex_lock(&ui_state_mutex);
+    while (ui_state_version == *seen_version && !stop_requested && pthread_cond_timedwait(&ui_state_cond, &ui_state_mutex, &deadline) == 0);
+    *seen_version = ui_state_version;
+    pthread_mutex_unlock(&ui_state_mutex);
+}
+
+uint64_t ui_thread_cpu_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
@@ -0,0 +1,311 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+* Upload progress for the main screen and the status file: the files being sent (fed by
+* curl's transfer-progress callbacks), the backlog still waiting, and a history of bytes
+* sent per UPLOAD_RATE_BUCKET_S interval in a fixed ring. The rate over the last
+* UPLOAD_RATE_WINDOW buckets is kept as a running sum updated as buckets complete, so
+* reading the rate or drawing the history never walks more than the ring itself.
+*/
+
+#define UPLOAD_RATE_BUCKETS 60 // five minutes of history
+#define UPLOAD_RATE_BUCKET_S 5
+#define UPLOAD_RATE_WINDOW 12 // one minute average for the rate and ETA, must be below UPLOAD_RATE_BUCKETS
+#define UPLOAD_PROGRESS_REDRAW_MS 500
+#define UPLOAD_TRANSFERS_MAX 4 // also the highest UPLOAD_CONCURRENCY
+#define UPLOAD_THROTTLE_MIN_BURST 4096
+
+typedef struct
+{
+    char file[256];
+    uint64_t sent;
+    uint64_t total;
+    unsigned long started; // orders transfers so the screen follows the oldest one
+    int active;
+} Upload_transfer;
+
+typedef struct
+{
+    uint64_t buckets[UPLOAD_RATE_BUCKETS];
+    long current_bucket; // absolute index (monotonic seconds / UPLOAD_RATE_BUCKET_S) of the bucket being filled
+    uint64_t window_bytes; // bytes in the newest UPLOAD_RATE_WINDOW complete buckets
+    Upload_transfer transfers[UPLOAD_TRANSFERS_MAX];
+    unsigned long transfers_started;
+    uint64_t last_redraw_ms;
+} Upload_progress;
+
+typedef struct
+{
+    uint64_t history[UPLOAD_RATE_BUCKETS]; // oldest first, the last entry is the bucket being filled
+    double rate_bps;
+    long long backlog_images;
+    long long backlog_bytes;
+    long eta_s; // -1 while nothing is being sent
+    char file[256]; // the oldest transfer still running
+    int file_percent;
+    int active; // transfers running
+} Upload_snapshot;
+
+Upload_progress upload_progress;
+pthread_mutex_t upload_progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// imported images not yet uploaded, kept current by the worker as each upload completes
+atomic_llong upload_backlog_images;
+atomic_llong upload_backlog_bytes;
+
+// total send rate across transfers in KB/s, 0 for none; set from config.json and the control socket
+atomic_int upload_rate_limit_kb_s;
+pthread_mutex_t upload_throttle_mutex = PTHREAD_MUTEX_INITIALIZER;
+double upload_throttle_tokens = 0;
+uint64_t upload_throttle_last_ms = 0;
+
+static uint64_t upload_progress_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+// moves the ring forward to the bucket for now; called with upload_progress_mutex held
+static void upload_rate_advance(uint64_t now_ms)
+{
+    long bucket = (long)(now_ms / 1000 / UPLOAD_RATE_BUCKET_S);
+    Upload_progress *p = &upload_progress;
+
+    if (bucket - p->current_bucket > UPLOAD_RATE_BUCKETS)
+    {
+        memset(p->buckets, 0, sizeof(p->buckets));
+        p->window_bytes = 0;
+        p->current_bucket = bucket;
+        return;
+    }
+
+    while (p->current_bucket < bucket)
+    {
+        // the bucket just completed joins the window and the oldest one in it drops out
+        long completed = p->current_bucket;
+        p->window_bytes += p->buckets[completed % UPLOAD_RATE_BUCKETS];
+        p->window_bytes -= p->buckets[(completed - UPLOAD_RATE_WINDOW + UPLOAD_RATE_BUCKETS) % UPLOAD_RATE_BUCKETS];
+        p->current_bucket++;
+        p->buckets[p->current_bucket % UPLOAD_RATE_BUCKETS] = 0;
+    }
+}
+
+// the history graph scrolls once per bucket, so a UI showing it wakes at each bucket boundary
+long upload_rate_bucket_now()
+{
+    return (long)(upload_progress_now_ms() / 1000 / UPLOAD_RATE_BUCKET_S);
+}
+
+int upload_rate_ms_until_next_bucket()
+{
+    return UPLOAD_RATE_BUCKET_S * 1000 - (int)(upload_progress_now_ms() % (UPLOAD_RATE_BUCKET_S * 1000));
+}
+
+void upload_progress_set_backlog(long long images, long long bytes)
+{
+    atomic_store(&upload_backlog_images, images);
+    atomic_store(&upload_backlog_bytes, bytes);
+}
+
+// an image left the backlog, from whichever upload lane sent it
+void upload_progress_sent(long long bytes)
+{
+    atomic_fetch_sub(&upload_backlog_images, 1);
+    atomic_fetch_sub(&upload_backlog_bytes, bytes);
+}
+
+// returns the slot the transfer reports its progress under, or -1 if all are in use
+int upload_progress_begin(const char *filename, uint64_t total)
+{
+    int slot = -1;
+    pthread_mutex_lock(&upload_progress_mutex);
+    upload_rate_advance(upload_progress_now_ms());
+    for (int i = 0; i < UPLOAD_TRANSFERS_MAX && slot < 0; i++)
+    {
+        if (!upload_progress.transfers[i].active)
+        {
+            slot = i;
+        }
+    }
+    if (slot >= 0)
+    {
+        Upload_transfer *transfer = &upload_progress.transfers[slot];
+        snprintf(transfer->file, sizeof(transfer->file), "%s", filename);
+        transfer->sent = 0;
+        transfer->total = total;
+        transfer->started = upload_progress.transfers_started++;
+        transfer->active = 1;
+    }
+    pthread_mutex_unlock(&upload_progress_mutex);
+    ui_request_redraw();
+    return slot;
+}
+
+// called from curl's transfer-progress callback with the bytes sent so far for the file in slot
+void upload_progress_update(int slot, uint64_t sent)
+{
+    if (slot < 0)
+    {
+        return;
+    }
+
+    uint64_t now_ms = upload_progress_now_ms();
+    int redraw = 0;
+
+    pthread_mutex_lock(&upload_progress_mutex);
+    upload_rate_advance(now_ms);
+    Upload_transfer *transfer = &upload_progress.transfers[slot];
+    if (sent > transfer->sent)
+    {
+        upload_progress.buckets[upload_progress.current_bucket % UPLOAD_RATE_BUCKETS] += sent - transfer->sent;
+        transfer->sent = sent;
+    }
+    if (now_ms - upload_progress.last_redraw_ms >= UPLOAD_PROGRESS_REDRAW_MS)
+    {
+        upload_progress.last_redraw_ms = now_ms;
+        redraw = 1;
+    }
+    pthread_mutex_unlock(&upload_progress_mutex);
+
+    if (redraw)
+    {
+        ui_request_redraw();
+    }
+}
+
+void upload_progress_end(int slot)
+{
+    if (slot < 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&upload_progress_mutex);
+    upload_progress.transfers[slot].active = 0;
+    upload_progress.transfers[slot].file[0] = '\0';
+    pthread_mutex_unlock(&upload_progress_mutex);
+    ui_request_redraw();
+}
+
+// percent sent of filename if it is being uploaded, otherwise -1
+int upload_progress_file_percent(const char *filename)
+{
+    int percent = -1;
+    pthread_mutex_lock(&upload_progress_mutex);
+    for (int i = 0; i < UPLOAD_TRANSFERS_MAX; i++)
+    {
+        const Upload_transfer *transfer = &upload_progress.transfers[i];
+        if (transfer->active && strcmp(transfer->file, filename) == 0)
+        {
+            percent = transfer->total ? (int)(transfer->sent * 100 / transfer->total) : 0;
+        }
+    }
+    pthread_mutex_unlock(&upload_progress_mutex);
+    return percent;
+}
+
+void upload_progress_snapshot(Upload_snapshot *out)
+{
+    pthread_mutex_lock(&upload_progress_mutex);
+    upload_rate_advance(upload_progress_now_ms());
+    const Upload_progress *p = &upload_progress;
+    for (int i = 0; i < UPLOAD_RATE_BUCKETS; i++)
+    {
+        out->history[i] = p->buckets[(p->current_bucket + 1 + i) % UPLOAD_RATE_BUCKETS];
+    }
+    out->rate_bps = (double)p->window_bytes / (UPLOAD_RATE_WINDOW * UPLOAD_RATE_BUCKET_S);
+
+    const Upload_transfer *oldest = NULL;
+    uint64_t file_sent = 0;
+    out->active = 0;
+    for (int i = 0; i < UPLOAD_TRANSFERS_MAX; i++)
+    {
+        const Upload_transfer *transfer = &p->transfers[i];
+        if (transfer->active)
+        {
+            out->active++;
+            file_sent += transfer->sent;
+            oldest = !oldest || transfer->started < oldest->started ? transfer : oldest;
+        }
+    }
+    snprintf(out->file, sizeof(out->file), "%s", oldest ? oldest->file : "");
+    out->file_percent = oldest && oldest->total ? (int)(oldest->sent * 100 / oldest->total) : 0;
+    pthread_mutex_unlock(&upload_progress_mutex);
+
+    out->backlog_images = atomic_load(&upload_backlog_images);
+    out->backlog_bytes = atomic_load(&upload_backlog_bytes);
+    long long remaining = out->backlog_bytes - (long long)file_sent;
+    remaining = remaining < 0 ? 0 : remaining;
+    out->eta_s = out->rate_bps > 0 ? (long)(remaining / out->rate_bps) : -1;
+}
+
+/*
+* Shared token bucket behind upload_rate_limit_kb_s, called from curl's read callbacks:
+* returns how many of want bytes may be sent now, sleeping until at least some may. The
+* limit is read on every call so a change applies to transfers already running.
+*/
+size_t upload_throttle(size_t want)
+{
+    while (!stop_requested)
+    {
+        int limit = atomic_load(&upload_rate_limit_kb_s);
+        if (limit <= 0)
+        {
+            return want;
+        }
+
+        double rate = limit * 1000.0;
+        double burst = rate / 4 > UPLOAD_THROTTLE_MIN_BURST ? rate / 4 : UPLOAD_THROTTLE_MIN_BURST;
+        double needed = want < 1024 ? want : 1024;
+        uint64_t now_ms = upload_progress_now_ms();
+
+        pthread_mutex_lock(&upload_throttle_mutex);
+        upload_throttle_tokens += (now_ms - upload_throttle_last_ms) * rate / 1000;
+        upload_throttle_tokens = upload_throttle_tokens > burst ? burst : upload_throttle_tokens;
+        upload_throttle_last_ms = now_ms;
+        if (upload_throttle_tokens >= needed)
+        {
+            size_t allowed = upload_throttle_tokens < want ? (size_t)upload_throttle_tokens : want;
+            upload_throttle_tokens -= allowed;
+            pthread_mutex_unlock(&upload_throttle_mutex);
+            return allowed;
+        }
+        double wait_ms = (needed - upload_throttle_tokens) * 1000 / rate;
+        pthread_mutex_unlock(&upload_throttle_mutex);
+
+        usleep((useconds_t)(wait_ms < 100 ? wait_ms + 1 : 100) * 1000);
+    }
+    return want;
+}
+
+void format_bytes(char *out, size_t size, double bytes)
+{
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while (bytes >= 1000 && unit < 4)
+    {
+        bytes /= 1000;
+        unit++;
+    }
+    snprintf(out, size, bytes < 10 && unit > 0 ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+}
+
+void format_duration(char *out, size_t size, long seconds)
+{
+    if (seconds < 60)
+    {
+        snprintf(out, size, "%lds", seconds);
+    }
+    else if (seconds < 3600)
+    {
+        snprintf(out, size, "%ldm", (seconds + 30) / 60);
+    }
+    else
+    {
+        snprintf(out, size, "%ldh %ldm", seconds / 3600, (seconds % 3600) / 60);
+    }
+}
@@ -20,6 +20,63 @@ GPContext *global_context = NULL;
 
 volatile int camera_initialized = 0;
 volatile int camera_busy_flag = 0;
+atomic_int files_imported_this_pass; // counted as staging writes complete
+int storage_full_this_pass = 0;
+int camera_ever_connected = 0;
+
+typedef enum
+{
+    UPLOAD_QUEUED,
+    UPLOAD_SENDING,
+    UPLOAD_SENT,
+    UPLOAD_FAILED,
+    UPLOAD_DEFERRED // mirror copy skipped while the mirror is unhealthy
+} UPLOAD_STATE;
+
+const char *upload_state_names[] = {"queued", "sending", "sent", "failed", "deferred"};
+
+typedef struct
+{
+    char name[256];
+    long long size;
+    UPLOAD_STATE state;
+    int destination; // index of the mirror this copy is for, or -1 to deliver wherever destination_route() says
+    int sent_to; // destination that has it or is sending it, -1 until then
+    Exif_info exif; // from queued_images; deliveries go out in capture order
+    int rejected; // by the reject filter in "defer" mode, so sent after the rest
+    unsigned long front; // from queued_images
+} Pending_upload;
+
+// what the scan keeps about an image from pass to pass
+typedef struct
+{
+    Exif_info exif; // parsed by fetch_file(), or read from the card by the first scan after a restart
+    unsigned long front; // when the control socket moved it to the front, so the newest goes first; 0 if never
+    unsigned long scan; // the last upload scan that queued it
+} Queued_image;
+
+/*
+* Images found waiting by the last upload scan, reused from pass to pass. Upload lanes take
+* them in order from pending_upload_next, so everything before it is being sent or done and
+* the control socket can reorder what comes after. Guarded by upload_queue_mutex.
+*/
+Pending_upload *pending_uploads = NULL;
+int pending_upload_count = 0;
+int pending_upload_capacity = 0;
+int pending_upload_next = 0;
+pthread_mutex_t upload_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t upload_queue_cond = PTHREAD_COND_INITIALIZER;
+unsigned upload_lanes_running = 0; // bit per lane id
+
+// Queued_image by relative name, for every image imported or queued since the last scan; guarded by upload_queue_mutex
+GHashTable *queued_images = NULL;
+unsigned long upload_scans = 0;
+unsigned long upload_front_moves = 0;
+
+// live settings, seeded from config.json and changed through the control socket
+atomic_int upload_concurrency;
+atomic_int uploads_paused;
+atomic_int imports_paused;
 
 void kill_device_mount_to_camera()
 {
@@ -41,7 +98,10 @@ void acquire_camera_name(Program_status *program_status)
     }
 
     CameraText text;
-    if (gp_camera_get_summary(global_camera, &text, global_context) == GP_OK)
+    uint64_t start_us = usb_stats_now_us();
+    int ret = gp_camera_get_summary(global_camera, &text, global_context);
+    usb_stats_record(USB_OP_SUMMARY, start_us, ret, 0);
+    if (ret == GP_OK)
     {
         // Reserve 128 bytes total: leave ~16 for formatting
         char manufacturer[48] = {0};
@@ -77,7 +137,7 @@ void acquire_camera_name(Program_status *program_status)
         strncpy(program_status->camera_serial_number, serial, sizeof(program_status->camera_serial_number) - 1);
         program_status->camera_serial_number[sizeof(program_status->camera_serial_number) - 1] = '\0';
 
-        _log(LOG_GENERAL, "Acquired camera name: %s, S/N: %s.", program_status->camera_name, program_status->camera_serial_number);
+        _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Acquired camera name: %s, S/N: %s.", program_status->camera_name, program_status->camera_serial_number);
     }
     else
     {
@@ -89,22 +149,52 @@ void acquire_camera_name(Program_status *program_status)
 
             program_status->camera_serial_number[0] = '\0';
 
-            _log(LOG_GENERAL, "Acquired camera name: %s, S/N: %s.", program_status->camera_name, program_status->camera_serial_number);
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Acquired camera name: %s, S/N: %s.", program_status->camera_name, program_status->camera_serial_number);
         }
         else
         {
             program_status->camera_name[0] = '\0';
             program_status->camera_serial_number[0] = '\0';
-            _log(LOG_ERROR, "Could not acquire camera name.");
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Could not acquire camera name.");
         }
     }
 }
 
+void count_camera_connection()
+{
+    // the first connection after start up is not a reconnect
+    if (camera_ever_connected)
+    {
+        metrics_count_camera_reconnect();
+    }
+    camera_ever_connected = 1;
+}
+
+void worker_publish_status(Program_status *program_status)
+{
+    // publish and wake the UI only when something it shows has changed
+    static Program_status last_published;
+    static int last_camera_found = 0;
+
+    if (camera_found != last_camera_found || program_status->status != last_published.status
+        || program_status->imported != last_published.imported || program_status->uploaded != last_published.uploaded
+        || strcmp(program_status->camera_name, last_published.camera_name) != 0
+        || strcmp(program_status->camera_serial_number, last_published.camera_serial_number) != 0)
+    {
+        last_camera_found = camera_found;
+        last_published = *program_status;
+        status_publish_program(program_status, camera_found);
+        ui_request_redraw();
+    }
+}
+
 static void camera_cleanup()
 {
     if (global_camera)
     {
-        gp_camera_exit(global_camera, global_context);
+        uint64_t start_us = usb_stats_now_us();
+        int ret = gp_camera_exit(global_camera, global_context);
+        usb_stats_record(USB_OP_CAMERA_EXIT, start_us, ret, 0);
         gp_camera_free(global_camera);
         global_camera = NULL;
     }
@@ -116,45 +206,205 @@ static void camera_cleanup()
     camera_initialized = camera_found = 0;
 }
 
-int fetch_file(const char *folder, const char *filename)
+// capture time from the camera for {date} in LAYOUT, falling back to now
+static time_t camera_file_time(const char *folder, const char *filename)
+{
+    CameraFileInfo info;
+    uint64_t start_us = usb_stats_now_us();
+    int ret = gp_camera_file_get_info(global_camera, folder, filename, &info, global_context);
+    usb_stats_record(USB_OP_FILE_INFO, start_us, ret, 0);
+
+    if (ret >= GP_OK && (info.file.fields & GP_FILE_INFO_MTIME) && info.file.mtime > 0)
+    {
+        return info.file.mtime;
+    }
+    return time(NULL);
+}
+
+// called with upload_queue_mutex held
+static Queued_image *queued_image_get(const char *relative)
+{
+    if (!queued_images)
+    {
+        queued_images = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    Queued_image *image = g_hash_table_lookup(queued_images, relative);
+    if (!image && (image = calloc(1, sizeof(Queued_image))) != NULL)
+    {
+        g_hash_table_insert(queued_images, g_strdup(relative), image);
+    }
+    return image;
+}
+
+// keeps the Exif data of a fresh import for the scans, so they need not read it from the card again
+static void queued_image_remember(const char *relative, const Exif_info *exif)
+{
+    pthread_mutex_lock(&upload_queue_mutex);
+    Queued_image *image = queued_image_get(relative);
+    if (image)
+    {
+        image->exif = *exif;
+        image->scan = upload_scans + 1; // kept through the next scan even if not yet published
+    }
+    pthread_mutex_unlock(&upload_queue_mutex);
+}
+
+// fills item from what is known of the image, reading the Exif data only for an image not seen since start up
+static void queued_image_fill(Pending_upload *item, const char *path)
+{
+    Queued_image *image = queued_image_get(item->name);
+    if (!image)
+    {
+        exif_read_file(path, &item->exif);
+        return;
+    }
+    if (!image->scan)
+    {
+        exif_read_file(path, &image->exif);
+    }
+    image->scan = upload_scans;
+    item->exif = image->exif;
+    item->front = image->front;
+}
+
+static gboolean queued_image_stale(gpointer key, gpointer value, gpointer data)
+{
+    (void)key;
+    (void)data;
+    return ((Queued_image *)value)->scan < upload_scans;
+}
+
+typedef struct
 {
     CameraFile *file;
-    gp_file_new(&file);
+    uint64_t start_us;
+    unsigned long size;
+} Import_save;
 
-    int ret = gp_camera_file_get(global_camera, folder, filename, GP_FILE_TYPE_NORMAL, file, global_context);
+// runs on a file_io.h thread once the image is written, and releases the camera data
+static void fetch_file_saved(void *owner, const char *file_path, int err)
+{
+    Import_save *save = owner;
+    int save_ret = err ? GP_ERROR : GP_OK;
+    usb_stats_record(USB_OP_FILE_SAVE, save->start_us, save_ret, err ? 0 : save->size);
 
-    if (ret < GP_OK)
+    if (!err)
+    {
+        atomic_fetch_add(&files_imported_this_pass, 1);
+        metrics_count_import(save->size);
+        _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Saved file to %s", file_path);
+    }
+    else
     {
-        ret = gp_camera_file_get(global_camera, folder, filename, GP_FILE_TYPE_PREVIEW, file, global_context);
+        _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Failed to save file %s: %s", file_path, strerror(err));
+        metrics_count_failure(FAILURE_FILE_SAVE);
     }
 
-    if (ret < GP_OK)
+    gp_file_free(save->file);
+    free(save);
+}
+
+// runs once an import is renamed into place, which for "batch" durability is after its flush
+static void import_published(const char *file_path)
+{
+    reject_submit(file_path + strlen(LOCAL_DIR) + 1);
+}
+
+/*
+* Stores an image fetched from the camera at LOCAL_DIR/relative. It is written to staging
+* in the background and only renamed into place once complete. Returns 1 if done will be
+* called with owner, 0 if the image was not stored (it already exists or has nowhere to go).
+*/
+int import_store(const char *relative, const char *data, unsigned long size, Staging_done done, void *owner)
+{
+    struct stat st;
+    char file_path[8192];
+    snprintf(file_path, sizeof(file_path), "%s/%s", LOCAL_DIR, relative);
+
+    if (stat(file_path, &st) == 0)
     {
-        ret = gp_camera_file_get(global_camera, folder, filename, GP_FILE_TYPE_RAW, file, global_context);
+        _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Skipping existing file %s", file_path);
+        return 0;
     }
+    if (layout_make_parent_dirs(file_path) != 0)
+    {
+        _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Failed to create directories for %s: %s", file_path, strerror(errno));
+        metrics_count_failure(FAILURE_FILE_SAVE);
+        return 0;
+    }
+
+    staging_write(file_path, data, size, done, owner, import_published);
+    return 1;
+}
 
+int fetch_file(const char *folder, const char *filename, const char *serial)
+{
+    CameraFile *file;
+    gp_file_new(&file);
+
+    const CameraFileType file_types[] = {GP_FILE_TYPE_NORMAL, GP_FILE_TYPE_PREVIEW, GP_FILE_TYPE_RAW};
+    const USB_OP file_ops[] = {USB_OP_FILE_GET, USB_OP_FILE_GET_PREVIEW, USB_OP_FILE_GET_RAW};
+
+    int ret = GP_ERROR;
+    const char *data = NULL;
+    unsigned long file_size = 0;
+    for (int i = 0; i < 3 && ret < GP_OK; i++)
+    {
+        uint64_t start_us = usb_stats_now_us();
+        ret = gp_camera_file_get(global_camera, folder, filename, file_types[i], file, global_context);
+
+        data = NULL;
+        file_size = 0;
+        if (ret >= GP_OK)
+        {
+            gp_file_get_data_and_size(file, &data, &file_size);
+        }
+        usb_stats_record(file_ops[i], start_us, ret, file_size);
+    }
+
+    // the layout is filled from the image's own Exif data, asking the camera only for what it lacks
+    char relative[512];
+    Exif_info exif;
     if (ret >= GP_OK)
     {
-        struct stat st;
-        char file_path[8192];
-        snprintf(file_path, sizeof(file_path), "%s/%s", LOCAL_DIR, filename);
+        exif_parse((const unsigned char *)data, file_size, &exif);
+        time_t captured = exif.captured ? exif.captured : (layout_uses_date() ? camera_file_time(folder, filename) : time(NULL));
+        if (!layout_expand(relative, sizeof(relative), filename, serial && serial[0] ? serial : exif.serial, captured))
+        {
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Layout path for %s/%s is too long.", folder, filename);
+            metrics_count_failure(FAILURE_FILE_SAVE);
+            gp_file_free(file);
+            return GP_ERROR;
+        }
+    }
 
-        if (stat(file_path, &st) == 0)
+    Import_save *save;
+    if (ret >= GP_OK && (save = malloc(sizeof(Import_save))) != NULL)
+    {
+        // the camera file is freed by fetch_file_saved once written, or here if it is not stored
+        save->file = file;
+        save->start_us = usb_stats_now_us();
+        save->size = file_size;
+        if (import_store(relative, data, file_size, fetch_file_saved, save))
         {
-            _log(LOG_GENERAL, "Skipping existing file %s", file_path);
+            file = NULL;
+            queued_image_remember(relative, &exif);
         }
         else
         {
-            gp_file_save(file, file_path);
-            _log(LOG_GENERAL, "Saved file to %s", file_path);
+            free(save);
         }
     }
     else
     {
-        _log(LOG_ERROR, "Failed to fetch file %s/%s (ret=%d: %s)", folder, filename, ret, gp_result_as_string(ret));
+        _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Failed to fetch file %s/%s (ret=%d: %s)", folder, filename, ret, gp_result_as_string(ret));
+        metrics_count_failure(FAILURE_CAMERA_FETCH);
     }
 
-    gp_file_free(file);
+    if (file)
+    {
+        gp_file_free(file);
+    }
     return ret;
 }
 
@@ -168,7 +418,9 @@ void list_files_recursive(const char *folder, Program_status *program_status)
     CameraList *subfolders = NULL;
     gp_list_new(&subfolders);
 
+    uint64_t start_us = usb_stats_now_us();
     int ret = gp_camera_folder_list_folders(global_camera, folder, subfolders, global_context);
+    usb_stats_record(USB_OP_LIST_FOLDERS, start_us, ret, 0);
     if (ret >= GP_OK)
     {
         int sub_count = gp_list_count(subfolders);
@@ -196,6 +448,7 @@ void list_files_recursive(const char *folder, Program_status *program_status)
         camera_cleanup();
         camera_initialized = 0;
         camera_found = (ret == GP_ERROR_MODEL_NOT_FOUND) ? 0 : -1;
+        metrics_count_failure(FAILURE_CAMERA_IO);
     }
 
     gp_list_free(subfolders);
@@ -203,14 +456,17 @@ void list_files_recursive(const char *folder, Program_status *program_status)
     CameraList *files = NULL;
     gp_list_new(&files);
 
+    start_us = usb_stats_now_us();
     ret = gp_camera_folder_list_files(global_camera, folder, files, global_context);
+    usb_stats_record(USB_OP_LIST_FILES, start_us, ret, 0);
     if (ret >= GP_OK)
     {
         int file_count = gp_list_count(files);
         if (file_count > 0)
         {
             program_status->status = internet_up ? CAMERA_STATUS_IMPORTING : CAMERA_STATUS_IMPORT_ONLY;
-            _log(LOG_GENERAL, "Importing images for folder %s", folder);
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Importing images for folder %s", folder);
+            worker_publish_status(program_status);
         }
         for (int j = 0; j < file_count; j++)
         {
@@ -223,29 +479,47 @@ void list_files_recursive(const char *folder, Program_status *program_status)
 
                 if (!g_hash_table_contains(downloaded_files, fullpath))
                 {
-                    _log(LOG_GENERAL, "Downloading file %s", fullpath);
-                    fetch_file(folder, filename);
+                    if (atomic_load(&imports_paused) || stop_requested)
+                    {
+                        break;
+                    }
+
+                    // left off the downloaded list so it is fetched once eviction or uploads make room
+                    if (!storage_import_allowed())
+                    {
+                        if (!storage_full_this_pass)
+                        {
+                            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Not enough storage to import %s, imports paused.", fullpath);
+                        }
+                        storage_full_this_pass = 1;
+                        break;
+                    }
+
+                    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Downloading file %s", fullpath);
+                    fetch_file(folder, filename, program_status->camera_serial_number);
                     g_hash_table_add(downloaded_files, g_strdup(fullpath));
                 }
             }
         }
-        program_status->status = CAMERA_STATUS_WAITING;
+        program_status->status = storage_full_this_pass ? CAMERA_STATUS_STORAGE_FULL : CAMERA_STATUS_WAITING;
     }
     else
     {
         camera_cleanup();
         camera_initialized = 0;
         camera_found = (ret == GP_ERROR_MODEL_NOT_FOUND) ? 0 : -1;
+        metrics_count_failure(FAILURE_CAMERA_IO);
         program_status->status = CAMERA_STATUS_NO_CAMERA;
         program_status->camera_name[0] = '\0';
         program_status->camera_serial_number[0] = '\0';
     }
+    worker_publish_status(program_status);
     gp_list_free(files);
 }
 
 static int try_init_camera_once(Program_status *program_status)
 {
-    _log(LOG_GENERAL, "Attempting to initialize camera...");
+    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Attempting to initialize camera...");
     int ret;
 
     if (!global_context)
@@ -259,7 +533,9 @@ static int try_init_camera_once(Program_status *program_status)
 
     if (global_camera)
     {
-        gp_camera_exit(global_camera, global_context);
+        uint64_t start_us = usb_stats_now_us();
+        ret = gp_camera_exit(global_camera, global_context);
+        usb_stats_record(USB_OP_CAMERA_EXIT, start_us, ret, 0);
         gp_camera_free(global_camera);
         global_camera = NULL;
     }
@@ -270,7 +546,9 @@ static int try_init_camera_once(Program_status *program_status)
         return ret;
     }
 
+    uint64_t start_us = usb_stats_now_us();
     ret = gp_camera_init(global_camera, global_context);
+    usb_stats_record(USB_OP_CAMERA_INIT, start_us, ret, 0);
     if (ret < GP_OK)
     {
         gp_camera_exit(global_camera, global_context);
@@ -282,9 +560,10 @@ static int try_init_camera_once(Program_status *program_status)
 
     acquire_camera_name(program_status);
 
-    _log(LOG_GENERAL, "Camera successfully initialized.");
+    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Camera successfully initialized.");
     camera_initialized = 1;
     camera_found = 1;
+    count_camera_connection();
     return GP_OK;
 }
 
@@ -300,45 +579,47 @@ void camera_init_global(Program_status *program_status)
         int ret = try_init_camera_once(program_status);
         if (ret >= GP_OK)
         {
-            _log(LOG_GENERAL, "Initialization attempt completed successfully.");
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Initialization attempt completed successfully.");
             return;
         }
 
         if (ret == GP_ERROR_MODEL_NOT_FOUND)
         {
             camera_found = 0;
-            _log(LOG_GENERAL, "Camera not present (attempt %d).", attempt + 1);
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Camera not present (attempt %d).", attempt + 1);
         }
         else if (ret == GP_ERROR_CAMERA_BUSY || ret == -53)
         {
             kill_device_mount_to_camera();
             camera_found = -1;
-            _log(LOG_ERROR, "Device busy (attempt %d). Attempting to kill existing mounts and", attempt + 1);
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Device busy (attempt %d). Attempting to kill existing mounts and", attempt + 1);
         }
         else
         {
             camera_found = 0;
-            _log(LOG_ERROR, "gp init failed (ret=%d: %s) (attempt %d).", ret, gp_result_as_string(ret), attempt + 1);
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "gp init failed (ret=%d: %s) (attempt %d).", ret, gp_result_as_string(ret), attempt + 1);
         }
 
         sleep(1 + attempt); // backoff and stall before retrying
     }
 
     camera_initialized = 0;
-    _log(LOG_GENERAL, "Camera could not be initialized.");
+    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Camera could not be initialized.");
 }
 
 void download_existing_files_from_camera(Program_status *program_status)
 {
-    _log(LOG_GENERAL, "Attempting to download existing files to device from camera.");
+    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Attempting to download existing files to device from camera.");
+    Trace_span mutex_wait = trace_begin("camera_mutex wait", "camera");
     pthread_mutex_lock(&camera_mutex);
+    trace_end(mutex_wait);
 
     if (!camera_initialized)
     {
         camera_init_global(program_status);
         if (!camera_initialized)
         {
-            _log(LOG_ERROR, "Camera failed intialized in download_existing_files_from_camera()... aborting...");
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Camera failed intialized in download_existing_files_from_camera()... aborting...");
             pthread_mutex_unlock(&camera_mutex);
             return;
         }
@@ -348,45 +629,330 @@ void download_existing_files_from_camera(Program_status *program_status)
     CameraList *folders = NULL;
     gp_list_new(&folders);
 
+    uint64_t start_us = usb_stats_now_us();
     int ret = gp_camera_folder_list_folders(global_camera, "/", folders, global_context);
+    usb_stats_record(USB_OP_LIST_FOLDERS, start_us, ret, 0);
     if (ret < GP_OK)
     {
-        _log(LOG_ERROR, "Failed to list folders: %d", ret);
+        _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_ERROR, "Failed to list folders: %d", ret);
         gp_list_free(folders);
         camera_busy_flag = 0;
         pthread_mutex_unlock(&camera_mutex);
         return;
     }
 
-    _log(LOG_GENERAL, "Importing images for from camera...");
+    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Importing images for from camera...");
+    files_imported_this_pass = 0;
+    storage_full_this_pass = 0;
     list_files_recursive("/", program_status);
+    staging_flush();
+    usb_stats_end_pass(files_imported_this_pass);
 
     gp_list_free(folders);
     camera_busy_flag = 0;
     pthread_mutex_unlock(&camera_mutex);
 }
 
+static Pending_upload *pending_upload_append(const char *relative)
+{
+    if (strlen(relative) >= sizeof(pending_uploads[0].name))
+    {
+        return NULL;
+    }
+
+    if (pending_upload_count == pending_upload_capacity)
+    {
+        int capacity = pending_upload_capacity ? pending_upload_capacity * 2 : 64;
+        Pending_upload *grown = realloc(pending_uploads, capacity * sizeof(Pending_upload));
+        if (!grown)
+        {
+            return NULL;
+        }
+        pending_uploads = grown;
+        pending_upload_capacity = capacity;
+    }
+
+    Pending_upload *item = &pending_uploads[pending_upload_count++];
+    strcpy(item->name, relative);
+    item->state = UPLOAD_QUEUED;
+    item->destination = -1;
+    item->sent_to = -1;
+    item->rejected = 0;
+    item->front = 0;
+    memset(&item->exif, 0, sizeof(item->exif));
+    return item;
+}
+
+typedef struct
+{
+    GHashTable *sent; // TRACK_FILE, loaded once per scan
+    long long backlog_bytes;
+} Delivery_scan;
+
+static void collect_pending_upload(const char *relative, const char *path, int is_dir, void *ctx)
+{
+    Delivery_scan *scan = ctx;
+    int rejected;
+    if (is_dir || !import_is_upload(relative) || g_hash_table_contains(scan->sent, relative) || reject_hold_back(relative, &rejected))
+    {
+        return;
+    }
+
+    struct stat st;
+    Pending_upload *item = pending_upload_append(relative);
+    if (item)
+    {
+        item->size = stat(path, &st) == 0 ? st.st_size : 0;
+        item->rejected = rejected;
+        queued_image_fill(item, path);
+        scan->backlog_bytes += item->size;
+    }
+}
+
+typedef struct
+{
+    int destination;
+    GHashTable *sent;
+} Mirror_scan;
+
+static void collect_mirror_upload(const char *relative, const char *path, int is_dir, void *ctx)
+{
+    Mirror_scan *scan = ctx;
+    int rejected;
+    if (is_dir || !import_is_upload(relative) || g_hash_table_contains(scan->sent, relative) || reject_hold_back(relative, &rejected))
+    {
+        return;
+    }
+
+    struct stat st;
+    Pending_upload *item = pending_upload_append(relative);
+    if (item)
+    {
+        item->size = stat(path, &st) == 0 ? st.st_size : 0;
+        item->destination = scan->destination;
+        item->rejected = rejected;
+        queued_image_fill(item, path);
+    }
+}
+
+// queues a copy for every healthy mirror of each image it has not received, behind the deliveries
+static void collect_mirror_uploads()
+{
+    for (int i = 0; i < destination_count; i++)
+    {
+        if (destinations[i].role != DESTINATION_MIRROR || !destination_healthy(&destinations[i]))
+        {
+            continue;
+        }
+        Mirror_scan scan = {i, track_file_load(destinations[i].track_file)};
+        import_walk(collect_mirror_upload, &scan);
+        g_hash_table_destroy(scan.sent);
+    }
+}
+
+static int upload_lane_may_continue(int lane)
+{
+    return internet_up && !stop_requested && !atomic_load(&uploads_paused) && lane < atomic_load(&upload_concurrency);
+}
+
+// one of up to UPLOAD_TRANSFERS_MAX threads taking images off the queue until it is empty or they are told to stop
+static void *upload_lane(void *arg)
+{
+    int lane = (int)(intptr_t)arg;
+    char name[32];
+    snprintf(name, sizeof(name), "upload %d", lane);
+    trace_name_thread(name);
+
+    pthread_mutex_lock(&upload_queue_mutex);
+    while (pending_upload_next < pending_upload_count && upload_lane_may_continue(lane))
+    {
+        int index = pending_upload_next++;
+        Pending_upload item = pending_uploads[index];
+        pending_uploads[index].state = UPLOAD_SENDING;
+
+        // the next image is read from the card while this one is on the wire
+        char next[1024] = {0};
+        long long next_size = 0;
+        if (pending_upload_next < pending_upload_count)
+        {
+            snprintf(next, sizeof(next), "%s/%s", LOCAL_DIR, pending_uploads[pending_upload_next].name);
+            next_size = pending_uploads[pending_upload_next].size;
+        }
+        pthread_mutex_unlock(&upload_queue_mutex);
+
+        if (next[0])
+        {
+            upload_prefetch_start(next, next_size);
+        }
+
+        int delivery = item.destination < 0;
+        Destination *d = delivery ? destination_route() : &destinations[item.destination];
+        int sent = 0;
+        UPLOAD_STATE state = UPLOAD_DEFERRED;
+
+        // a mirror that went unhealthy since the scan gets its copies on a later pass
+        if (delivery || destination_healthy(d))
+        {
+            pthread_mutex_lock(&upload_queue_mutex);
+            pending_uploads[index].sent_to = destination_index(d);
+            pthread_mutex_unlock(&upload_queue_mutex);
+
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", LOCAL_DIR, item.name);
+            sent = upload_file(d, path, item.name);
+            state = sent ? UPLOAD_SENT : UPLOAD_FAILED;
+        }
+
+        if (sent)
+        {
+            mark_sent_to(d, item.name);
+        }
+        if (sent && delivery)
+        {
+            mark_uploaded(item.name);
+            reject_forget(item.name);
+            if (atomic_load(&storage_imports_paused))
+            {
+                storage_request_check();
+            }
+            upload_progress_sent(item.size);
+        }
+
+        // items before pending_upload_next are never moved, so index still refers to this image
+        pthread_mutex_lock(&upload_queue_mutex);
+        pending_uploads[index].state = state;
+    }
+    upload_lanes_running &= ~(1u << lane);
+    pthread_cond_broadcast(&upload_queue_cond);
+    pthread_mutex_unlock(&upload_queue_mutex);
+    return NULL;
+}
+
+/*
+* Images moved to the front through the control socket first, latest move first, then
+* deliveries before mirror copies, rejected images after the rest, each oldest shot first;
+* images without a capture time go last by name.
+*/
+static int pending_upload_compare(const void *a, const void *b)
+{
+    const Pending_upload *x = a;
+    const Pending_upload *y = b;
+    if (x->front != y->front)
+    {
+        return x->front > y->front ? -1 : 1;
+    }
+    if (x->destination != y->destination)
+    {
+        return x->destination < y->destination ? -1 : 1;
+    }
+    if (x->rejected != y->rejected)
+    {
+        return x->rejected - y->rejected;
+    }
+    if (x->exif.captured != y->exif.captured)
+    {
+        return !y->exif.captured || (x->exif.captured && x->exif.captured < y->exif.captured) ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// rebuilds the upload queue from the import folder; returns whether anything is waiting
+static int upload_scan()
+{
+    Trace_span span = trace_begin("upload scan", "upload");
+    // read before taking the queue, which the control socket's commands wait on
+    Delivery_scan scan = {track_file_load(TRACK_FILE), 0};
+    pthread_mutex_lock(&upload_queue_mutex);
+    pending_upload_count = 0;
+    pending_upload_next = 0;
+    upload_scans++;
+    import_walk(collect_pending_upload, &scan);
+    g_hash_table_destroy(scan.sent);
+    upload_progress_set_backlog(pending_upload_count, scan.backlog_bytes);
+    collect_mirror_uploads();
+    // drops images this scan did not queue: sent, evicted, deleted or held back
+    if (queued_images)
+    {
+        g_hash_table_foreach_remove(queued_images, queued_image_stale, NULL);
+    }
+    qsort(pending_uploads, pending_upload_count, sizeof(Pending_upload), pending_upload_compare);
+    int have_uploads = pending_upload_count > 0;
+    pthread_mutex_unlock(&upload_queue_mutex);
+    trace_end(span);
+    return have_uploads;
+}
+
+/*
+* Sends the queue with upload_concurrency lanes, adding or retiring lanes as the setting
+* changes, and returns once the queue is done or uploads stop (internet down, paused,
+* shutting down). Transfers already running are always allowed to finish.
+*/
+static void upload_pending_images()
+{
+    pthread_mutex_lock(&upload_queue_mutex);
+    while (1)
+    {
+        int remaining = pending_upload_next < pending_upload_count;
+        int can_send = internet_up && !stop_requested && !atomic_load(&uploads_paused);
+        if ((!remaining || !can_send) && upload_lanes_running == 0)
+        {
+            break;
+        }
+
+        int concurrency = atomic_load(&upload_concurrency);
+        for (int lane = 0; lane < concurrency && remaining && can_send; lane++)
+        {
+            if (upload_lanes_running & (1u << lane))
+            {
+                continue;
+            }
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, upload_lane, (void *)(intptr_t)lane) == 0)
+            {
+                upload_lanes_running |= 1u << lane;
+                pthread_detach(thread);
+            }
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&upload_queue_cond, &upload_queue_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&upload_queue_mutex);
+}
+
 void *import_upload_worker(void *arg) 
 {
     Program_status *program_status = (Program_status *)arg;
 
     _log(LOG_GENERAL, "Starting upload worker.");
+    trace_name_thread("worker");
+    file_io_init();
+    staging_init();
+    atomic_store(&upload_concurrency, UPLOAD_CONCURRENCY < 1 ? 1 : (UPLOAD_CONCURRENCY > UPLOAD_TRANSFERS_MAX ? UPLOAD_TRANSFERS_MAX : UPLOAD_CONCURRENCY));
+    atomic_store(&upload_rate_limit_kb_s, UPLOAD_RATE_LIMIT_KB_S);
 
     while (!stop_requested) 
     {
         // Step 1: Ensure camera is initialized
         if (!camera_initialized)
         {
+            Trace_span mutex_wait = trace_begin("camera_mutex wait", "camera");
             pthread_mutex_lock(&camera_mutex);
+            trace_end(mutex_wait);
             int ret = gp_camera_new(&global_camera);
             if (ret >= GP_OK)
             {
+                uint64_t start_us = usb_stats_now_us();
                 ret = gp_camera_init(global_camera, global_context);
+                usb_stats_record(USB_OP_CAMERA_INIT, start_us, ret, 0);
                 if (ret >= GP_OK)
                 {
                     camera_initialized = 1;
                     camera_found = 1;
-                    _log(LOG_GENERAL, "Camera initialized in worker loop.");
+                    count_camera_connection();
+                    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Camera initialized in worker loop.");
 
                     acquire_camera_name(program_status);
                 }
@@ -400,28 +966,47 @@ void *import_upload_worker(void *arg)
                     {
                         kill_device_mount_to_camera();
                     }
-                    _log(LOG_GENERAL, ret == -53 ? "Camera busy... could not connect." :  "No camera detected.");
+                    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, ret == -53 ? "Camera busy... could not connect." :  "No camera detected.");
                 }
             }
             else
             {
                 camera_initialized = 0;
                 camera_found = 0;
-                _log(LOG_GENERAL, "Failed to create camera in worker loop.");
+                _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Failed to create camera in worker loop.");
             }
             pthread_mutex_unlock(&camera_mutex);
+            worker_publish_status(program_status);
         }
 
         // Step 2: Only fetch files if camera is initialized and available
-        if (camera_initialized && camera_found > 0)
+        if (camera_initialized && camera_found > 0 && !atomic_load(&imports_paused))
         {
+            Trace_span import_pass = trace_begin("import pass", "camera");
             download_existing_files_from_camera(program_status);
-            _log(LOG_GENERAL, "Existing file download complete.");
+            trace_end(import_pass);
+            _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Existing file download complete.");
+        }
+
+        if (usb_stats_dump_requested)
+        {
+            usb_stats_dump_requested = 0;
+            usb_stats_dump();
+            task_pool_log_stats();
+        }
+
+        if (trace_dump_requested)
+        {
+            trace_dump_requested = 0;
+            trace_write();
         }
 
         // Update status
+        Trace_span count_span = trace_begin("count images", "worker");
         program_status->imported = count_imported_images();
         program_status->uploaded = count_uploaded_images();
+        trace_end(count_span);
+        worker_publish_status(program_status);
 
         // Step 3: Periodically handle camera events (no reinit)
         static time_t last_camera_check = 0;
@@ -432,23 +1017,28 @@ void *import_upload_worker(void *arg)
 
             if (camera_initialized && camera_found > 0)
             {
+                Trace_span mutex_wait = trace_begin("camera_mutex wait", "camera");
                 pthread_mutex_lock(&camera_mutex);
+                trace_end(mutex_wait);
 
                 CameraFile *file;
                 gp_file_new(&file);
                 CameraEventType event_type;
                 void *event_data = NULL;
+                uint64_t start_us = usb_stats_now_us();
                 int ret = gp_camera_wait_for_event(global_camera, 2000, &event_type, &event_data, global_context);
+                usb_stats_record(USB_OP_WAIT_EVENT, start_us, ret, 0);
 
                 if (event_type == GP_EVENT_FILE_ADDED) 
                 {
                     CameraFilePath *path = (CameraFilePath *)event_data;
-                    _log(LOG_GENERAL, "New file added: %s/%s", path->folder, path->name);
+                    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "New file added: %s/%s", path->folder, path->name);
                 }
 
                 if (ret != GP_OK) 
                 {
-                    _log(LOG_GENERAL, "Camera event wait failed: %d", ret);
+                    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_GENERAL, "Camera event wait failed: %d", ret);
+                    metrics_count_failure(FAILURE_CAMERA_IO);
                     camera_cleanup();
                     camera_initialized = 0;
                     program_status->status = CAMERA_STATUS_NO_CAMERA;
@@ -459,49 +1049,43 @@ void *import_upload_worker(void *arg)
 
                 gp_file_free(file);
                 pthread_mutex_unlock(&camera_mutex);
+                worker_publish_status(program_status);
             }
         }
 
-        // Step 4: Upload images
-        DIR *d = opendir(LOCAL_DIR);
-        if (internet_up && d) 
-        {
-            struct dirent *dir;
-            while ((dir = readdir(d)) != NULL) 
-            {
-                if (dir->d_type != DT_REG)
-                {
-                    continue;
-                }
+        // Step 4: Upload images. Everything waiting is tallied first so the backlog and ETA
+        // cover the whole batch, then each image leaves the backlog as its upload completes.
+        int have_uploads = upload_scan();
 
-                const char *ext = strrchr(dir->d_name, '.');
-                if (!ext || (strcasecmp(ext, ".jpg") && strcasecmp(ext, ".jpeg")))
-                {
-                    continue;
-                }
-                if (is_uploaded(dir->d_name))
-                {
-                    continue;
-                }
+        if (have_uploads && internet_up && !atomic_load(&uploads_paused))
+        {
+            program_status->status = CAMERA_STATUS_UPLOADING;
+            worker_publish_status(program_status);
+            upload_pending_images();
+        }
 
-                char path[1024];
-                program_status->status = CAMERA_STATUS_UPLOADING;
-                snprintf(path, sizeof(path), "%s/%s", LOCAL_DIR, dir->d_name);
+        upload_prefetch_discard();
 
-                if (upload_file(path, dir->d_name))
-                {
-                    mark_uploaded(dir->d_name);
-                }
-            }
-            closedir(d);
-        } 
-        else if (!internet_up && camera_found > 0) 
+        if (!internet_up && camera_found > 0 && !storage_full_this_pass) 
         {
             program_status->status = CAMERA_STATUS_IMPORT_ONLY;
         }
+        if ((atomic_load(&imports_paused) && camera_found > 0) || (atomic_load(&uploads_paused) && have_uploads))
+        {
+            program_status->status = CAMERA_STATUS_PAUSED;
+        }
+        else if (program_status->status == CAMERA_STATUS_PAUSED)
+        {
+            program_status->status = camera_found > 0 ? CAMERA_STATUS_WAITING : CAMERA_STATUS_NO_CAMERA;
+        }
+        worker_publish_status(program_status);
 
         usleep(100000);
     }
 
+    // shutting down: publish whatever is still batched in staging
+    staging_flush();
+    staging_stop();
+    _log(LOG_GENERAL, "Upload worker stopped.");
     return NULL;
 }
\ No newline at end of file
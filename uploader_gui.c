@@ -1,5 +1,9 @@
+#define _GNU_SOURCE // syncfs() for batched import durability (staging.h), pthread_timedjoin_np() at shut down
+
+#ifndef HEADLESS
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,60 +14,150 @@ const char *LOCAL_DIR;
 const char *TRACK_FILE = ".track.txt";
 const char *FTP_URL;
 const char *FTP_USERPWD;
+int PROBE_ICMP_FALLBACK = 0;
+const char *METRICS_ADDRESS = "127.0.0.1:9273";
+const char *STATUS_FILE = "status.json";
+const char *LAYOUT = "{name}"; // see layout.h
+const char *IMPORT_DURABILITY = "batch"; // "file", "batch" or "none", see staging.h
+int IMPORT_SYNC_BATCH = 16;
+int STORAGE_HIGH_WATERMARK = 90; // percent of the import filesystem used before eviction starts
+int STORAGE_LOW_WATERMARK = 80; // eviction stops once usage is back down to this
+int STORAGE_RESERVE_MB = 256; // imports pause rather than leave less than this free
+const char *CONTROL_SOCKET = "control.sock"; // see control.h
+int UPLOAD_CONCURRENCY = 1; // parallel uploads, 1 to UPLOAD_TRANSFERS_MAX
+int UPLOAD_RATE_LIMIT_KB_S = 0; // total upload rate cap, 0 for none
+const char *REJECT_FILTER = "off"; // "off", "defer" or "hold", see reject.h
+double REJECT_SHARPNESS_MIN = 50.0; // variance of the Laplacian at 1/8 scale
+int REJECT_DUPLICATE_BITS = 6; // of the 64 bit difference hash
+int UPLOAD_RAW = 0; // also upload RAW and TIFF files, see layout.h
+const char *UPLOAD_COMPRESSION = "off"; // "off" or "auto", see compress.h
 
 volatile sig_atomic_t stop_requested = 0;
 
+#ifndef HEADLESS
 #include "ui_colors.h"
+#endif
 #include "log.h"
+#include "trace.h"
+#include "ui_events.h"
+#include "usb_stats.h"
+#include "task_pool.h"
+#include "layout.h"
+#include "exif.h"
+#include "destination.h"
 #include "support.h"
-#include "ftp.h"
+#include "status.h"
+#include "upload_rate.h"
+#include "storage.h"
+#ifndef HEADLESS
+#include "wifi.h"
+#include "text_cache.h"
+#include "gallery.h"
 #include "ui.h"
+#endif
+#include "net_probe.h"
+#include "file_io.h"
+#include "compress.h"
+#include "metrics.h"
+#include "ftp.h"
+#include "staging.h"
+#include "reject.h"
 #include "uploader.h"
+#include "control.h"
+#include "status_file.h"
+
+// the benchmarks in bench/ include this file for everything but main()
+#ifndef UPLOADER_NO_MAIN
+
+#define SHUTDOWN_TIMEOUT_S 60 // under systemd's default stop timeout
+
+// lets uploads in flight finish and staged imports publish before exiting
+static void wait_for_worker(pthread_t worker)
+{
+    stop_requested = 1;
+    storage_stop();
+    _log(LOG_GENERAL, "Waiting for running transfers to finish...");
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SHUTDOWN_TIMEOUT_S;
+    if (pthread_timedjoin_np(worker, NULL, &deadline) != 0)
+    {
+        _log(LOG_ERROR, "Worker still busy after %d seconds, exiting anyway.", SHUTDOWN_TIMEOUT_S);
+    }
+}
 
 int main(int argc, char *argv[]) 
 {
+    log_start();
     _log(LOG_GENERAL, "Uploader started... Ready.");
 
     int full_screen_mode = 0;
     logging_status = LOGGIN_ERROR_ONLY;
 
+    // builds made with -DHEADLESS have no SDL at all and always run headless
+#ifdef HEADLESS
+    int headless_mode = 1;
+#else
+    int headless_mode = 0;
+#endif
+
     for (int i = 1; i < argc; i++)
     {
-        if (strcmp(argv[i], "--fullscreen") == 0)
+        if (strcmp(argv[i], "--fullscreen") == 0 && !headless_mode)
         {
             _log(LOG_GENERAL, "Full screen mode enabled.");
             full_screen_mode = 1;
-            break;
+        }
+        else if (strcmp(argv[i], "--headless") == 0 && !full_screen_mode)
+        {
+            headless_mode = 1;
         }
         else if (strcmp(argv[i], "--log-all") == 0)
         {
             logging_status = LOGGIN_ALL;
         }
+        else if (strcmp(argv[i], "--trace") == 0)
+        {
+            trace_start();
+        }
         else
         {
-            printf("Invalid argument %s. Valid options are '--fullscreen' or '--log-all' only.\n", argv[i]);
-            _log(LOG_ERROR, "Invalid argument %s. Valid options are '--fullscreen' only.", argv[i]);
+            printf("Invalid argument %s. Valid options are '--fullscreen' or '--headless', '--log-all' and '--trace' only.\n", argv[i]);
+            _log(LOG_ERROR, "Invalid argument %s. Valid options are '--fullscreen' or '--headless', '--log-all' and '--trace' only.", argv[i]);
             return 10;
         }
     }
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) 
-    { 
-        printf("SDL Init Error: %s\n", SDL_GetError()); 
-        return 1;
-    }
-
-    if (TTF_Init() != 0)
+#ifndef HEADLESS
+    if (!headless_mode)
     {
-        printf("TTF Init Error: %s\n", TTF_GetError());
-        SDL_Quit(); 
-        return 1;
+        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) 
+        { 
+            printf("SDL Init Error: %s\n", SDL_GetError()); 
+            return 1;
+        }
+
+        if (TTF_Init() != 0)
+        {
+            printf("TTF Init Error: %s\n", TTF_GetError());
+            SDL_Quit(); 
+            return 1;
+        }
+
+        ui_events_init();
     }
+#endif
 
     Program_status program_status = {0, 0, 0, {0}, {0}};
     signal(SIGINT, handle_sigint);
+    signal(SIGTERM, handle_sigint);
+    signal(SIGUSR1, handle_sigusr1);
+    signal(SIGUSR2, handle_sigusr2);
 
     load_config();
+    curl_global_init(CURL_GLOBAL_DEFAULT); // before upload lanes can race to do it
+    control_listen(); // before other threads create files, as it sets the umask
 
     _log(LOG_GENERAL, "Initialization complete.");
 
@@ -75,7 +169,49 @@ int main(int argc, char *argv[])
     pthread_t internet_is_up;
     pthread_create(&internet_is_up, NULL, internet_poll_thread, NULL);
 
-    run_UI(&program_status, full_screen_mode);
+    // thread evicting uploaded images when the import filesystem runs low on space
+    pthread_t storage;
+    pthread_create(&storage, NULL, storage_thread, NULL);
+
+    // thread serving Prometheus metrics for fleet monitoring
+    pthread_t metrics;
+    pthread_create(&metrics, NULL, metrics_thread, NULL);
+
+    // thread answering the local control socket
+    pthread_t control;
+    pthread_create(&control, NULL, control_thread, NULL);
 
+    // workers shared by the CPU bound work: reject filter scoring and gallery thumbnails
+    task_pool_start(0);
+    reject_start();
+
+    if (headless_mode)
+    {
+        run_headless();
+        wait_for_worker(worker);
+        pthread_join(storage, NULL);
+        pthread_join(control, NULL);
+        task_pool_stop();
+        return 0;
+    }
+
+#ifndef HEADLESS
+    // thread running the NetworkManager main loop that keeps the Wi-Fi network list current; only the network screen uses it
+    pthread_t wifi;
+    pthread_create(&wifi, NULL, wifi_thread, NULL);
+
+    // thread listing recent imports and decoding their thumbnails while the gallery is open
+    pthread_t gallery;
+    pthread_create(&gallery, NULL, gallery_thread, NULL);
+
+    run_UI(full_screen_mode);
+#endif
+
+    wait_for_worker(worker);
+    pthread_join(storage, NULL);
+    pthread_join(control, NULL);
+    task_pool_stop();
     return 0;
-}
\ No newline at end of file
+}
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <gphoto2/gphoto2-camera.h>
+
+/*
+* Timing and byte counters for every gphoto2 call made against the camera. Each call is
+* recorded into a log2 latency histogram (bucket 0 is < 64us, each bucket after doubles)
+* so we can see whether an import is slow in folder listing, file transfer, saving to the
+* SD card or camera re-initialization. Stats are kept both for the current import pass
+* and cumulatively since start up. Send SIGUSR1 to dump the cumulative figures to the log.
+*/
+
+#define USB_STATS_BUCKETS 20
+#define USB_STATS_FIRST_BUCKET_US 64
+
+typedef enum
+{
+    USB_OP_CAMERA_INIT,
+    USB_OP_CAMERA_EXIT,
+    USB_OP_SUMMARY,
+    USB_OP_LIST_FOLDERS,
+    USB_OP_LIST_FILES,
+    USB_OP_FILE_GET,
+    USB_OP_FILE_GET_PREVIEW,
+    USB_OP_FILE_GET_RAW,
+    USB_OP_FILE_SAVE,
+    USB_OP_WAIT_EVENT,
+    USB_OP_FILE_INFO,
+    USB_OP_COUNT
+} USB_OP;
+
+const char *usb_op_names[USB_OP_COUNT] = {
+    "camera_init",
+    "camera_exit",
+    "summary",
+    "list_folders",
+    "list_files",
+    "file_get",
+    "file_get_preview",
+    "file_get_raw",
+    "file_save",
+    "wait_event",
+    "file_info"
+};
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[USB_STATS_BUCKETS];
+} Usb_op_stats;
+
+typedef struct
+{
+    Usb_op_stats ops[USB_OP_COUNT];
+    uint64_t reinits; // camera inits that followed a gphoto2 error
+} Usb_stats;
+
+Usb_stats usb_stats_total;
+Usb_stats usb_stats_pass;
+pthread_mutex_t usb_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+volatile sig_atomic_t usb_stats_dump_requested = 0;
+volatile int usb_last_call_failed = 0;
+
+uint64_t usb_stats_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+int usb_stats_bucket_for(uint64_t elapsed_us)
+{
+    int bucket = 0;
+    uint64_t limit = USB_STATS_FIRST_BUCKET_US;
+    while (elapsed_us >= limit && bucket < USB_STATS_BUCKETS - 1)
+    {
+        limit <<= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+uint64_t usb_stats_bucket_upper_us(int bucket)
+{
+    return (uint64_t)USB_STATS_FIRST_BUCKET_US << bucket;
+}
+
+static void usb_stats_add(Usb_op_stats *op_stats, uint64_t elapsed_us, int failed, uint64_t bytes)
+{
+    op_stats->count++;
+    op_stats->errors += failed ? 1 : 0;
+    op_stats->bytes += bytes;
+    op_stats->total_us += elapsed_us;
+    if (elapsed_us > op_stats->max_us)
+    {
+        op_stats->max_us = elapsed_us;
+    }
+    op_stats->buckets[usb_stats_bucket_for(elapsed_us)]++;
+}
+
+void usb_stats_record(USB_OP op, uint64_t start_us, int ret, uint64_t bytes)
+{
+    uint64_t end_us = usb_stats_now_us();
+    uint64_t elapsed_us = end_us - start_us;
+    int failed = ret < GP_OK;
+
+    trace_complete(usb_op_names[op], "camera", start_us, end_us);
+
+    pthread_mutex_lock(&usb_stats_mutex);
+    if (op == USB_OP_CAMERA_INIT && usb_last_call_failed)
+    {
+        usb_stats_total.reinits++;
+        usb_stats_pass.reinits++;
+    }
+    usb_stats_add(&usb_stats_total.ops[op], elapsed_us, failed, bytes);
+    usb_stats_add(&usb_stats_pass.ops[op], elapsed_us, failed, bytes);
+    pthread_mutex_unlock(&usb_stats_mutex);
+
+    if (op != USB_OP_CAMERA_EXIT)
+    {
+        // the exit issued while tearing down after an error should not hide that error from the next init
+        usb_last_call_failed = failed;
+    }
+}
+
+uint64_t usb_stats_percentile_us(const Usb_op_stats *op_stats, int percentile)
+{
+    if (op_stats->count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t target = (op_stats->count * percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < USB_STATS_BUCKETS; i++)
+    {
+        seen += op_stats->buckets[i];
+        if (seen >= target)
+        {
+            uint64_t upper = usb_stats_bucket_upper_us(i);
+            return upper < op_stats->max_us ? upper : op_stats->max_us;
+        }
+    }
+    return op_stats->max_us;
+}
+
+static void usb_stats_log(const char *title, const Usb_stats *stats)
+{
+    _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_STATS, "%s (camera re-inits after error: %llu)", title, (unsigned long long)stats->reinits);
+
+    for (int op = 0; op < USB_OP_COUNT; op++)
+    {
+        const Usb_op_stats *op_stats = &stats->ops[op];
+        if (op_stats->count == 0)
+        {
+            continue;
+        }
+
+        double mb_per_sec = op_stats->total_us ? ((double)op_stats->bytes / (1024.0 * 1024.0)) / ((double)op_stats->total_us / 1000000.0) : 0.0;
+
+        _log_sub(LOG_SUBSYSTEM_CAMERA, LOG_STATS, "  %-16s n=%llu err=%llu avg=%.1fms p50<=%.1fms p95<=%.1fms max=%.1fms bytes=%llu rate=%.2fMB/s",
+            usb_op_names[op],
+            (unsigned long long)op_stats->count,
+            (unsigned long long)op_stats->errors,
+            (double)op_stats->total_us / op_stats->count / 1000.0,
+            usb_stats_percentile_us(op_stats, 50) / 1000.0,
+            usb_stats_percentile_us(op_stats, 95) / 1000.0,
+            op_stats->max_us / 1000.0,
+            (unsigned long long)op_stats->bytes,
+            mb_per_sec);
+    }
+}
+
+void usb_stats_end_pass(int files_imported)
+{
+    Usb_stats pass;
+
+    pthread_mutex_lock(&usb_stats_mutex);
+    pass = usb_stats_pass;
+    memset(&usb_stats_pass, 0, sizeof(usb_stats_pass));
+    pthread_mutex_unlock(&usb_stats_mutex);
+
+    // passes run continuously while a camera is attached; only summarize the ones that moved data
+    if (files_imported > 0)
+    {
+        char title[96];
+        snprintf(title, sizeof(title), "Import pass complete: %d file%s imported", files_imported, files_imported == 1 ? "" : "s");
+        usb_stats_log(title, &pass);
+    }
+}
+
+void usb_stats_dump()
+{
+    Usb_stats total;
+
+    pthread_mutex_lock(&usb_stats_mutex);
+    total = usb_stats_total;
+    pthread_mutex_unlock(&usb_stats_mutex);
+
+    usb_stats_log("USB transfer statistics since start", &total);
+}
+
+void handle_sigusr1(int sig)
+{
+    (void)sig;
+    usb_stats_dump_requested = 1;
+}
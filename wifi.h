@@ -0,0 +1,433 @@
+#include <pthread.h>
+#include <glib.h>
+#include <NetworkManager.h>
+
+/*
+* Wi-Fi backend built on libnm. A dedicated thread runs a GLib main loop that owns the
+* NMClient; every access point signal (added, removed, strength change) refreshes a small
+* cache of networks sorted by signal strength, so the network screen can show a current
+* list the moment it opens. Connection attempts are started on the same thread and their
+* outcome is delivered by the active connection's state-changed signal.
+*/
+
+#define WIFI_CACHE_MAX 16
+#define WIFI_SCAN_MAX 64
+
+typedef struct
+{
+    char ssid[128];
+    int strength;
+    const char *security;
+} WifiNetwork;
+
+typedef enum
+{
+    WIFI_CONNECT_IDLE,
+    WIFI_CONNECT_PENDING,
+    WIFI_CONNECT_SUCCEEDED,
+    WIFI_CONNECT_FAILED
+} WIFI_CONNECT_STATE;
+
+WifiNetwork wifi_cache[WIFI_CACHE_MAX];
+int wifi_cache_count = 0;
+pthread_mutex_t wifi_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+volatile int wifi_backend_ready = 0;
+volatile int wifi_connect_state = WIFI_CONNECT_IDLE;
+
+NMClient *nm_client = NULL;
+GMainContext *wifi_context = NULL;
+char wifi_connect_ssid[128];
+
+const char *wifi_security_label(NMAccessPoint *ap)
+{
+    NM80211ApSecurityFlags security = nm_access_point_get_wpa_flags(ap) | nm_access_point_get_rsn_flags(ap);
+
+    if (security & NM_802_11_AP_SEC_KEY_MGMT_802_1X)
+    {
+        return "Enterprise";
+    }
+    if (security & NM_802_11_AP_SEC_KEY_MGMT_SAE)
+    {
+        return "WPA3";
+    }
+    if (security & NM_802_11_AP_SEC_KEY_MGMT_PSK)
+    {
+        return "WPA2";
+    }
+    if (nm_access_point_get_flags(ap) & NM_802_11_AP_FLAGS_PRIVACY)
+    {
+        return "WEP";
+    }
+    return "Open";
+}
+
+int wifi_ssid_of(NMAccessPoint *ap, char *ssid, size_t size)
+{
+    GBytes *ssid_bytes = nm_access_point_get_ssid(ap);
+    if (!ssid_bytes)
+    {
+        return 0; // hidden network
+    }
+
+    gsize length = 0;
+    const guint8 *data = g_bytes_get_data(ssid_bytes, &length);
+    gchar *utf8 = nm_utils_ssid_to_utf8(data, length);
+    if (!utf8)
+    {
+        return 0;
+    }
+
+    snprintf(ssid, size, "%s", utf8);
+    g_free(utf8);
+    return ssid[0] != '\0';
+}
+
+void wifi_refresh_cache()
+{
+    Trace_span span = trace_begin("wifi cache refresh", "network");
+    WifiNetwork found[WIFI_SCAN_MAX];
+    int count = 0;
+
+    const GPtrArray *devices = nm_client_get_devices(nm_client);
+    for (guint d = 0; devices && d < devices->len; d++)
+    {
+        if (!NM_IS_DEVICE_WIFI(devices->pdata[d]))
+        {
+            continue;
+        }
+
+        const GPtrArray *aps = nm_device_wifi_get_access_points(NM_DEVICE_WIFI(devices->pdata[d]));
+        for (guint a = 0; aps && a < aps->len && count < WIFI_SCAN_MAX; a++)
+        {
+            NMAccessPoint *ap = NM_ACCESS_POINT(aps->pdata[a]);
+            WifiNetwork network;
+            if (!wifi_ssid_of(ap, network.ssid, sizeof(network.ssid)))
+            {
+                continue;
+            }
+            network.strength = nm_access_point_get_strength(ap);
+            network.security = wifi_security_label(ap);
+
+            // one entry per SSID, keeping the strongest access point
+            int existing = -1;
+            for (int i = 0; i < count; i++)
+            {
+                if (strcmp(found[i].ssid, network.ssid) == 0)
+                {
+                    existing = i;
+                    break;
+                }
+            }
+
+            if (existing < 0)
+            {
+                found[count++] = network;
+            }
+            else if (network.strength > found[existing].strength)
+            {
+                found[existing] = network;
+            }
+        }
+    }
+
+    // strongest first
+    for (int i = 1; i < count; i++)
+    {
+        for (int j = i; j > 0 && found[j].strength > found[j - 1].strength; j--)
+        {
+            WifiNetwork swap = found[j];
+            found[j] = found[j - 1];
+            found[j - 1] = swap;
+        }
+    }
+
+    if (count > WIFI_CACHE_MAX)
+    {
+        count = WIFI_CACHE_MAX;
+    }
+
+    pthread_mutex_lock(&wifi_cache_mutex);
+    int changed = count != wifi_cache_count;
+    for (int i = 0; i < count && !changed; i++)
+    {
+        changed = strcmp(wifi_cache[i].ssid, found[i].ssid) != 0 || wifi_cache[i].strength != found[i].strength || wifi_cache[i].security != found[i].security;
+    }
+    memcpy(wifi_cache, found, sizeof(WifiNetwork) * count);
+    wifi_cache_count = count;
+    pthread_mutex_unlock(&wifi_cache_mutex);
+    trace_end(span);
+
+    if (changed)
+    {
+        ui_request_redraw();
+    }
+}
+
+int wifi_copy_networks(WifiNetwork *out, int max)
+{
+    pthread_mutex_lock(&wifi_cache_mutex);
+    int count = wifi_cache_count < max ? wifi_cache_count : max;
+    memcpy(out, wifi_cache, sizeof(WifiNetwork) * count);
+    pthread_mutex_unlock(&wifi_cache_mutex);
+    return count;
+}
+
+void on_wifi_ap_strength_changed(GObject *ap, GParamSpec *pspec, gpointer user_data)
+{
+    (void)ap; (void)pspec; (void)user_data;
+    wifi_refresh_cache();
+}
+
+void on_wifi_ap_added(NMDeviceWifi *device, NMAccessPoint *ap, gpointer user_data)
+{
+    (void)device; (void)user_data;
+    g_signal_connect(ap, "notify::strength", G_CALLBACK(on_wifi_ap_strength_changed), NULL);
+    wifi_refresh_cache();
+}
+
+void on_wifi_ap_removed(NMDeviceWifi *device, NMAccessPoint *ap, gpointer user_data)
+{
+    (void)device; (void)ap; (void)user_data;
+    wifi_refresh_cache();
+}
+
+void wifi_watch_device(NMDevice *device)
+{
+    if (!NM_IS_DEVICE_WIFI(device))
+    {
+        return;
+    }
+
+    g_signal_connect(device, "access-point-added", G_CALLBACK(on_wifi_ap_added), NULL);
+    g_signal_connect(device, "access-point-removed", G_CALLBACK(on_wifi_ap_removed), NULL);
+
+    const GPtrArray *aps = nm_device_wifi_get_access_points(NM_DEVICE_WIFI(device));
+    for (guint a = 0; aps && a < aps->len; a++)
+    {
+        g_signal_connect(aps->pdata[a], "notify::strength", G_CALLBACK(on_wifi_ap_strength_changed), NULL);
+    }
+}
+
+void on_wifi_device_added(NMClient *client, NMDevice *device, gpointer user_data)
+{
+    (void)client; (void)user_data;
+    wifi_watch_device(device);
+    wifi_refresh_cache();
+}
+
+void on_wifi_device_removed(NMClient *client, NMDevice *device, gpointer user_data)
+{
+    (void)client; (void)device; (void)user_data;
+    wifi_refresh_cache();
+}
+
+void on_wifi_client_ready(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    (void)source; (void)user_data;
+    GError *error = NULL;
+
+    nm_client = nm_client_new_finish(result, &error);
+    if (!nm_client)
+    {
+        _log_sub(LOG_SUBSYSTEM_NETWORK, LOG_ERROR, "Could not connect to NetworkManager: %s", error ? error->message : "unknown error");
+        g_clear_error(&error);
+        wifi_backend_ready = 1; // let the network screen report an empty list instead of loading forever
+        ui_request_redraw();
+        return;
+    }
+
+    g_signal_connect(nm_client, "device-added", G_CALLBACK(on_wifi_device_added), NULL);
+    g_signal_connect(nm_client, "device-removed", G_CALLBACK(on_wifi_device_removed), NULL);
+
+    const GPtrArray *devices = nm_client_get_devices(nm_client);
+    for (guint d = 0; devices && d < devices->len; d++)
+    {
+        wifi_watch_device(NM_DEVICE(devices->pdata[d]));
+    }
+
+    wifi_refresh_cache();
+    wifi_backend_ready = 1;
+    ui_request_redraw();
+    _log_sub(LOG_SUBSYSTEM_NETWORK, LOG_GENERAL, "NetworkManager Wi-Fi backend ready with %d network(s) cached.", wifi_cache_count);
+}
+
+void* wifi_thread()
+{
+    trace_name_thread("wifi");
+    wifi_context = g_main_context_new();
+    g_main_context_push_thread_default(wifi_context);
+
+    GMainLoop *loop = g_main_loop_new(wifi_context, FALSE);
+    nm_client_new_async(NULL, on_wifi_client_ready, NULL);
+    g_main_loop_run(loop);
+
+    return NULL;
+}
+
+void on_wifi_scan_requested(GObject *device, GAsyncResult *result, gpointer user_data)
+{
+    (void)user_data;
+    GError *error = NULL;
+    if (!nm_device_wifi_request_scan_finish(NM_DEVICE_WIFI(device), result, &error))
+    {
+        // NetworkManager refuses scans that come too soon after the last one; the cache is still fresh then
+        _log_sub(LOG_SUBSYSTEM_NETWORK, LOG_GENERAL, "Wi-Fi scan request declined: %s", error ? error->message : "unknown error");
+        g_clear_error(&error);
+    }
+}
+
+gboolean wifi_request_scan_in_context(gpointer user_data)
+{
+    (void)user_data;
+    const GPtrArray *devices = nm_client ? nm_client_get_devices(nm_client) : NULL;
+    for (guint d = 0; devices && d < devices->len; d++)
+    {
+        if (NM_IS_DEVICE_WIFI(devices->pdata[d]))
+        {
+            nm_device_wifi_request_scan_async(NM_DEVICE_WIFI(devices->pdata[d]), NULL, on_wifi_scan_requested, NULL);
+        }
+    }
+    return G_SOURCE_REMOVE;
+}
+
+void wifi_request_scan()
+{
+    if (wifi_context)
+    {
+        g_main_context_invoke(wifi_context, wifi_request_scan_in_context, NULL);
+    }
+}
+
+void on_wifi_active_state_changed(NMActiveConnection *active, guint state, guint reason, gpointer user_data);
+
+void wifi_connect_finished(NMActiveConnection *active, int succeeded)
+{
+    if (active)
+    {
+        g_signal_handlers_disconnect_by_func(active, on_wifi_active_state_changed, NULL);
+        g_object_unref(active);
+    }
+
+    _log_sub(LOG_SUBSYSTEM_NETWORK, succeeded ? LOG_GENERAL : LOG_ERROR, "Network connection to %s %s.", wifi_connect_ssid, succeeded ? "succeeded" : "failed");
+    wifi_connect_state = succeeded ? WIFI_CONNECT_SUCCEEDED : WIFI_CONNECT_FAILED;
+    ui_request_redraw();
+}
+
+void on_wifi_active_state_changed(NMActiveConnection *active, guint state, guint reason, gpointer user_data)
+{
+    (void)reason; (void)user_data;
+
+    if (state == NM_ACTIVE_CONNECTION_STATE_ACTIVATED)
+    {
+        wifi_connect_finished(active, 1);
+    }
+    else if (state == NM_ACTIVE_CONNECTION_STATE_DEACTIVATED)
+    {
+        wifi_connect_finished(active, 0);
+    }
+}
+
+void on_wifi_activation_started(GObject *client, GAsyncResult *result, gpointer user_data)
+{
+    GError *error = NULL;
+    int is_new_connection = GPOINTER_TO_INT(user_data);
+
+    NMActiveConnection *active = is_new_connection
+        ? nm_client_add_and_activate_connection_finish(NM_CLIENT(client), result, &error)
+        : nm_client_activate_connection_finish(NM_CLIENT(client), result, &error);
+
+    if (!active)
+    {
+        _log_sub(LOG_SUBSYSTEM_NETWORK, LOG_ERROR, "Network activation rejected: %s", error ? error->message : "unknown error");
+        g_clear_error(&error);
+        wifi_connect_finished(NULL, 0);
+        return;
+    }
+
+    // the connection may have come up before we could subscribe to its state
+    NMActiveConnectionState state = nm_active_connection_get_state(active);
+    if (state == NM_ACTIVE_CONNECTION_STATE_ACTIVATED || state == NM_ACTIVE_CONNECTION_STATE_DEACTIVATED)
+    {
+        on_wifi_active_state_changed(active, state, 0, NULL);
+        return;
+    }
+
+    g_signal_connect(active, "state-changed", G_CALLBACK(on_wifi_active_state_changed), NULL);
+}
+
+gboolean wifi_connect_in_context(gpointer user_data)
+{
+    (void)user_data;
+
+    if (!nm_client)
+    {
+        wifi_connect_finished(NULL, 0);
+        return G_SOURCE_REMOVE;
+    }
+
+    // pick the wifi device and strongest access point advertising the SSID
+    NMDevice *device = NULL;
+    NMAccessPoint *best_ap = NULL;
+    const GPtrArray *devices = nm_client_get_devices(nm_client);
+    for (guint d = 0; devices && d < devices->len; d++)
+    {
+        if (!NM_IS_DEVICE_WIFI(devices->pdata[d]))
+        {
+            continue;
+        }
+
+        const GPtrArray *aps = nm_device_wifi_get_access_points(NM_DEVICE_WIFI(devices->pdata[d]));
+        for (guint a = 0; aps && a < aps->len; a++)
+        {
+            NMAccessPoint *ap = NM_ACCESS_POINT(aps->pdata[a]);
+            char ssid[128];
+            if (wifi_ssid_of(ap, ssid, sizeof(ssid)) && strcmp(ssid, wifi_connect_ssid) == 0 &&
+                (!best_ap || nm_access_point_get_strength(ap) > nm_access_point_get_strength(best_ap)))
+            {
+                best_ap = ap;
+                device = NM_DEVICE(devices->pdata[d]);
+            }
+        }
+    }
+
+    if (!best_ap)
+    {
+        _log_sub(LOG_SUBSYSTEM_NETWORK, LOG_ERROR, "Network %s is no longer visible.", wifi_connect_ssid);
+        wifi_connect_finished(NULL, 0);
+        return G_SOURCE_REMOVE;
+    }
+
+    const char *ap_path = nm_object_get_path(NM_OBJECT(best_ap));
+
+    // reuse a saved profile for this SSID rather than creating a duplicate on every attempt
+    GBytes *wanted_ssid = nm_access_point_get_ssid(best_ap);
+    const GPtrArray *connections = nm_client_get_connections(nm_client);
+    for (guint c = 0; connections && c < connections->len; c++)
+    {
+        NMSettingWireless *wireless = nm_connection_get_setting_wireless(NM_CONNECTION(connections->pdata[c]));
+        GBytes *ssid = wireless ? nm_setting_wireless_get_ssid(wireless) : NULL;
+        if (ssid && g_bytes_equal(ssid, wanted_ssid))
+        {
+            nm_client_activate_connection_async(nm_client, NM_CONNECTION(connections->pdata[c]), device, ap_path, NULL, on_wifi_activation_started, GINT_TO_POINTER(0));
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    nm_client_add_and_activate_connection_async(nm_client, NULL, device, ap_path, NULL, on_wifi_activation_started, GINT_TO_POINTER(1));
+    return G_SOURCE_REMOVE;
+}
+
+void wifi_connect_async(const char *ssid)
+{
+    snprintf(wifi_connect_ssid, sizeof(wifi_connect_ssid), "%s", ssid);
+    wifi_connect_state = WIFI_CONNECT_PENDING;
+    _log_sub(LOG_SUBSYSTEM_NETWORK, LOG_GENERAL, "Attempting to connect to network %s...", wifi_connect_ssid);
+
+    if (!wifi_context)
+    {
+        wifi_connect_finished(NULL, 0);
+        return;
+    }
+    g_main_context_invoke(wifi_context, wifi_connect_in_context, NULL);
+}